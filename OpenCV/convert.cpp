@@ -22,4 +22,29 @@ cv::Mat* Convert_NDIlib_video_frame_v2_t_to_CVMat(
                                p_ndi_frame->p_data);
 
   return cvMat;
-}
\ No newline at end of file
+}
+
+cv::Mat NDIlib_video_frame_v2_t_to_CVMatView(
+    const NDIlib_video_frame_v2_t& ndi_frame) {
+  int type;
+  switch (ndi_frame.FourCC) {
+    case NDIlib_FourCC_type_BGRA:
+    case NDIlib_FourCC_type_BGRX:
+    case NDIlib_FourCC_type_RGBA:
+    case NDIlib_FourCC_type_RGBX:
+      type = CV_8UC4;
+      break;
+    case NDIlib_FourCC_type_UYVY:
+      type = CV_8UC2;
+      break;
+    default:
+      std::cout << "Frame format not supported" << std::endl;
+      return cv::Mat();
+  }
+
+  // The stride may be larger than the visible row
+  const size_t step = ndi_frame.line_stride_in_bytes
+                          ? ndi_frame.line_stride_in_bytes
+                          : cv::Mat::AUTO_STEP;
+  return cv::Mat(ndi_frame.yres, ndi_frame.xres, type, ndi_frame.p_data, step);
+}
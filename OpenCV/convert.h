@@ -8,4 +8,10 @@
 cv::Mat* Convert_NDIlib_video_frame_v2_t_to_CVMat(
     NDIlib_video_frame_v2_t* p_ndi_frame);
 
-#endif
\ No newline at end of file
+// Header only view of the frame data, nothing is copied
+// BGRA, BGRX, RGBA and RGBX give a CV_8UC4 matrix, UYVY a CV_8UC2 one
+// Returns an empty matrix for the other formats
+cv::Mat NDIlib_video_frame_v2_t_to_CVMatView(
+    const NDIlib_video_frame_v2_t& ndi_frame);
+
+#endif
@@ -6,7 +6,9 @@
 #include <windows.h>
 #else
 #define IS_POSIX
+#include <errno.h>
 #include <ncurses.h>
+#include <stdio.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #endif
@@ -226,6 +228,9 @@ class Window {
     window_height = height();
     rows_ = rows();
     columns_ = columns();
+#ifdef IS_POSIX
+    resize_buffers();
+#endif
   }
 
   // Draw border with given widget dimensions
@@ -414,6 +419,11 @@ class Window {
 
   // Return the content of the buffer
   inline CHAR_INFO* get_content() { return content; }
+
+  // Mark the area of a widget as changed (no op, the whole buffer is
+  // written on render)
+  template <typename Widget>
+  inline void mark_dirty(const Widget& widget) {}
 #elif defined(IS_POSIX)
   Window() {
     initscr();
@@ -422,6 +432,9 @@ class Window {
     noecho();
     start_color();
     hide_cursor();
+    // Let ncurses clear the screen once, the front buffer starts blank.
+    // stdscr is not drawn to after this, so getch has nothing to refresh.
+    refresh();
     update_dimensions();
     timeout(1);
   }
@@ -432,11 +445,25 @@ class Window {
     endwin();
   }
 
+  // Resize the cell buffers to the rows and columns
+  void resize_buffers() {
+    if (back.size() != (size_t)rows_ * columns_) {
+      // The terminal reflows on resize, start again from a blank screen
+      back.assign((size_t)rows_ * columns_, ' ');
+      front.assign((size_t)rows_ * columns_, ' ');
+      output += "\x1b[2J";
+      mark_dirty(0, 0, columns_, rows_);
+    }
+  }
+
   // Remove scrollbar from console (no op)
   inline void remove_scrollbar() {};
 
-  // Clear content (no op)
-  inline void clear() {};
+  // Clear content
+  inline void clear() {
+    std::fill(back.begin(), back.end(), ' ');
+    mark_dirty(0, 0, columns_, rows_);
+  }
 
   // Hide cursor from console
   inline void hide_cursor() { curs_set(0); }
@@ -475,14 +502,44 @@ class Window {
   // Set window title (no op)
   inline void set_title(std::string str) {};
 
-  // Set character in tui
+  // Set character in content
   inline void draw_char(int x, int y, char c, short color = 0x000F) {
     // TODO: Add color functionality
-    mvaddch(y, x, c);
+    if (x >= 0 && x < columns_ && y >= 0 && y < rows_) {
+      back[y * columns_ + x] = c;
+      // Characters drawn outside of a widget are tracked on their own
+      if (dirty.empty() || !dirty.back().contains(x, y)) {
+        loose.extend(x, y);
+      }
+    }
   }
 
-  // Render tui
-  inline void render() { refresh(); }
+  // Render content, writing the cells that changed since the last render
+  void render() {
+    if (!loose.empty()) {
+      dirty.push_back(loose);
+      loose = Rect{};
+    }
+    for (const Rect& rect : dirty) {
+      for (int y = rect.y0; y < rect.y1; y++) {
+        render_row(y, rect.x0, rect.x1);
+      }
+    }
+    dirty.clear();
+    last_render_bytes_ = output.size();
+    total_render_bytes_ += output.size();
+    renders_++;
+    write_output();
+  }
+
+  // Bytes written to the terminal by the last render
+  inline size_t last_render_bytes() const { return last_render_bytes_; }
+
+  // Bytes written to the terminal by all renders
+  inline size_t total_render_bytes() const { return total_render_bytes_; }
+
+  // Number of renders
+  inline size_t renders() const { return renders_; }
 
   // Poll for event
   bool poll_event(Event& event) {
@@ -504,6 +561,34 @@ class Window {
 
   // Return the content of the buffer (no op)
   inline void get_content() {};
+
+  // Mark the area of a widget as changed. Render compares only the
+  // changed areas with what is on the terminal.
+  template <typename Widget>
+  inline void mark_dirty(const Widget& widget) {
+    mark_dirty(widget.x, widget.y, widget.width, widget.height);
+  }
+
+  void mark_dirty(int x, int y, int width, int height) {
+    Rect rect;
+    rect.x0 = std::max(0, x);
+    rect.y0 = std::max(0, y);
+    rect.x1 = std::min((int)columns_, x + width);
+    rect.y1 = std::min((int)rows_, y + height);
+    if (rect.empty()) {
+      return;
+    }
+    if (dirty.size() >= max_dirty) {
+      // Too many to be worth keeping apart
+      dirty.front().merge(rect);
+      for (size_t i = 1; i < dirty.size(); i++) {
+        dirty.front().merge(dirty[i]);
+      }
+      dirty.resize(1);
+    } else {
+      dirty.push_back(rect);
+    }
+  }
 #endif
  private:
 #ifdef IS_WIN
@@ -518,17 +603,114 @@ class Window {
   LONG default_width;   // Width of the window before tui started
   LONG default_height;  // Height of the window before tui started
 #elif defined(IS_POSIX)
+  // Cells from x0 to x1 and from y0 to y1, exclusive
+  struct Rect {
+    int x0 = INT_MAX;
+    int y0 = INT_MAX;
+    int x1 = INT_MIN;
+    int y1 = INT_MIN;
+
+    bool empty() const { return x0 >= x1 || y0 >= y1; }
+    bool contains(int x, int y) const {
+      return x >= x0 && x < x1 && y >= y0 && y < y1;
+    }
+    void extend(int x, int y) {
+      x0 = std::min(x0, x);
+      y0 = std::min(y0, y);
+      x1 = std::max(x1, x + 1);
+      y1 = std::max(y1, y + 1);
+    }
+    void merge(const Rect& rect) {
+      x0 = std::min(x0, rect.x0);
+      y0 = std::min(y0, rect.y0);
+      x1 = std::max(x1, rect.x1);
+      y1 = std::max(y1, rect.y1);
+    }
+  };
+
+  // Unchanged cells shorter than a cursor move are written again to join
+  // two runs
+  static const int max_gap = 6;
+  // Dirty rectangles kept apart before they are merged into one
+  static const size_t max_dirty = 64;
+
+  // Append the changed cells of a row to the output, in runs
+  void render_row(int y, int x0, int x1) {
+    // Writing the last cell of the screen would scroll it
+    if (y == rows_ - 1) {
+      x1 = std::min(x1, columns_ - 1);
+    }
+    const char* next = back.data() + y * columns_;
+    char* current = front.data() + y * columns_;
+    int x = x0;
+    while (x < x1) {
+      if (next[x] == current[x]) {
+        x++;
+        continue;
+      }
+      // Extend the run over changed cells and short unchanged gaps
+      int end = x + 1;
+      int last_changed = x;
+      while (end < x1 && end - last_changed <= max_gap) {
+        if (next[end] != current[end]) {
+          last_changed = end;
+        }
+        end++;
+      }
+      end = last_changed + 1;
+      if (cursor_x != x || cursor_y != y) {
+        char move[32];
+        snprintf(move, sizeof(move), "\x1b[%d;%dH", y + 1, x + 1);
+        output += move;
+      }
+      output.append(next + x, end - x);
+      std::copy(next + x, next + end, current + x);
+      // The cursor stays on the last column after writing it
+      cursor_x = end < columns_ ? end : -1;
+      cursor_y = y;
+      x = end;
+    }
+  }
+
+  // Write the output to the terminal in one go
+  void write_output() {
+    size_t written = 0;
+    while (written < output.size()) {
+      ssize_t n = ::write(STDOUT_FILENO, output.data() + written,
+                          output.size() - written);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      written += n;
+    }
+    output.clear();
+  }
+
   short window_width;
   short window_height;
   short columns_;
   short rows_;
   int current_pair = 1;
+  std::vector<char> back;   // Content to be rendered
+  std::vector<char> front;  // Content on the terminal
+  std::vector<Rect> dirty;  // Areas of back that may differ from front
+  Rect loose;               // Characters drawn outside of the dirty areas
+  std::string output;       // Escape sequences and characters to write
+  int cursor_x = -1;        // Terminal cursor position, -1 if unknown
+  int cursor_y = -1;
+  size_t last_render_bytes_ = 0;
+  size_t total_render_bytes_ = 0;
+  size_t renders_ = 0;
 #endif
 };
 
 // Widget add to window method definitions
 template <>
 void Window::add(Paragraph paragraph) {
+  mark_dirty(paragraph);
   if (paragraph.border == true) {
     draw_border(paragraph);
   }
@@ -567,6 +749,7 @@ void Window::add(Paragraph paragraph) {
 
 template <>
 void Window::add(List list) {
+  mark_dirty(list);
   if (list.border == true) {
     draw_border(list);
   }
@@ -602,6 +785,7 @@ void Window::add(List list) {
 
 template <>
 void Window::add(BarChart bar_chart) {
+  mark_dirty(bar_chart);
   if (bar_chart.border == true) {
     draw_border(bar_chart);
   }
@@ -682,6 +866,7 @@ void Window::add(BarChart bar_chart) {
 
 template <>
 void Window::add(Gauge gauge) {
+  mark_dirty(gauge);
   if (gauge.border == true) {
     draw_border(gauge);
   }
@@ -695,17 +880,22 @@ void Window::add(Gauge gauge) {
   int bar_width = floor(((float)gauge.percent / 100) * (gauge.width - 2));
   for (int i = gauge.y + 1; i < gauge.y + gauge.height - 1; i++) {
     for (int j = gauge.x + 1; j < gauge.x + gauge.width - 1; j++) {
+#ifdef IS_WIN
       // Naively assume character is empty
       draw_char(j, i, ' ');
       if ((j - (gauge.x + 1)) < bar_width) {
-#ifdef IS_WIN
         content[(i * columns_) + j].Attributes =
             get_color(gauge.label_style.foreground, gauge.bar_color);
+      }
 #elif defined(IS_POSIX)
+      // Each cell is written once, as bar or as empty
+      if ((j - (gauge.x + 1)) < bar_width) {
         draw_char(j, i, '#',
                   get_color(gauge.label_style.foreground, gauge.bar_color));
-#endif
+      } else {
+        draw_char(j, i, ' ');
       }
+#endif
     }
   }
   // Draw label
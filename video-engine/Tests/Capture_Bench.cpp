@@ -0,0 +1,114 @@
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "capture-executor.h"
+#include "synthetic-source.h"
+
+// Benchmark of the capture executor against one receive thread per source,
+// at 16, 64 and 128 inputs. The inputs are synthetic 50 fps sources on the
+// system clock: a source sends a frame when it is due and the capture
+// latency is the time from then until the frame is in the ring, which is
+// what the scheduling adds. The CPU is the time of the whole process over
+// the run, the small frames keep the copy out of it.
+
+static const int kXres = 256;
+static const int kYres = 144;
+static const int kRunMs = 3000;
+
+struct Result {
+  double mCpuMs;
+  double mLatencyAvgMs;
+  double mLatencyMaxMs;
+  uint64_t mFrames;
+  int mThreads;
+};
+
+static double ProcessCpuMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static Result Run(int inputs, bool executor) {
+  std::vector<std::unique_ptr<SyntheticSource>> sources;
+  for (int i = 0; i < inputs; i++) {
+    sources.emplace_back(new SyntheticSource(
+        "bench " + std::to_string(i), kXres, kYres, 50, 1, 12));
+    sources.back()->SetRunLimit(0);
+  }
+
+  CaptureExecutor pool;
+  Result result = {};
+  const double cpuStart = ProcessCpuMs();
+  if (executor) {
+    for (auto& source : sources) {
+      pool.AddSource(source.get());
+    }
+    pool.Start();
+    result.mThreads = std::min<int>(inputs, pool.GetThreads());
+  } else {
+    for (auto& source : sources) {
+      source->Start();
+    }
+    result.mThreads = inputs;
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(kRunMs));
+  for (auto& source : sources) {
+    source->RequestStop();
+  }
+  if (executor) {
+    pool.Stop();
+  }
+  for (auto& source : sources) {
+    source->Stop();
+  }
+  result.mCpuMs = ProcessCpuMs() - cpuStart;
+
+  double latencySum = 0;
+  for (auto& source : sources) {
+    latencySum += source->GetCaptureLatencyAvg() / 10000.0;
+    result.mLatencyMaxMs = std::max(result.mLatencyMaxMs,
+                                    source->GetCaptureLatencyMax() / 10000.0);
+    result.mFrames += source->GetFramesCaptured();
+  }
+  result.mLatencyAvgMs = latencySum / inputs;
+  return result;
+}
+
+static void Print(int inputs, const char* mode, const Result& result) {
+  printf("%6d %-10s %7d %10.0f %8.1f %10.3f %10.3f\n", inputs, mode,
+         result.mThreads, result.mCpuMs,
+         100.0 * result.mCpuMs / kRunMs, result.mLatencyAvgMs,
+         result.mLatencyMaxMs);
+}
+
+int main() {
+  printf("%6s %-10s %7s %10s %8s %10s %10s\n", "inputs", "capture",
+         "threads", "CPU ms", "CPU %", "lat avg ms", "lat max ms");
+  bool ok = true;
+  for (int inputs : {16, 64, 128}) {
+    const Result threads = Run(inputs, false);
+    Print(inputs, "threads", threads);
+    const Result pool = Run(inputs, true);
+    Print(inputs, "executor", pool);
+    // Both have to keep up with the inputs
+    const uint64_t expected = (uint64_t)inputs * 50 * kRunMs / 1000;
+    for (const Result* result : {&threads, &pool}) {
+      if (result->mFrames < expected * 9 / 10) {
+        printf("%d inputs: %llu frames captured of %llu\n", inputs,
+               (unsigned long long)result->mFrames,
+               (unsigned long long)expected);
+        ok = false;
+      }
+    }
+  }
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
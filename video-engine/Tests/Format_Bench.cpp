@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "format-convert.h"
+
+// Benchmark of the format conversion specialised on the pair of formats
+// (ConvertRow through DispatchFormatPair) against a converter that looks the
+// formats up for every macropixel, on 1080p frames of every pair of packed
+// formats and to the 24-bit BGR of the snapshots and recordings. The two
+// share the fixed point arithmetic, so their outputs have to be identical.
+//
+// The code size of the two is read from the symbols of the binary, the
+// baseline is ConvertRowRuntime, the specialised code the symbols of
+// ConvertRow, ConvertFrame and ConvertDispatch and their lambdas:
+//   nm -C -S Format-Bench | grep -E 'ConvertRow|ConvertFrame|ConvertDispatch'
+
+static const int kWidth = 1920;
+static const int kHeight = 1080;
+static const int kFrames = 20;
+
+// Not an NDI format, stands for PixelFormatBGR24 in the runtime converter
+static const NDIlib_FourCC_video_type_e kBGR24 = (NDIlib_FourCC_video_type_e)0;
+
+static const NDIlib_FourCC_video_type_e kFormats[] = {
+    NDIlib_FourCC_video_type_UYVY, NDIlib_FourCC_video_type_UYVA,
+    NDIlib_FourCC_video_type_BGRA, NDIlib_FourCC_video_type_BGRX,
+    NDIlib_FourCC_video_type_RGBA, NDIlib_FourCC_video_type_RGBX};
+
+static const char* Name(NDIlib_FourCC_video_type_e FourCC) {
+  switch (FourCC) {
+    case NDIlib_FourCC_video_type_UYVY:
+      return "UYVY";
+    case NDIlib_FourCC_video_type_UYVA:
+      return "UYVA";
+    case NDIlib_FourCC_video_type_BGRA:
+      return "BGRA";
+    case NDIlib_FourCC_video_type_BGRX:
+      return "BGRX";
+    case NDIlib_FourCC_video_type_RGBA:
+      return "RGBA";
+    case NDIlib_FourCC_video_type_RGBX:
+      return "RGBX";
+    default:
+      return "BGR24";
+  }
+}
+
+static int BytesPerPixel(NDIlib_FourCC_video_type_e FourCC) {
+  switch (FourCC) {
+    case NDIlib_FourCC_video_type_UYVY:
+    case NDIlib_FourCC_video_type_UYVA:
+      return 2;
+    case NDIlib_FourCC_video_type_BGRA:
+    case NDIlib_FourCC_video_type_BGRX:
+    case NDIlib_FourCC_video_type_RGBA:
+    case NDIlib_FourCC_video_type_RGBX:
+      return 4;
+    default:
+      return 3;
+  }
+}
+
+// The baseline: every macropixel switches on both formats
+__attribute__((noinline)) static void ConvertRowRuntime(
+    NDIlib_FourCC_video_type_e inFourCC, NDIlib_FourCC_video_type_e outFourCC,
+    const uint8_t* in, const uint8_t* inAlpha, uint8_t* out,
+    uint8_t* outAlpha, int pixels) {
+  for (int x = 0; x < pixels; x += 2) {
+    int r[2], g[2], b[2], a[2], y[2], u = 0, v = 0;
+    bool yuv = false;
+    switch (inFourCC) {
+      case NDIlib_FourCC_video_type_UYVY:
+      case NDIlib_FourCC_video_type_UYVA: {
+        const uint8_t* p = in + x * 2;
+        u = p[0];
+        y[0] = p[1];
+        v = p[2];
+        y[1] = p[3];
+        const bool alpha =
+            inFourCC == NDIlib_FourCC_video_type_UYVA && inAlpha;
+        a[0] = alpha ? inAlpha[x] : 255;
+        a[1] = alpha ? inAlpha[x + 1] : 255;
+        yuv = true;
+        break;
+      }
+      default:
+        for (int i = 0; i < 2; i++) {
+          const uint8_t* p = in + (x + i) * 4;
+          switch (inFourCC) {
+            case NDIlib_FourCC_video_type_BGRA:
+            case NDIlib_FourCC_video_type_BGRX:
+              r[i] = p[2];
+              b[i] = p[0];
+              break;
+            default:
+              r[i] = p[0];
+              b[i] = p[2];
+              break;
+          }
+          g[i] = p[1];
+          switch (inFourCC) {
+            case NDIlib_FourCC_video_type_BGRA:
+            case NDIlib_FourCC_video_type_RGBA:
+              a[i] = p[3];
+              break;
+            default:
+              a[i] = 255;
+              break;
+          }
+        }
+        break;
+    }
+
+    switch (outFourCC) {
+      case NDIlib_FourCC_video_type_UYVY:
+      case NDIlib_FourCC_video_type_UYVA: {
+        uint8_t* o = out + x * 2;
+        if (yuv) {
+          o[0] = (uint8_t)u;
+          o[1] = (uint8_t)y[0];
+          o[2] = (uint8_t)v;
+          o[3] = (uint8_t)y[1];
+        } else {
+          o[1] = (uint8_t)(((47 * r[0] + 157 * g[0] + 16 * b[0] + 128) >> 8) +
+                           16);
+          o[3] = (uint8_t)(((47 * r[1] + 157 * g[1] + 16 * b[1] + 128) >> 8) +
+                           16);
+          o[0] = (uint8_t)(((-26 * (r[0] + r[1]) - 86 * (g[0] + g[1]) +
+                             112 * (b[0] + b[1]) + 256) >>
+                            9) +
+                           128);
+          o[2] = (uint8_t)(((112 * (r[0] + r[1]) - 102 * (g[0] + g[1]) -
+                             10 * (b[0] + b[1]) + 256) >>
+                            9) +
+                           128);
+        }
+        if (outAlpha) {
+          outAlpha[x] = (uint8_t)a[0];
+          outAlpha[x + 1] = (uint8_t)a[1];
+        }
+        break;
+      }
+      default: {
+        const int bytes = BytesPerPixel(outFourCC);
+        for (int i = 0; i < 2; i++) {
+          if (yuv) {
+            const int yy = ConvertLuma6(y[i]);
+            r[i] = ConvertClamp((yy + 115 * (v - 128) + 32) >> 6);
+            g[i] = ConvertClamp((yy - 14 * (u - 128) - 34 * (v - 128) + 32) >>
+                                6);
+            b[i] = ConvertClamp((yy + 135 * (u - 128) + 32) >> 6);
+          }
+          uint8_t* o = out + (x + i) * bytes;
+          switch (outFourCC) {
+            case NDIlib_FourCC_video_type_RGBA:
+            case NDIlib_FourCC_video_type_RGBX:
+              o[0] = (uint8_t)r[i];
+              o[2] = (uint8_t)b[i];
+              break;
+            default:
+              o[0] = (uint8_t)b[i];
+              o[2] = (uint8_t)r[i];
+              break;
+          }
+          o[1] = (uint8_t)g[i];
+          if (bytes == 4) {
+            o[3] = (uint8_t)a[i];
+          }
+        }
+        break;
+      }
+    }
+  }
+}
+
+struct Frame {
+  NDIlib_video_frame_v2_t mFrame;
+  std::vector<uint8_t> mData;
+};
+
+static Frame MakeFrame(NDIlib_FourCC_video_type_e FourCC,
+                       std::mt19937& random) {
+  Frame frame;
+  frame.mFrame = NDIlib_video_frame_v2_t();
+  const int stride = kWidth * BytesPerPixel(FourCC);
+  const bool alpha = FourCC == NDIlib_FourCC_video_type_UYVA;
+  frame.mData.resize((size_t)stride * kHeight +
+                     (alpha ? (size_t)kWidth * kHeight : 0));
+  for (auto& byte : frame.mData) {
+    byte = (uint8_t)random();
+  }
+  frame.mFrame.FourCC = FourCC;
+  frame.mFrame.xres = kWidth;
+  frame.mFrame.yres = kHeight;
+  frame.mFrame.line_stride_in_bytes = stride;
+  frame.mFrame.p_data = frame.mData.data();
+  return frame;
+}
+
+static void ConvertRuntime(const NDIlib_video_frame_v2_t& frame,
+                           NDIlib_FourCC_video_type_e outFourCC, uint8_t* out,
+                           uint8_t* outAlpha) {
+  const int outStride = kWidth * BytesPerPixel(outFourCC);
+  const uint8_t* alpha =
+      frame.FourCC == NDIlib_FourCC_video_type_UYVA
+          ? frame.p_data + (size_t)frame.line_stride_in_bytes * frame.yres
+          : nullptr;
+  for (int y = 0; y < frame.yres; y++) {
+    ConvertRowRuntime(frame.FourCC, outFourCC,
+                      frame.p_data + (size_t)y * frame.line_stride_in_bytes,
+                      alpha ? alpha + (size_t)y * frame.xres : nullptr,
+                      out + (size_t)y * outStride,
+                      outAlpha ? outAlpha + (size_t)y * frame.xres : nullptr,
+                      frame.xres);
+  }
+}
+
+static void ConvertDispatch(const NDIlib_video_frame_v2_t& frame,
+                            NDIlib_FourCC_video_type_e outFourCC,
+                            uint8_t* out, uint8_t* outAlpha) {
+  if (outFourCC == kBGR24) {
+    ConvertFrame<PixelFormatBGR24>(frame, out, kWidth * 3);
+    return;
+  }
+  DispatchFormat(outFourCC, PackedFormats(), [&](auto format) {
+    using Out = decltype(format);
+    ConvertFrame<Out>(frame, out, kWidth * Out::kBytesPerPixel, outAlpha);
+  });
+}
+
+template <class Fn>
+static double MedianMs(Fn&& fn) {
+  std::vector<double> times;
+  for (int i = 0; i < kFrames; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    fn();
+    times.push_back(std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count());
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+int main() {
+  std::mt19937 random(1);
+  std::vector<NDIlib_FourCC_video_type_e> outputs(std::begin(kFormats),
+                                                  std::end(kFormats));
+  outputs.push_back(kBGR24);
+
+  const size_t bytes = (size_t)kWidth * kHeight * 4;
+  std::vector<uint8_t> runtimeOut(bytes), dispatchOut(bytes);
+  std::vector<uint8_t> runtimeAlpha((size_t)kWidth * kHeight);
+  std::vector<uint8_t> dispatchAlpha((size_t)kWidth * kHeight);
+
+  bool ok = true;
+  double runtimeTotal = 0, dispatchTotal = 0;
+  printf("%-6s %-6s %12s %12s %8s\n", "in", "out", "runtime ms",
+         "dispatch ms", "speedup");
+  for (NDIlib_FourCC_video_type_e in : kFormats) {
+    const Frame frame = MakeFrame(in, random);
+    for (NDIlib_FourCC_video_type_e out : outputs) {
+      const bool alpha = out == NDIlib_FourCC_video_type_UYVA;
+      uint8_t* ra = alpha ? runtimeAlpha.data() : nullptr;
+      uint8_t* da = alpha ? dispatchAlpha.data() : nullptr;
+      const double runtime = MedianMs(
+          [&] { ConvertRuntime(frame.mFrame, out, runtimeOut.data(), ra); });
+      const double dispatch = MedianMs(
+          [&] { ConvertDispatch(frame.mFrame, out, dispatchOut.data(), da); });
+      runtimeTotal += runtime;
+      dispatchTotal += dispatch;
+
+      const size_t outBytes = (size_t)kWidth * kHeight * BytesPerPixel(out);
+      const bool same =
+          memcmp(runtimeOut.data(), dispatchOut.data(), outBytes) == 0 &&
+          (!alpha || runtimeAlpha == dispatchAlpha);
+      ok = ok && same;
+      printf("%-6s %-6s %12.2f %12.2f %7.1fx%s\n", Name(in), Name(out),
+             runtime, dispatch, runtime / dispatch, same ? "" : "  DIFFERS");
+    }
+  }
+  printf("total  %19.2f %12.2f %7.1fx\n", runtimeTotal, dispatchTotal,
+         runtimeTotal / dispatchTotal);
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+#include <cstdio>
+
+#include "keyer.h"
+
+// Checks that the vector ramp of the keyer gives the same alpha as the
+// scalar one of the leftover pixels, for every low and high and every value
+// of the luma (shift 8), UYVY chroma (shift 7) and RGB colour (shift 6)
+// keys, and that a ramp reaches 0 at low and 255 at high.
+
+static bool CheckShift(int shift, int maxValue) {
+  uint64_t cases = 0;
+  uint64_t mismatches = 0;
+  uint64_t wrongEnds = 0;
+  for (int low = 0; low <= maxValue; low++) {
+    for (int high = low + 1; high <= maxValue; high++) {
+      const __m128i lowV = _mm_set1_epi16((short)low);
+      const __m128i range =
+          _mm_set1_epi16((short)KeyerRange(low, high, shift));
+      const __m128i gain = _mm_set1_epi16((short)KeyerGain(low, high, shift));
+      // The ramp of a narrow range is widened, its end is not checked
+      const bool widened = high - low < (1 << (8 - shift));
+      for (int value = 0; value <= maxValue; value += 8) {
+        const __m128i values =
+            _mm_add_epi16(_mm_set1_epi16((short)value),
+                          _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7));
+        alignas(16) uint8_t lanes[16];
+        _mm_store_si128(
+            (__m128i*)lanes,
+            _mm_packus_epi16(KeyerRampSSE2(values, lowV, range, gain, shift),
+                             _mm_setzero_si128()));
+        for (int i = 0; i < 8 && value + i <= maxValue; i++) {
+          const int v = value + i;
+          const uint8_t scalar = KeyerRamp(v, low, high, shift);
+          cases++;
+          if (lanes[i] != scalar) {
+            if (mismatches++ < 5) {
+              printf("shift %d low %d high %d value %d: lane %d scalar %d\n",
+                     shift, low, high, v, lanes[i], scalar);
+            }
+          }
+          if ((v <= low && scalar != 0) ||
+              (v >= high && !widened && scalar != 255)) {
+            if (wrongEnds++ < 5) {
+              printf("shift %d low %d high %d value %d: ramp gives %d\n",
+                     shift, low, high, v, scalar);
+            }
+          }
+        }
+      }
+    }
+  }
+  printf("shift %d: %llu cases, %llu mismatches, %llu wrong ends\n", shift,
+         (unsigned long long)cases, (unsigned long long)mismatches,
+         (unsigned long long)wrongEnds);
+  return mismatches == 0 && wrongEnds == 0;
+}
+
+int main() {
+  bool ok = CheckShift(8, 255);
+  ok = CheckShift(7, 510) && ok;
+  ok = CheckShift(6, 765) && ok;
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
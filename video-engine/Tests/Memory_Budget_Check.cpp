@@ -0,0 +1,85 @@
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include "memory-budget.h"
+
+// Checks that the budget degrades level by level while the usage is over
+// its limit and then refuses new sources, even small ones that would still
+// fit, and that it admits them again once the usage went back down.
+
+static const int64_t kMB = 1024 * 1024;
+
+static bool Expect(bool condition, const char* what) {
+  if (!condition) {
+    printf("failed: %s\n", what);
+  }
+  return condition;
+}
+
+int main() {
+  MemoryBudget& budget = MemoryBudget::Get();
+  // No settle time, every update moves one level
+  budget.Configure(100 * kMB, 3, 0, 0.8);
+  MemoryAccount* account = budget.Register("check", true);
+  bool ok = Expect(budget.Admit("first", 10 * kMB), "admit under the limit");
+
+  account->Charge(MemoryKind::Ring, 150 * kMB);
+  budget.Update();
+  ok = Expect(budget.GetLevel() == MemoryBudget::Level::ShrinkRings &&
+                  account->GetRingDepth() == 3,
+              "shrink the rings first") &&
+       ok;
+  budget.Update();
+  ok = Expect(budget.GetLevel() == MemoryBudget::Level::Proxy &&
+                  account->IsProxy(),
+              "then switch to proxy") &&
+       ok;
+  budget.Update();
+  ok = Expect(budget.GetLevel() == MemoryBudget::Level::Refuse,
+              "then refuse") &&
+       ok;
+
+  // Back under the limit but above the recovery threshold, the budget
+  // keeps refusing a source that would fit
+  account->Release(MemoryKind::Ring, 60 * kMB);
+  budget.Update();
+  ok = Expect(budget.GetLevel() == MemoryBudget::Level::Refuse,
+              "stay at refuse above the recovery threshold") &&
+       ok;
+  ok = Expect(!budget.Admit("refused", 1 * kMB),
+              "refuse a source that fits at the refuse level") &&
+       ok;
+
+  account->Release(MemoryKind::Ring, 80 * kMB);
+  for (int i = 0; i < 4; i++) {
+    budget.Update();
+  }
+  ok = Expect(budget.GetLevel() == MemoryBudget::Level::Normal &&
+                  account->GetRingDepth() == 0 && !account->IsProxy(),
+              "recover once under the recovery threshold") &&
+       ok;
+  ok = Expect(budget.Admit("second", 1 * kMB), "admit after recovering") &&
+       ok;
+
+  // The same through the budget thread
+  budget.Start(5);
+  account->Charge(MemoryKind::Ring, 150 * kMB);
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (budget.GetLevel() != MemoryBudget::Level::Refuse &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  account->Release(MemoryKind::Ring, 70 * kMB);
+  ok = Expect(budget.GetLevel() == MemoryBudget::Level::Refuse,
+              "the budget thread reaches refuse") &&
+       ok;
+  ok = Expect(!budget.Admit("late", 1 * kMB),
+              "refuse once the budget thread got there") &&
+       ok;
+  budget.Stop();
+
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
@@ -1,8 +1,16 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
 #include <Processing.NDI.Lib.h>
+#include "latency-barcode.h"
 
 #ifdef _WIN32
 #ifdef _WIN64
@@ -12,45 +20,226 @@
 #endif // _WIN64
 #endif // _WIN32
 
-int main(int argc, char* argv[])
-{	// Not required, but "correct" (see the SDK documentation.
-	if (!NDIlib_initialize()) return 0;
-	
-	// We create the NDI sender
-	NDIlib_send_instance_t pNDI_send = NDIlib_send_create();
-	if (!pNDI_send) return 0;
-
-	// We are going to create a 1920x1080 interlaced frame at 29.97Hz.
-	NDIlib_video_frame_v2_t NDI_video_frame;
-	NDI_video_frame.xres = 1920;
-	NDI_video_frame.yres = 1080;
-	NDI_video_frame.FourCC = NDIlib_FourCC_type_BGRX;
-	NDI_video_frame.p_data = (uint8_t*)malloc(NDI_video_frame.xres*NDI_video_frame.yres * 4);
-
-	// Run for one minute
-	using namespace std::chrono;
-	for (const auto start = high_resolution_clock::now(); high_resolution_clock::now() - start < minutes(5);)
-	{	// Get the current time
-		const auto start_send = high_resolution_clock::now();
-
-		// Send 200 frames
-		for (int idx = 200; idx; idx--)
-		{	// Fill in the buffer. It is likely that you would do something much smarter than this.
-			memset((void*)NDI_video_frame.p_data, (idx & 1) ? 255 : 0, NDI_video_frame.xres*NDI_video_frame.yres * 4);
-
-			// We now submit the frame. Note that this call will be clocked so that we end up submitting at exactly 29.97fps.
-			NDIlib_send_send_video_v2(pNDI_send, &NDI_video_frame);
+// Load generator for the video engine: N senders, one thread each, sending synthetic streams.
+//
+// Every sender renders a small pool of frames once and sends them in turn, so a send costs no
+// fill and the generator keeps up with many more streams than the engine. The only per frame
+// work is the send time stamped for the latency probe of the engine, see latency-barcode.h.
+//
+//   NDI-Send-Video [-n streams] [-s WxH] [-f UYVY|BGRX|BGRA|RGBX|RGBA] [-r N/D]
+//                  [-m flash|bar|noise|static] [-p pool frames] [-t seconds] [-name prefix]
+
+using namespace std::chrono;
+
+struct Options
+{	int streams = 1;
+	int xres = 1920;
+	int yres = 1080;
+	NDIlib_FourCC_video_type_e FourCC = NDIlib_FourCC_video_type_BGRX;
+	int frame_rate_N = 30000;
+	int frame_rate_D = 1001;
+	std::string motion = "flash";
+	int pool_frames = 8;
+	int seconds = 300;
+	std::string name = "Load";
+};
+
+// Counters of one sender, read by the main thread for the reports
+struct Stream
+{	std::atomic<uint64_t> sent{ 0 };
+	std::atomic<uint64_t> late{ 0 };
+	std::atomic<uint64_t> send_ns{ 0 };
+	std::thread thread;
+};
+
+static std::atomic<bool> running{ true };
+
+static bool ParseFourCC(const std::string& name, NDIlib_FourCC_video_type_e* FourCC)
+{	if (name == "UYVY") *FourCC = NDIlib_FourCC_video_type_UYVY;
+	else if (name == "BGRX") *FourCC = NDIlib_FourCC_video_type_BGRX;
+	else if (name == "BGRA") *FourCC = NDIlib_FourCC_video_type_BGRA;
+	else if (name == "RGBX") *FourCC = NDIlib_FourCC_video_type_RGBX;
+	else if (name == "RGBA") *FourCC = NDIlib_FourCC_video_type_RGBA;
+	else return false;
+	return true;
+}
+
+static bool ParseOptions(int argc, char* argv[], Options* options)
+{	for (int i = 1; i < argc; i++)
+	{	const std::string arg = argv[i];
+		if (i + 1 >= argc) return false;
+		const char* value = argv[++i];
+		if (arg == "-n") options->streams = atoi(value);
+		else if (arg == "-s") { if (sscanf(value, "%dx%d", &options->xres, &options->yres) != 2) return false; }
+		else if (arg == "-f") { if (!ParseFourCC(value, &options->FourCC)) return false; }
+		else if (arg == "-r")
+		{	// A single value is a whole frame rate, 60 rather than 60/1001
+			const int fields = sscanf(value, "%d/%d", &options->frame_rate_N, &options->frame_rate_D);
+			if (fields < 1) return false;
+			if (fields == 1) options->frame_rate_D = 1;
 		}
+		else if (arg == "-m") options->motion = value;
+		else if (arg == "-p") options->pool_frames = atoi(value);
+		else if (arg == "-t") options->seconds = atoi(value);
+		else if (arg == "-name") options->name = value;
+		else return false;
+	}
+	if (options->motion == "static") options->pool_frames = 1;
+	if (options->motion == "flash") options->pool_frames = 2;
+	// UYVY pixels come in pairs
+	if (options->FourCC == NDIlib_FourCC_video_type_UYVY && (options->xres & 1)) return false;
+	return options->streams > 0 && options->xres > 1 && options->yres > 0 && options->frame_rate_N > 0 &&
+	       options->frame_rate_D > 0 && options->pool_frames > 0 &&
+	       (options->motion == "flash" || options->motion == "bar" || options->motion == "noise" || options->motion == "static");
+}
+
+// Writes a grey level into one pixel, two pixels share their chroma in UYVY
+static inline void PutPixel(uint8_t* row, int x, NDIlib_FourCC_video_type_e FourCC, uint8_t level)
+{	if (FourCC == NDIlib_FourCC_video_type_UYVY)
+	{	row[(x / 2) * 4 + 0] = 128;
+		row[(x / 2) * 4 + 2] = 128;
+		row[(x / 2) * 4 + 1 + (x & 1) * 2] = (uint8_t)(16 + level * 219 / 255);
+	}
+	else
+	{	row[x * 4 + 0] = row[x * 4 + 1] = row[x * 4 + 2] = level;
+		row[x * 4 + 3] = 255;
+	}
+}
+
+// index is the place of the frame in a pool of count frames, for the motion pattern
+static void Render(const Options& options, int index, int count, std::mt19937& random, NDIlib_video_frame_v2_t& frame)
+{	const int bar_width = std::max(1, options.xres / 16);
+	const int bar_x = (options.xres - bar_width) * index / std::max(1, count - 1);
+	for (int y = 0; y < frame.yres; y++)
+	{	uint8_t* row = frame.p_data + (size_t)y * frame.line_stride_in_bytes;
+		for (int x = 0; x < frame.xres; x++)
+		{	uint8_t level = 128;
+			if (options.motion == "flash") level = (index & 1) ? 255 : 0;
+			else if (options.motion == "bar") level = (x >= bar_x && x < bar_x + bar_width) ? 235 : 32;
+			else if (options.motion == "noise") level = (uint8_t)random();
+			PutPixel(row, x, frame.FourCC, level);
+		}
+	}
+}
+
+static void RunSender(const Options& options, int index, Stream& stream)
+{	const std::string name = options.name + " " + std::to_string(index);
+	// The sender is not clocked by the SDK, we pace the frames ourselves so that the send time
+	// stamped into a frame is taken right before it leaves
+	NDIlib_send_create_t NDI_send_create_desc;
+	NDI_send_create_desc.p_ndi_name = name.c_str();
+	NDI_send_create_desc.clock_video = false;
+	NDIlib_send_instance_t pNDI_send = NDIlib_send_create(&NDI_send_create_desc);
+	if (!pNDI_send)
+	{	printf("Cannot create sender %s\n", name.c_str());
+		return;
+	}
 
-		// Just display something helpful
-		printf("200 frames sent, at %1.2ffps\n", 200.0f / duration_cast<duration<float>>(high_resolution_clock::now() - start_send).count());
+	// Render the pool
+	const int bytes_per_pixel = (options.FourCC == NDIlib_FourCC_video_type_UYVY) ? 2 : 4;
+	std::mt19937 random(index + 1);
+	std::vector<std::unique_ptr<uint8_t[]>> buffers;
+	std::vector<NDIlib_video_frame_v2_t> pool(options.pool_frames);
+	for (int i = 0; i < options.pool_frames; i++)
+	{	NDIlib_video_frame_v2_t& frame = pool[i];
+		frame.xres = options.xres;
+		frame.yres = options.yres;
+		frame.FourCC = options.FourCC;
+		frame.frame_rate_N = options.frame_rate_N;
+		frame.frame_rate_D = options.frame_rate_D;
+		frame.frame_format_type = NDIlib_frame_format_type_progressive;
+		frame.line_stride_in_bytes = options.xres * bytes_per_pixel;
+		buffers.emplace_back(new uint8_t[(size_t)frame.line_stride_in_bytes * frame.yres]);
+		frame.p_data = buffers.back().get();
+		Render(options, i, options.pool_frames, random, frame);
 	}
 
-	// Free the video frame
-	free(NDI_video_frame.p_data);
+	char metadata[64];
+	const auto frame_duration = duration_cast<steady_clock::duration>(
+		duration<double>((double)options.frame_rate_D / options.frame_rate_N));
+	// Spread the senders over a frame so they do not all send at once
+	auto next_send = steady_clock::now() + frame_duration * index / options.streams;
+
+	for (uint64_t n = 0; running; n++)
+	{	NDIlib_video_frame_v2_t& frame = pool[n % pool.size()];
+
+		// Wait for the time of the frame. A sender more than a frame behind starts again from now
+		// rather than sending a burst.
+		next_send += frame_duration;
+		const auto now = steady_clock::now();
+		if (now > next_send + frame_duration)
+		{	stream.late++;
+			next_send = now;
+		}
+		std::this_thread::sleep_until(next_send);
+
+		// Stamp the send time, as a barcode in the picture and as metadata, in 100ns intervals like
+		// the NDI timestamps
+		const int64_t send_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count() / 100;
+		LatencyBarcodeWrite(frame, send_time);
+		LatencyMetadataWrite(metadata, sizeof(metadata), send_time);
+		frame.p_metadata = metadata;
+
+		const auto start_send = steady_clock::now();
+		NDIlib_send_send_video_v2(pNDI_send, &frame);
+		stream.send_ns += duration_cast<nanoseconds>(steady_clock::now() - start_send).count();
+		stream.sent++;
+	}
 
 	// Destroy the NDI sender
 	NDIlib_send_destroy(pNDI_send);
+}
+
+int main(int argc, char* argv[])
+{	Options options;
+	if (!ParseOptions(argc, argv, &options))
+	{	printf("Usage: %s [-n streams] [-s WxH] [-f UYVY|BGRX|BGRA|RGBX|RGBA] [-r N/D]\n"
+		       "       [-m flash|bar|noise|static] [-p pool frames] [-t seconds] [-name prefix]\n", argv[0]);
+		return 1;
+	}
+
+	// Not required, but "correct" (see the SDK documentation.
+	if (!NDIlib_initialize()) return 0;
+
+	const double target_fps = (double)options.frame_rate_N / options.frame_rate_D;
+	printf("%d streams of %dx%d at %1.2ffps, %s motion, %d pool frames\n", options.streams, options.xres,
+	       options.yres, target_fps, options.motion.c_str(), options.pool_frames);
+
+	std::vector<std::unique_ptr<Stream>> streams;
+	for (int i = 0; i < options.streams; i++)
+	{	streams.emplace_back(new Stream());
+		Stream& stream = *streams.back();
+		stream.thread = std::thread(RunSender, std::cref(options), i, std::ref(stream));
+	}
+
+	// Report the achieved rate of every stream every 5 seconds
+	std::vector<uint64_t> last_sent(options.streams, 0), last_send_ns(options.streams, 0);
+	auto last_report = steady_clock::now();
+	for (const auto start = steady_clock::now(); steady_clock::now() - start < seconds(options.seconds);)
+	{	std::this_thread::sleep_for(seconds(5));
+		const auto now = steady_clock::now();
+		const double elapsed = duration_cast<duration<double>>(now - last_report).count();
+		last_report = now;
+
+		double total_fps = 0;
+		for (int i = 0; i < options.streams; i++)
+		{	const uint64_t sent = streams[i]->sent;
+			const uint64_t send_ns = streams[i]->send_ns;
+			const uint64_t frames = sent - last_sent[i];
+			const double fps = frames / elapsed;
+			total_fps += fps;
+			printf("%s %d: %1.2f/%1.2ffps, send %1.2fms, late %llu\n", options.name.c_str(), i, fps, target_fps,
+			       frames ? (send_ns - last_send_ns[i]) / 1e6 / frames : 0.0,
+			       (unsigned long long)streams[i]->late.load());
+			last_sent[i] = sent;
+			last_send_ns[i] = send_ns;
+		}
+		printf("All streams: %1.2f/%1.2ffps\n", total_fps, target_fps * options.streams);
+	}
+
+	running = false;
+	for (auto& stream : streams)
+		stream->thread.join();
 
 	// Not required, but nice
 	NDIlib_destroy();
@@ -58,4 +247,3 @@ int main(int argc, char* argv[])
 	// Success
 	return 0;
 }
-
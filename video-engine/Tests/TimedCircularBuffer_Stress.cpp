@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "tcb.h"
+
+// Stress of the overflow policies of TimedCircularBuffer
+//
+// One writer puts items at a capture rate while slow readers lock items with
+// Get and GetLatest, hold them for milliseconds and unlock them. Every Put is
+// timed: under Skip, Drop and Grow the writer must never wait for a reader,
+// so their worst Put has to stay far below the worst Put of Block. At the end
+// every lock must be released, the ring must hold at most its size and every
+// item the ring does not hold anymore must have gone through the deleter.
+
+static std::atomic<int> gLive{0};
+
+static const char* PolicyName(OverflowPolicy policy) {
+  switch (policy) {
+    case OverflowPolicy::Block:
+      return "Block";
+    case OverflowPolicy::Skip:
+      return "Skip";
+    case OverflowPolicy::Drop:
+      return "Drop";
+    case OverflowPolicy::Grow:
+      return "Grow";
+  }
+  return "";
+}
+
+// Put latencies of a policy, in microseconds
+struct PutTimes {
+  double mMaxUs;
+  double mP99Us;
+};
+
+static TimedCircularBuffer<int*>* MakeBuffer(int size, OverflowPolicy policy,
+                                             int spareCapacity) {
+  auto* buffer = new TimedCircularBuffer<int*>(size);
+  buffer->SetDeleter([](int** item) {
+    delete *item;
+    gLive--;
+  });
+  buffer->SetOverflowPolicy(policy, spareCapacity);
+  return buffer;
+}
+
+static int* NewItem(int value) {
+  gLive++;
+  return new int(value);
+}
+
+// Checks the state of a buffer no reader holds anymore
+static bool CheckIdle(TimedCircularBuffer<int*>* buffer, const char* name) {
+  bool ok = true;
+  if (buffer->GetLocked() != 0) {
+    printf("%s: %d locks left\n", name, buffer->GetLocked());
+    ok = false;
+  }
+  if (buffer->GetOccupied() > buffer->GetSize()) {
+    printf("%s: %d slots occupied of %d\n", name, buffer->GetOccupied(),
+           buffer->GetSize());
+    ok = false;
+  }
+  if (gLive != buffer->GetOccupied()) {
+    printf("%s: %d items alive, %d slots occupied\n", name, gLive.load(),
+           buffer->GetOccupied());
+    ok = false;
+  }
+  if (!ok) {
+    return false;
+  }
+  buffer->Clear();
+  if (gLive != 0) {
+    printf("%s: %d items alive after Clear\n", name, gLive.load());
+    return false;
+  }
+  return true;
+}
+
+// A slot skipped over while locked must not be returned for an index it was
+// never written at
+static bool SkipReuse() {
+  const int size = 4;
+  auto* buffer = MakeBuffer(size, OverflowPolicy::Skip, 0);
+  for (int i = 0; i < size; i++) {
+    buffer->Put(NewItem(i), i);
+  }
+  int id0, id1, writeIndex;
+  buffer->Get(0, 0, &id0, &writeIndex);
+  // Slot 0 is locked, the put skips to index 5
+  buffer->Put(NewItem(size), size);
+  buffer->Get(0, 0, &id1, &writeIndex);
+  buffer->Unlock(id0);
+  if (id1 < writeIndex) {
+    buffer->Unlock(id1);
+  }
+  const bool ok = CheckIdle(buffer, "Skip reuse");
+  delete buffer;
+  return ok;
+}
+
+// Each reader holds at most one item, so a spare pool of readers items lets
+// Grow move every locked item out of the way
+static bool Stress(OverflowPolicy policy, int size, int readers, int puts,
+                   PutTimes* times) {
+  auto* buffer = MakeBuffer(size, policy, readers);
+  std::atomic<bool> done{false};
+  std::atomic<uint64_t> newest{0};
+  std::atomic<uint64_t> gets{0};
+
+  std::vector<std::thread> threads;
+  for (int r = 0; r < readers; r++) {
+    threads.emplace_back([&, r] {
+      std::mt19937 random(r);
+      while (!done) {
+        int id = -1;
+        int writeIndex = 0;
+        int* item = nullptr;
+        if (random() % 2) {
+          item = buffer->GetLatest(&id);
+        } else {
+          const uint64_t last = newest;
+          const uint64_t back = random() % size;
+          const uint64_t timestamp = last > back ? last - back : 0;
+          item = buffer->Get(timestamp, size, &id, &writeIndex);
+          if (id >= writeIndex) {
+            // Nothing was locked
+            id = -1;
+          }
+        }
+        if (id < 0) {
+          std::this_thread::yield();
+          continue;
+        }
+        if (!item) {
+          printf("%s: null item locked at %d\n", PolicyName(policy), id);
+        }
+        gets++;
+        // A renderer slower than the capture
+        std::this_thread::sleep_for(
+            std::chrono::microseconds(1000 + random() % 4000));
+        buffer->Unlock(id);
+      }
+    });
+  }
+
+  std::vector<double> putUs;
+  putUs.reserve(puts);
+  for (int i = 0; i < puts; i++) {
+    int* item = NewItem(i);
+    const auto start = std::chrono::steady_clock::now();
+    buffer->Put(item, i);
+    putUs.push_back(std::chrono::duration<double, std::micro>(
+                        std::chrono::steady_clock::now() - start)
+                        .count());
+    newest = i;
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  done = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::sort(putUs.begin(), putUs.end());
+  times->mMaxUs = putUs.back();
+  times->mP99Us = putUs[putUs.size() * 99 / 100];
+
+  OverflowStats& stats = buffer->GetOverflowStats();
+  printf("%-5s puts %llu | gets %llu | blocked %llu (%.1f ms) | skipped %llu "
+         "| dropped %llu | grown %llu | put p99 %.1f us max %.1f us\n",
+         PolicyName(policy), (unsigned long long)stats.mPuts.load(),
+         (unsigned long long)gets.load(),
+         (unsigned long long)stats.mBlocked.load(),
+         stats.mBlockedNs.load() / 1e6,
+         (unsigned long long)stats.mSkipped.load(),
+         (unsigned long long)stats.mDropped.load(),
+         (unsigned long long)stats.mGrown.load(), times->mP99Us,
+         times->mMaxUs);
+  bool ok = true;
+  if (policy != OverflowPolicy::Block && stats.mBlocked != 0) {
+    printf("%s: the writer blocked\n", PolicyName(policy));
+    ok = false;
+  }
+  ok = CheckIdle(buffer, PolicyName(policy)) && ok;
+  delete buffer;
+  return ok;
+}
+
+int main() {
+  bool ok = SkipReuse();
+  PutTimes block;
+  ok = Stress(OverflowPolicy::Block, 8, 4, 2000, &block) && ok;
+  for (OverflowPolicy policy :
+       {OverflowPolicy::Skip, OverflowPolicy::Drop, OverflowPolicy::Grow}) {
+    PutTimes times;
+    ok = Stress(policy, 8, 4, 2000, &times) && ok;
+    // Block waits out a held frame, milliseconds, the others only ever wait
+    // for the ring mutex
+    if (times.mMaxUs > block.mMaxUs / 4) {
+      printf("%s: worst put %.1f us against %.1f us under Block\n",
+             PolicyName(policy), times.mMaxUs, block.mMaxUs);
+      ok = false;
+    }
+  }
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
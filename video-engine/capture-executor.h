@@ -0,0 +1,209 @@
+#ifndef CAPTURE_EXECUTOR_HPP___
+#define CAPTURE_EXECUTOR_HPP___
+
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "source.h"
+
+// Drives many sources from a fixed pool of threads instead of one receive
+// thread per source. Every worker owns a share of the sources and polls
+// their receivers without blocking. Parked (suspended) sources are skipped
+// and a worker that found nothing to capture in a full pass backs off for a
+// short, bounded time. A receiver that cannot be created is retried, and a
+// source stops being driven once its run limit elapsed, as its own receive
+// thread would. Tests/Capture_Bench.cpp compares the two.
+class CaptureExecutor {
+ public:
+  // threads of 0 sizes the pool to the number of cores
+  CaptureExecutor(int threads = 0)
+      : mWorkers(threads > 0
+                     ? threads
+                     : std::max(1u, std::thread::hardware_concurrency())),
+        mClock(SystemClock::Get()),
+        mIsRunning(false) {}
+  virtual ~CaptureExecutor() {}
+
+  // Time source of the run limits, the retries and the idle sleeps, set
+  // before Start. Give it the clock of the sources.
+  void SetClock(Clock* clock) { mClock = clock; }
+
+  // Sources must be added before Start
+  void AddSource(Source* source) {
+    mWorkers[mSourceCount % mWorkers.size()].mSources.push_back(source);
+    mSourceCount++;
+  }
+
+  // Control API
+  // ------------------------------------------------------------------
+  void Start() {
+    mIsRunning = true;
+    for (size_t i = 0; i < mWorkers.size(); i++) {
+      // Never start more threads than there are sources
+      if (mWorkers[i].mSources.empty()) {
+        continue;
+      }
+      for (auto source : mWorkers[i].mSources) {
+        source->Attach();
+      }
+      mClock->AddParticipant();
+      mWorkers[i].mThread = std::thread(&CaptureExecutor::Run, this, i);
+    }
+  }
+
+  void Stop() {
+    mIsRunning = false;
+    for (auto& worker : mWorkers) {
+      if (worker.mThread.joinable()) {
+        worker.mThread.join();
+      }
+    }
+  }
+  // ----------------------------------------------------- Control API
+
+  int GetThreads() { return (int)mWorkers.size(); }
+
+  void Output() {
+    uint64_t frames = 0;
+    uint64_t passes = 0;
+    uint64_t idleSleeps = 0;
+    uint64_t openFailures = 0;
+    uint64_t cpuNs = 0;
+    for (auto& worker : mWorkers) {
+      frames += worker.mFrames;
+      passes += worker.mPasses;
+      idleSleeps += worker.mIdleSleeps;
+      openFailures += worker.mOpenFailures;
+      cpuNs += worker.mCpuNs;
+    }
+    std::cout << "Capture executor | threads " << mWorkers.size()
+              << " | sources " << mSourceCount << " | frames " << frames
+              << " | passes " << passes << " | idle sleeps " << idleSleeps
+              << " | failed opens " << openFailures << " | scheduler CPU "
+              << cpuNs / 1000000 << " ms" << std::endl;
+  }
+
+ private:
+  // Shortest and longest sleep of a worker that found nothing to capture
+  // The sleep delays the first frame after a quiet spell, so it stays well
+  // below a frame period
+  static constexpr int kMinBackoffUs = 100;
+  static constexpr int kMaxBackoffUs = 500;
+  // Time between two attempts to create a receiver that failed
+  static constexpr int kReopenMs = 1000;
+  // Parked sources only need their demand checked now and then
+  static constexpr int kParkedCheckMs = 20;
+  // Keeps a flooding source from starving the others of the same worker
+  static constexpr int kMaxFramesPerPass = 4;
+
+  struct Worker {
+    std::thread mThread;
+    std::vector<Source*> mSources;
+
+    std::atomic<uint64_t> mFrames{0};
+    std::atomic<uint64_t> mPasses{0};
+    std::atomic<uint64_t> mIdleSleeps{0};
+    std::atomic<uint64_t> mOpenFailures{0};
+    // Thread CPU time, updated after every pass
+    std::atomic<uint64_t> mCpuNs{0};
+  };
+
+  std::vector<Worker> mWorkers;
+  size_t mSourceCount = 0;
+  Clock* mClock;
+  std::atomic<bool> mIsRunning;
+
+  static uint64_t ThreadCpuNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  void Run(int workerIndex) {
+    TRACE_THREAD_NAME("capture worker " + std::to_string(workerIndex));
+    Worker& worker = mWorkers[workerIndex];
+    std::vector<Source*>& sources = worker.mSources;
+    std::vector<bool> isOpen(sources.size(), false);
+    // Stopped, or past its run limit, the source is not driven anymore
+    std::vector<bool> isDone(sources.size(), false);
+    size_t done = 0;
+    // Next demand check of a parked source, or next attempt to open a source
+    // that failed to open
+    std::vector<int64_t> nextParkedCheck(sources.size(), 0);
+
+    const uint64_t cpuStart = ThreadCpuNs();
+    const int64_t start = mClock->NowMs();
+    int backoffUs = kMinBackoffUs;
+    while (mIsRunning && done < sources.size()) {
+      bool captured = false;
+      const int64_t now = mClock->NowMs();
+
+      for (size_t i = 0; i < sources.size(); i++) {
+        Source* source = sources[i];
+        if (isDone[i]) {
+          continue;
+        }
+        // A stopped source gives its receiver back
+        const int64_t limitMs = source->GetRunLimit();
+        if (!source->isRunning() || (limitMs && now - start >= limitMs)) {
+          if (isOpen[i]) {
+            source->Close();
+            isOpen[i] = false;
+          }
+          isDone[i] = true;
+          done++;
+          continue;
+        }
+        if (!isOpen[i]) {
+          if (now < nextParkedCheck[i]) {
+            continue;
+          }
+          isOpen[i] = source->Open();
+          if (!isOpen[i]) {
+            worker.mOpenFailures++;
+            nextParkedCheck[i] = now + kReopenMs;
+            continue;
+          }
+        }
+        if (source->IsParked() && now < nextParkedCheck[i]) {
+          continue;
+        }
+
+        // Drain what the receiver has queued
+        for (int n = 0; n < kMaxFramesPerPass && source->Service(0); n++) {
+          captured = true;
+          worker.mFrames++;
+        }
+
+        if (source->IsParked()) {
+          nextParkedCheck[i] = now + kParkedCheckMs;
+        }
+      }
+
+      worker.mPasses++;
+      worker.mCpuNs = ThreadCpuNs() - cpuStart;
+
+      if (captured) {
+        backoffUs = kMinBackoffUs;
+        continue;
+      }
+      worker.mIdleSleeps++;
+      mClock->SleepFor((int64_t)backoffUs * 10);
+      backoffUs = std::min(backoffUs * 2, kMaxBackoffUs);
+    }
+
+    for (size_t i = 0; i < sources.size(); i++) {
+      if (isOpen[i]) {
+        sources[i]->Close();
+      }
+    }
+    mClock->RemoveParticipant();
+  }
+};
+
+#endif  // CAPTURE_EXECUTOR_HPP___
@@ -0,0 +1,124 @@
+#ifndef CLOCK_HPP___
+#define CLOCK_HPP___
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <thread>
+
+// Time source of the renderers and the sources
+//
+// Times are in 100ns intervals since the Unix epoch, the unit of the NDI
+// timestamps. The SystemClock follows the wall clock. The VirtualClock only
+// moves when every thread using it is asleep, it then jumps straight to the
+// earliest wake up time, so a simulation runs as fast as the CPU allows and
+// the same run always sees the same times.
+class Clock {
+ public:
+  virtual ~Clock() {}
+
+  virtual int64_t Now() = 0;
+
+  // Returns once Now() reached deadline
+  virtual void SleepUntil(int64_t deadline) = 0;
+
+  void SleepFor(int64_t duration) { SleepUntil(Now() + duration); }
+
+  // Threads sleeping on the clock register for their whole lifetime, see
+  // VirtualClock. Register from the thread starting them, so that the clock
+  // does not move before they run.
+  virtual void AddParticipant() {}
+  virtual void RemoveParticipant() {}
+
+  int64_t NowMs() { return Now() / 10000; }
+};
+
+class SystemClock : public Clock {
+ public:
+  // The clock of the engine unless one is injected
+  static SystemClock* Get() {
+    static SystemClock clock;
+    return &clock;
+  }
+
+  int64_t Now() override {
+    return std::chrono::system_clock::now().time_since_epoch().count() / 100;
+  }
+
+  void SleepUntil(int64_t deadline) override {
+    const int64_t remaining = deadline - Now();
+    if (remaining > 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(remaining / 10));
+    }
+  }
+};
+
+// Discrete event clock
+// Participants blocked on anything but the clock hold time still; a ring
+// buffer in Block overflow policy for instance would deadlock a run, see
+// OverflowPolicy.
+class VirtualClock : public Clock {
+ public:
+  // 2024-01-01 00:00:00 UTC
+  static constexpr int64_t kDefaultStart = 17040672000000000LL;
+
+  explicit VirtualClock(int64_t start = kDefaultStart)
+      : mNow(start), mParticipants(0) {}
+
+  int64_t Now() override {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mNow;
+  }
+
+  void SleepUntil(int64_t deadline) override {
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (deadline <= mNow) {
+      return;
+    }
+    auto it = mDeadlines.insert(deadline);
+    while (mNow < deadline) {
+      Advance();
+      if (mNow >= deadline) {
+        break;
+      }
+      mCond.wait(lock);
+    }
+    mDeadlines.erase(it);
+  }
+
+  void AddParticipant() override {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mParticipants++;
+  }
+
+  void RemoveParticipant() override {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mParticipants--;
+    Advance();
+  }
+
+ private:
+  std::mutex mMutex;
+  std::condition_variable mCond;
+  int64_t mNow;
+  int mParticipants;
+  // Wake up times of the sleeping participants
+  std::multiset<int64_t> mDeadlines;
+
+  // Called with mMutex held, moves to the earliest deadline once every
+  // participant sleeps
+  void Advance() {
+    if (mDeadlines.empty() || (int)mDeadlines.size() < mParticipants) {
+      return;
+    }
+    const int64_t next = *mDeadlines.begin();
+    if (next > mNow) {
+      mNow = next;
+      mCond.notify_all();
+    }
+  }
+};
+
+#endif  // CLOCK_HPP___
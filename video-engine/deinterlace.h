@@ -0,0 +1,322 @@
+#ifndef DEINTERLACE_HPP___
+#define DEINTERLACE_HPP___
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Processing.NDI.Lib.h"
+#include "parallel-for.h"
+#include "simd.h"
+#include "trace.h"
+
+// Deinterlacing of interleaved frames, in place
+//
+// Field 0 (the even rows) is kept, the rows of field 1 are rebuilt from it:
+// Bob            average of the rows above and below
+// Blend          [1 2 1] / 4 vertical filter over the three rows, both fields
+//                are kept but blurred together
+// EdgeDirected   edge-based line average, the rows above and below are
+//                averaged along the diagonal or vertical direction where they
+//                match best
+//
+// The kernels work on bytes and compare bytes 4 apart, which is the next
+// sample of the same component in UYVY (a macropixel) and in the 32-bit RGB
+// formats (a pixel), so one set of kernels serves both.
+
+// above and below are the field 0 rows around cur, out may be cur
+typedef void (*DeinterlaceRowFn)(const uint8_t* above, const uint8_t* cur,
+                                 const uint8_t* below, uint8_t* out,
+                                 int bytes);
+
+// Edge-based line average of one byte, x is at least 4 and bytes - 5 at most
+inline uint8_t DeinterlaceEla(const uint8_t* above, const uint8_t* below,
+                              int x) {
+  const int dl = std::abs(above[x - 4] - below[x + 4]);
+  const int dc = std::abs(above[x] - below[x]);
+  const int dr = std::abs(above[x + 4] - below[x - 4]);
+  const int min = std::min(dc, std::min(dl, dr));
+  if (dc == min) {
+    return SimdAvg(above[x], below[x]);
+  }
+  if (dl == min) {
+    return SimdAvg(above[x - 4], below[x + 4]);
+  }
+  return SimdAvg(above[x + 4], below[x - 4]);
+}
+
+inline void BobRowScalar(const uint8_t* above, const uint8_t* /*cur*/,
+                         const uint8_t* below, uint8_t* out, int bytes) {
+  for (int x = 0; x < bytes; x++) {
+    out[x] = SimdAvg(above[x], below[x]);
+  }
+}
+
+inline void BlendRowScalar(const uint8_t* above, const uint8_t* cur,
+                           const uint8_t* below, uint8_t* out, int bytes) {
+  for (int x = 0; x < bytes; x++) {
+    out[x] = SimdAvg(SimdAvg(above[x], below[x]), cur[x]);
+  }
+}
+
+// The first and last 4 bytes have no diagonal neighbours
+inline void EdgeRowScalar(const uint8_t* above, const uint8_t* /*cur*/,
+                          const uint8_t* below, uint8_t* out, int bytes) {
+  for (int x = 0; x < bytes; x++) {
+    out[x] = (x < 4 || x >= bytes - 4) ? SimdAvg(above[x], below[x])
+                                       : DeinterlaceEla(above, below, x);
+  }
+}
+
+inline void BobRowSSE2(const uint8_t* above, const uint8_t* cur,
+                       const uint8_t* below, uint8_t* out, int bytes) {
+  int x = 0;
+  for (; x + 16 <= bytes; x += 16) {
+    const __m128i a = _mm_loadu_si128((const __m128i*)(above + x));
+    const __m128i b = _mm_loadu_si128((const __m128i*)(below + x));
+    _mm_storeu_si128((__m128i*)(out + x), _mm_avg_epu8(a, b));
+  }
+  BobRowScalar(above + x, cur + x, below + x, out + x, bytes - x);
+}
+
+inline void BlendRowSSE2(const uint8_t* above, const uint8_t* cur,
+                         const uint8_t* below, uint8_t* out, int bytes) {
+  int x = 0;
+  for (; x + 16 <= bytes; x += 16) {
+    const __m128i a = _mm_loadu_si128((const __m128i*)(above + x));
+    const __m128i c = _mm_loadu_si128((const __m128i*)(cur + x));
+    const __m128i b = _mm_loadu_si128((const __m128i*)(below + x));
+    _mm_storeu_si128((__m128i*)(out + x), _mm_avg_epu8(_mm_avg_epu8(a, b), c));
+  }
+  BlendRowScalar(above + x, cur + x, below + x, out + x, bytes - x);
+}
+
+// Picks the vertical average on ties, then the left diagonal, like
+// DeinterlaceEla
+inline void EdgeRowSSE2(const uint8_t* above, const uint8_t* cur,
+                        const uint8_t* below, uint8_t* out, int bytes) {
+  EdgeRowScalar(above, cur, below, out, std::min(bytes, 4));
+  int x = 4;
+  for (; x + 20 <= bytes; x += 16) {
+    const __m128i al = _mm_loadu_si128((const __m128i*)(above + x - 4));
+    const __m128i ac = _mm_loadu_si128((const __m128i*)(above + x));
+    const __m128i ar = _mm_loadu_si128((const __m128i*)(above + x + 4));
+    const __m128i bl = _mm_loadu_si128((const __m128i*)(below + x - 4));
+    const __m128i bc = _mm_loadu_si128((const __m128i*)(below + x));
+    const __m128i br = _mm_loadu_si128((const __m128i*)(below + x + 4));
+
+    const __m128i dl = SimdAbsDiffU8(al, br);
+    const __m128i dc = SimdAbsDiffU8(ac, bc);
+    const __m128i dr = SimdAbsDiffU8(ar, bl);
+    const __m128i min = _mm_min_epu8(dc, _mm_min_epu8(dl, dr));
+
+    __m128i result = _mm_avg_epu8(ar, bl);
+    __m128i mask = _mm_cmpeq_epi8(dl, min);
+    result = _mm_or_si128(_mm_and_si128(mask, _mm_avg_epu8(al, br)),
+                          _mm_andnot_si128(mask, result));
+    mask = _mm_cmpeq_epi8(dc, min);
+    result = _mm_or_si128(_mm_and_si128(mask, _mm_avg_epu8(ac, bc)),
+                          _mm_andnot_si128(mask, result));
+    _mm_storeu_si128((__m128i*)(out + x), result);
+  }
+  for (; x < bytes; x++) {
+    out[x] = x >= bytes - 4 ? SimdAvg(above[x], below[x])
+                            : DeinterlaceEla(above, below, x);
+  }
+}
+
+CNS_TARGET_AVX2
+inline void BobRowAVX2(const uint8_t* above, const uint8_t* cur,
+                       const uint8_t* below, uint8_t* out, int bytes) {
+  int x = 0;
+  for (; x + 32 <= bytes; x += 32) {
+    const __m256i a = _mm256_loadu_si256((const __m256i*)(above + x));
+    const __m256i b = _mm256_loadu_si256((const __m256i*)(below + x));
+    _mm256_storeu_si256((__m256i*)(out + x), _mm256_avg_epu8(a, b));
+  }
+  BobRowScalar(above + x, cur + x, below + x, out + x, bytes - x);
+}
+
+CNS_TARGET_AVX2
+inline void BlendRowAVX2(const uint8_t* above, const uint8_t* cur,
+                         const uint8_t* below, uint8_t* out, int bytes) {
+  int x = 0;
+  for (; x + 32 <= bytes; x += 32) {
+    const __m256i a = _mm256_loadu_si256((const __m256i*)(above + x));
+    const __m256i c = _mm256_loadu_si256((const __m256i*)(cur + x));
+    const __m256i b = _mm256_loadu_si256((const __m256i*)(below + x));
+    _mm256_storeu_si256((__m256i*)(out + x),
+                        _mm256_avg_epu8(_mm256_avg_epu8(a, b), c));
+  }
+  BlendRowScalar(above + x, cur + x, below + x, out + x, bytes - x);
+}
+
+CNS_TARGET_AVX2
+inline __m256i AbsDiffAVX2(__m256i a, __m256i b) {
+  return _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+}
+
+CNS_TARGET_AVX2
+inline void EdgeRowAVX2(const uint8_t* above, const uint8_t* cur,
+                        const uint8_t* below, uint8_t* out, int bytes) {
+  EdgeRowScalar(above, cur, below, out, std::min(bytes, 4));
+  int x = 4;
+  for (; x + 36 <= bytes; x += 32) {
+    const __m256i al = _mm256_loadu_si256((const __m256i*)(above + x - 4));
+    const __m256i ac = _mm256_loadu_si256((const __m256i*)(above + x));
+    const __m256i ar = _mm256_loadu_si256((const __m256i*)(above + x + 4));
+    const __m256i bl = _mm256_loadu_si256((const __m256i*)(below + x - 4));
+    const __m256i bc = _mm256_loadu_si256((const __m256i*)(below + x));
+    const __m256i br = _mm256_loadu_si256((const __m256i*)(below + x + 4));
+
+    const __m256i dl = AbsDiffAVX2(al, br);
+    const __m256i dc = AbsDiffAVX2(ac, bc);
+    const __m256i dr = AbsDiffAVX2(ar, bl);
+    const __m256i min = _mm256_min_epu8(dc, _mm256_min_epu8(dl, dr));
+
+    __m256i result = _mm256_avg_epu8(ar, bl);
+    result = _mm256_blendv_epi8(result, _mm256_avg_epu8(al, br),
+                                _mm256_cmpeq_epi8(dl, min));
+    result = _mm256_blendv_epi8(result, _mm256_avg_epu8(ac, bc),
+                                _mm256_cmpeq_epi8(dc, min));
+    _mm256_storeu_si256((__m256i*)(out + x), result);
+  }
+  for (; x < bytes; x++) {
+    out[x] = x >= bytes - 4 ? SimdAvg(above[x], below[x])
+                            : DeinterlaceEla(above, below, x);
+  }
+}
+
+class Deinterlacer {
+ public:
+  enum class Mode { Off, Bob, Blend, EdgeDirected };
+
+  Deinterlacer(Mode mode = Mode::EdgeDirected)
+      : mMode(mode), mFrames(0), mUnsupported(0), mTotalNs(0), mMaxNs(0) {}
+
+  void SetMode(Mode mode) { mMode = mode; }
+  Mode GetMode() { return mMode; }
+
+  // Deinterlaces an interleaved UYVY or 32-bit RGB frame in place and marks
+  // it progressive. Returns false if the frame was left untouched.
+  //
+  // Source applies it to the frame returned by NDIlib_recv_capture_v2,
+  // before the frame goes in the ring. That buffer belongs to the SDK, and
+  // writing to it assumes that the caller owns it until
+  // NDIlib_recv_free_video_v2, which is how the receiver hands it out:
+  // nothing else reads it meanwhile and it is not shared with another
+  // receiver. A copy of every interlaced frame would cost more than the
+  // filter itself.
+  bool Apply(NDIlib_video_frame_v2_t& frame) {
+    if (mMode == Mode::Off ||
+        frame.frame_format_type != NDIlib_frame_format_type_interleaved ||
+        !frame.p_data || frame.yres < 3) {
+      return false;
+    }
+    int bytes = 0;
+    switch (frame.FourCC) {
+      case NDIlib_FourCC_video_type_UYVY:
+        bytes = frame.xres * 2;
+        break;
+      case NDIlib_FourCC_video_type_BGRA:
+      case NDIlib_FourCC_video_type_BGRX:
+      case NDIlib_FourCC_video_type_RGBA:
+      case NDIlib_FourCC_video_type_RGBX:
+        bytes = frame.xres * 4;
+        break;
+      default:
+        mUnsupported++;
+        return false;
+    }
+
+    TRACE_SPAN("deinterlace", -1, mFrames);
+    const auto start = std::chrono::steady_clock::now();
+    const int stride = frame.line_stride_in_bytes;
+    const int height = frame.yres;
+    uint8_t* data = frame.p_data;
+    const DeinterlaceRowFn rowFn = SelectRowFn(mMode);
+
+    if (mMode == Mode::Blend) {
+      // Every row changes, the neighbours have to be read from a copy
+      mScratch.resize((size_t)stride * height);
+      memcpy(mScratch.data(), data, mScratch.size());
+      const uint8_t* src = mScratch.data();
+      ParallelFor::Shared().Run(height, 64, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+          const int above = y > 0 ? y - 1 : 1;
+          const int below = y < height - 1 ? y + 1 : height - 2;
+          rowFn(src + (size_t)above * stride, src + (size_t)y * stride,
+                src + (size_t)below * stride, data + (size_t)y * stride,
+                bytes);
+        }
+      });
+    } else {
+      // Only the odd rows change and they are built from the even ones
+      const int fieldRows = height / 2;
+      ParallelFor::Shared().Run(fieldRows, 32, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+          const int y = 2 * i + 1;
+          uint8_t* row = data + (size_t)y * stride;
+          const uint8_t* above = row - stride;
+          if (y == height - 1) {
+            memcpy(row, above, bytes);
+            continue;
+          }
+          rowFn(above, row, row + stride, row, bytes);
+        }
+      });
+    }
+    frame.frame_format_type = NDIlib_frame_format_type_progressive;
+
+    const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+    mFrames++;
+    mTotalNs += ns;
+    if (ns > mMaxNs) {
+      mMaxNs = ns;
+    }
+    return true;
+  }
+
+  void Output(const std::string& name) {
+    const uint64_t frames = mFrames;
+    if (!frames && !mUnsupported) {
+      return;
+    }
+    std::cout << "Source " << name << " | deinterlaced " << frames
+              << " | unsupported format " << mUnsupported << " | avg "
+              << (frames ? mTotalNs / frames / 1000000.0 : 0) << " ms | max "
+              << mMaxNs / 1000000.0 << " ms" << std::endl;
+  }
+
+ private:
+  Mode mMode;
+  // Copy of the frame for the blend mode
+  std::vector<uint8_t> mScratch;
+
+  std::atomic<uint64_t> mFrames;
+  std::atomic<uint64_t> mUnsupported;
+  std::atomic<uint64_t> mTotalNs;
+  std::atomic<uint64_t> mMaxNs;
+
+  static DeinterlaceRowFn SelectRowFn(Mode mode) {
+    const bool avx2 = CpuHasAVX2();
+    switch (mode) {
+      case Mode::Bob:
+        return avx2 ? BobRowAVX2 : BobRowSSE2;
+      case Mode::Blend:
+        return avx2 ? BlendRowAVX2 : BlendRowSSE2;
+      default:
+        return avx2 ? EdgeRowAVX2 : EdgeRowSSE2;
+    }
+  }
+};
+
+#endif  // DEINTERLACE_HPP___
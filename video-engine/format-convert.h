@@ -0,0 +1,285 @@
+#ifndef FORMAT_CONVERT_HPP___
+#define FORMAT_CONVERT_HPP___
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "pixel-format.h"
+#include "simd.h"
+
+// Row conversion between the packed formats, specialised on the pair at
+// compile time (see pixel-format.h)
+//
+// Y'CbCr is BT.709 video range, RGB full range. The SSE2 loops and the
+// scalar tails share the fixed point arithmetic, so a row converts the same
+// whatever its length:
+//   Y'CbCr to RGB  6 fractional bits, luma scaled through Y * 257 with a
+//                  16-bit high multiply so that super-whites do not wrap
+//   RGB to Y'CbCr  8 fractional bits for luma, chroma from the sum of the
+//                  two pixels of the macropixel
+
+inline uint8_t ConvertClamp(int value) {
+  return (uint8_t)std::min(255, std::max(0, value));
+}
+
+// Luma in 6 fractional bits, 1.164 (Y - 16)
+inline int ConvertLuma6(int y) { return ((y * 257 * 18997) >> 16) - 1192; }
+
+template <class Out>
+inline void ConvertStoreRGB(int yy, int u, int v, int a, uint8_t* out) {
+  out[Out::kR] = ConvertClamp((yy + 115 * v + 32) >> 6);
+  out[1] = ConvertClamp((yy - 14 * u - 34 * v + 32) >> 6);
+  out[Out::kB] = ConvertClamp((yy + 135 * u + 32) >> 6);
+  if constexpr (Out::kBytesPerPixel == 4) {
+    out[Out::kA] = (uint8_t)a;
+  }
+}
+
+// 4 pixels made as 32-bit lanes, the fourth byte dropped for 24-bit RGB
+template <class Out>
+inline void ConvertStorePixelsSSE2(__m128i pixels, uint8_t* out) {
+  if constexpr (Out::kBytesPerPixel == 4) {
+    _mm_storeu_si128((__m128i*)out, pixels);
+  } else {
+    alignas(16) uint8_t lanes[16];
+    _mm_store_si128((__m128i*)lanes, pixels);
+    for (int i = 0; i < 4; i++) {
+      memcpy(out + i * 3, lanes + i * 4, 3);
+    }
+  }
+}
+
+// Clamped bytes of 8 16-bit lanes, widened back to 16 bits
+inline __m128i ConvertClampSSE2(__m128i v) {
+  return _mm_unpacklo_epi8(_mm_packus_epi16(v, v), _mm_setzero_si128());
+}
+
+// Component at byte offset Shift / 8 of 4 32-bit pixels, as 32-bit lanes
+template <int Shift>
+inline __m128i ConvertComponentSSE2(__m128i pixels) {
+  return _mm_and_si128(_mm_srli_epi32(pixels, Shift), _mm_set1_epi32(0xff));
+}
+
+// Pixels of a row of In to Out. inAlpha is the alpha plane of UYVA, null
+// for the other formats. outAlpha, if not null, receives the alpha as a
+// plane when Out has no alpha byte; an RGB Out takes it in its alpha byte.
+// A format without alpha is opaque. Pixels is even with a Y'CbCr side.
+template <class In, class Out>
+void ConvertRow(const uint8_t* in, const uint8_t* inAlpha, uint8_t* out,
+                uint8_t* outAlpha, int pixels) {
+  static_assert(!In::kPlanar && !Out::kPlanar, "packed formats only");
+  static_assert(In::kBytesPerPixel != 3, "24-bit RGB is an output only");
+  constexpr int kOutBytes = Out::kBytesPerPixel;
+
+  if constexpr (In::kYUV && Out::kYUV) {
+    memcpy(out, in, (size_t)pixels * 2);
+    if (outAlpha) {
+      if (In::kAlphaPlane && inAlpha) {
+        memcpy(outAlpha, inAlpha, pixels);
+      } else {
+        memset(outAlpha, 255, pixels);
+      }
+    }
+  } else if constexpr (In::kYUV) {
+    // Y'CbCr to RGB, 8 pixels a loop
+    const bool alpha = In::kAlphaPlane && inAlpha;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lowByte = _mm_set1_epi16(0xff);
+    const __m128i half = _mm_set1_epi16(128);
+    const __m128i opaque = _mm_set1_epi32((int)0xff000000u);
+    int x = 0;
+    for (; x + 8 <= pixels; x += 8) {
+      const __m128i v = _mm_loadu_si128((const __m128i*)(in + x * 2));
+      const __m128i y = _mm_srli_epi16(v, 8);
+      const __m128i uv = _mm_sub_epi16(_mm_and_si128(v, lowByte), half);
+      const __m128i cb = _mm_shufflehi_epi16(
+          _mm_shufflelo_epi16(uv, _MM_SHUFFLE(2, 2, 0, 0)),
+          _MM_SHUFFLE(2, 2, 0, 0));
+      const __m128i cr = _mm_shufflehi_epi16(
+          _mm_shufflelo_epi16(uv, _MM_SHUFFLE(3, 3, 1, 1)),
+          _MM_SHUFFLE(3, 3, 1, 1));
+      const __m128i yy = _mm_add_epi16(
+          _mm_sub_epi16(
+              _mm_mulhi_epu16(_mm_or_si128(y, _mm_slli_epi16(y, 8)),
+                              _mm_set1_epi16(18997)),
+              _mm_set1_epi16(1192)),
+          _mm_set1_epi16(32));
+      const __m128i r = ConvertClampSSE2(_mm_srai_epi16(
+          _mm_adds_epi16(yy, _mm_mullo_epi16(cr, _mm_set1_epi16(115))), 6));
+      const __m128i g = ConvertClampSSE2(_mm_srai_epi16(
+          _mm_subs_epi16(
+              _mm_subs_epi16(yy, _mm_mullo_epi16(cb, _mm_set1_epi16(14))),
+              _mm_mullo_epi16(cr, _mm_set1_epi16(34))),
+          6));
+      const __m128i b = ConvertClampSSE2(_mm_srai_epi16(
+          _mm_adds_epi16(yy, _mm_mullo_epi16(cb, _mm_set1_epi16(135))), 6));
+      __m128i a = zero;
+      if (alpha) {
+        a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(inAlpha + x)),
+                              zero);
+      }
+      for (int part = 0; part < 2; part++) {
+        const __m128i r32 =
+            part ? _mm_unpackhi_epi16(r, zero) : _mm_unpacklo_epi16(r, zero);
+        const __m128i g32 =
+            part ? _mm_unpackhi_epi16(g, zero) : _mm_unpacklo_epi16(g, zero);
+        const __m128i b32 =
+            part ? _mm_unpackhi_epi16(b, zero) : _mm_unpacklo_epi16(b, zero);
+        const __m128i a32 =
+            alpha ? _mm_slli_epi32(part ? _mm_unpackhi_epi16(a, zero)
+                                        : _mm_unpacklo_epi16(a, zero),
+                                   24)
+                  : opaque;
+        const __m128i rgba = _mm_or_si128(
+            _mm_or_si128(_mm_slli_epi32(r32, Out::kR * 8),
+                         _mm_slli_epi32(g32, 8)),
+            _mm_or_si128(_mm_slli_epi32(b32, Out::kB * 8), a32));
+        ConvertStorePixelsSSE2<Out>(rgba, out + (x + part * 4) * kOutBytes);
+      }
+    }
+    for (; x < pixels; x += 2) {
+      const uint8_t* p = in + x * 2;
+      const int u = p[In::kU] - 128;
+      const int v = p[In::kV] - 128;
+      ConvertStoreRGB<Out>(ConvertLuma6(p[In::kY0]), u, v,
+                           alpha ? inAlpha[x] : 255, out + x * kOutBytes);
+      ConvertStoreRGB<Out>(ConvertLuma6(p[In::kY1]), u, v,
+                           alpha ? inAlpha[x + 1] : 255,
+                           out + (x + 1) * kOutBytes);
+    }
+  } else if constexpr (Out::kYUV) {
+    // RGB to Y'CbCr, 8 pixels a loop
+    int x = 0;
+    for (; x + 8 <= pixels; x += 8) {
+      const __m128i p0 = _mm_loadu_si128((const __m128i*)(in + x * 4));
+      const __m128i p1 = _mm_loadu_si128((const __m128i*)(in + x * 4 + 16));
+      const __m128i r =
+          _mm_packs_epi32(ConvertComponentSSE2<In::kR * 8>(p0),
+                          ConvertComponentSSE2<In::kR * 8>(p1));
+      const __m128i g = _mm_packs_epi32(ConvertComponentSSE2<8>(p0),
+                                        ConvertComponentSSE2<8>(p1));
+      const __m128i b =
+          _mm_packs_epi32(ConvertComponentSSE2<In::kB * 8>(p0),
+                          ConvertComponentSSE2<In::kB * 8>(p1));
+      // At most 220 * 255 + 128, unsigned 16 bits
+      const __m128i y = _mm_add_epi16(
+          _mm_srli_epi16(
+              _mm_add_epi16(
+                  _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(47)),
+                                _mm_mullo_epi16(g, _mm_set1_epi16(157))),
+                  _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(16)),
+                                _mm_set1_epi16(128))),
+              8),
+          _mm_set1_epi16(16));
+      // madd sums the two pixels of each macropixel
+      const __m128i u = _mm_add_epi32(
+          _mm_srai_epi32(
+              _mm_add_epi32(
+                  _mm_add_epi32(_mm_madd_epi16(r, _mm_set1_epi16(-26)),
+                                _mm_madd_epi16(g, _mm_set1_epi16(-86))),
+                  _mm_add_epi32(_mm_madd_epi16(b, _mm_set1_epi16(112)),
+                                _mm_set1_epi32(256))),
+              9),
+          _mm_set1_epi32(128));
+      const __m128i v = _mm_add_epi32(
+          _mm_srai_epi32(
+              _mm_add_epi32(
+                  _mm_add_epi32(_mm_madd_epi16(r, _mm_set1_epi16(112)),
+                                _mm_madd_epi16(g, _mm_set1_epi16(-102))),
+                  _mm_add_epi32(_mm_madd_epi16(b, _mm_set1_epi16(-10)),
+                                _mm_set1_epi32(256))),
+              9),
+          _mm_set1_epi32(128));
+      const __m128i uv = _mm_or_si128(_mm_and_si128(u, _mm_set1_epi32(0xffff)),
+                                      _mm_slli_epi32(v, 16));
+      _mm_storeu_si128((__m128i*)(out + x * 2),
+                       _mm_or_si128(uv, _mm_slli_epi16(y, 8)));
+      if (In::kHasAlpha && outAlpha) {
+        const __m128i a = _mm_packs_epi32(_mm_srli_epi32(p0, 24),
+                                          _mm_srli_epi32(p1, 24));
+        _mm_storel_epi64((__m128i*)(outAlpha + x), _mm_packus_epi16(a, a));
+      }
+    }
+    for (; x < pixels; x += 2) {
+      const uint8_t* p = in + x * 4;
+      const int r0 = p[In::kR], g0 = p[1], b0 = p[In::kB];
+      const int r1 = p[4 + In::kR], g1 = p[5], b1 = p[4 + In::kB];
+      uint8_t* o = out + x * 2;
+      o[Out::kY0] = (uint8_t)(((47 * r0 + 157 * g0 + 16 * b0 + 128) >> 8) + 16);
+      o[Out::kY1] = (uint8_t)(((47 * r1 + 157 * g1 + 16 * b1 + 128) >> 8) + 16);
+      o[Out::kU] = (uint8_t)(((-26 * (r0 + r1) - 86 * (g0 + g1) +
+                               112 * (b0 + b1) + 256) >>
+                              9) +
+                             128);
+      o[Out::kV] = (uint8_t)(((112 * (r0 + r1) - 102 * (g0 + g1) -
+                               10 * (b0 + b1) + 256) >>
+                              9) +
+                             128);
+      if (In::kHasAlpha && outAlpha) {
+        outAlpha[x] = p[3];
+        outAlpha[x + 1] = p[7];
+      }
+    }
+    if (!In::kHasAlpha && outAlpha) {
+      memset(outAlpha, 255, pixels);
+    }
+  } else {
+    // RGB to RGB, a swizzle of 4 pixels a loop
+    const __m128i opaque = _mm_set1_epi32((int)0xff000000u);
+    const __m128i alphaMask = In::kHasAlpha ? opaque : _mm_setzero_si128();
+    const __m128i alphaFill = In::kHasAlpha ? _mm_setzero_si128() : opaque;
+    int x = 0;
+    for (; x + 4 <= pixels; x += 4) {
+      const __m128i p = _mm_loadu_si128((const __m128i*)(in + x * 4));
+      const __m128i rgba = _mm_or_si128(
+          _mm_or_si128(
+              _mm_slli_epi32(ConvertComponentSSE2<In::kR * 8>(p), Out::kR * 8),
+              _mm_and_si128(p, _mm_set1_epi32(0xff00))),
+          _mm_or_si128(
+              _mm_slli_epi32(ConvertComponentSSE2<In::kB * 8>(p), Out::kB * 8),
+              _mm_or_si128(_mm_and_si128(p, alphaMask), alphaFill)));
+      ConvertStorePixelsSSE2<Out>(rgba, out + x * kOutBytes);
+    }
+    for (; x < pixels; x++) {
+      const uint8_t* p = in + x * 4;
+      uint8_t* o = out + x * kOutBytes;
+      const uint8_t r = p[In::kR], g = p[1], b = p[In::kB];
+      o[Out::kR] = r;
+      o[1] = g;
+      o[Out::kB] = b;
+      if constexpr (kOutBytes == 4) {
+        o[Out::kA] = In::kHasAlpha ? p[In::kA] : 255;
+      }
+    }
+  }
+}
+
+// Converts a frame of any packed format to Out, the format being resolved
+// once for the whole frame. out has outStride bytes a row, outAlpha (see
+// ConvertRow) xres. Returns false for the formats without a converter.
+template <class Out>
+bool ConvertFrame(const NDIlib_video_frame_v2_t& frame, uint8_t* out,
+                  int outStride, uint8_t* outAlpha = nullptr) {
+  if (!frame.p_data) {
+    return false;
+  }
+  return DispatchFormat(frame.FourCC, PackedFormats(), [&](auto format) {
+    using In = decltype(format);
+    // The alpha plane of UYVA follows the picture, one byte a pixel
+    const uint8_t* alpha =
+        In::kAlphaPlane
+            ? frame.p_data + (size_t)frame.line_stride_in_bytes * frame.yres
+            : nullptr;
+    for (int y = 0; y < frame.yres; y++) {
+      ConvertRow<In, Out>(
+          frame.p_data + (size_t)y * frame.line_stride_in_bytes,
+          alpha ? alpha + (size_t)y * frame.xres : nullptr,
+          out + (size_t)y * outStride,
+          outAlpha ? outAlpha + (size_t)y * frame.xres : nullptr,
+          frame.xres);
+    }
+  });
+}
+
+#endif  // FORMAT_CONVERT_HPP___
@@ -0,0 +1,121 @@
+#ifndef FRAME_HASH_HPP___
+#define FRAME_HASH_HPP___
+
+#include <cstdint>
+#include <cstring>
+
+#include "Processing.NDI.Lib.h"
+#include "simd.h"
+
+// Content hash of a video frame, used to detect repeated frames
+// The CRC32C instruction is run on three interleaved streams so that the
+// three CRCs are computed in parallel. The third is folded into the first,
+// which then forms the high half of the 64-bit result and the second the low
+// half.
+// A rowStep larger than 1 only hashes every rowStep-th row, which is cheaper
+// but can miss changes confined to the skipped rows.
+
+inline uint64_t HashRowsScalar(const uint8_t* data, int stride, int rowBytes,
+                               int rows, int rowStep) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (int y = 0; y < rows; y += rowStep) {
+    const uint8_t* row = data + (size_t)y * stride;
+    int x = 0;
+    for (; x + 8 <= rowBytes; x += 8) {
+      uint64_t w;
+      memcpy(&w, row + x, 8);
+      h = (h ^ w) * 0x100000001b3ull;
+    }
+    for (; x < rowBytes; x++) {
+      h = (h ^ row[x]) * 0x100000001b3ull;
+    }
+  }
+  return h;
+}
+
+CNS_TARGET_SSE42
+inline uint64_t HashRowsSSE42(const uint8_t* data, int stride, int rowBytes,
+                              int rows, int rowStep) {
+  uint64_t a = 0xffffffff, b = 0x12345678, c = 0x9abcdef0;
+  for (int y = 0; y < rows; y += rowStep) {
+    const uint8_t* row = data + (size_t)y * stride;
+    int x = 0;
+    for (; x + 24 <= rowBytes; x += 24) {
+      uint64_t w0, w1, w2;
+      memcpy(&w0, row + x, 8);
+      memcpy(&w1, row + x + 8, 8);
+      memcpy(&w2, row + x + 16, 8);
+      a = _mm_crc32_u64(a, w0);
+      b = _mm_crc32_u64(b, w1);
+      c = _mm_crc32_u64(c, w2);
+    }
+    for (; x < rowBytes; x++) {
+      a = _mm_crc32_u8((uint32_t)a, row[x]);
+    }
+  }
+  a = _mm_crc32_u32((uint32_t)a, (uint32_t)c);
+  return (a << 32) | (uint32_t)b;
+}
+
+// Number of bytes per row holding pixels, and rows to hash (the alpha plane
+// of UYVA is hashed as part of the data)
+inline void FrameHashExtent(const NDIlib_video_frame_v2_t& frame,
+                            int* rowBytes, int* rows) {
+  switch (frame.FourCC) {
+    case NDIlib_FourCC_video_type_UYVY:
+      *rowBytes = frame.xres * 2;
+      *rows = frame.yres;
+      break;
+    case NDIlib_FourCC_video_type_UYVA:
+      // The alpha plane follows the UYVY plane, with half its stride
+      *rowBytes = frame.xres * 2;
+      *rows = frame.yres + frame.yres / 2;
+      break;
+    case NDIlib_FourCC_video_type_NV12:
+    case NDIlib_FourCC_video_type_I420:
+    case NDIlib_FourCC_video_type_YV12:
+      *rowBytes = frame.xres;
+      *rows = frame.yres + frame.yres / 2;
+      break;
+    // 16-bit luma, then the interleaved chroma plane and for PA16 the alpha
+    // plane, each with the stride of the luma
+    case NDIlib_FourCC_video_type_P216:
+      *rowBytes = frame.xres * 2;
+      *rows = frame.yres * 2;
+      break;
+    case NDIlib_FourCC_video_type_PA16:
+      *rowBytes = frame.xres * 2;
+      *rows = frame.yres * 3;
+      break;
+    default:
+      *rowBytes = frame.xres * 4;
+      *rows = frame.yres;
+      break;
+  }
+}
+
+inline uint64_t HashFrame(const NDIlib_video_frame_v2_t& frame,
+                          int rowStep = 1) {
+  if (!frame.p_data) {
+    return 0;
+  }
+  int rowBytes = 0;
+  int rows = 0;
+  FrameHashExtent(frame, &rowBytes, &rows);
+  const int stride =
+      frame.line_stride_in_bytes ? frame.line_stride_in_bytes : rowBytes;
+  if (rowBytes > stride) {
+    rowBytes = stride;
+  }
+
+  uint64_t h = CpuHasSSE42()
+                   ? HashRowsSSE42(frame.p_data, stride, rowBytes, rows,
+                                   rowStep)
+                   : HashRowsScalar(frame.p_data, stride, rowBytes, rows,
+                                    rowStep);
+  // Frames of a different size or format never compare equal
+  return h ^ ((uint64_t)frame.xres << 40) ^ ((uint64_t)frame.yres << 20) ^
+         (uint64_t)frame.FourCC;
+}
+
+#endif  // FRAME_HASH_HPP___
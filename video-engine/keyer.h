@@ -0,0 +1,273 @@
+#ifndef KEYER_HPP___
+#define KEYER_HPP___
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "simd.h"
+
+// Row kernels of the compositor (renderer-compositor.h)
+//
+// A layer row is blended over the canvas in two steps: a key kernel makes
+// the alpha of every pixel, one byte per pixel, then a blend kernel mixes
+// the layer into the canvas with it. The keys and the blends come in a
+// UYVY flavour and a 32-bit RGB flavour; alpha is straight (not
+// premultiplied) everywhere. In UYVY the chroma of a macropixel takes the
+// average alpha of its two pixels.
+//
+// Keys ramp linearly from transparent to opaque between two limits. The
+// kernels clamp the difference to the ramp and multiply it by a gain from
+// KeyerGain, which keeps every product within unsigned 16 bits.
+
+// Width of the ramp between low and high. The gain of a narrower ramp would
+// not fit 16 bits, so it is widened to 1 << (8 - shift).
+inline int KeyerRange(int low, int high, int shift) {
+  return std::max(1 << (8 - shift), high - low);
+}
+
+// Gain of a ramp between low and high, for a difference shifted left by
+// shift bits and taken back with a 16-bit high multiply. Rounded up so that
+// the end of the ramp reaches 255; the widened range keeps it within 65280.
+inline uint16_t KeyerGain(int low, int high, int shift) {
+  const int range = KeyerRange(low, high, shift);
+  return (uint16_t)(((255 << (16 - shift)) + range - 1) / range);
+}
+
+// Ramp of 16-bit values, from 0 at low to at least 255 from high, which the
+// final pack saturates
+inline __m128i KeyerRampSSE2(__m128i value, __m128i low, __m128i range,
+                             __m128i gain, int shift) {
+  const __m128i clamped = _mm_min_epi16(_mm_subs_epu16(value, low), range);
+  return _mm_mulhi_epu16(_mm_sll_epi16(clamped, _mm_cvtsi32_si128(shift)),
+                         gain);
+}
+
+// The same ramp for the pixels left over by the vector loops, so that a
+// pixel keys the same in every lane
+inline uint8_t KeyerRamp(int value, int low, int high, int shift) {
+  const uint32_t clamped = (uint32_t)std::min(
+      std::max(value - low, 0), KeyerRange(low, high, shift));
+  return (uint8_t)std::min<uint32_t>(
+      255, ((clamped << shift) * KeyerGain(low, high, shift)) >> 16);
+}
+
+// (fg * m + bg * (255 - m)) / 255 per byte, the division being exact for
+// the products of two bytes
+inline __m128i KeyerBlendBytesSSE2(__m128i fg, __m128i bg, __m128i matte) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i full = _mm_set1_epi16(255);
+  const __m128i round = _mm_set1_epi16(128);
+  __m128i result[2];
+  for (int half = 0; half < 2; half++) {
+    const __m128i f = half ? _mm_unpackhi_epi8(fg, zero)
+                           : _mm_unpacklo_epi8(fg, zero);
+    const __m128i b = half ? _mm_unpackhi_epi8(bg, zero)
+                           : _mm_unpacklo_epi8(bg, zero);
+    const __m128i m = half ? _mm_unpackhi_epi8(matte, zero)
+                           : _mm_unpacklo_epi8(matte, zero);
+    __m128i t = _mm_add_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(f, m),
+                      _mm_mullo_epi16(b, _mm_sub_epi16(full, m))),
+        round);
+    t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    result[half] = t;
+  }
+  return _mm_packus_epi16(result[0], result[1]);
+}
+
+inline uint8_t KeyerBlendByte(int fg, int bg, int m) {
+  const int t = fg * m + bg * (255 - m) + 128;
+  return (uint8_t)((t + (t >> 8)) >> 8);
+}
+
+// ---------------------------------------------------------------- Blends
+
+// Blends pixels of 32-bit RGB fg over out with one alpha byte per pixel
+inline void KeyerBlendRGBASSE2(const uint8_t* fg, const uint8_t* alpha,
+                               uint8_t* out, int pixels) {
+  int x = 0;
+  for (; x + 4 <= pixels; x += 4) {
+    int a;
+    memcpy(&a, alpha + x, 4);
+    __m128i matte = _mm_cvtsi32_si128(a);
+    matte = _mm_unpacklo_epi8(matte, matte);
+    matte = _mm_unpacklo_epi16(matte, matte);
+    const __m128i f = _mm_loadu_si128((const __m128i*)(fg + x * 4));
+    const __m128i b = _mm_loadu_si128((const __m128i*)(out + x * 4));
+    _mm_storeu_si128((__m128i*)(out + x * 4),
+                     KeyerBlendBytesSSE2(f, b, matte));
+  }
+  for (; x < pixels; x++) {
+    for (int c = 0; c < 4; c++) {
+      out[x * 4 + c] = KeyerBlendByte(fg[x * 4 + c], out[x * 4 + c], alpha[x]);
+    }
+  }
+}
+
+// Blends UYVY fg over out, pixels is even
+inline void KeyerBlendUYVYSSE2(const uint8_t* fg, const uint8_t* alpha,
+                               uint8_t* out, int pixels) {
+  const __m128i lowBytes = _mm_set1_epi16(0x00ff);
+  const __m128i highBytes = _mm_set1_epi16((short)0xff00);
+  int x = 0;
+  for (; x + 8 <= pixels; x += 8) {
+    // Words of two pixel alphas, one word per macropixel
+    const __m128i w = _mm_loadl_epi64((const __m128i*)(alpha + x));
+    const __m128i chroma =
+        _mm_and_si128(_mm_avg_epu8(w, _mm_srli_epi16(w, 8)), lowBytes);
+    // U Y0 and V Y1 of each macropixel, interleaved
+    const __m128i even = _mm_or_si128(chroma, _mm_slli_epi16(w, 8));
+    const __m128i odd = _mm_or_si128(chroma, _mm_and_si128(w, highBytes));
+    const __m128i matte = _mm_unpacklo_epi16(even, odd);
+    const __m128i f = _mm_loadu_si128((const __m128i*)(fg + x * 2));
+    const __m128i b = _mm_loadu_si128((const __m128i*)(out + x * 2));
+    _mm_storeu_si128((__m128i*)(out + x * 2),
+                     KeyerBlendBytesSSE2(f, b, matte));
+  }
+  for (; x + 2 <= pixels; x += 2) {
+    const int a0 = alpha[x];
+    const int a1 = alpha[x + 1];
+    const int c = (a0 + a1 + 1) >> 1;
+    uint8_t* o = out + x * 2;
+    const uint8_t* f = fg + x * 2;
+    o[0] = KeyerBlendByte(f[0], o[0], c);
+    o[1] = KeyerBlendByte(f[1], o[1], a0);
+    o[2] = KeyerBlendByte(f[2], o[2], c);
+    o[3] = KeyerBlendByte(f[3], o[3], a1);
+  }
+}
+
+// ------------------------------------------------------------------ Keys
+
+// Straight alpha of 32-bit RGB pixels, the fourth byte
+inline void KeyerAlphaRGBASSE2(const uint8_t* fg, uint8_t* alpha,
+                               int pixels) {
+  int x = 0;
+  for (; x + 8 <= pixels; x += 8) {
+    const __m128i a0 =
+        _mm_srli_epi32(_mm_loadu_si128((const __m128i*)(fg + x * 4)), 24);
+    const __m128i a1 =
+        _mm_srli_epi32(_mm_loadu_si128((const __m128i*)(fg + x * 4 + 16)), 24);
+    _mm_storel_epi64((__m128i*)(alpha + x),
+                     _mm_packus_epi16(_mm_packs_epi32(a0, a1),
+                                      _mm_setzero_si128()));
+  }
+  for (; x < pixels; x++) {
+    alpha[x] = fg[x * 4 + 3];
+  }
+}
+
+// Luma key of UYVY: transparent at luma low and below, opaque from high
+inline void KeyerLumaUYVYSSE2(const uint8_t* fg, uint8_t* alpha, int pixels,
+                              int low, int high) {
+  const __m128i lowV = _mm_set1_epi16((short)low);
+  const __m128i range = _mm_set1_epi16((short)KeyerRange(low, high, 8));
+  const __m128i gain = _mm_set1_epi16((short)KeyerGain(low, high, 8));
+  int x = 0;
+  for (; x + 16 <= pixels; x += 16) {
+    __m128i a[2];
+    for (int half = 0; half < 2; half++) {
+      const __m128i y = _mm_srli_epi16(
+          _mm_loadu_si128((const __m128i*)(fg + x * 2 + half * 16)), 8);
+      a[half] = KeyerRampSSE2(y, lowV, range, gain, 8);
+    }
+    _mm_storeu_si128((__m128i*)(alpha + x), _mm_packus_epi16(a[0], a[1]));
+  }
+  for (; x < pixels; x++) {
+    alpha[x] = KeyerRamp(fg[x * 2 + 1], low, high, 8);
+  }
+}
+
+inline void KeyerLumaRGBASSE2(const uint8_t* fg, uint8_t* alpha, int pixels,
+                              int low, int high) {
+  const __m128i lowV = _mm_set1_epi16((short)low);
+  const __m128i range = _mm_set1_epi16((short)KeyerRange(low, high, 8));
+  const __m128i gain = _mm_set1_epi16((short)KeyerGain(low, high, 8));
+  int x = 0;
+  for (; x + 8 <= pixels; x += 8) {
+    const __m128i y = _mm_packs_epi32(
+        SimdLumaRGBA(_mm_loadu_si128((const __m128i*)(fg + x * 4))),
+        SimdLumaRGBA(_mm_loadu_si128((const __m128i*)(fg + x * 4 + 16))));
+    const __m128i a = KeyerRampSSE2(y, lowV, range, gain, 8);
+    _mm_storel_epi64((__m128i*)(alpha + x),
+                     _mm_packus_epi16(a, _mm_setzero_si128()));
+  }
+  for (; x < pixels; x++) {
+    const uint8_t* p = fg + x * 4;
+    const int y = (((p[0] + p[2] + 1) >> 1) + p[1] + 1) >> 1;
+    alpha[x] = KeyerRamp(y, low, high, 8);
+  }
+}
+
+// Chroma key of UYVY: the distance |U - u| + |V - v| of a macropixel to the
+// key colour ramps from transparent at inner to opaque at outer
+inline void KeyerChromaUYVYSSE2(const uint8_t* fg, uint8_t* alpha, int pixels,
+                                uint8_t u, uint8_t v, int inner, int outer) {
+  const __m128i key = _mm_set1_epi32(u | (v << 16));
+  const __m128i chromaMask = _mm_set1_epi32(0x00ff00ff);
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128i innerV = _mm_set1_epi16((short)inner);
+  const __m128i range = _mm_set1_epi16((short)KeyerRange(inner, outer, 7));
+  const __m128i gain = _mm_set1_epi16((short)KeyerGain(inner, outer, 7));
+  int x = 0;
+  for (; x + 16 <= pixels; x += 16) {
+    __m128i d[2];
+    for (int half = 0; half < 2; half++) {
+      const __m128i p =
+          _mm_loadu_si128((const __m128i*)(fg + x * 2 + half * 16));
+      d[half] = _mm_madd_epi16(
+          _mm_and_si128(SimdAbsDiffU8(p, key), chromaMask), ones);
+    }
+    // One distance per macropixel, at most 510
+    const __m128i distance = _mm_packs_epi32(d[0], d[1]);
+    const __m128i a = _mm_packus_epi16(
+        KeyerRampSSE2(distance, innerV, range, gain, 7), _mm_setzero_si128());
+    _mm_storeu_si128((__m128i*)(alpha + x), _mm_unpacklo_epi8(a, a));
+  }
+  for (; x + 2 <= pixels; x += 2) {
+    const uint8_t* p = fg + x * 2;
+    alpha[x] = alpha[x + 1] =
+        KeyerRamp(abs(p[0] - u) + abs(p[2] - v), inner, outer, 7);
+  }
+}
+
+// Colour key of 32-bit RGB: the distance is the sum of the absolute
+// differences of the three colour bytes, key holds them in the order of the
+// format
+inline void KeyerChromaRGBASSE2(const uint8_t* fg, uint8_t* alpha,
+                                int pixels, const uint8_t key[3], int inner,
+                                int outer) {
+  const __m128i keyV =
+      _mm_set1_epi32(key[0] | (key[1] << 8) | (key[2] << 16));
+  const __m128i byteMask = _mm_set1_epi32(0xff);
+  const __m128i innerV = _mm_set1_epi16((short)inner);
+  const __m128i range = _mm_set1_epi16((short)KeyerRange(inner, outer, 6));
+  const __m128i gain = _mm_set1_epi16((short)KeyerGain(inner, outer, 6));
+  int x = 0;
+  for (; x + 8 <= pixels; x += 8) {
+    __m128i d[2];
+    for (int half = 0; half < 2; half++) {
+      const __m128i diff = SimdAbsDiffU8(
+          _mm_loadu_si128((const __m128i*)(fg + x * 4 + half * 16)), keyV);
+      d[half] = _mm_add_epi32(
+          _mm_and_si128(diff, byteMask),
+          _mm_add_epi32(_mm_and_si128(_mm_srli_epi32(diff, 8), byteMask),
+                        _mm_and_si128(_mm_srli_epi32(diff, 16), byteMask)));
+    }
+    // At most 765
+    const __m128i distance = _mm_packs_epi32(d[0], d[1]);
+    const __m128i a = KeyerRampSSE2(distance, innerV, range, gain, 6);
+    _mm_storel_epi64((__m128i*)(alpha + x),
+                     _mm_packus_epi16(a, _mm_setzero_si128()));
+  }
+  for (; x < pixels; x++) {
+    const uint8_t* p = fg + x * 4;
+    alpha[x] = KeyerRamp(abs(p[0] - key[0]) + abs(p[1] - key[1]) +
+                             abs(p[2] - key[2]),
+                         inner, outer, 6);
+  }
+}
+
+#endif  // KEYER_HPP___
@@ -0,0 +1,161 @@
+#ifndef LATENCY_BARCODE_HPP___
+#define LATENCY_BARCODE_HPP___
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Processing.NDI.Lib.h"
+
+// Send time stamped into a frame by the test sender (Tests/) and read back
+// by the latency probe (latency-probe.h), in 100ns intervals of the system
+// clock
+//
+// The time goes twice into a frame: as per-frame metadata, exact but only
+// there as long as every hop forwards the metadata, and as a barcode of
+// black and white cells in the picture, which survives the NDI compression
+// and any renderer passing the pixels through. The barcode is 64 bits of
+// time and an 8 bit check, in two rows of 36 cells of 16x16 pixels near the
+// bottom left corner, out of the way of the burn-in text.
+
+constexpr int kLatencyBarcodeBits = 72;
+constexpr int kLatencyBarcodeColumns = 36;
+constexpr int kLatencyBarcodeCell = 16;
+constexpr int kLatencyBarcodeMargin = 32;
+
+inline uint8_t LatencyBarcodeCheck(uint64_t time) {
+  uint8_t check = 0xa5;
+  for (int i = 0; i < 8; i++) {
+    check ^= (uint8_t)(time >> (i * 8));
+    check = (uint8_t)((check << 1) | (check >> 7));
+  }
+  return check;
+}
+
+inline bool LatencyBarcodeFits(const NDIlib_video_frame_v2_t& frame) {
+  const bool uyvy = frame.FourCC == NDIlib_FourCC_video_type_UYVY ||
+                    frame.FourCC == NDIlib_FourCC_video_type_UYVA;
+  const bool rgba = frame.FourCC == NDIlib_FourCC_video_type_BGRA ||
+                    frame.FourCC == NDIlib_FourCC_video_type_BGRX ||
+                    frame.FourCC == NDIlib_FourCC_video_type_RGBA ||
+                    frame.FourCC == NDIlib_FourCC_video_type_RGBX;
+  const int rows = kLatencyBarcodeBits / kLatencyBarcodeColumns;
+  return (uyvy || rgba) && frame.p_data &&
+         frame.xres >= kLatencyBarcodeMargin +
+                           kLatencyBarcodeColumns * kLatencyBarcodeCell &&
+         frame.yres >= 2 * kLatencyBarcodeMargin + rows * kLatencyBarcodeCell;
+}
+
+// Top left pixel of a cell
+inline void LatencyBarcodeCellOrigin(const NDIlib_video_frame_v2_t& frame,
+                                     int bit, int* x, int* y) {
+  const int rows = kLatencyBarcodeBits / kLatencyBarcodeColumns;
+  *x = kLatencyBarcodeMargin + (bit % kLatencyBarcodeColumns) *
+                                   kLatencyBarcodeCell;
+  *y = frame.yres - kLatencyBarcodeMargin - rows * kLatencyBarcodeCell +
+       (bit / kLatencyBarcodeColumns) * kLatencyBarcodeCell;
+}
+
+// Draws the barcode of time into the frame, false if the format or the size
+// is not supported
+inline bool LatencyBarcodeWrite(NDIlib_video_frame_v2_t& frame, int64_t time) {
+  if (!LatencyBarcodeFits(frame)) {
+    return false;
+  }
+  const bool uyvy = frame.FourCC == NDIlib_FourCC_video_type_UYVY ||
+                    frame.FourCC == NDIlib_FourCC_video_type_UYVA;
+  const uint8_t check = LatencyBarcodeCheck((uint64_t)time);
+  for (int bit = 0; bit < kLatencyBarcodeBits; bit++) {
+    const bool set = bit < 64 ? ((uint64_t)time >> bit) & 1
+                              : (check >> (bit - 64)) & 1;
+    int x0, y0;
+    LatencyBarcodeCellOrigin(frame, bit, &x0, &y0);
+    for (int y = y0; y < y0 + kLatencyBarcodeCell; y++) {
+      uint8_t* row = frame.p_data + (size_t)y * frame.line_stride_in_bytes;
+      if (uyvy) {
+        // Video range black and white, neutral chroma
+        uint8_t* p = row + x0 * 2;
+        for (int x = 0; x < kLatencyBarcodeCell; x += 2, p += 4) {
+          p[0] = 128;
+          p[1] = set ? 235 : 16;
+          p[2] = 128;
+          p[3] = set ? 235 : 16;
+        }
+      } else {
+        uint8_t* p = row + x0 * 4;
+        for (int x = 0; x < kLatencyBarcodeCell; x++, p += 4) {
+          p[0] = p[1] = p[2] = set ? 255 : 0;
+          p[3] = 255;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Reads the barcode back, from the middle of every cell so that blurred
+// cell edges do not matter. False if the frame has no valid barcode.
+inline bool LatencyBarcodeRead(const NDIlib_video_frame_v2_t& frame,
+                               int64_t* time) {
+  if (!LatencyBarcodeFits(frame)) {
+    return false;
+  }
+  const bool uyvy = frame.FourCC == NDIlib_FourCC_video_type_UYVY ||
+                    frame.FourCC == NDIlib_FourCC_video_type_UYVA;
+  const int inset = kLatencyBarcodeCell / 4;
+  uint64_t value = 0;
+  uint8_t check = 0;
+  for (int bit = 0; bit < kLatencyBarcodeBits; bit++) {
+    int x0, y0;
+    LatencyBarcodeCellOrigin(frame, bit, &x0, &y0);
+    int sum = 0;
+    int count = 0;
+    for (int y = y0 + inset; y < y0 + kLatencyBarcodeCell - inset; y++) {
+      const uint8_t* row =
+          frame.p_data + (size_t)y * frame.line_stride_in_bytes;
+      for (int x = x0 + inset; x < x0 + kLatencyBarcodeCell - inset; x++) {
+        // Luma, or green which weighs the most in it
+        sum += uyvy ? row[x * 2 + 1] : row[x * 4 + 1];
+        count++;
+      }
+    }
+    const bool set = sum > 128 * count;
+    if (bit < 64) {
+      value |= (uint64_t)set << bit;
+    } else {
+      check |= (uint8_t)(set << (bit - 64));
+    }
+  }
+  if (check != LatencyBarcodeCheck(value)) {
+    return false;
+  }
+  *time = (int64_t)value;
+  return true;
+}
+
+// Per-frame metadata carrying the same time, NDI metadata is XML
+inline void LatencyMetadataWrite(char* buffer, size_t size, int64_t time) {
+  snprintf(buffer, size, "<ve_latency send_time=\"%" PRId64 "\"/>", time);
+}
+
+inline bool LatencyMetadataRead(const char* metadata, int64_t* time) {
+  if (!metadata) {
+    return false;
+  }
+  const char* tag = strstr(metadata, "<ve_latency send_time=\"");
+  if (!tag) {
+    return false;
+  }
+  char* end = nullptr;
+  const long long value = strtoll(tag + strlen("<ve_latency send_time=\""),
+                                  &end, 10);
+  if (!end || *end != '"') {
+    return false;
+  }
+  *time = value;
+  return true;
+}
+
+#endif  // LATENCY_BARCODE_HPP___
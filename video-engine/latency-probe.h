@@ -0,0 +1,199 @@
+#ifndef LATENCY_PROBE_HPP___
+#define LATENCY_PROBE_HPP___
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Processing.NDI.Lib.h"
+#include "clock.h"
+#include "latency-barcode.h"
+#include "trace.h"
+
+// Receives an NDI output of the engine and measures the time from the test
+// sender to here, the whole path through the engine
+//
+// The sender (Tests/NDI-Send-Video) stamps its send time into every frame,
+// see latency-barcode.h. The probe reads the barcode, falls back to the
+// metadata when the barcode is unreadable, and keeps one latency sample per
+// sent frame, the percentiles are over the last kMaxSamples of them; a frame
+// the renderer sent again is counted as a repeat. The sender, the engine and
+// the probe share the system clock, so they have to run on the same host,
+// where NDI goes over loopback.
+class LatencyProbe {
+ public:
+  // outputName is the NDI name of the engine output, without the host part
+  explicit LatencyProbe(std::string outputName)
+      : mOutputName(outputName),
+        mIsRunning(false),
+        mFrames(0),
+        mBarcodes(0),
+        mMetadata(0),
+        mMismatches(0),
+        mRepeats(0),
+        mUnstamped(0),
+        mSampleCount(0) {
+    mSamples.resize(kMaxSamples);
+  }
+  ~LatencyProbe() { Stop(); }
+
+  void Start() {
+    mIsRunning = true;
+    mThread = std::thread(&LatencyProbe::Run, this);
+  }
+
+  void Stop() {
+    mIsRunning = false;
+    if (mThread.joinable()) {
+      mThread.join();
+    }
+  }
+
+  void Output() {
+    std::vector<int64_t> samples;
+    uint64_t count = 0;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      count = mSampleCount;
+      samples.assign(mSamples.begin(),
+                     mSamples.begin() + std::min<uint64_t>(count, kMaxSamples));
+    }
+    std::cout << "Latency probe " << mOutputName << " | frames " << mFrames
+              << " | barcode " << mBarcodes << " | metadata " << mMetadata
+              << " | mismatched " << mMismatches << " | repeats " << mRepeats
+              << " | unstamped " << mUnstamped << std::endl;
+    if (samples.empty()) {
+      return;
+    }
+    std::sort(samples.begin(), samples.end());
+    std::cout << "Latency probe " << mOutputName << " | samples "
+              << samples.size() << " of " << count << " | min "
+              << samples.front() / 10000.0
+              << " ms | p50 " << Percentile(samples, 50) / 10000.0
+              << " ms | p90 " << Percentile(samples, 90) / 10000.0
+              << " ms | p99 " << Percentile(samples, 99) / 10000.0
+              << " ms | p99.9 " << Percentile(samples, 99.9) / 10000.0
+              << " ms | max " << samples.back() / 10000.0 << " ms"
+              << std::endl;
+  }
+
+ private:
+  std::string mOutputName;
+  std::thread mThread;
+  std::atomic<bool> mIsRunning;
+
+  std::atomic<uint64_t> mFrames;
+  std::atomic<uint64_t> mBarcodes;
+  std::atomic<uint64_t> mMetadata;
+  std::atomic<uint64_t> mMismatches;
+  std::atomic<uint64_t> mRepeats;
+  std::atomic<uint64_t> mUnstamped;
+  // Samples kept for the percentiles, older ones are overwritten. About five
+  // minutes of 60 frames/s.
+  static constexpr uint64_t kMaxSamples = 1 << 14;
+
+  // Ring of the latencies in 100ns intervals, mSampleCount is the total
+  // measured and the write position
+  std::mutex mMutex;
+  std::vector<int64_t> mSamples;
+  uint64_t mSampleCount;
+
+  static int64_t Percentile(const std::vector<int64_t>& sorted, double p) {
+    const size_t rank = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(rank, sorted.size() - 1)];
+  }
+
+  // NDI names look like "HOST (Output)"
+  bool Matches(const char* name) {
+    const std::string suffix = "(" + mOutputName + ")";
+    const std::string ndiName = name ? name : "";
+    return ndiName.size() >= suffix.size() &&
+           ndiName.compare(ndiName.size() - suffix.size(), suffix.size(),
+                           suffix) == 0;
+  }
+
+  // Waits for the engine output to be announced, null once stopped
+  NDIlib_recv_instance_t Connect() {
+    NDIlib_find_instance_t finder = NDIlib_find_create_v2();
+    if (!finder) {
+      return nullptr;
+    }
+    NDIlib_recv_instance_t recv = nullptr;
+    while (mIsRunning && !recv) {
+      NDIlib_find_wait_for_sources(finder, 500);
+      uint32_t count = 0;
+      const NDIlib_source_t* sources =
+          NDIlib_find_get_current_sources(finder, &count);
+      for (uint32_t i = 0; i < count; i++) {
+        if (!Matches(sources[i].p_ndi_name)) {
+          continue;
+        }
+        NDIlib_recv_create_v3_t recvDesc;
+        recvDesc.source_to_connect_to = sources[i];
+        recvDesc.bandwidth = NDIlib_recv_bandwidth_highest;
+        recvDesc.color_format = NDIlib_recv_color_format_UYVY_BGRA;
+        recv = NDIlib_recv_create_v3(&recvDesc);
+        std::cout << "Latency probe connected to " << sources[i].p_ndi_name
+                  << std::endl;
+        break;
+      }
+    }
+    NDIlib_find_destroy(finder);
+    return recv;
+  }
+
+  void Measure(const NDIlib_video_frame_v2_t& frame, int64_t now,
+               int64_t* lastSendTime) {
+    mFrames++;
+    int64_t barcode = 0;
+    int64_t metadata = 0;
+    const bool hasBarcode = LatencyBarcodeRead(frame, &barcode);
+    const bool hasMetadata = LatencyMetadataRead(frame.p_metadata, &metadata);
+    mBarcodes += hasBarcode;
+    mMetadata += hasMetadata;
+    if (hasBarcode && hasMetadata && barcode != metadata) {
+      mMismatches++;
+    }
+    if (!hasBarcode && !hasMetadata) {
+      mUnstamped++;
+      return;
+    }
+    const int64_t sendTime = hasBarcode ? barcode : metadata;
+    if (sendTime == *lastSendTime) {
+      mRepeats++;
+      return;
+    }
+    *lastSendTime = sendTime;
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSamples[mSampleCount++ % kMaxSamples] = now - sendTime;
+  }
+
+  void Run() {
+    TRACE_THREAD_NAME("latency probe");
+    NDIlib_recv_instance_t recv = Connect();
+    if (!recv) {
+      return;
+    }
+    int64_t lastSendTime = 0;
+    while (mIsRunning) {
+      NDIlib_video_frame_v2_t frame;
+      switch (NDIlib_recv_capture_v2(recv, &frame, nullptr, nullptr, 100)) {
+        case NDIlib_frame_type_video:
+          // Timed before decoding, decoding is not part of the path
+          Measure(frame, SystemClock::Get()->Now(), &lastSendTime);
+          NDIlib_recv_free_video_v2(recv, &frame);
+          break;
+        default:
+          break;
+      }
+    }
+    NDIlib_recv_destroy(recv);
+  }
+};
+
+#endif  // LATENCY_PROBE_HPP___
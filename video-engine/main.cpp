@@ -1,21 +1,230 @@
+#include <algorithm>
 #include <chrono>
+#include <ctime>
 #include <iostream>
 #include <list>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "Processing.NDI.Lib.h"
+#include "capture-executor.h"
+#include "clock.h"
+#include "latency-probe.h"
+#include "memory-budget.h"
+#include "metrics-server.h"
+#include "recording-sink.h"
+#include "redundant-source.h"
+#include "renderer-compositor.h"
+#include "renderer-null.h"
+#include "renderer-opencv-pipeline.h"
 #include "renderer-passthrough-ndi.h"
+#include "renderer-switcher.h"
+#include "shm-transport.h"
+#include "signal-monitor.h"
+#include "snapshot-service.h"
 #include "source.h"
+#include "synthetic-source.h"
+#include "trace.h"
+
+// Runs synthetic sources and a null renderer on a virtual clock for hours of
+// simulated time, as fast as the CPU allows, then reports the drift, the
+// drops and the memory
+static int RunSoak(double hours, int sourceCount, int xres, int yres,
+                   double driftPpm, int jitterUs, double dropRate,
+                   int rendererFRateNum, int rendererFRateDen,
+                   OverflowPolicy ringOverflowPolicy, int ringSpareFrames) {
+  std::cout << "Soak: " << hours << " h, " << sourceCount << " sources"
+            << std::endl;
+  VirtualClock clock;
+  const int64_t start = clock.Now();
+  const int64_t end = start + (int64_t)(hours * 3600 * 10000000);
+  const auto realStart = std::chrono::steady_clock::now();
+  const uint64_t rssStart = ProcessRssBytes();
+
+  std::list<Source *> sources;
+  RendererNull renderer(rendererFRateNum, rendererFRateDen);
+  renderer.SetClock(&clock);
+  renderer.SetVerbose(false);
+  for (int i = 0; i < sourceCount; i++) {
+    SyntheticSource *source =
+        new SyntheticSource("SOAK (" + std::to_string(i) + ")", xres, yres);
+    source->SetClock(&clock);
+    source->SetRunLimit(0);
+    // Each sender drifts its own way
+    source->SetImpairments(driftPpm * (i % 2 ? -1 : 1) * (i / 2 + 1),
+                           jitterUs, dropRate, i + 1);
+    // A blocked capture thread would hold the virtual clock forever
+    source->SetOverflowPolicy(ringOverflowPolicy == OverflowPolicy::Block
+                                  ? OverflowPolicy::Skip
+                                  : ringOverflowPolicy,
+                              ringSpareFrames);
+    sources.push_back(source);
+    renderer.AddSource(source);
+  }
+  for (std::list<Source *>::iterator it = sources.begin(); it != sources.end();
+       it++) {
+    (*it)->Start();
+  }
+  renderer.Start();
+
+  // Progress every simulated hour
+  uint64_t rssPeak = rssStart;
+  int64_t nextReport = clock.Now() + 36000000000LL;
+  while (clock.Now() < end) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    const uint64_t rss = ProcessRssBytes();
+    rssPeak = std::max(rssPeak, rss);
+    if (clock.Now() >= nextReport) {
+      nextReport += 36000000000LL;
+      std::cout << "Soak: " << (clock.Now() - start) / 36000000000.0
+                << " h | real "
+                << std::chrono::duration_cast<std::chrono::seconds>(
+                       std::chrono::steady_clock::now() - realStart)
+                       .count()
+                << " s | ticks " << renderer.GetTicks() << " | rss "
+                << rss / 1048576.0 << " MB" << std::endl;
+    }
+  }
+
+  // Stops the sources too, the run goes on a little while this thread
+  // catches up
+  renderer.Stop();
+  const double realSeconds =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - realStart)
+          .count() /
+      1000.0;
+  renderer.OutputStats();
+  for (std::list<Source *>::iterator it = sources.begin(); it != sources.end();
+       it++) {
+    (*it)->OutputCaptureStats();
+  }
+  MemoryBudget::Get().Output();
+  std::cout << "Soak: " << (clock.Now() - start) / 36000000000.0
+            << " h simulated in " << realSeconds
+            << " s | rss start " << rssStart / 1048576.0 << " MB | peak "
+            << rssPeak / 1048576.0 << " MB | end "
+            << ProcessRssBytes() / 1048576.0 << " MB" << std::endl;
+  for (std::list<Source *>::iterator it = sources.begin(); it != sources.end();
+       it++) {
+    delete *it;
+  }
+  return 0;
+}
 
 int main() {
 
   // All parameters are hardcoded for now
   std::string ndiOutputName = "Video Engine";
+  // "passthrough", "opencv", "switcher" or "compositor"
+  std::string rendererType = "passthrough";
   int rendererFRateNum = 15;
   int rendererFRateDen = 1;
   int frameDelays = 2;
+  // Per tick status lines of the renderer, for debugging only
+  bool rendererVerbose = false;
+  // Sources not read by any renderer for this long are suspended
+  int sourceIdleTimeoutMs = 5000;
+  Source::IdleMode sourceIdleMode = Source::IdleMode::Disconnect;
+  bool sourceLazyConnect = true;
+  // Upper bound on the time a resumed source takes to be ready
+  int sourceWarmupFrames = 3;
+  int sourceWarmupTimeoutMs = 500;
+  // A slow renderer holding ring slots must not stall capture, write around
+  // the frames it still holds
+  OverflowPolicy ringOverflowPolicy = OverflowPolicy::Skip;
+  int ringSpareFrames = 4;
+  // Interlaced sources are deinterlaced on capture
+  Deinterlacer::Mode deinterlaceMode = Deinterlacer::Mode::EdgeDirected;
+  // Capture all the sources from a fixed thread pool instead of one thread
+  // per source, 0 threads sizes the pool to the number of cores
+  bool useCaptureExecutor = false;
+  int captureThreads = 0;
+  // Do not send again frames identical to the previous one of a source, but
+  // still send one every second
+  RepeatFrameDetector::Policy repeatPolicy = RepeatFrameDetector::Policy::Skip;
+  int repeatKeepaliveTicks = rendererFRateNum / rendererFRateDen;
+  // Burn the source name, timecode and latency into the output
+  bool burnIn = false;
+  // Canvas of the compositor, UYVY
+  int compositorXres = 1920;
+  int compositorYres = 1080;
+  // Transition of the switcher takes, and its length in output frames
+  RendererSwitcher::Transition switcherTransition =
+      RendererSwitcher::Transition::Mix;
+  int switcherTransitionFrames = rendererFRateNum / rendererFRateDen;
+  // Renders all the sources from one common NDI timecode rather than each
+  // from its own receive time, for split screens of cameras sharing a house
+  // timecode, see RendererBase::SetSyncGroup
+  bool timecodeSync = false;
+  int timecodeSyncDelayFrames = 1;
+  // Chrome trace event file, see trace.h
+  std::string traceFile = "ve-trace.json";
+  // Multi-process deployment, see shm-transport.h
+  // "" captures and renders in this process, "publish" only captures and
+  // writes every selected source to a shared memory ring, "subscribe" renders
+  // the rings written by a publisher process
+  std::string shmMode = "";
+  std::string shmRingPrefix = "/cns-ve-";
+  int shmSlots = 4;
+  uint64_t shmSlotBytes = 1920 * 1080 * 4;
+  // Sources are selected in pairs, main then backup, each pair is rendered
+  // as one source that fails over to the backup
+  bool redundantPairs = false;
+  bool redundantRevertive = false;
+  int redundantRevertHoldMs = 5000;
+  // JPEG thumbnails of every source for the operator UI, 0 fps disables
+  // them, 2 fps is enough for a multiviewer. Pyramid level 2 is a quarter of
+  // the source size. With a directory set ("/dev/shm/cns-ve-snapshots" for
+  // instance) each thumbnail is also written there.
+  double snapshotRateFps = 0;
+  int snapshotLevel = 2;
+  int snapshotWorkers = 1;
+  std::string snapshotDir = "";
+  // Black, freeze and silence alarms, analyses per second of every source,
+  // 0 disables them. Thresholds and durations are in SignalMonitor.
+  double signalRateFps = 5.0;
+  // Simulated run on a virtual clock with synthetic sources and no NDI,
+  // see RunSoak. 0 hours runs the engine.
+  double soakHours = 0;
+  int soakSources = 4;
+  int soakXres = 1280;
+  int soakYres = 720;
+  double soakDriftPpm = 50;
+  int soakJitterUs = 2000;
+  double soakDropRate = 0.0001;
+  // Glass-to-glass latency: select Tests/NDI-Send-Video running on this host,
+  // the probe receives the engine output and reads back the send time the
+  // sender stamped into each frame, see latency-probe.h
+  bool latencyProbe = false;
+  // Compressed recording of the renderer output, "" disables it. Files of
+  // recordSegmentSeconds go to recordDirectory, encoded on recordWorkers
+  // threads. Past recordQueueDepth queued frames the newest are dropped.
+  std::string recordDirectory = "";
+  double recordSegmentSeconds = 600;
+  int recordQueueDepth = 16;
+  int recordWorkers = 2;
+  // Prometheus scrape endpoint, GET /metrics on this port, 0 disables it
+  int metricsPort = 9464;
+  std::string metricsAddress = "0.0.0.0";
+  // Frame memory budget of the process, 0 for no limit, see memory-budget.h
+  // Over it the rings shrink to memoryShrunkRingDepth frames, then the
+  // sources go to proxy bandwidth, then no more source is admitted. A source
+  // is admitted if memorySourceBytes more still fit, a ring of 1080p UYVY.
+  int64_t memoryBudgetBytes = 4LL * 1024 * 1024 * 1024;
+  int memoryShrunkRingDepth = 3;
+  int64_t memorySourceBytes = 8LL * 1920 * 1080 * 2;
+
+  if (soakHours > 0) {
+    return RunSoak(soakHours, soakSources, soakXres, soakYres, soakDriftPpm,
+                   soakJitterUs, soakDropRate, rendererFRateNum,
+                   rendererFRateDen, ringOverflowPolicy, ringSpareFrames);
+  }
 
   std::cout << "Starting Video Engine ..." << std::endl;
+  MemoryBudget &memoryBudget = MemoryBudget::Get();
+  memoryBudget.Configure(memoryBudgetBytes, memoryShrunkRingDepth);
 
   // Discovering NDI sources
   // Not required, but "correct" (see the SDK documentation).
@@ -47,57 +256,366 @@ int main() {
   for (uint32_t i = 0; i < no_sources; i++)
     ndiSourceNames.push_back(p_sources[i].p_ndi_name);
 
-  // Lists all the sources
+  // Lists all the sources, or the rings of the publisher process, numbered
+  // by the publisher's source indices
   int sourceIndex = 0;
-  for (std::list<std::string>::iterator it = ndiSourceNames.begin();
-       it != ndiSourceNames.end(); it++) {
-    std::cout << sourceIndex++ << " : " << *it << std::endl;
+  std::vector<ShmRingInfo> shmRings;
+  if (shmMode == "subscribe") {
+    shmRings = ShmListRings(shmRingPrefix);
+    std::cout << "Number of shared memory rings: " << shmRings.size()
+              << std::endl;
+    for (const ShmRingInfo &ring : shmRings) {
+      std::cout << ring.mIndex << " : " << ring.mSourceName << " ("
+                << ring.mShmName << ")" << std::endl;
+    }
+  } else {
+    for (std::list<std::string>::iterator it = ndiSourceNames.begin();
+         it != ndiSourceNames.end(); it++) {
+      std::cout << sourceIndex++ << " : " << *it << std::endl;
+    }
   }
 
+  // Subscribed sources have no receiver for the executor to drive, a
+  // redundant group drives its own feeds
+  const bool executorDriven =
+      useCaptureExecutor && shmMode != "subscribe" && !redundantPairs;
+
+  // The budget runs while the sources are selected, and the sources not
+  // driven by the executor start capturing as soon as they are admitted, so
+  // that the next source is admitted against what they actually use and the
+  // Refuse level of the budget applies
+  memoryBudget.Start();
+
   std::list<Source *> sources;
+  auto addSource = [&sources, executorDriven](Source *source) {
+    sources.push_back(source);
+    if (!executorDriven) {
+      source->Start();
+    }
+  };
+  std::list<ShmPublisher *> publishers;
+  // Main feed of a redundant pair waiting for its backup
+  Source *pendingMainFeed = nullptr;
   while (true) {
     std::string selectedSourceIndex;
-    std::cout << "Select a source index or (q) to quit: ";
+    if (shmMode == "subscribe") {
+      std::cout << "Select a shared memory ring index or (q) to quit: ";
+    } else {
+      std::cout << "Select a source index or (q) to quit: ";
+    }
     std::cin >> selectedSourceIndex;
     if (selectedSourceIndex == "q") {
       break;
     }
     sourceIndex = std::stoi(selectedSourceIndex);
 
+    // The publisher process owns the receivers
+    if (shmMode == "subscribe") {
+      auto ring = std::find_if(shmRings.begin(), shmRings.end(),
+                               [sourceIndex](const ShmRingInfo &r) {
+                                 return r.mIndex == sourceIndex;
+                               });
+      if (ring == shmRings.end()) {
+        std::cout << "No shared memory ring " << sourceIndex << std::endl;
+        continue;
+      }
+      if (memoryBudget.Admit(ring->mShmName, memorySourceBytes)) {
+        addSource(new ShmSource(ring->mShmName));
+      }
+      continue;
+    }
+    if (sourceIndex < 0 || sourceIndex >= (int)no_sources ||
+        !memoryBudget.Admit(p_sources[sourceIndex].p_ndi_name,
+                            memorySourceBytes)) {
+      continue;
+    }
+
     Source *videoSource = new Source();
     videoSource->Init((NDIlib_source_t *)&p_sources[sourceIndex]);
-    sources.push_back(videoSource);
+    videoSource->SetIdlePolicy(sourceIdleMode, sourceIdleTimeoutMs,
+                               sourceLazyConnect);
+    videoSource->SetWarmup(sourceWarmupFrames, sourceWarmupTimeoutMs);
+    videoSource->SetOverflowPolicy(ringOverflowPolicy, ringSpareFrames);
+    videoSource->SetDeinterlaceMode(deinterlaceMode);
+    // The OpenCV filters work on BGRA frames
+    if (rendererType == "opencv") {
+      videoSource->SetColorFormat(NDIlib_recv_color_format_BGRX_BGRA);
+    }
+    // The UYVY canvas of the compositor keys with the UYVA alpha
+    if (rendererType == "compositor") {
+      videoSource->SetColorFormat(NDIlib_recv_color_format_fastest);
+    }
+    if (shmMode == "publish") {
+      ShmPublisher *publisher =
+          new ShmPublisher(shmRingPrefix + std::to_string(sourceIndex));
+      if (!publisher->Open(shmSlots, shmSlotBytes,
+                           p_sources[sourceIndex].p_ndi_name)) {
+        delete publisher;
+        delete videoSource;
+        continue;
+      }
+      // No renderer in this process asks for frames, so the source never
+      // goes idle
+      videoSource->SetIdlePolicy(Source::IdleMode::None, 0, false);
+      videoSource->SetFrameCallback(
+          [publisher](const NDIlib_video_frame_v2_t &frame) {
+            publisher->Publish(frame);
+          });
+      publishers.push_back(publisher);
+      // Shared memory counts against the same container limit
+      videoSource->GetMemoryAccount()->Charge(MemoryKind::Pool,
+                                              (int64_t)shmSlots * shmSlotBytes);
+    }
+    if (redundantPairs && shmMode != "publish") {
+      if (!pendingMainFeed) {
+        pendingMainFeed = videoSource;
+        std::cout << "Select the backup feed" << std::endl;
+        continue;
+      }
+      RedundantSource *group =
+          new RedundantSource(pendingMainFeed, videoSource);
+      group->SetRevertive(redundantRevertive, redundantRevertHoldMs);
+      pendingMainFeed = nullptr;
+      addSource(group);
+      continue;
+    }
+    addSource(videoSource);
   }
 
-  // Start the sources
-  for (std::list<Source *>::iterator it = sources.begin(); it != sources.end();
-       it++) {
-    (*it)->Start();
+  // A main feed selected without its backup is used on its own
+  if (pendingMainFeed) {
+    addSource(pendingMainFeed);
   }
 
-  RendererBase *renderer = new RendererPassthroughNDI(
-      rendererFRateNum, rendererFRateDen, ndiOutputName);
+  // The executor takes its sources before it starts
+  CaptureExecutor *captureExecutor = nullptr;
+  if (executorDriven) {
+    captureExecutor = new CaptureExecutor(captureThreads);
+    for (std::list<Source *>::iterator it = sources.begin();
+         it != sources.end(); it++) {
+      captureExecutor->AddSource(*it);
+    }
+    captureExecutor->Start();
+  }
+
+  RendererBase *renderer = nullptr;
+  RendererSwitcher *switcher = nullptr;
+  if (shmMode == "publish") {
+    // Capture only
+  } else if (rendererType == "opencv") {
+    std::vector<OpenCVStage> stages = {
+        MakeDenoiseStage(), MakeSharpenStage(),
+        MakeColorCorrectionStage(cv::Scalar(1.0, 1.0, 1.05),
+                                 cv::Scalar(0, 0, 0))};
+    renderer = new RendererOpenCVPipeline(rendererFRateNum, rendererFRateDen,
+                                          ndiOutputName, stages);
+  } else if (rendererType == "compositor") {
+    // The first source fills the canvas, the second is a picture in
+    // picture in the bottom right quarter, keyed with its own alpha
+    RendererCompositor *compositor =
+        new RendererCompositor(rendererFRateNum, rendererFRateDen,
+                               ndiOutputName, compositorXres, compositorYres);
+    RendererCompositor::Layer background;
+    background.mSource = 0;
+    background.mCrop = {0, 0, 0, 0};
+    background.mDest = {0, 0, compositorXres, compositorYres};
+    background.mAlpha = RendererCompositor::AlphaMode::Opaque;
+    compositor->AddLayer(background);
+    RendererCompositor::Layer pip;
+    pip.mSource = 1;
+    pip.mCrop = {0, 0, 0, 0};
+    pip.mDest = {compositorXres / 2 - 32, compositorYres / 2 - 32,
+                 compositorXres / 2, compositorYres / 2};
+    pip.mAlpha = RendererCompositor::AlphaMode::Straight;
+    compositor->AddLayer(pip);
+    renderer = compositor;
+  } else if (rendererType == "switcher") {
+    switcher = new RendererSwitcher(rendererFRateNum, rendererFRateDen,
+                                    ndiOutputName);
+    renderer = switcher;
+  } else {
+    RendererPassthroughNDI *passthrough = new RendererPassthroughNDI(
+        rendererFRateNum, rendererFRateDen, ndiOutputName);
+    passthrough->SetRepeatPolicy(repeatPolicy, repeatKeepaliveTicks);
+    passthrough->SetBurnIn(burnIn);
+    renderer = passthrough;
+  }
+
+  if (renderer) {
+    renderer->SetVerbose(rendererVerbose);
+  }
 
   // Add the sources to the renderer
-  for (std::list<Source *>::iterator it = sources.begin(); it != sources.end();
-       it++) {
+  for (std::list<Source *>::iterator it = sources.begin();
+       renderer && it != sources.end(); it++) {
     renderer->AddSource(*it);
   }
 
+  if (renderer && timecodeSync) {
+    std::vector<int> syncGroup;
+    for (size_t i = 0; i < sources.size(); i++) {
+      syncGroup.push_back((int)i);
+    }
+    renderer->SetSyncGroup(syncGroup, timecodeSyncDelayFrames);
+  }
+
+  RecordingSink *recorder = nullptr;
+  if (renderer && !recordDirectory.empty()) {
+    recorder = new RecordingSink(ndiOutputName, recordDirectory,
+                                 recordSegmentSeconds, recordQueueDepth,
+                                 recordWorkers);
+    recorder->Start();
+    renderer->SetRecorder(recorder);
+  }
+
   // Start the renderer
-  renderer->Start();
+  if (renderer) {
+    renderer->Start();
+  }
+
+  LatencyProbe *probe = nullptr;
+  if (latencyProbe && renderer) {
+    probe = new LatencyProbe(ndiOutputName);
+    probe->Start();
+  }
+
+  MetricsServer *metricsServer = nullptr;
+  if (metricsPort > 0) {
+    MetricsRegistry &metrics = MetricsRegistry::Get();
+    metrics.AddCallback("process_resident_memory_bytes",
+                        "Resident memory size in bytes", "gauge", "",
+                        [] { return (double)ProcessRssBytes(); });
+    for (std::list<Source *>::iterator it = sources.begin();
+         it != sources.end(); it++) {
+      (*it)->ExportMetrics(metrics);
+    }
+    if (recorder) {
+      recorder->ExportMetrics(metrics);
+    }
+    memoryBudget.ExportMetrics(metrics);
+    metricsServer = new MetricsServer(metricsAddress, metricsPort);
+    if (!metricsServer->Start()) {
+      delete metricsServer;
+      metricsServer = nullptr;
+    }
+  }
+
+  SnapshotService *snapshots = nullptr;
+  if (snapshotRateFps > 0 && shmMode != "publish") {
+    snapshots = new SnapshotService(snapshotRateFps, snapshotLevel,
+                                    snapshotWorkers, 80, snapshotDir);
+    for (std::list<Source *>::iterator it = sources.begin();
+         it != sources.end(); it++) {
+      snapshots->AddSource(*it);
+    }
+    snapshots->Start();
+  }
+
+  SignalMonitor *signals = nullptr;
+  if (signalRateFps > 0 && shmMode != "publish") {
+    signals = new SignalMonitor(signalRateFps);
+    for (std::list<Source *>::iterator it = sources.begin();
+         it != sources.end(); it++) {
+      signals->AddSource(*it);
+    }
+    if (metricsServer) {
+      signals->ExportMetrics(MetricsRegistry::Get());
+    }
+    signals->Start();
+  }
 
   // Ask for user input to stop the program, stop if the user enters 'q'
+  // 't' dumps the trace of the last frames
+  // With the switcher, a digit takes that source to program and 'c', 'm',
+  // 'd' or 'w' picks cut, mix, dip or wipe for the next takes
   char c;
   while (1) {
     std::cin >> c;
     if (c == 'q') {
       break;
     }
+    if (switcher && c >= '0' && c <= '9') {
+      if (!switcher->Take(c - '0', switcherTransition,
+                          switcherTransitionFrames)) {
+        std::cout << "Switcher busy, take dropped" << std::endl;
+      }
+    }
+    if (switcher && (c == 'c' || c == 'm' || c == 'd' || c == 'w')) {
+      switcherTransition = c == 'c'   ? RendererSwitcher::Transition::Cut
+                           : c == 'm' ? RendererSwitcher::Transition::Mix
+                           : c == 'd' ? RendererSwitcher::Transition::Dip
+                                      : RendererSwitcher::Transition::Wipe;
+    }
+    if (c == 't') {
+      if (TRACE_DUMP(traceFile)) {
+        std::cout << "Trace written to " << traceFile << std::endl;
+      } else {
+        std::cout << "No trace, build with make TRACE=1" << std::endl;
+      }
+    }
+  }
+
+  // A scrape reads the sources and the renderer
+  if (metricsServer) {
+    std::cout << "Metrics scrapes: " << metricsServer->GetScrapes()
+              << std::endl;
+    metricsServer->Stop();
+    delete metricsServer;
+  }
+
+  // The signal monitor and the snapshots read the sources, stop them first
+  if (signals) {
+    signals->Stop();
+    signals->Output();
+    delete signals;
+  }
+  if (snapshots) {
+    snapshots->Stop();
+    snapshots->Output();
+    delete snapshots;
+  }
+
+  if (probe) {
+    probe->Stop();
+    probe->Output();
+    delete probe;
   }
 
   // Stop the renderer
-  renderer->Stop();
+  if (renderer) {
+    renderer->Stop();
+    renderer->OutputStats();
+    // Nothing is recorded once the renderer stopped, the queue is encoded
+    if (recorder) {
+      recorder->Stop();
+      recorder->Output();
+    }
+  } else {
+    for (std::list<Source *>::iterator it = sources.begin();
+         it != sources.end(); it++) {
+      (*it)->Stop();
+    }
+  }
+
+  // Capture statistics, to compare the executor with thread per source
+  for (std::list<Source *>::iterator it = sources.begin(); it != sources.end();
+       it++) {
+    (*it)->OutputCaptureStats();
+  }
+  memoryBudget.Stop();
+  memoryBudget.Output();
+  std::cout << "Process CPU: " << 1000.0 * std::clock() / CLOCKS_PER_SEC
+            << " ms" << std::endl;
+  if (captureExecutor) {
+    captureExecutor->Stop();
+    captureExecutor->Output();
+    delete captureExecutor;
+  }
+  // The rings stay in place for a restarted publisher to take over
+  for (std::list<ShmPublisher *>::iterator it = publishers.begin();
+       it != publishers.end(); it++) {
+    (*it)->Output();
+  }
 
   // Destroy the NDI finder. We needed to have access to the pointers to
   // p_sources[0]
@@ -106,14 +624,19 @@ int main() {
   // Not required, but nice
   NDIlib_destroy();
 
-  // Delete the sources
+  // Delete the sources, then the publishers their callbacks write to
   for (std::list<Source *>::iterator it = sources.begin(); it != sources.end();
        it++) {
     delete *it;
   }
+  for (std::list<ShmPublisher *>::iterator it = publishers.begin();
+       it != publishers.end(); it++) {
+    delete *it;
+  }
 
-  // Delete the renderer
+  // Delete the renderer, then the recorder it wrote to
   delete renderer;
+  delete recorder;
 
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,378 @@
+#ifndef MEMORY_BUDGET_HPP___
+#define MEMORY_BUDGET_HPP___
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "Processing.NDI.Lib.h"
+#include "clock.h"
+#include "metrics.h"
+#include "trace.h"
+
+// Accounting of the frame memory of the engine against a global budget
+//
+// Every owner of frame memory (a source, the renderer) charges an account
+// of its own when it allocates or receives a frame and releases it when the
+// frame goes, with a relaxed atomic add. A budget thread sums the accounts
+// a few times a second and, while the sum is over the limit, degrades the
+// engine one level at a time, in this order:
+//   ShrinkRings  the rings of the sources keep fewer frames
+//   Proxy        the receivers switch to proxy bandwidth
+//   Refuse       no new source is admitted
+// Each level gets a settle time to take effect before the next one. Once
+// the sum stays below a fraction of the limit for as long, the levels are
+// undone in the reverse order.
+//
+// The budget only asks: the owners read its directives from their account
+// (GetRingDepth, IsProxy) on their own threads and apply them when they
+// can, so no frame is freed under a reader.
+
+enum class MemoryKind { Ring, Pool, Pyramid, Render, Recorder };
+static constexpr int kMemoryKinds = 5;
+
+inline const char* MemoryKindName(MemoryKind kind) {
+  switch (kind) {
+    case MemoryKind::Ring:
+      return "ring";
+    case MemoryKind::Pool:
+      return "pool";
+    case MemoryKind::Pyramid:
+      return "pyramid";
+    case MemoryKind::Render:
+      return "render";
+    default:
+      return "recorder";
+  }
+}
+
+// Bytes of the buffer of a frame as the SDK lays it out, planes included
+inline int64_t FrameBytes(const NDIlib_video_frame_v2_t& frame) {
+  if (!frame.p_data) {
+    return 0;
+  }
+  const int64_t plane = (int64_t)frame.line_stride_in_bytes * frame.yres;
+  switch (frame.FourCC) {
+    // The alpha plane is 8-bit, one byte per pixel
+    case NDIlib_FourCC_video_type_UYVA:
+      return plane + (int64_t)frame.xres * frame.yres;
+    // Chroma is half the luma plane
+    case NDIlib_FourCC_video_type_NV12:
+    case NDIlib_FourCC_video_type_I420:
+    case NDIlib_FourCC_video_type_YV12:
+      return plane * 3 / 2;
+    // 16-bit, the interleaved chroma plane is as large as the luma plane
+    // and PA16 adds an alpha plane as large again
+    case NDIlib_FourCC_video_type_P216:
+      return plane * 2;
+    case NDIlib_FourCC_video_type_PA16:
+      return plane * 3;
+    default:
+      return plane;
+  }
+}
+
+class MemoryAccount {
+ public:
+  void Charge(MemoryKind kind, int64_t bytes) {
+    mBytes[(int)kind].fetch_add(bytes, std::memory_order_relaxed);
+    if (bytes <= 0) {
+      return;
+    }
+    const int64_t total = GetTotal();
+    int64_t peak = mPeak.load(std::memory_order_relaxed);
+    while (total > peak && !mPeak.compare_exchange_weak(peak, total)) {
+    }
+  }
+  void Release(MemoryKind kind, int64_t bytes) { Charge(kind, -bytes); }
+
+  int64_t GetBytes(MemoryKind kind) {
+    return mBytes[(int)kind].load(std::memory_order_relaxed);
+  }
+  int64_t GetTotal() {
+    int64_t total = 0;
+    for (int i = 0; i < kMemoryKinds; i++) {
+      total += mBytes[i].load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+  int64_t GetPeak() { return mPeak; }
+
+  const std::string& GetName() { return mName; }
+
+  // Directives of the budget
+  // Frames the ring of the owner keeps at most, 0 for all of them
+  int GetRingDepth() { return mRingDepth; }
+  // True when the owner is to receive at proxy bandwidth
+  bool IsProxy() { return mProxy; }
+
+ private:
+  friend class MemoryBudget;
+  MemoryAccount(const std::string& name, bool degradable)
+      : mName(name), mDegradable(degradable) {}
+
+  std::string mName;
+  // Only the accounts of sources take the directives
+  bool mDegradable;
+  std::atomic<int64_t> mBytes[kMemoryKinds] = {};
+  std::atomic<int64_t> mPeak{0};
+  std::atomic<int> mRingDepth{0};
+  std::atomic<bool> mProxy{false};
+};
+
+class MemoryBudget {
+ public:
+  enum class Level { Normal, ShrinkRings, Proxy, Refuse };
+
+  static MemoryBudget& Get() {
+    static MemoryBudget budget;
+    return budget;
+  }
+
+  ~MemoryBudget() { Stop(); }
+
+  // limitBytes of 0 accounts without a limit. shrunkRingDepth is the ring
+  // depth of the ShrinkRings level; keep it above the frame delay of the
+  // renderers. A level is raised at most every settleMs, and undone once the
+  // usage stayed below recoverFraction of the limit for settleMs.
+  void Configure(int64_t limitBytes, int shrunkRingDepth = 3,
+                 int settleMs = 2000, double recoverFraction = 0.8) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mLimit = limitBytes;
+    mShrunkRingDepth = shrunkRingDepth;
+    mSettleMs = settleMs;
+    mRecoverFraction = recoverFraction;
+  }
+
+  // Time source of the settle times, set before Start
+  void SetClock(Clock* clock) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mClock = clock;
+  }
+
+  // The account of name, created on the first call. Accounts live as long
+  // as the process, so frames released late can still be released.
+  // degradable accounts take the directives of the budget.
+  MemoryAccount* Register(const std::string& name, bool degradable) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto& account : mAccounts) {
+      if (account->mName == name) {
+        return account.get();
+      }
+    }
+    mAccounts.emplace_back(new MemoryAccount(name, degradable));
+    MemoryAccount* account = mAccounts.back().get();
+    ApplyLevel(account);
+    return account;
+  }
+
+  // Whether a new source expected to take expectedBytes fits the budget.
+  // The sources admitted before count for what they use, or what they were
+  // expected to take if they have not received that much yet.
+  bool Admit(const std::string& name, int64_t expectedBytes) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    const int64_t used = std::max(Sum(), mAdmittedBytes);
+    if (mLevel == Level::Refuse ||
+        (mLimit > 0 && used + expectedBytes > mLimit)) {
+      mRefused++;
+      std::cout << "Memory budget | source " << name << " refused, "
+                << (used + expectedBytes) / 1048576.0 << " MB of "
+                << mLimit / 1048576.0 << " MB" << std::endl;
+      return false;
+    }
+    mAdmittedBytes += expectedBytes;
+    return true;
+  }
+
+  int64_t GetUsed() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return Sum();
+  }
+  Level GetLevel() { return mLevel; }
+
+  // One step of the degradation, run by the budget thread every intervalMs
+  // after Start
+  void Update() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    const int64_t used = Sum();
+    mPeak = std::max(mPeak, used);
+    if (mLimit <= 0) {
+      return;
+    }
+    const int64_t now = mClock->NowMs();
+    if (used > mLimit * mRecoverFraction) {
+      mUnderSinceMs = -1;
+    } else if (mUnderSinceMs < 0) {
+      mUnderSinceMs = now;
+    }
+    if (now - mLevelChangeMs < mSettleMs) {
+      return;
+    }
+    Level level = mLevel;
+    if (used > mLimit && level != Level::Refuse) {
+      level = (Level)((int)level + 1);
+    } else if (mUnderSinceMs >= 0 && now - mUnderSinceMs >= mSettleMs &&
+               level != Level::Normal) {
+      level = (Level)((int)level - 1);
+    } else {
+      return;
+    }
+    std::cout << "Memory budget | " << used / 1048576.0 << " MB of "
+              << mLimit / 1048576.0 << " MB | " << LevelName(mLevel)
+              << " -> " << LevelName(level) << std::endl;
+    mLevel = level;
+    mLevelChangeMs = now;
+    mLevelChanges++;
+    for (auto& account : mAccounts) {
+      ApplyLevel(account.get());
+    }
+  }
+
+  void Start(int intervalMs = 200) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mIsRunning) {
+      return;
+    }
+    mIsRunning = true;
+    mLevelChangeMs = mClock->NowMs();
+    mThread = std::thread(&MemoryBudget::Run, this, intervalMs);
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mIsRunning = false;
+    }
+    mCond.notify_all();
+    if (mThread.joinable()) {
+      mThread.join();
+    }
+  }
+
+  // Per account and kind, read from the atomics by the scrape
+  void ExportMetrics(MetricsRegistry& metrics) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto& account : mAccounts) {
+      MemoryAccount* a = account.get();
+      const std::string owner = MetricsRegistry::Label("owner", a->mName);
+      for (int i = 0; i < kMemoryKinds; i++) {
+        const MemoryKind kind = (MemoryKind)i;
+        metrics.AddCallback(
+            "ve_memory_bytes", "Frame memory held, by owner and kind",
+            "gauge",
+            owner + "," + MetricsRegistry::Label("kind", MemoryKindName(kind)),
+            [a, kind] { return (double)a->GetBytes(kind); });
+      }
+    }
+    metrics.AddCallback("ve_memory_budget_bytes",
+                        "Frame memory budget, 0 for no limit", "gauge", "",
+                        [this] { return (double)mLimit; });
+    metrics.AddCallback(
+        "ve_memory_degradation_level",
+        "0 normal, 1 shrunk rings, 2 proxy, 3 refusing sources", "gauge", "",
+        [this] { return (double)(int)mLevel.load(); });
+    metrics.AddCallback("ve_memory_refused_sources_total",
+                        "Sources refused by the memory budget", "counter", "",
+                        [this] { return (double)mRefused; });
+  }
+
+  void Output() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto& account : mAccounts) {
+      std::cout << "Memory " << account->mName << " |";
+      for (int i = 0; i < kMemoryKinds; i++) {
+        const int64_t bytes = account->GetBytes((MemoryKind)i);
+        if (bytes) {
+          std::cout << " " << MemoryKindName((MemoryKind)i) << " "
+                    << bytes / 1048576.0 << " MB |";
+        }
+      }
+      std::cout << " peak " << account->GetPeak() / 1048576.0 << " MB"
+                << std::endl;
+    }
+    std::cout << "Memory budget | limit " << mLimit / 1048576.0
+              << " MB | used " << Sum() / 1048576.0 << " MB | peak "
+              << mPeak / 1048576.0 << " MB | level " << LevelName(mLevel)
+              << " | level changes " << mLevelChanges << " | refused "
+              << mRefused << std::endl;
+  }
+
+  static const char* LevelName(Level level) {
+    switch (level) {
+      case Level::Normal:
+        return "normal";
+      case Level::ShrinkRings:
+        return "shrink rings";
+      case Level::Proxy:
+        return "proxy";
+      default:
+        return "refuse";
+    }
+  }
+
+ private:
+  MemoryBudget() {}
+
+  // Pointers to the accounts stay valid as the deque grows
+  std::deque<std::unique_ptr<MemoryAccount>> mAccounts;
+  std::mutex mMutex;
+  std::condition_variable mCond;
+  std::thread mThread;
+  bool mIsRunning = false;
+  Clock* mClock = SystemClock::Get();
+
+  std::atomic<int64_t> mLimit{0};
+  int mShrunkRingDepth = 3;
+  int mSettleMs = 2000;
+  double mRecoverFraction = 0.8;
+
+  std::atomic<Level> mLevel{Level::Normal};
+  int64_t mLevelChangeMs = 0;
+  int64_t mUnderSinceMs = -1;
+  int64_t mAdmittedBytes = 0;
+  int64_t mPeak = 0;
+  uint64_t mLevelChanges = 0;
+  std::atomic<uint64_t> mRefused{0};
+
+  // Called with the lock held
+  int64_t Sum() {
+    int64_t total = 0;
+    for (auto& account : mAccounts) {
+      total += account->GetTotal();
+    }
+    return total;
+  }
+
+  void ApplyLevel(MemoryAccount* account) {
+    if (!account->mDegradable) {
+      return;
+    }
+    account->mRingDepth =
+        mLevel >= Level::ShrinkRings ? mShrunkRingDepth : 0;
+    account->mProxy = mLevel >= Level::Proxy;
+  }
+
+  void Run(int intervalMs) {
+    TRACE_THREAD_NAME("memory budget");
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mIsRunning) {
+      mCond.wait_for(lock, std::chrono::milliseconds(intervalMs));
+      if (!mIsRunning) {
+        break;
+      }
+      lock.unlock();
+      Update();
+      lock.lock();
+    }
+  }
+};
+
+#endif  // MEMORY_BUDGET_HPP___
@@ -0,0 +1,197 @@
+#ifndef METRICS_SERVER_HPP___
+#define METRICS_SERVER_HPP___
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+#include "trace.h"
+
+// HTTP endpoint serving GET /metrics to the Prometheus scrapers
+//
+// One thread serves every connection with poll() and non-blocking sockets,
+// a slow client never holds up another. Each request gets one response and
+// the connection is closed, which is all a scraper needs.
+class MetricsServer {
+ public:
+  MetricsServer(std::string address = "0.0.0.0", int port = 9464)
+      : mAddress(address),
+        mPort(port),
+        mListenFd(-1),
+        mIsRunning(false),
+        mScrapes(0) {}
+  ~MetricsServer() { Stop(); }
+
+  bool Start() {
+    mListenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (mListenFd < 0) {
+      std::cerr << "Metrics: cannot create socket" << std::endl;
+      return false;
+    }
+    const int reuse = 1;
+    setsockopt(mListenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(mPort);
+    if (inet_pton(AF_INET, mAddress.c_str(), &addr.sin_addr) != 1 ||
+        bind(mListenFd, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(mListenFd, 16) < 0) {
+      std::cerr << "Metrics: cannot listen on " << mAddress << ":" << mPort
+                << std::endl;
+      close(mListenFd);
+      mListenFd = -1;
+      return false;
+    }
+    std::cout << "Metrics on http://" << mAddress << ":" << mPort
+              << "/metrics" << std::endl;
+    mIsRunning = true;
+    mThread = std::thread(&MetricsServer::Run, this);
+    return true;
+  }
+
+  void Stop() {
+    mIsRunning = false;
+    if (mThread.joinable()) {
+      mThread.join();
+    }
+    if (mListenFd >= 0) {
+      close(mListenFd);
+      mListenFd = -1;
+    }
+  }
+
+  uint64_t GetScrapes() { return mScrapes; }
+
+ private:
+  static constexpr size_t kMaxRequestBytes = 8192;
+  static constexpr int kMaxClients = 16;
+  static constexpr int kClientTimeoutMs = 5000;
+
+  struct Client {
+    int mFd;
+    std::string mRequest;
+    std::string mResponse;
+    size_t mSent;
+    std::chrono::steady_clock::time_point mSince;
+  };
+
+  std::string mAddress;
+  int mPort;
+  int mListenFd;
+  std::thread mThread;
+  std::atomic<bool> mIsRunning;
+  std::atomic<uint64_t> mScrapes;
+  std::vector<Client> mClients;
+
+  std::string Respond(const std::string& request) {
+    std::string status = "200 OK";
+    std::string body;
+    if (request.compare(0, 13, "GET /metrics ") == 0 ||
+        request.compare(0, 13, "GET /metrics?") == 0) {
+      body = MetricsRegistry::Get().Render();
+      mScrapes++;
+    } else {
+      status = "404 Not Found";
+      body = "Not found, try /metrics\n";
+    }
+    return "HTTP/1.1 " + status +
+           "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+           std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" +
+           body;
+  }
+
+  void Accept() {
+    while ((int)mClients.size() < kMaxClients) {
+      const int fd = accept4(mListenFd, nullptr, nullptr, SOCK_NONBLOCK);
+      if (fd < 0) {
+        return;
+      }
+      mClients.push_back(
+          Client{fd, "", "", 0, std::chrono::steady_clock::now()});
+    }
+  }
+
+  // Returns false once the client is done with
+  bool Serve(Client& client, short events) {
+    // A client may hang up its side right after the request
+    if ((events & (POLLERR | POLLNVAL)) ||
+        ((events & POLLHUP) && !(events & POLLIN))) {
+      return false;
+    }
+    if (client.mResponse.empty() && (events & POLLIN)) {
+      char buffer[2048];
+      const ssize_t n = read(client.mFd, buffer, sizeof(buffer));
+      if (n <= 0) {
+        return false;
+      }
+      client.mRequest.append(buffer, n);
+      if (client.mRequest.find("\r\n\r\n") != std::string::npos) {
+        client.mResponse = Respond(client.mRequest);
+      } else if (client.mRequest.size() > kMaxRequestBytes) {
+        return false;
+      }
+    }
+    if (!client.mResponse.empty()) {
+      // A scraper closing early must not raise SIGPIPE on the engine
+      const ssize_t n =
+          send(client.mFd, client.mResponse.data() + client.mSent,
+               client.mResponse.size() - client.mSent, MSG_NOSIGNAL);
+      if (n < 0) {
+        return errno == EAGAIN;
+      }
+      client.mSent += n;
+      return client.mSent < client.mResponse.size();
+    }
+    return std::chrono::steady_clock::now() - client.mSince <
+           std::chrono::milliseconds(kClientTimeoutMs);
+  }
+
+  void Run() {
+    TRACE_THREAD_NAME("metrics");
+    std::vector<pollfd> fds;
+    while (mIsRunning) {
+      fds.clear();
+      fds.push_back(pollfd{mListenFd, POLLIN, 0});
+      for (auto& client : mClients) {
+        fds.push_back(pollfd{
+            client.mFd, (short)(client.mResponse.empty() ? POLLIN : POLLOUT),
+            0});
+      }
+      // The timeout bounds the time Stop waits
+      if (poll(fds.data(), fds.size(), 200) < 0 && errno != EINTR) {
+        break;
+      }
+      if (fds[0].revents & POLLIN) {
+        Accept();
+      }
+      // New clients are past the end of fds, served on the next poll
+      const size_t polled = fds.size() - 1;
+      for (size_t i = polled; i-- > 0;) {
+        if (!Serve(mClients[i], fds[i + 1].revents)) {
+          close(mClients[i].mFd);
+          mClients.erase(mClients.begin() + i);
+        }
+      }
+    }
+    for (auto& client : mClients) {
+      close(client.mFd);
+    }
+    mClients.clear();
+  }
+};
+
+#endif  // METRICS_SERVER_HPP___
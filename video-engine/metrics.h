@@ -0,0 +1,335 @@
+#ifndef METRICS_HPP___
+#define METRICS_HPP___
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Engine counters and histograms, rendered in the Prometheus text format
+// for MetricsServer
+//
+// A counter or a histogram is a few slots of a shard, and every thread
+// writing metrics gets a shard of its own on its first write. A write is a
+// relaxed atomic add on the writer's own cache lines, never a lock, and a
+// scrape sums the slots of all the shards. Values that already live in
+// atomics (capture counts, ring statistics) are exported through callbacks
+// run by the scrape instead of being counted twice. The shard of a thread
+// that exits is added to a shared one and given to the next new thread.
+class MetricsRegistry {
+ public:
+  static constexpr int kMaxShards = 128;
+  static constexpr int kSlots = 4096;
+
+  // A counter or a histogram added once the slots ran out has no slot, it
+  // drops its writes and is not exported
+  class Counter {
+   public:
+    void Add(uint64_t value = 1) {
+      if (mSlot >= 0) {
+        MetricsRegistry::Get().Add(mSlot, value);
+      }
+    }
+
+   private:
+    friend class MetricsRegistry;
+    explicit Counter(int slot) : mSlot(slot) {}
+    int mSlot;
+  };
+
+  // Values are integers in the unit of the caller, 100ns intervals for
+  // instance; scale converts them to the exported unit, seconds by the
+  // Prometheus conventions
+  class Histogram {
+   public:
+    void Observe(int64_t value) {
+      if (mSlot < 0) {
+        return;
+      }
+      MetricsRegistry& registry = MetricsRegistry::Get();
+      size_t bucket = 0;
+      while (bucket < mBounds.size() && value > mBounds[bucket]) {
+        bucket++;
+      }
+      registry.Add(mSlot + (int)bucket, 1);
+      // Slots wrap around, so a negative sum works like a two's complement
+      registry.Add(mSlot + (int)mBounds.size() + 1, (uint64_t)value);
+    }
+
+   private:
+    friend class MetricsRegistry;
+    Histogram(int slot, std::vector<int64_t> bounds, double scale)
+        : mSlot(slot), mBounds(bounds), mScale(scale) {}
+    // One slot per bucket, the last one for values above every bound, then
+    // the sum
+    int mSlot;
+    std::vector<int64_t> mBounds;
+    double mScale;
+  };
+
+  static MetricsRegistry& Get() {
+    static MetricsRegistry registry;
+    return registry;
+  }
+
+  // labels is a comma separated list made with Label, "" for none
+  // The same name and labels give the same counter
+  Counter* AddCounter(const std::string& name, const std::string& help,
+                      const std::string& labels = "") {
+    std::lock_guard<std::mutex> lock(mMutex);
+    Series* series = FindSeries(name, help, "counter", labels);
+    if (!series->mCounter) {
+      series->mCounter.reset(new Counter(AllocateSlots(name, 1)));
+    }
+    return series->mCounter.get();
+  }
+
+  Histogram* AddHistogram(const std::string& name, const std::string& help,
+                          const std::string& labels,
+                          std::vector<int64_t> bounds, double scale) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    Series* series = FindSeries(name, help, "histogram", labels);
+    if (!series->mHistogram) {
+      std::sort(bounds.begin(), bounds.end());
+      series->mHistogram.reset(new Histogram(
+          AllocateSlots(name, (int)bounds.size() + 2), bounds, scale));
+    }
+    return series->mHistogram.get();
+  }
+
+  // value is called by the scrape thread, it must not block and has to stay
+  // valid while a MetricsServer runs. type is "gauge" or "counter".
+  void AddCallback(const std::string& name, const std::string& help,
+                   const std::string& type, const std::string& labels,
+                   std::function<double()> value) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    FindSeries(name, help, type, labels)->mCallback = value;
+  }
+
+  static std::string Label(const std::string& key, const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+      if (c == '\\' || c == '"') {
+        escaped += '\\';
+      }
+      escaped += c == '\n' ? ' ' : c;
+    }
+    return key + "=\"" + escaped + "\"";
+  }
+
+  // The Prometheus text exposition format, version 0.0.4
+  std::string Render() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::ostringstream out;
+    out.precision(10);
+    for (auto& family : mFamilies) {
+      out << "# HELP " << family.first << " " << family.second.mHelp << "\n";
+      out << "# TYPE " << family.first << " " << family.second.mType << "\n";
+      for (auto& series : family.second.mSeries) {
+        RenderSeries(out, family.first, *series);
+      }
+    }
+    return out.str();
+  }
+
+ private:
+  struct Shard {
+    std::atomic<uint64_t> mSlots[kSlots];
+  };
+
+  struct Series {
+    std::string mLabels;
+    std::unique_ptr<Counter> mCounter;
+    std::unique_ptr<Histogram> mHistogram;
+    std::function<double()> mCallback;
+  };
+
+  struct Family {
+    std::string mHelp;
+    std::string mType;
+    std::vector<std::unique_ptr<Series>> mSeries;
+  };
+
+  // Guards the families and the slot allocation, never taken by a write
+  std::mutex mMutex;
+  std::map<std::string, Family> mFamilies;
+  int mNextSlot;
+
+  std::atomic<Shard*> mShards[kMaxShards];
+  std::atomic<int> mShardCount;
+  // Shards of the threads that exited, guarded by mMutex
+  std::vector<int> mFreeShards;
+  // Written by the threads that came while every shard was in use, and
+  // holds the counts of the threads that exited
+  Shard mSharedShard;
+
+  // Gives the shard of a thread back to the registry when the thread exits
+  struct ShardHandle {
+    Shard* mShard = nullptr;
+    int mIndex = -1;
+    ~ShardHandle() {
+      if (mIndex >= 0) {
+        MetricsRegistry::Get().ReleaseShard(mIndex);
+      }
+    }
+  };
+
+  MetricsRegistry() : mNextSlot(0), mShardCount(0) {
+    for (auto& shard : mShards) {
+      shard = nullptr;
+    }
+    ZeroShard(&mSharedShard);
+  }
+
+  static void ZeroShard(Shard* shard) {
+    for (auto& slot : shard->mSlots) {
+      slot.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // The shard of the calling thread, taken on its first write
+  Shard* ThreadShard() {
+    thread_local ShardHandle handle;
+    if (!handle.mShard) {
+      std::lock_guard<std::mutex> lock(mMutex);
+      if (!mFreeShards.empty()) {
+        handle.mIndex = mFreeShards.back();
+        mFreeShards.pop_back();
+        handle.mShard = mShards[handle.mIndex].load();
+      } else if (mShardCount < kMaxShards) {
+        Shard* own = new Shard();
+        ZeroShard(own);
+        handle.mIndex = mShardCount;
+        handle.mShard = own;
+        mShards[handle.mIndex].store(own, std::memory_order_release);
+        mShardCount++;
+      } else {
+        handle.mShard = &mSharedShard;
+      }
+    }
+    return handle.mShard;
+  }
+
+  // Moves the counts of an exited thread to the shared shard. A scrape holds
+  // mMutex while it sums, so it sees them in one shard or the other.
+  void ReleaseShard(int index) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    Shard* shard = mShards[index].load();
+    for (int slot = 0; slot < kSlots; slot++) {
+      const uint64_t value =
+          shard->mSlots[slot].exchange(0, std::memory_order_relaxed);
+      if (value) {
+        mSharedShard.mSlots[slot].fetch_add(value, std::memory_order_relaxed);
+      }
+    }
+    mFreeShards.push_back(index);
+  }
+
+  void Add(int slot, uint64_t value) {
+    ThreadShard()->mSlots[slot].fetch_add(value, std::memory_order_relaxed);
+  }
+
+  uint64_t Sum(int slot) {
+    uint64_t sum = mSharedShard.mSlots[slot].load(std::memory_order_relaxed);
+    const int count = mShardCount;
+    for (int i = 0; i < count; i++) {
+      Shard* shard = mShards[i].load(std::memory_order_acquire);
+      if (shard) {
+        sum += shard->mSlots[slot].load(std::memory_order_relaxed);
+      }
+    }
+    return sum;
+  }
+
+  // Called with mMutex held, returns -1 once the slots ran out
+  int AllocateSlots(const std::string& name, int count) {
+    if (mNextSlot + count > kSlots) {
+      std::cerr << "Metrics: out of slots, " << name << " is not exported"
+                << std::endl;
+      return -1;
+    }
+    mNextSlot += count;
+    return mNextSlot - count;
+  }
+
+  // Called with mMutex held
+  Series* FindSeries(const std::string& name, const std::string& help,
+                     const std::string& type, const std::string& labels) {
+    Family& family = mFamilies[name];
+    if (family.mType.empty()) {
+      family.mHelp = help;
+      family.mType = type;
+    }
+    for (auto& series : family.mSeries) {
+      if (series->mLabels == labels) {
+        return series.get();
+      }
+    }
+    family.mSeries.emplace_back(new Series());
+    family.mSeries.back()->mLabels = labels;
+    return family.mSeries.back().get();
+  }
+
+  static std::string Braces(const std::string& labels,
+                            const std::string& extra = "") {
+    if (labels.empty() && extra.empty()) {
+      return "";
+    }
+    return "{" + labels + (labels.empty() || extra.empty() ? "" : ",") +
+           extra + "}";
+  }
+
+  void RenderSeries(std::ostringstream& out, const std::string& name,
+                    Series& series) {
+    if (series.mCallback) {
+      out << name << Braces(series.mLabels) << " " << series.mCallback()
+          << "\n";
+    } else if (series.mCounter && series.mCounter->mSlot >= 0) {
+      out << name << Braces(series.mLabels) << " "
+          << Sum(series.mCounter->mSlot) << "\n";
+    } else if (series.mHistogram && series.mHistogram->mSlot >= 0) {
+      const Histogram& histogram = *series.mHistogram;
+      uint64_t cumulative = 0;
+      for (size_t i = 0; i <= histogram.mBounds.size(); i++) {
+        cumulative += Sum(histogram.mSlot + (int)i);
+        std::ostringstream bound;
+        bound.precision(10);
+        if (i < histogram.mBounds.size()) {
+          bound << histogram.mBounds[i] * histogram.mScale;
+        } else {
+          bound << "+Inf";
+        }
+        out << name << "_bucket"
+            << Braces(series.mLabels, Label("le", bound.str())) << " "
+            << cumulative << "\n";
+      }
+      const int64_t sum =
+          (int64_t)Sum(histogram.mSlot + (int)histogram.mBounds.size() + 1);
+      out << name << "_sum" << Braces(series.mLabels) << " "
+          << sum * histogram.mScale << "\n";
+      out << name << "_count" << Braces(series.mLabels) << " " << cumulative
+          << "\n";
+    }
+  }
+};
+
+// Resident set size of the process, from /proc/self/statm
+inline uint64_t ProcessRssBytes() {
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size = 0, resident = 0;
+  statm >> size >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+#endif  // METRICS_HPP___
@@ -0,0 +1,58 @@
+#ifndef OPENCV_FILTERS_HPP___
+#define OPENCV_FILTERS_HPP___
+
+#include <functional>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+// A filter reads in and writes out, out is allocated by OpenCV when needed
+// Filters run on 4 channel (BGRA/BGRX) frames
+typedef std::function<void(const cv::Mat &in, cv::Mat &out)> OpenCVFilter;
+
+struct OpenCVStage {
+  std::string mName;
+  OpenCVFilter mFilter;
+};
+
+// Median filter, ksize must be 3 or 5 for 4 channel frames
+inline OpenCVStage MakeDenoiseStage(int ksize = 3) {
+  return {"denoise", [ksize](const cv::Mat &in, cv::Mat &out) {
+            cv::medianBlur(in, out, ksize);
+          }};
+}
+
+// Unsharp mask, out = in + amount * (in - blur(in))
+inline OpenCVStage MakeSharpenStage(double sigma = 1.5, double amount = 0.5) {
+  return {"sharpen", [sigma, amount](const cv::Mat &in, cv::Mat &out) {
+            cv::GaussianBlur(in, out, cv::Size(0, 0), sigma);
+            cv::addWeighted(in, 1.0 + amount, out, -amount, 0, out);
+          }};
+}
+
+// Per channel gain and offset, in BGR order
+inline OpenCVStage MakeColorCorrectionStage(cv::Scalar gain,
+                                            cv::Scalar offset) {
+  // Alpha is left untouched
+  gain[3] = 1.0;
+  offset[3] = 0.0;
+  return {"color", [gain, offset](const cv::Mat &in, cv::Mat &out) {
+            cv::multiply(in, gain, out);
+            cv::add(out, offset, out);
+          }};
+}
+
+// Blurs a region of the frame, to hide faces or licence plates
+inline OpenCVStage MakePrivacyBlurStage(cv::Rect region, int ksize = 31) {
+  return {"privacy", [region, ksize](const cv::Mat &in, cv::Mat &out) {
+            in.copyTo(out);
+            const cv::Rect roi = region & cv::Rect(0, 0, in.cols, in.rows);
+            if (roi.area() == 0) {
+              return;
+            }
+            cv::Mat outRoi = out(roi);
+            cv::GaussianBlur(in(roi), outRoi, cv::Size(ksize, ksize), 0);
+          }};
+}
+
+#endif // OPENCV_FILTERS_HPP___
@@ -0,0 +1,368 @@
+#ifndef OVERLAY_HPP___
+#define OVERLAY_HPP___
+
+#include <emmintrin.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "Processing.NDI.Lib.h"
+
+// Classic 5x7 font for the printable ASCII characters (0x20 to 0x7E)
+// One byte per column, bit 0 is the top row
+static const uint8_t kFont5x7[95][5] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5F, 0x00, 0x00},
+    {0x00, 0x07, 0x00, 0x07, 0x00}, {0x14, 0x7F, 0x14, 0x7F, 0x14},
+    {0x24, 0x2A, 0x7F, 0x2A, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62},
+    {0x36, 0x49, 0x56, 0x20, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00},
+    {0x00, 0x1C, 0x22, 0x41, 0x00}, {0x00, 0x41, 0x22, 0x1C, 0x00},
+    {0x08, 0x2A, 0x1C, 0x2A, 0x08}, {0x08, 0x08, 0x3E, 0x08, 0x08},
+    {0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08},
+    {0x00, 0x60, 0x60, 0x00, 0x00}, {0x20, 0x10, 0x08, 0x04, 0x02},
+    {0x3E, 0x51, 0x49, 0x45, 0x3E}, {0x00, 0x42, 0x7F, 0x40, 0x00},
+    {0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4B, 0x31},
+    {0x18, 0x14, 0x12, 0x7F, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39},
+    {0x3C, 0x4A, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},
+    {0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1E},
+    {0x00, 0x36, 0x36, 0x00, 0x00}, {0x00, 0x56, 0x36, 0x00, 0x00},
+    {0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14},
+    {0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06},
+    {0x32, 0x49, 0x79, 0x41, 0x3E}, {0x7E, 0x11, 0x11, 0x11, 0x7E},
+    {0x7F, 0x49, 0x49, 0x49, 0x36}, {0x3E, 0x41, 0x41, 0x41, 0x22},
+    {0x7F, 0x41, 0x41, 0x22, 0x1C}, {0x7F, 0x49, 0x49, 0x49, 0x41},
+    {0x7F, 0x09, 0x09, 0x09, 0x01}, {0x3E, 0x41, 0x49, 0x49, 0x7A},
+    {0x7F, 0x08, 0x08, 0x08, 0x7F}, {0x00, 0x41, 0x7F, 0x41, 0x00},
+    {0x20, 0x40, 0x41, 0x3F, 0x01}, {0x7F, 0x08, 0x14, 0x22, 0x41},
+    {0x7F, 0x40, 0x40, 0x40, 0x40}, {0x7F, 0x02, 0x0C, 0x02, 0x7F},
+    {0x7F, 0x04, 0x08, 0x10, 0x7F}, {0x3E, 0x41, 0x41, 0x41, 0x3E},
+    {0x7F, 0x09, 0x09, 0x09, 0x06}, {0x3E, 0x41, 0x51, 0x21, 0x5E},
+    {0x7F, 0x09, 0x19, 0x29, 0x46}, {0x46, 0x49, 0x49, 0x49, 0x31},
+    {0x01, 0x01, 0x7F, 0x01, 0x01}, {0x3F, 0x40, 0x40, 0x40, 0x3F},
+    {0x1F, 0x20, 0x40, 0x20, 0x1F}, {0x3F, 0x40, 0x38, 0x40, 0x3F},
+    {0x63, 0x14, 0x08, 0x14, 0x63}, {0x07, 0x08, 0x70, 0x08, 0x07},
+    {0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7F, 0x41, 0x41, 0x00},
+    {0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7F, 0x00},
+    {0x04, 0x02, 0x01, 0x02, 0x04}, {0x40, 0x40, 0x40, 0x40, 0x40},
+    {0x00, 0x01, 0x02, 0x04, 0x00}, {0x20, 0x54, 0x54, 0x54, 0x78},
+    {0x7F, 0x48, 0x44, 0x44, 0x38}, {0x38, 0x44, 0x44, 0x44, 0x20},
+    {0x38, 0x44, 0x44, 0x48, 0x7F}, {0x38, 0x54, 0x54, 0x54, 0x18},
+    {0x08, 0x7E, 0x09, 0x01, 0x02}, {0x0C, 0x52, 0x52, 0x52, 0x3E},
+    {0x7F, 0x08, 0x04, 0x04, 0x78}, {0x00, 0x44, 0x7D, 0x40, 0x00},
+    {0x20, 0x40, 0x44, 0x3D, 0x00}, {0x7F, 0x10, 0x28, 0x44, 0x00},
+    {0x00, 0x41, 0x7F, 0x40, 0x00}, {0x7C, 0x04, 0x18, 0x04, 0x78},
+    {0x7C, 0x08, 0x04, 0x04, 0x78}, {0x38, 0x44, 0x44, 0x44, 0x38},
+    {0x7C, 0x14, 0x14, 0x14, 0x08}, {0x08, 0x14, 0x14, 0x18, 0x7C},
+    {0x7C, 0x08, 0x04, 0x04, 0x08}, {0x48, 0x54, 0x54, 0x54, 0x20},
+    {0x04, 0x3F, 0x44, 0x40, 0x20}, {0x3C, 0x40, 0x40, 0x20, 0x7C},
+    {0x1C, 0x20, 0x40, 0x20, 0x1C}, {0x3C, 0x40, 0x30, 0x40, 0x3C},
+    {0x44, 0x28, 0x10, 0x28, 0x44}, {0x0C, 0x50, 0x50, 0x50, 0x3C},
+    {0x44, 0x64, 0x54, 0x4C, 0x44}, {0x00, 0x08, 0x36, 0x41, 0x00},
+    {0x00, 0x00, 0x7F, 0x00, 0x00}, {0x00, 0x41, 0x36, 0x08, 0x00},
+    {0x10, 0x08, 0x08, 0x10, 0x08}};
+
+// Burns text into video frames
+//
+// The font is rasterized once, at the requested scale and with smoothed
+// edges, into a glyph atlas of coverage values. Every text slot keeps its
+// string composed from the atlas as per byte blend weights laid out like the
+// destination frame (UYVY or 4 bytes per pixel). Changing the text of a slot
+// only recomposes the characters that changed. Apply then blends all the
+// slots into the frame with SSE2, white text on a half transparent black box.
+//
+// Apply writes into the frame data, the caller must own the buffer.
+class TextOverlay {
+ public:
+  TextOverlay(int scale = 2) : mScale(std::max(1, scale)) { BuildAtlas(); }
+
+  // Adds a text slot of at most maxChars characters with its top left corner
+  // at (x, y), returns the slot id
+  int AddText(int x, int y, int maxChars) {
+    Slot slot;
+    slot.mX = x & ~1;  // UYVY macro pixels are two pixels wide
+    slot.mY = y;
+    slot.mMaxChars = maxChars;
+    slot.mWidth = maxChars * mCellWidth;
+    slot.mCoverage.assign((size_t)slot.mWidth * mCellHeight, 0);
+    slot.mText.assign(maxChars, ' ');
+    slot.mFourCC = (NDIlib_FourCC_video_type_e)0;
+    mSlots.push_back(slot);
+    return (int)mSlots.size() - 1;
+  }
+
+  void SetText(int id, const std::string &text) {
+    Slot &slot = mSlots[id];
+    for (int i = 0; i < slot.mMaxChars; i++) {
+      const char c = i < (int)text.size() ? text[i] : ' ';
+      if (c == slot.mText[i]) {
+        continue;
+      }
+      slot.mText[i] = c;
+      ComposeChar(slot, i);
+      slot.mDirtyBegin = std::min(slot.mDirtyBegin, i * mCellWidth);
+      slot.mDirtyEnd = std::max(slot.mDirtyEnd, (i + 1) * mCellWidth);
+    }
+  }
+
+  int GetCellWidth() { return mCellWidth; }
+  int GetCellHeight() { return mCellHeight; }
+
+  // Rows [*begin, *end) of a frame of yres rows that Apply writes to
+  void GetRows(int yres, int *begin, int *end) {
+    *begin = yres;
+    *end = 0;
+    for (auto &slot : mSlots) {
+      *begin = std::min(*begin, slot.mY);
+      *end = std::max(*end, std::min(yres, slot.mY + mCellHeight));
+    }
+    *begin = std::min(*begin, *end);
+  }
+
+  // Blends every slot into the frame, formats other than UYVY, BGRA, BGRX,
+  // RGBA and RGBX are left untouched
+  void Apply(NDIlib_video_frame_v2_t &frame) {
+    int bytesPerPixel;
+    switch (frame.FourCC) {
+      case NDIlib_FourCC_video_type_UYVY:
+      case NDIlib_FourCC_video_type_UYVA:
+        bytesPerPixel = 2;
+        break;
+      case NDIlib_FourCC_video_type_BGRA:
+      case NDIlib_FourCC_video_type_BGRX:
+      case NDIlib_FourCC_video_type_RGBA:
+      case NDIlib_FourCC_video_type_RGBX:
+        bytesPerPixel = 4;
+        break;
+      default:
+        return;
+    }
+    const int stride = frame.line_stride_in_bytes
+                           ? frame.line_stride_in_bytes
+                           : frame.xres * bytesPerPixel;
+    const bool uyvy = bytesPerPixel == 2;
+
+    for (auto &slot : mSlots) {
+      Expand(slot, frame.FourCC, bytesPerPixel);
+
+      // Clip the slot to the frame
+      if (slot.mX >= frame.xres || slot.mY >= frame.yres) {
+        continue;
+      }
+      const int width = std::min(slot.mWidth, frame.xres - slot.mX);
+      const int height = std::min(mCellHeight, frame.yres - slot.mY);
+      const int rowBytes = width * bytesPerPixel;
+      const int slotStride = slot.mWidth * bytesPerPixel;
+
+      for (int y = 0; y < height; y++) {
+        uint8_t *dst = frame.p_data + (size_t)(slot.mY + y) * stride +
+                       slot.mX * bytesPerPixel;
+        BlendRow(dst, &slot.mWeight[(size_t)y * slotStride],
+                 &slot.mAdd[(size_t)y * slotStride], rowBytes,
+                 uyvy ? kUYVYMin : kFullMin, uyvy ? kUYVYMax : kFullMax);
+      }
+    }
+  }
+
+ private:
+  // Opacity of the box behind the text
+  static constexpr int kBoxAlpha = 128;
+
+  // Bounds of the blended bytes, a run of 16 starting on a pixel. UYVY is
+  // kept in video range, 16-240 for the chroma and 16-235 for the luma.
+  static constexpr uint8_t kUYVYMin[16] = {16, 16, 16, 16, 16, 16, 16, 16,
+                                           16, 16, 16, 16, 16, 16, 16, 16};
+  static constexpr uint8_t kUYVYMax[16] = {240, 235, 240, 235, 240, 235,
+                                           240, 235, 240, 235, 240, 235,
+                                           240, 235, 240, 235};
+  static constexpr uint8_t kFullMin[16] = {};
+  static constexpr uint8_t kFullMax[16] = {255, 255, 255, 255, 255, 255,
+                                           255, 255, 255, 255, 255, 255,
+                                           255, 255, 255, 255};
+
+  struct Slot {
+    int mX, mY;
+    int mMaxChars;
+    int mWidth;
+    std::string mText;
+    // Glyph coverage, one byte per pixel
+    std::vector<uint8_t> mCoverage;
+    // Blend weights laid out like the destination,
+    // out = dst * (255 - weight) / 255 + add
+    NDIlib_FourCC_video_type_e mFourCC;
+    std::vector<uint8_t> mWeight;
+    std::vector<uint8_t> mAdd;
+    // Columns of mCoverage not expanded into mWeight and mAdd yet
+    int mDirtyBegin = 0;
+    int mDirtyEnd = 0;
+  };
+
+  int mScale;
+  int mCellWidth, mCellHeight;
+  // All glyphs side by side, mCellWidth columns each
+  int mAtlasWidth;
+  std::vector<uint8_t> mAtlas;
+  std::vector<Slot> mSlots;
+
+  void BuildAtlas() {
+    // One blank column and row around every glyph
+    mCellWidth = 6 * mScale;
+    mCellHeight = 9 * mScale;
+    mAtlasWidth = 95 * mCellWidth;
+
+    // Upscaled hard edged glyphs
+    std::vector<uint8_t> hard((size_t)mAtlasWidth * mCellHeight, 0);
+    for (int g = 0; g < 95; g++) {
+      for (int col = 0; col < 5; col++) {
+        for (int row = 0; row < 7; row++) {
+          if (!(kFont5x7[g][col] & (1 << row))) {
+            continue;
+          }
+          for (int sy = 0; sy < mScale; sy++) {
+            for (int sx = 0; sx < mScale; sx++) {
+              const int x = g * mCellWidth + (col + 1) * mScale + sx;
+              const int y = (row + 1) * mScale + sy;
+              hard[(size_t)y * mAtlasWidth + x] = 255;
+            }
+          }
+        }
+      }
+    }
+
+    // Smooth the edges with a 3x3 tent filter, scaled glyphs only
+    mAtlas = hard;
+    if (mScale < 2) {
+      return;
+    }
+    static const int kTent[3] = {1, 2, 1};
+    for (int y = 1; y < mCellHeight - 1; y++) {
+      for (int x = 1; x < mAtlasWidth - 1; x++) {
+        int sum = 0;
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dx = -1; dx <= 1; dx++) {
+            sum += kTent[dy + 1] * kTent[dx + 1] *
+                   hard[(size_t)(y + dy) * mAtlasWidth + x + dx];
+          }
+        }
+        mAtlas[(size_t)y * mAtlasWidth + x] = sum / 16;
+      }
+    }
+  }
+
+  void ComposeChar(Slot &slot, int index) {
+    int glyph = (unsigned char)slot.mText[index] - 0x20;
+    if (glyph < 0 || glyph >= 95) {
+      glyph = '?' - 0x20;
+    }
+    for (int y = 0; y < mCellHeight; y++) {
+      memcpy(&slot.mCoverage[(size_t)y * slot.mWidth + index * mCellWidth],
+             &mAtlas[(size_t)y * mAtlasWidth + glyph * mCellWidth],
+             mCellWidth);
+    }
+  }
+
+  // Turns coverage into destination blend weights, only over the dirty
+  // columns unless the destination format changed
+  void Expand(Slot &slot, NDIlib_FourCC_video_type_e fourCC,
+              int bytesPerPixel) {
+    if (slot.mFourCC != fourCC) {
+      slot.mFourCC = fourCC;
+      const size_t size = (size_t)slot.mWidth * bytesPerPixel * mCellHeight;
+      slot.mWeight.assign(size, 0);
+      slot.mAdd.assign(size, 0);
+      slot.mDirtyBegin = 0;
+      slot.mDirtyEnd = slot.mWidth;
+    }
+    if (slot.mDirtyBegin >= slot.mDirtyEnd) {
+      return;
+    }
+
+    const int slotStride = slot.mWidth * bytesPerPixel;
+    for (int y = 0; y < mCellHeight; y++) {
+      const uint8_t *coverage = &slot.mCoverage[(size_t)y * slot.mWidth];
+      uint8_t *weight = &slot.mWeight[(size_t)y * slotStride];
+      uint8_t *add = &slot.mAdd[(size_t)y * slotStride];
+      // Pairs of pixels for UYVY
+      for (int x = slot.mDirtyBegin; x < slot.mDirtyEnd; x += 2) {
+        const int c0 = coverage[x];
+        const int c1 = coverage[x + 1];
+        // Text over the box, white on black
+        const int a0 = kBoxAlpha + (255 - kBoxAlpha) * c0 / 255;
+        const int a1 = kBoxAlpha + (255 - kBoxAlpha) * c1 / 255;
+        if (bytesPerPixel == 2) {
+          // U Y V Y in video range, chroma goes to neutral grey, the box
+          // is black at 16 and the text white at 235
+          const int a = (a0 + a1) / 2;
+          uint8_t *w = weight + x * 2;
+          uint8_t *p = add + x * 2;
+          w[0] = a, p[0] = 128 * a / 255;
+          w[1] = a0, p[1] = VideoLuma(c0);
+          w[2] = a, p[2] = 128 * a / 255;
+          w[3] = a1, p[3] = VideoLuma(c1);
+        } else {
+          // Colour channels only, alpha is kept
+          for (int i = 0; i < 2; i++) {
+            const int a = i ? a1 : a0;
+            const int c = i ? c1 : c0;
+            uint8_t *w = weight + (x + i) * 4;
+            uint8_t *p = add + (x + i) * 4;
+            w[0] = w[1] = w[2] = a;
+            p[0] = p[1] = p[2] = c;
+            w[3] = p[3] = 0;
+          }
+        }
+      }
+    }
+    slot.mDirtyBegin = slot.mWidth;
+    slot.mDirtyEnd = 0;
+  }
+
+  // Luma the box and the text add for coverage c, the text over the box
+  static int VideoLuma(int c) {
+    return (16 * kBoxAlpha * (255 - c) / 255 + 235 * c) / 255;
+  }
+
+  // out = dst * (255 - weight) / 255 + add, per byte, then bounded by min
+  // and max
+  static void BlendRow(uint8_t *dst, const uint8_t *weight, const uint8_t *add,
+                       int bytes, const uint8_t *min, const uint8_t *max) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(255);
+    const __m128i minV = _mm_loadu_si128((const __m128i *)min);
+    const __m128i maxV = _mm_loadu_si128((const __m128i *)max);
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+      const __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+      const __m128i w = _mm_loadu_si128((const __m128i *)(weight + i));
+      const __m128i p = _mm_loadu_si128((const __m128i *)(add + i));
+
+      __m128i lo =
+          _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero),
+                          _mm_sub_epi16(ones, _mm_unpacklo_epi8(w, zero)));
+      __m128i hi =
+          _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero),
+                          _mm_sub_epi16(ones, _mm_unpackhi_epi8(w, zero)));
+      // x / 255 as (x + 1 + (x >> 8)) >> 8
+      lo = _mm_srli_epi16(
+          _mm_add_epi16(_mm_add_epi16(lo, _mm_set1_epi16(1)),
+                        _mm_srli_epi16(lo, 8)),
+          8);
+      hi = _mm_srli_epi16(
+          _mm_add_epi16(_mm_add_epi16(hi, _mm_set1_epi16(1)),
+                        _mm_srli_epi16(hi, 8)),
+          8);
+      const __m128i out = _mm_adds_epu8(_mm_packus_epi16(lo, hi), p);
+      _mm_storeu_si128((__m128i *)(dst + i),
+                       _mm_min_epu8(_mm_max_epu8(out, minV), maxV));
+    }
+    for (; i < bytes; i++) {
+      const int x = dst[i] * (255 - weight[i]);
+      const int out = std::min(255, ((x + 1 + (x >> 8)) >> 8) + add[i]);
+      dst[i] = (uint8_t)std::min<int>(std::max<int>(out, min[i % 16]),
+                                      max[i % 16]);
+    }
+  }
+};
+
+#endif  // OVERLAY_HPP___
@@ -0,0 +1,138 @@
+#ifndef PARALLEL_FOR_HPP___
+#define PARALLEL_FOR_HPP___
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool splitting loops over rows between threads
+//
+// Run can be called from several threads at once, every capture thread
+// deinterlacing its own frames for instance. A job is cut in chunks that
+// the pool threads and the calling thread claim in turn, so a call always
+// makes progress even when the pool is busy with the jobs of other threads.
+class ParallelFor {
+ public:
+  // fn(begin, end) handles the items in [begin, end)
+  typedef std::function<void(int begin, int end)> Body;
+
+  // threads of 0 uses one thread per core, the caller being one of them
+  explicit ParallelFor(int threads = 0) : mIsRunning(true) {
+    if (threads <= 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (int i = 0; i < threads - 1; i++) {
+      mThreads.emplace_back(&ParallelFor::Worker, this);
+    }
+  }
+  ~ParallelFor() {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mIsRunning = false;
+    }
+    mCond.notify_all();
+    for (auto& thread : mThreads) {
+      thread.join();
+    }
+  }
+
+  // Shared by the whole engine
+  static ParallelFor& Shared() {
+    static ParallelFor pool;
+    return pool;
+  }
+
+  int GetThreadCount() { return (int)mThreads.size() + 1; }
+
+  // Runs fn over [0, count) in chunks of at least grain items, returns once
+  // every chunk is done
+  void Run(int count, int grain, const Body& fn) {
+    if (count <= 0) {
+      return;
+    }
+    const int chunks = std::min(GetThreadCount() * 2,
+                                std::max(1, count / std::max(1, grain)));
+    if (chunks == 1 || mThreads.empty()) {
+      fn(0, count);
+      return;
+    }
+
+    std::shared_ptr<Job> job(new Job(fn, count, chunks));
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mJobs.push_back(job);
+    }
+    mCond.notify_all();
+
+    while (job->RunChunk()) {
+    }
+    std::unique_lock<std::mutex> lock(job->mMutex);
+    job->mCond.wait(lock, [&job] { return job->mDone == job->mChunks; });
+  }
+
+ private:
+  struct Job {
+    Job(const Body& fn, int count, int chunks)
+        : mFn(fn), mCount(count), mChunks(chunks), mNext(0), mDone(0) {}
+
+    const Body& mFn;
+    int mCount;
+    int mChunks;
+    std::atomic<int> mNext;
+    int mDone;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+
+    bool HasWork() { return mNext < mChunks; }
+
+    // Claims and runs one chunk, returns false if none was left
+    bool RunChunk() {
+      const int chunk = mNext++;
+      if (chunk >= mChunks) {
+        return false;
+      }
+      const int begin = (int)((int64_t)mCount * chunk / mChunks);
+      const int end = (int)((int64_t)mCount * (chunk + 1) / mChunks);
+      mFn(begin, end);
+      std::lock_guard<std::mutex> lock(mMutex);
+      if (++mDone == mChunks) {
+        mCond.notify_all();
+      }
+      return true;
+    }
+  };
+
+  std::vector<std::thread> mThreads;
+  std::mutex mMutex;
+  std::condition_variable mCond;
+  std::deque<std::shared_ptr<Job>> mJobs;
+  bool mIsRunning;
+
+  void Worker() {
+    while (true) {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCond.wait(lock, [this] { return !mIsRunning || !mJobs.empty(); });
+        if (!mIsRunning) {
+          return;
+        }
+        job = mJobs.front();
+        // Every chunk is claimed, the job no longer needs the pool
+        if (!job->HasWork()) {
+          mJobs.pop_front();
+          continue;
+        }
+      }
+      job->RunChunk();
+    }
+  }
+};
+
+#endif  // PARALLEL_FOR_HPP___
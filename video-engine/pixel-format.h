@@ -0,0 +1,177 @@
+#ifndef PIXEL_FORMAT_HPP___
+#define PIXEL_FORMAT_HPP___
+
+#include <cstdint>
+
+#include "Processing.NDI.Lib.h"
+
+// Compile-time description of the 8-bit NDI pixel formats, and a dispatch
+// from the runtime FourCC of a frame to kernels specialised on them
+//
+// A per-pixel stage takes its formats as template parameters and reads the
+// layout from the traits, so the inner loop has no branch on the format and
+// its shifts and offsets are constants. The FourCC is resolved once per
+// frame, see DispatchFormat and DispatchFormatPair.
+//
+//   kYUV              4:2:2 or 4:2:0 Y'CbCr, video range BT.709
+//   kPlanes           planes of the frame, the alpha plane included
+//   kBytesPerPixel    of the first plane
+//   kPixelsPerGroup   pixels sharing a chroma sample along a row, the
+//                     horizontal unit of crops and scales
+//   kChromaShiftX/Y   chroma subsampling, as shifts
+//   kHasAlpha         whether the format carries an alpha
+//   kAlphaPlane       alpha in a plane of its own after the picture, one
+//                     byte per pixel, as UYVA
+//   kR, kG, kB, kA    byte offsets in a pixel of the 32-bit RGB formats
+template <NDIlib_FourCC_video_type_e FourCC>
+struct PixelFormat;
+
+template <NDIlib_FourCC_video_type_e FourCC, bool HasAlpha, int R, int B>
+struct PixelFormatRGB32 {
+  static constexpr NDIlib_FourCC_video_type_e kFourCC = FourCC;
+  static constexpr bool kYUV = false;
+  static constexpr bool kPlanar = false;
+  static constexpr int kPlanes = 1;
+  static constexpr int kBytesPerPixel = 4;
+  static constexpr int kPixelsPerGroup = 1;
+  static constexpr int kChromaShiftX = 0;
+  static constexpr int kChromaShiftY = 0;
+  static constexpr bool kHasAlpha = HasAlpha;
+  static constexpr bool kAlphaPlane = false;
+  static constexpr int kR = R;
+  static constexpr int kG = 1;
+  static constexpr int kB = B;
+  // The keyers read the alpha of every RGB format from the last byte
+  static constexpr int kA = 3;
+};
+
+template <NDIlib_FourCC_video_type_e FourCC, bool HasAlpha>
+struct PixelFormatUYVY {
+  static constexpr NDIlib_FourCC_video_type_e kFourCC = FourCC;
+  static constexpr bool kYUV = true;
+  static constexpr bool kPlanar = false;
+  static constexpr int kPlanes = HasAlpha ? 2 : 1;
+  static constexpr int kBytesPerPixel = 2;
+  static constexpr int kPixelsPerGroup = 2;
+  static constexpr int kChromaShiftX = 1;
+  static constexpr int kChromaShiftY = 0;
+  static constexpr bool kHasAlpha = HasAlpha;
+  static constexpr bool kAlphaPlane = HasAlpha;
+  // Byte offsets in a macropixel
+  static constexpr int kU = 0;
+  static constexpr int kY0 = 1;
+  static constexpr int kV = 2;
+  static constexpr int kY1 = 3;
+};
+
+// 4:2:0, a full size luma plane then the chroma, interleaved for NV12
+template <NDIlib_FourCC_video_type_e FourCC, int Planes>
+struct PixelFormatYUV420 {
+  static constexpr NDIlib_FourCC_video_type_e kFourCC = FourCC;
+  static constexpr bool kYUV = true;
+  static constexpr bool kPlanar = true;
+  static constexpr int kPlanes = Planes;
+  static constexpr int kBytesPerPixel = 1;
+  static constexpr int kPixelsPerGroup = 2;
+  static constexpr int kChromaShiftX = 1;
+  static constexpr int kChromaShiftY = 1;
+  static constexpr bool kHasAlpha = false;
+  static constexpr bool kAlphaPlane = false;
+};
+
+template <>
+struct PixelFormat<NDIlib_FourCC_video_type_UYVY>
+    : PixelFormatUYVY<NDIlib_FourCC_video_type_UYVY, false> {};
+template <>
+struct PixelFormat<NDIlib_FourCC_video_type_UYVA>
+    : PixelFormatUYVY<NDIlib_FourCC_video_type_UYVA, true> {};
+template <>
+struct PixelFormat<NDIlib_FourCC_video_type_BGRA>
+    : PixelFormatRGB32<NDIlib_FourCC_video_type_BGRA, true, 2, 0> {};
+template <>
+struct PixelFormat<NDIlib_FourCC_video_type_BGRX>
+    : PixelFormatRGB32<NDIlib_FourCC_video_type_BGRX, false, 2, 0> {};
+template <>
+struct PixelFormat<NDIlib_FourCC_video_type_RGBA>
+    : PixelFormatRGB32<NDIlib_FourCC_video_type_RGBA, true, 0, 2> {};
+template <>
+struct PixelFormat<NDIlib_FourCC_video_type_RGBX>
+    : PixelFormatRGB32<NDIlib_FourCC_video_type_RGBX, false, 0, 2> {};
+template <>
+struct PixelFormat<NDIlib_FourCC_video_type_NV12>
+    : PixelFormatYUV420<NDIlib_FourCC_video_type_NV12, 2> {};
+template <>
+struct PixelFormat<NDIlib_FourCC_video_type_I420>
+    : PixelFormatYUV420<NDIlib_FourCC_video_type_I420, 3> {};
+template <>
+struct PixelFormat<NDIlib_FourCC_video_type_YV12>
+    : PixelFormatYUV420<NDIlib_FourCC_video_type_YV12, 3> {};
+
+// 24-bit BGR, the layout of the CV_8UC3 images of OpenCV. No NDI frame
+// carries it, it is an output of the converters only.
+struct PixelFormatBGR24 {
+  static constexpr bool kYUV = false;
+  static constexpr bool kPlanar = false;
+  static constexpr int kPlanes = 1;
+  static constexpr int kBytesPerPixel = 3;
+  static constexpr int kPixelsPerGroup = 1;
+  static constexpr int kChromaShiftX = 0;
+  static constexpr int kChromaShiftY = 0;
+  static constexpr bool kHasAlpha = false;
+  static constexpr bool kAlphaPlane = false;
+  static constexpr int kR = 2;
+  static constexpr int kG = 1;
+  static constexpr int kB = 0;
+};
+
+// True when a row of In is a row of Out, only the meaning of the fourth
+// byte or of the alpha plane may differ
+template <class In, class Out>
+constexpr bool SamePixelLayout() {
+  if constexpr (In::kYUV != Out::kYUV || In::kPlanar || Out::kPlanar) {
+    return false;
+  } else if constexpr (In::kYUV) {
+    return true;
+  } else {
+    return In::kR == Out::kR && In::kB == Out::kB;
+  }
+}
+
+// The formats a stage supports, in the order they are tried
+template <class... Formats>
+struct FormatList {};
+
+using PackedFormats = FormatList<
+    PixelFormat<NDIlib_FourCC_video_type_UYVY>,
+    PixelFormat<NDIlib_FourCC_video_type_UYVA>,
+    PixelFormat<NDIlib_FourCC_video_type_BGRA>,
+    PixelFormat<NDIlib_FourCC_video_type_BGRX>,
+    PixelFormat<NDIlib_FourCC_video_type_RGBA>,
+    PixelFormat<NDIlib_FourCC_video_type_RGBX>>;
+
+// Calls fn(Format()) with the traits of FourCC if the list has them.
+// Returns false, without calling fn, for the other formats. Every format of
+// the list instantiates fn once, so stages list only what they support.
+template <class Fn, class... Formats>
+bool DispatchFormat(NDIlib_FourCC_video_type_e FourCC, FormatList<Formats...>,
+                    Fn&& fn) {
+  return ((FourCC == Formats::kFourCC ? (fn(Formats()), true) : false) ||
+          ...);
+}
+
+// Calls fn(In(), Out()) for a pair of formats, one instantiation per pair
+// of the two lists
+template <class Fn, class InList, class OutList>
+bool DispatchFormatPair(NDIlib_FourCC_video_type_e in,
+                        NDIlib_FourCC_video_type_e out, InList inList,
+                        OutList outList, Fn&& fn) {
+  bool found = false;
+  DispatchFormat(in, inList, [&](auto inFormat) {
+    found = DispatchFormat(out, outList, [&](auto outFormat) {
+      fn(inFormat, outFormat);
+    });
+  });
+  return found;
+}
+
+#endif  // PIXEL_FORMAT_HPP___
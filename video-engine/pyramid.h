@@ -0,0 +1,200 @@
+#ifndef PYRAMID_HPP___
+#define PYRAMID_HPP___
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Processing.NDI.Lib.h"
+#include "simd.h"
+#include "trace.h"
+
+// Reduced copies of a frame at 1/2, 1/4 and 1/8 of its size, for the
+// consumers that do not need the full resolution (tiles, proxies,
+// thumbnails, analysis)
+//
+// Each level is a 2x2 box filter of the level above. A pyramid is built at
+// most once per frame, see Source::GetPyramid, and shared by all the readers
+// of the frame.
+
+// One output pixel of 4 bytes from 2x2 pixels, the rows are averaged first
+// like the SSE2 kernel does
+inline void DownscaleRGBAScalar(const uint8_t* row0, const uint8_t* row1,
+                                uint8_t* out, int outPixels) {
+  for (int x = 0; x < outPixels; x++) {
+    const uint8_t* a = row0 + x * 8;
+    const uint8_t* b = row1 + x * 8;
+    for (int c = 0; c < 4; c++) {
+      out[x * 4 + c] =
+          SimdAvg(SimdAvg(a[c], b[c]), SimdAvg(a[c + 4], b[c + 4]));
+    }
+  }
+}
+
+// One output macropixel (U Y0 V Y1) from 2x2 macropixels, the chroma of the
+// two macropixels is averaged and each of them gives one luma sample
+inline void DownscaleUYVYScalar(const uint8_t* row0, const uint8_t* row1,
+                                uint8_t* out, int outMacropixels) {
+  for (int x = 0; x < outMacropixels; x++) {
+    uint8_t v[8];
+    for (int c = 0; c < 8; c++) {
+      v[c] = SimdAvg(row0[x * 8 + c], row1[x * 8 + c]);
+    }
+    out[x * 4 + 0] = SimdAvg(v[0], v[4]);
+    out[x * 4 + 1] = SimdAvg(v[1], v[3]);
+    out[x * 4 + 2] = SimdAvg(v[2], v[6]);
+    out[x * 4 + 3] = SimdAvg(v[5], v[7]);
+  }
+}
+
+// 8 input pixels of each row give 4 output pixels
+inline void DownscaleRGBASSE2(const uint8_t* row0, const uint8_t* row1,
+                              uint8_t* out, int outPixels) {
+  int x = 0;
+  for (; x + 4 <= outPixels; x += 4) {
+    const __m128i v0 =
+        _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + x * 8)),
+                     _mm_loadu_si128((const __m128i*)(row1 + x * 8)));
+    const __m128i v1 =
+        _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + x * 8 + 16)),
+                     _mm_loadu_si128((const __m128i*)(row1 + x * 8 + 16)));
+    // Even and odd pixels
+    const __m128i even = _mm_castps_si128(_mm_shuffle_ps(
+        _mm_castsi128_ps(v0), _mm_castsi128_ps(v1), _MM_SHUFFLE(2, 0, 2, 0)));
+    const __m128i odd = _mm_castps_si128(_mm_shuffle_ps(
+        _mm_castsi128_ps(v0), _mm_castsi128_ps(v1), _MM_SHUFFLE(3, 1, 3, 1)));
+    _mm_storeu_si128((__m128i*)(out + x * 4), _mm_avg_epu8(even, odd));
+  }
+  DownscaleRGBAScalar(row0 + x * 8, row1 + x * 8, out + x * 4,
+                      outPixels - x);
+}
+
+// 8 input macropixels of each row give 4 output macropixels
+inline void DownscaleUYVYSSE2(const uint8_t* row0, const uint8_t* row1,
+                              uint8_t* out, int outMacropixels) {
+  const __m128i chromaMask = _mm_set1_epi32(0x00ff00ff);
+  const __m128i y0Mask = _mm_set1_epi32(0x0000ff00);
+  const __m128i y1Mask = _mm_set1_epi32((int)0xff000000);
+  int x = 0;
+  for (; x + 4 <= outMacropixels; x += 4) {
+    const __m128i v0 =
+        _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + x * 8)),
+                     _mm_loadu_si128((const __m128i*)(row1 + x * 8)));
+    const __m128i v1 =
+        _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + x * 8 + 16)),
+                     _mm_loadu_si128((const __m128i*)(row1 + x * 8 + 16)));
+    const __m128i a = _mm_castps_si128(_mm_shuffle_ps(
+        _mm_castsi128_ps(v0), _mm_castsi128_ps(v1), _MM_SHUFFLE(2, 0, 2, 0)));
+    const __m128i b = _mm_castps_si128(_mm_shuffle_ps(
+        _mm_castsi128_ps(v0), _mm_castsi128_ps(v1), _MM_SHUFFLE(3, 1, 3, 1)));
+    // U and V of both macropixels
+    const __m128i chroma = _mm_avg_epu8(a, b);
+    // Y0 and Y1 of a macropixel averaged into its byte 1
+    const __m128i lumaA = _mm_avg_epu8(a, _mm_srli_epi32(a, 16));
+    const __m128i lumaB = _mm_avg_epu8(b, _mm_srli_epi32(b, 16));
+    const __m128i result =
+        _mm_or_si128(_mm_and_si128(chroma, chromaMask),
+                     _mm_or_si128(_mm_and_si128(lumaA, y0Mask),
+                                  _mm_and_si128(_mm_slli_epi32(lumaB, 16),
+                                                y1Mask)));
+    _mm_storeu_si128((__m128i*)(out + x * 4), result);
+  }
+  DownscaleUYVYScalar(row0 + x * 8, row1 + x * 8, out + x * 4,
+                      outMacropixels - x);
+}
+
+class FramePyramid {
+ public:
+  static constexpr int kLevels = 3;
+
+  struct Level {
+    int mXres;
+    int mYres;
+    int mStride;
+    std::vector<uint8_t> mData;
+  };
+
+  // Returns null for the formats without a box filter
+  static std::shared_ptr<FramePyramid> Build(
+      const NDIlib_video_frame_v2_t& frame) {
+    const bool uyvy = frame.FourCC == NDIlib_FourCC_video_type_UYVY ||
+                      frame.FourCC == NDIlib_FourCC_video_type_UYVA;
+    const bool rgba = frame.FourCC == NDIlib_FourCC_video_type_BGRA ||
+                      frame.FourCC == NDIlib_FourCC_video_type_BGRX ||
+                      frame.FourCC == NDIlib_FourCC_video_type_RGBA ||
+                      frame.FourCC == NDIlib_FourCC_video_type_RGBX;
+    if ((!uyvy && !rgba) || !frame.p_data) {
+      return nullptr;
+    }
+    TRACE_SPAN("pyramid", -1, -1);
+
+    std::shared_ptr<FramePyramid> pyramid(new FramePyramid());
+    pyramid->mFrame = frame;
+    // The alpha plane of UYVA is not kept
+    pyramid->mFrame.FourCC =
+        uyvy ? NDIlib_FourCC_video_type_UYVY : frame.FourCC;
+    pyramid->mFrame.p_data = nullptr;
+    pyramid->mFrame.p_metadata = nullptr;
+
+    const uint8_t* src = frame.p_data;
+    int srcStride = frame.line_stride_in_bytes;
+    int xres = frame.xres;
+    int yres = frame.yres;
+    for (int i = 0; i < kLevels; i++) {
+      Level& level = pyramid->mLevels[i];
+      // UYVY is scaled by whole macropixels
+      level.mXres = uyvy ? xres / 4 * 2 : xres / 2;
+      level.mYres = yres / 2;
+      level.mStride = level.mXres * (uyvy ? 2 : 4);
+      level.mData.resize((size_t)level.mStride * level.mYres);
+
+      for (int y = 0; y < level.mYres; y++) {
+        const uint8_t* row0 = src + (size_t)(2 * y) * srcStride;
+        uint8_t* out = level.mData.data() + (size_t)y * level.mStride;
+        if (uyvy) {
+          DownscaleUYVYSSE2(row0, row0 + srcStride, out, level.mXres / 2);
+        } else {
+          DownscaleRGBASSE2(row0, row0 + srcStride, out, level.mXres);
+        }
+      }
+
+      src = level.mData.data();
+      srcStride = level.mStride;
+      xres = level.mXres;
+      yres = level.mYres;
+    }
+    return pyramid;
+  }
+
+  // Level 1 is half the size of the frame, 3 an eighth
+  const Level& GetLevel(int level) { return mLevels[level - 1]; }
+
+  // Memory of all the levels
+  int64_t GetBytes() {
+    int64_t bytes = 0;
+    for (const Level& level : mLevels) {
+      bytes += (int64_t)level.mData.size();
+    }
+    return bytes;
+  }
+
+  // The level as a frame with the timing of the source frame, valid as long
+  // as the pyramid is
+  NDIlib_video_frame_v2_t GetFrame(int level) {
+    const Level& l = GetLevel(level);
+    NDIlib_video_frame_v2_t frame = mFrame;
+    frame.xres = l.mXres;
+    frame.yres = l.mYres;
+    frame.line_stride_in_bytes = l.mStride;
+    frame.p_data = (uint8_t*)l.mData.data();
+    return frame;
+  }
+
+ private:
+  FramePyramid() {}
+
+  NDIlib_video_frame_v2_t mFrame;
+  Level mLevels[kLevels];
+};
+
+#endif  // PYRAMID_HPP___
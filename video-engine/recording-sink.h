@@ -0,0 +1,461 @@
+#ifndef RECORDING_SINK_HPP___
+#define RECORDING_SINK_HPP___
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "Processing.NDI.Lib.h"
+#include "clock.h"
+#include "format-convert.h"
+#include "memory-budget.h"
+#include "metrics.h"
+#include "source.h"
+#include "trace.h"
+
+// Compressed recording of a renderer output, for compliance, in files of a
+// fixed length
+//
+// The renderer hands every frame it sends to Record, which copies it into a
+// pooled refcounted buffer and queues it; it never waits on an encoder. The
+// frames are encoded with cv::VideoWriter (FFmpeg backend) on a pool of low
+// priority workers. A segment is encoded by one worker at a time, so its
+// frames stay in order, and a worker behind on a segment leaves the next one
+// to another worker. Past queueDepth frames Record drops by policy rather
+// than blocking the render tick. Stop encodes what is queued and closes the
+// last segment.
+class RecordingSink {
+ public:
+  // Newest drops the frame being recorded, Oldest the oldest queued one,
+  // which keeps the recording closest to the output
+  enum class DropPolicy { Newest, Oldest };
+
+  // codec is a cv::VideoWriter FourCC, extension picks the container
+  RecordingSink(std::string name, std::string directory,
+                double segmentSeconds = 600, int queueDepth = 16,
+                int workers = 2, DropPolicy policy = DropPolicy::Newest,
+                std::string codec = "mp4v", std::string extension = "mp4")
+      : mName(name),
+        mFileName(NdiFileName(name)),
+        mDirectory(directory),
+        mSegmentSeconds(segmentSeconds),
+        mQueueDepth(queueDepth),
+        mWorkerCount(workers),
+        mPolicy(policy),
+        mCodec(codec),
+        mExtension(extension),
+        mClock(SystemClock::Get()),
+        mIsRunning(false),
+        mQueued(0),
+        mMaxQueued(0),
+        mEncoded(0),
+        mDropped(0),
+        mFailed(0),
+        mSegments(0),
+        mEncodeNs(0),
+        mMemory(MemoryBudget::Get().Register("recorder " + name, false)) {}
+  ~RecordingSink() {
+    Stop();
+    for (Frame* frame : mFree) {
+      mMemory->Release(MemoryKind::Recorder, frame->mData.capacity());
+      delete frame;
+    }
+  }
+
+  // Time source of the recording rate, set before Start
+  void SetClock(Clock* clock) { mClock = clock; }
+
+  void Start() {
+    mkdir(mDirectory.c_str(), 0755);
+    mStartMs = mClock->NowMs();
+    mIsRunning = true;
+    for (int i = 0; i < mWorkerCount; i++) {
+      mWorkers.emplace_back(&RecordingSink::Run, this);
+    }
+  }
+
+  // Encodes what is queued, closes the last segment and waits for the
+  // workers
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mIsRunning = false;
+      if (!mSegmentList.empty()) {
+        mSegmentList.back()->mClosed = true;
+      }
+      mLast.reset();
+    }
+    mCond.notify_all();
+    for (auto& worker : mWorkers) {
+      worker.join();
+    }
+    mWorkers.clear();
+  }
+
+  // Called by the renderer with each frame it sends. The frame is copied,
+  // it may be reused once this returns. The alpha plane of UYVA is not
+  // recorded.
+  void Record(const NDIlib_video_frame_v2_t& frame) {
+    if (!frame.p_data || frame.xres <= 0 || frame.yres <= 0) {
+      return;
+    }
+    std::shared_ptr<Frame> evicted;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      // The slot is held while the frame is copied
+      if (!mIsRunning || !Reserve(&evicted)) {
+        return;
+      }
+    }
+    // Back to the pool before a buffer is taken from it
+    evicted.reset();
+
+    std::shared_ptr<Frame> item;
+    {
+      TRACE_SPAN("record", -1, -1);
+      const size_t bytes = (size_t)frame.line_stride_in_bytes * frame.yres;
+      item = Acquire(bytes);
+      memcpy(item->mData.data(), frame.p_data, bytes);
+      item->mFrame = frame;
+      item->mFrame.p_data = item->mData.data();
+      if (frame.FourCC == NDIlib_FourCC_video_type_UYVA) {
+        item->mFrame.FourCC = NDIlib_FourCC_video_type_UYVY;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      // Stop may have run during the copy, the workers are gone
+      if (!mIsRunning) {
+        mQueued--;
+        mDropped++;
+        return;
+      }
+      mLast = item;
+      SegmentFor(item->mFrame)->mQueue.push_back(std::move(item));
+    }
+    mCond.notify_one();
+  }
+
+  // Records the last recorded frame again, for a tick that repeats it on
+  // the output, so that the recording keeps the pace of the wall clock. The
+  // frame is shared, not copied.
+  void RecordRepeat() {
+    std::shared_ptr<Frame> evicted;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      if (!mIsRunning || !mLast || !Reserve(&evicted)) {
+        return;
+      }
+      SegmentFor(mLast->mFrame)->mQueue.push_back(mLast);
+    }
+    mCond.notify_one();
+  }
+
+  void ExportMetrics(MetricsRegistry& metrics) {
+    const std::string output = MetricsRegistry::Label("output", mName);
+    metrics.AddCallback("ve_recorder_queue_frames",
+                        "Frames queued for encoding", "gauge", output,
+                        [this] { return (double)mQueued; });
+    metrics.AddCallback("ve_recorder_encoded_frames_total",
+                        "Frames encoded into a recording", "counter", output,
+                        [this] { return (double)mEncoded; });
+    metrics.AddCallback("ve_recorder_dropped_frames_total",
+                        "Frames dropped with the encode queue full",
+                        "counter", output,
+                        [this] { return (double)mDropped; });
+    metrics.AddCallback("ve_recorder_failed_frames_total",
+                        "Frames lost to a segment that could not be opened",
+                        "counter", output, [this] { return (double)mFailed; });
+    metrics.AddCallback(
+        "ve_recorder_encode_fps",
+        "Frames a worker encodes per second of encoding time", "gauge",
+        output, [this] { return EncodeFps(); });
+  }
+
+  void Output() {
+    const uint64_t encoded = mEncoded;
+    const double wallS =
+        (double)std::max<int64_t>(1, mClock->NowMs() - mStartMs) / 1000.0;
+    std::cout << "Recorder " << mName << " | encoded " << encoded
+              << " | dropped " << mDropped << " | failed " << mFailed
+              << " | segments " << mSegments << " | queue max " << mMaxQueued
+              << " of " << mQueueDepth << " | " << encoded / wallS
+              << " fps | encode avg "
+              << (encoded ? mEncodeNs / encoded / 1000000.0 : 0) << " ms ("
+              << EncodeFps() << " fps per worker)" << std::endl;
+  }
+
+ private:
+  struct Frame {
+    std::vector<uint8_t> mData;
+    // Points to mData
+    NDIlib_video_frame_v2_t mFrame;
+  };
+
+  // A file of the recording. The frames are encoded in order by the worker
+  // that has it busy.
+  struct Segment {
+    std::string mPath;
+    int mXres;
+    int mYres;
+    NDIlib_FourCC_video_type_e mFourCC;
+    double mFps;
+    // Frames given to the segment, queued or encoded
+    int64_t mFrames = 0;
+    int64_t mMaxFrames;
+    // Guarded by mMutex
+    std::deque<std::shared_ptr<Frame>> mQueue;
+    bool mBusy = false;
+    // No more frames will be added
+    bool mClosed = false;
+    // Used by the worker that has the segment busy
+    cv::VideoWriter mWriter;
+    bool mFailed = false;
+  };
+
+  std::string mName;
+  std::string mFileName;
+  std::string mDirectory;
+  double mSegmentSeconds;
+  int mQueueDepth;
+  int mWorkerCount;
+  DropPolicy mPolicy;
+  std::string mCodec;
+  std::string mExtension;
+  Clock* mClock;
+
+  std::vector<std::thread> mWorkers;
+  std::mutex mMutex;
+  std::condition_variable mCond;
+  bool mIsRunning;
+  // Oldest first, guarded by mMutex
+  std::list<std::unique_ptr<Segment>> mSegmentList;
+  int64_t mStartMs = 0;
+
+  // Last frame recorded, for RecordRepeat, guarded by mMutex
+  std::shared_ptr<Frame> mLast;
+
+  // Buffers not in use, guarded by mPoolMutex. At most mQueueDepth plus
+  // one per worker and mLast are ever in use.
+  std::mutex mPoolMutex;
+  std::vector<Frame*> mFree;
+
+  std::atomic<int> mQueued;
+  std::atomic<int> mMaxQueued;
+  std::atomic<uint64_t> mEncoded;
+  std::atomic<uint64_t> mDropped;
+  std::atomic<uint64_t> mFailed;
+  std::atomic<uint64_t> mSegments;
+  std::atomic<uint64_t> mEncodeNs;
+  MemoryAccount* mMemory;
+
+  double EncodeFps() {
+    const uint64_t ns = mEncodeNs;
+    return ns ? mEncoded * 1e9 / ns : 0;
+  }
+
+  // A buffer of the pool with room for bytes, returned to the pool when the
+  // last reference goes
+  std::shared_ptr<Frame> Acquire(size_t bytes) {
+    Frame* frame = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mPoolMutex);
+      if (!mFree.empty()) {
+        frame = mFree.back();
+        mFree.pop_back();
+      }
+    }
+    if (!frame) {
+      frame = new Frame();
+    }
+    const size_t capacity = frame->mData.capacity();
+    frame->mData.resize(bytes);
+    mMemory->Charge(MemoryKind::Recorder,
+                    (int64_t)frame->mData.capacity() - (int64_t)capacity);
+    return std::shared_ptr<Frame>(frame, [this](Frame* f) {
+      std::lock_guard<std::mutex> lock(mPoolMutex);
+      mFree.push_back(f);
+    });
+  }
+
+  // Takes a place in the queue for a frame, dropping by policy when it is
+  // full. Returns false if the new frame is the one dropped. Called with
+  // mMutex held, an evicted frame is to be released after it.
+  bool Reserve(std::shared_ptr<Frame>* evicted) {
+    if (mQueued >= mQueueDepth) {
+      mDropped++;
+      if (mPolicy == DropPolicy::Newest) {
+        return false;
+      }
+      *evicted = PopOldest();
+    }
+    mQueued++;
+    if (mQueued > mMaxQueued) {
+      mMaxQueued = mQueued.load();
+    }
+    return true;
+  }
+
+  // Oldest queued frame, called with mMutex held and the queue full
+  std::shared_ptr<Frame> PopOldest() {
+    for (auto& segment : mSegmentList) {
+      if (!segment->mQueue.empty()) {
+        std::shared_ptr<Frame> frame = std::move(segment->mQueue.front());
+        segment->mQueue.pop_front();
+        segment->mFrames--;
+        mQueued--;
+        return frame;
+      }
+    }
+    return nullptr;
+  }
+
+  // Segment the frame goes to, called with mMutex held. A new segment starts
+  // after mSegmentSeconds of frames or when the format changes.
+  Segment* SegmentFor(const NDIlib_video_frame_v2_t& frame) {
+    Segment* segment =
+        mSegmentList.empty() ? nullptr : mSegmentList.back().get();
+    if (segment && !segment->mClosed &&
+        segment->mFrames < segment->mMaxFrames &&
+        segment->mXres == frame.xres && segment->mYres == frame.yres &&
+        segment->mFourCC == frame.FourCC) {
+      segment->mFrames++;
+      return segment;
+    }
+    if (segment) {
+      segment->mClosed = true;
+    }
+    std::unique_ptr<Segment> next(new Segment());
+    next->mXres = frame.xres;
+    next->mYres = frame.yres;
+    next->mFourCC = frame.FourCC;
+    next->mFps = frame.frame_rate_D
+                     ? (double)frame.frame_rate_N / frame.frame_rate_D
+                     : 30.0;
+    next->mMaxFrames =
+        std::max<int64_t>(1, (int64_t)(mSegmentSeconds * next->mFps));
+    next->mFrames = 1;
+    // Named after the wall clock time the segment starts at, in UTC
+    const time_t now = time(nullptr);
+    struct tm utc;
+    gmtime_r(&now, &utc);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &utc);
+    next->mPath = mDirectory + "/" + mFileName + "-" + stamp + "-" +
+                  std::to_string(mSegments + mSegmentList.size()) + "." +
+                  mExtension;
+    mSegmentList.push_back(std::move(next));
+    return mSegmentList.back().get();
+  }
+
+  // Oldest segment no other worker has, with frames to encode or to be
+  // closed. Called with mMutex held.
+  Segment* NextSegment() {
+    for (auto& segment : mSegmentList) {
+      if (!segment->mBusy && (!segment->mQueue.empty() || segment->mClosed)) {
+        return segment.get();
+      }
+    }
+    return nullptr;
+  }
+
+  void Encode(Segment& segment, const Frame& item, cv::Mat& bgr) {
+    TRACE_SPAN("encode", -1, -1);
+    const auto start = std::chrono::steady_clock::now();
+    if (!segment.mWriter.isOpened() && !segment.mFailed) {
+      const std::string& c = mCodec;
+      segment.mFailed = c.size() != 4 ||
+                        !segment.mWriter.open(
+                            segment.mPath, cv::CAP_FFMPEG,
+                            cv::VideoWriter::fourcc(c[0], c[1], c[2], c[3]),
+                            segment.mFps,
+                            cv::Size(segment.mXres, segment.mYres));
+      if (segment.mFailed) {
+        std::cout << "Recorder " << mName << " | cannot open "
+                  << segment.mPath << std::endl;
+      }
+    }
+    if (segment.mFailed) {
+      mFailed++;
+      return;
+    }
+    bgr.create(item.mFrame.yres, item.mFrame.xres, CV_8UC3);
+    if (!ConvertFrame<PixelFormatBGR24>(item.mFrame, bgr.data,
+                                        (int)bgr.step)) {
+      mFailed++;
+      return;
+    }
+    segment.mWriter.write(bgr);
+    mEncodeNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+    mEncoded++;
+  }
+
+  void Run() {
+    TRACE_THREAD_NAME("recorder");
+    // Below the renderers and the capture, above the snapshots
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+    // Converted frame, reused across frames
+    cv::Mat bgr;
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+      Segment* segment = NextSegment();
+      if (!segment) {
+        if (!mIsRunning && mSegmentList.empty()) {
+          break;
+        }
+        mCond.wait(lock);
+        continue;
+      }
+      segment->mBusy = true;
+      while (!segment->mQueue.empty()) {
+        std::shared_ptr<Frame> item = std::move(segment->mQueue.front());
+        segment->mQueue.pop_front();
+        mQueued--;
+        lock.unlock();
+        Encode(*segment, *item, bgr);
+        // Back to the pool
+        item.reset();
+        lock.lock();
+      }
+      if (segment->mClosed) {
+        // Nothing is added to a closed segment, it is finished. It stays
+        // busy until it is gone.
+        lock.unlock();
+        segment->mWriter.release();
+        lock.lock();
+        mSegmentList.remove_if(
+            [segment](const std::unique_ptr<Segment>& s) {
+              return s.get() == segment;
+            });
+        mSegments++;
+      } else {
+        segment->mBusy = false;
+      }
+      // Another worker may wait for the last segment to go
+      mCond.notify_all();
+    }
+  }
+};
+
+#endif  // RECORDING_SINK_HPP___
@@ -0,0 +1,349 @@
+#ifndef REDUNDANT_SOURCE_HPP___
+#define REDUNDANT_SOURCE_HPP___
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Processing.NDI.Lib.h"
+#include "source.h"
+#include "trace.h"
+
+// Hot standby pair of sources, a main feed and a backup feed of the same
+// picture sent on two paths
+//
+// Both feeds receive all the time into their own ring. The renderer reads
+// from the active feed; the active feed is lost once its next frame is
+// overdue, a frame period and a quarter of jitter margin after its last
+// frame was captured, while the other feed still delivers. Every lookup
+// checks that deadline, and a monitor thread sleeps until it, so a loss is
+// detected within a frame of the missing one. A lookup that finds nothing on
+// the active feed is served by the other feed in the same tick, so a switch
+// never costs an output frame.
+//
+// Frame indices handed to the renderer carry the feed they came from,
+// (ring index << 1) | feed
+class RedundantSource : public Source {
+ public:
+  enum Feed { Main = 0, Backup = 1 };
+
+  struct SwitchEvent {
+    // Clock time of the switch, in 100ns intervals
+    int64_t mTime;
+    int mFrom;
+    int mTo;
+    const char* mReason;
+    // Age of the last frame of the lost feed when the switch happened, in
+    // 100ns intervals
+    int64_t mDetectDelay;
+  };
+
+  // Takes ownership of the feeds
+  RedundantSource(Source* mainFeed, Source* backupFeed)
+      : mActive(Main), mSwitches(0), mRevertive(false), mRevertHoldMs(5000),
+        mMainHealthySinceMs(0) {
+    mFeeds[Main] = mainFeed;
+    mFeeds[Backup] = backupFeed;
+    mSourceName =
+        mainFeed->GetSourceName() + " / " + backupFeed->GetSourceName();
+    // The backup has to be warm when the main goes away
+    for (Source* feed : mFeeds) {
+      feed->SetIdlePolicy(IdleMode::None, 0, false);
+    }
+  }
+  virtual ~RedundantSource() {
+    Stop();
+    delete mFeeds[Main];
+    delete mFeeds[Backup];
+  }
+
+  // With revertive switching the group goes back to the main feed once it
+  // has been healthy for holdMs
+  void SetRevertive(bool revertive, int holdMs) {
+    mRevertive = revertive;
+    mRevertHoldMs = holdMs;
+  }
+
+  void SetClock(Clock* clock) override {
+    Source::SetClock(clock);
+    for (Source* feed : mFeeds) {
+      feed->SetClock(clock);
+    }
+  }
+
+  void Start(int /*runForIterations*/ = 10) override {
+    for (Source* feed : mFeeds) {
+      feed->Start();
+    }
+    mIsRunning = true;
+    mClock->AddParticipant();
+    mState = State::Warming;
+    mThread = std::thread(&RedundantSource::Run, this);
+  }
+
+  void RequestStop() override {
+    Source::RequestStop();
+    for (Source* feed : mFeeds) {
+      feed->RequestStop();
+    }
+  }
+
+  void Stop() override {
+    Source::Stop();
+    for (Source* feed : mFeeds) {
+      feed->Stop();
+    }
+  }
+
+  NDIlib_video_frame_v2_t GetVideoFrameAtTime(uint64_t timestamp,
+                                              uint64_t threshold, int* index,
+                                              int* writeIndex) override {
+    RequestVideo();
+    std::lock_guard<std::mutex> lock(mFeedMutex);
+    UpdateActiveFeed();
+
+    int raw = 0;
+    int rawWrite = 0;
+    int feed = mActive;
+    NDIlib_video_frame_v2_t frame =
+        mFeeds[feed]->GetVideoFrameAtTime(timestamp, threshold, &raw,
+                                          &rawWrite);
+    // The ring returns its write index when nothing matched, the other feed
+    // may still have the frame for this tick
+    if (raw >= rawWrite) {
+      int otherRaw = 0;
+      int otherWrite = 0;
+      NDIlib_video_frame_v2_t other =
+          mFeeds[1 - feed]->GetVideoFrameAtTime(timestamp, threshold,
+                                                &otherRaw, &otherWrite);
+      if (otherRaw < otherWrite) {
+        SwitchTo(1 - feed, "lookup miss");
+        feed = mActive;
+        frame = other;
+        raw = otherRaw;
+        rawWrite = otherWrite;
+      }
+    }
+
+    if (index) {
+      *index = (raw << 1) | feed;
+    }
+    if (writeIndex) {
+      *writeIndex = (rawWrite << 1) | feed;
+    }
+    return frame;
+  }
+
+  // The active feed is kept from BeginSync to EndSync
+  void BeginSync() override {
+    mFeedMutex.lock();
+    UpdateActiveFeed();
+    mFeeds[mActive]->BeginSync();
+  }
+  void EndSync() override {
+    mFeeds[mActive]->EndSync();
+    mFeedMutex.unlock();
+  }
+  void GetTimecodes(std::vector<int64_t>* timecodes) override {
+    mFeeds[mActive]->GetTimecodes(timecodes);
+  }
+  NDIlib_video_frame_v2_t LockFrameAtTimecode(int64_t timecode,
+                                              int64_t tolerance, int* index,
+                                              int* writeIndex) override {
+    int raw = -1;
+    int rawWrite = 0;
+    NDIlib_video_frame_v2_t frame = mFeeds[mActive]->LockFrameAtTimecode(
+        timecode, tolerance, &raw, &rawWrite);
+    *index = raw < 0 ? -1 : (raw << 1) | mActive;
+    *writeIndex = (rawWrite << 1) | mActive;
+    return frame;
+  }
+
+  void ReleaseVideoFrame(int index) override {
+    if (index < 0) {
+      return;
+    }
+    mFeeds[index & 1]->ReleaseVideoFrame(index >> 1);
+  }
+
+  NDIlib_video_frame_v2_t GetLatestVideoFrame(int* index) override {
+    int feed = 0;
+    {
+      std::lock_guard<std::mutex> lock(mFeedMutex);
+      feed = mActive;
+    }
+    int raw = -1;
+    NDIlib_video_frame_v2_t frame = mFeeds[feed]->GetLatestVideoFrame(&raw);
+    *index = raw < 0 ? -1 : (raw << 1) | feed;
+    return frame;
+  }
+
+  float GetAudioRms(uint64_t* frames) override {
+    int feed = 0;
+    {
+      std::lock_guard<std::mutex> lock(mFeedMutex);
+      feed = mActive;
+    }
+    return mFeeds[feed]->GetAudioRms(frames);
+  }
+
+  std::shared_ptr<FramePyramid> GetPyramid(int index) override {
+    if (index < 0) {
+      return nullptr;
+    }
+    return mFeeds[index & 1]->GetPyramid(index >> 1);
+  }
+
+  void OutputCaptureStats() override {
+    mFeeds[Main]->OutputCaptureStats();
+    mFeeds[Backup]->OutputCaptureStats();
+    std::lock_guard<std::mutex> lock(mFeedMutex);
+    const uint64_t switches = mSwitches;
+    std::cout << "Redundant " << mSourceName << " | active "
+              << FeedName(mActive) << " | switches " << switches
+              << std::endl;
+    // The last kMaxEvents switches, oldest first
+    const uint64_t begin = switches > kMaxEvents ? switches - kMaxEvents : 0;
+    for (uint64_t i = begin; i < switches; i++) {
+      const SwitchEvent& event = mEvents[i % kMaxEvents];
+      std::cout << "  " << event.mTime << " " << FeedName(event.mFrom)
+                << " -> " << FeedName(event.mTo) << " (" << event.mReason
+                << ") detected after " << event.mDetectDelay / 10000.0
+                << " ms" << std::endl;
+    }
+  }
+
+  int GetActiveFeed() { return mActive; }
+
+  void ExportMetrics(MetricsRegistry& metrics) override {
+    for (Source* feed : mFeeds) {
+      feed->ExportMetrics(metrics);
+    }
+    const std::string source = MetricsRegistry::Label("source", mSourceName);
+    metrics.AddCallback("ve_redundant_active_feed",
+                        "Feed of the redundant pair in use, 0 main, 1 backup",
+                        "gauge", source, [this] { return (double)mActive; });
+    metrics.AddCallback(
+        "ve_redundant_switches_total",
+        "Switches between the feeds of the redundant pair", "counter", source,
+        [this] { return (double)mSwitches; });
+  }
+
+ private:
+  // Switches kept for the report, older ones are overwritten
+  static constexpr uint64_t kMaxEvents = 64;
+
+  Source* mFeeds[2];
+  // Guards the active feed and the events, taken by the renderer and the
+  // monitor thread
+  std::mutex mFeedMutex;
+  // Also read by the metrics scrape, without the lock
+  std::atomic<int> mActive;
+  // Also the write position of mEvents
+  std::atomic<uint64_t> mSwitches;
+  bool mRevertive;
+  int mRevertHoldMs;
+  int64_t mMainHealthySinceMs;
+  SwitchEvent mEvents[kMaxEvents];
+
+  static const char* FeedName(int feed) {
+    return feed == Main ? "main" : "backup";
+  }
+
+  int64_t NowTimestamp() { return mClock->Now(); }
+
+  // One frame of the feed, in 100ns intervals, 0 while unknown
+  static int64_t FramePeriod(Source* feed) {
+    const int num = feed->GetSourceFRateNum();
+    const int den = feed->GetSourceFRateDen();
+    if (num <= 0 || den <= 0) {
+      return 0;
+    }
+    return 10000000LL * den / num;
+  }
+
+  void SwitchTo(int feed, const char* reason) {
+    const int64_t now = NowTimestamp();
+    const int64_t last = mFeeds[mActive]->GetLastTimestamp();
+    mEvents[mSwitches % kMaxEvents] =
+        SwitchEvent{now, mActive, feed, reason, last ? now - last : 0};
+    std::cout << "Source " << mSourceName << " switched from "
+              << FeedName(mActive) << " to " << FeedName(feed) << " ("
+              << reason << ")" << std::endl;
+    mActive = feed;
+    mSwitches++;
+    mMainHealthySinceMs = 0;
+  }
+
+  // Clock time the next frame of the active feed is overdue at, 0 while the
+  // frame period is unknown. A quarter frame of margin absorbs the jitter
+  // of the capture. Called with mFeedMutex held.
+  int64_t LossDeadline() {
+    Source* active = mFeeds[mActive];
+    const int64_t period =
+        std::max(FramePeriod(active), FramePeriod(mFeeds[1 - mActive]));
+    const int64_t last = active->GetLastCaptureTime();
+    return period && last ? last + period + period / 4 : 0;
+  }
+
+  // Called with mFeedMutex held
+  void UpdateActiveFeed() {
+    Source* active = mFeeds[mActive];
+    Source* other = mFeeds[1 - mActive];
+    const int64_t period = std::max(FramePeriod(active), FramePeriod(other));
+    const int64_t activeLast = active->GetLastTimestamp();
+    const int64_t otherLast = other->GetLastTimestamp();
+
+    // Lost when the active feed missed its deadline while the other feed
+    // captured since its last frame
+    const int64_t deadline = LossDeadline();
+    if (deadline && NowTimestamp() >= deadline &&
+        other->GetLastCaptureTime() > active->GetLastCaptureTime()) {
+      SwitchTo(1 - mActive, "loss");
+    } else if (mRevertive && mActive == Backup && period) {
+      // The main is healthy while it keeps up with the backup
+      if (activeLast - otherLast <= period / 2) {
+        if (!mMainHealthySinceMs) {
+          mMainHealthySinceMs = NowMs();
+        } else if (NowMs() - mMainHealthySinceMs >= mRevertHoldMs) {
+          SwitchTo(Main, "revert");
+        }
+      } else {
+        mMainHealthySinceMs = 0;
+      }
+    }
+
+    Source* feed = mFeeds[mActive];
+    mSourceFRateNum = feed->GetSourceFRateNum();
+    mSourceFRateDen = feed->GetSourceFRateDen();
+    mState = (feed->IsReady() || mFeeds[1 - mActive]->IsReady())
+                 ? State::Active
+                 : State::Warming;
+  }
+
+  void Run() {
+    TRACE_THREAD_NAME("redundant " + mSourceName);
+    while (isRunning()) {
+      int64_t deadline = 0;
+      int64_t period = 0;
+      {
+        std::lock_guard<std::mutex> lock(mFeedMutex);
+        UpdateActiveFeed();
+        deadline = LossDeadline();
+        period = FramePeriod(mFeeds[mActive]);
+      }
+      // Until the active feed is overdue, at most a frame so that the
+      // revertive switch is followed too, 5 ms while the period is unknown
+      const int64_t now = NowTimestamp();
+      const int64_t wake = period ? now + period : now + 50000;
+      mClock->SleepUntil(deadline > now ? std::min(deadline, wake) : wake);
+    }
+    mClock->RemoveParticipant();
+  }
+};
+
+#endif  // REDUNDANT_SOURCE_HPP___
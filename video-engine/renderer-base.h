@@ -1,21 +1,65 @@
 #ifndef RENDERER_HPP___
 #define RENDERER_HPP___
 
+#include <chrono>
+#include <algorithm>
 #include <cstdlib>
 #include <thread>
 #include <vector>
 
+#include "clock.h"
+#include "memory-budget.h"
+#include "metrics.h"
+#include "recording-sink.h"
 #include "source.h"
+#include "trace.h"
+
+// The frame of one source for a render tick
+struct RenderFrame {
+  NDIlib_video_frame_v2_t mFrame;
+  int mSourceId;
+  // False when the source had no frame for the tick, mFrame is not to be
+  // used then
+  bool mFound;
+  // Lookup target minus the frame timestamp, in 100ns intervals. For a
+  // source of the sync group, the tick time minus the frame timestamp.
+  int64_t mLateness;
+  // Non-modulo ring index of the frame, -1 when nothing is locked
+  int mRingIndex;
+  // Ring write index at the time of the lookup
+  int mWriteIndex;
+};
+
+// View over the frames of a tick, one per source in the order they were
+// added, like a C++20 std::span. The frames are owned by the renderer and
+// reused every tick.
+struct FrameSpan {
+  RenderFrame *mData;
+  size_t mSize;
+
+  size_t size() const { return mSize; }
+  bool empty() const { return mSize == 0; }
+  RenderFrame &operator[](size_t i) const { return mData[i]; }
+  RenderFrame *begin() const { return mData; }
+  RenderFrame *end() const { return mData + mSize; }
+};
 
 class RendererBase {
 public:
   RendererBase(int rendererFRateNum, int rendererFRateDen)
       : mIsRunning(false), mRendererFRateNum(rendererFRateNum),
-        mRendererFRateDen(rendererFRateDen) {}
-  virtual ~RendererBase() {}
+        mRendererFRateDen(rendererFRateDen), mClock(SystemClock::Get()),
+        mVerbose(true),
+        mMemory(MemoryBudget::Get().Register("renderer", false)) {}
+  virtual ~RendererBase() {
+    mMemory->Release(MemoryKind::Render, mMemory->GetBytes(MemoryKind::Render));
+  }
 
   void Start() {
     mIsRunning = true;
+    // Registered here rather than in Run, so a virtual clock cannot move
+    // before the first tick
+    mClock->AddParticipant();
     mThread = std::thread(&RendererBase::Run, this);
   }
 
@@ -26,47 +70,306 @@ public:
 
   void AddSource(Source *source) { mSources.push_back(source); }
 
-  void virtual Process(std::vector<NDIlib_video_frame_v2_t>) = 0;
+  // Time source of the render loop, set before Start. Sources are not
+  // changed, see Source::SetClock.
+  void SetClock(Clock *clock) { mClock = clock; }
+
+  // Without verbose the loop does not print anything per tick, for long
+  // simulated runs
+  void SetVerbose(bool verbose) { mVerbose = verbose; }
+
+  // Renders these sources, indices in the order of AddSource, from one
+  // common capture instant by NDI timecode rather than each from its own
+  // receive time, for split screens of cameras sharing a house timecode.
+  // The instant is the newest one every source of the group holds, less
+  // delayFrames frames of the source behind, against late frames. Set
+  // before Start.
+  void SetSyncGroup(const std::vector<int> &sources, int delayFrames = 1) {
+    mSyncGroup = sources;
+    mSyncDelayFrames = delayFrames;
+  }
+
+  // Records every frame the renderer sends, set before Start
+  void SetRecorder(RecordingSink *recorder) { mRecorder = recorder; }
+
+  // Entries may be modified, they are reset before the next tick
+  void virtual Process(FrameSpan frames) = 0;
+
+  // Prints the renderer specific statistics
+  void virtual OutputStats() {}
 
 protected:
   std::vector<Source *> mSources;
   int mRendererFRateDen, mRendererFRateNum;
+  Clock *mClock;
+  bool mVerbose;
+  // Output buffers of the renderer, see ResizeBuffer
+  MemoryAccount *mMemory;
+  RecordingSink *mRecorder = nullptr;
+
+  // Called by the renderers with each frame they send
+  void Record(const NDIlib_video_frame_v2_t &frame) {
+    if (mRecorder) {
+      mRecorder->Record(frame);
+    }
+  }
+
+  // Called instead of Record for a tick that sends nothing new, the
+  // receivers showing the previous frame again
+  void RecordRepeat() {
+    if (mRecorder) {
+      mRecorder->RecordRepeat();
+    }
+  }
+
+  // Resizes an output buffer, charging what it allocated to the budget
+  void ResizeBuffer(std::vector<uint8_t> &buffer, size_t bytes) {
+    const size_t capacity = buffer.capacity();
+    buffer.resize(bytes);
+    mMemory->Charge(MemoryKind::Render,
+                    (int64_t)buffer.capacity() - (int64_t)capacity);
+  }
 
 private:
   std::thread mThread;
   bool mIsRunning;
+  std::vector<int> mSyncGroup;
+  int mSyncDelayFrames = 1;
+
+  // Per tick state of the sync group, allocated once
+  struct SyncGroup {
+    // Sources of the group in source id order, the order their rings are
+    // locked in
+    std::vector<int> mOrder;
+    // Sources of mOrder ready this tick
+    std::vector<int> mMembers;
+    // Timecodes held by each member, and half its frame period, in 100ns
+    std::vector<std::vector<int64_t>> mTimecodes;
+    std::vector<int64_t> mTolerance;
+    MetricsRegistry::Counter *mMisses;
+  };
+
+  // Looks up the frames of the sync group for one common timecode in one
+  // pass, with the rings of the group locked together. Either every ready
+  // source of the group gets the frame of the instant or none does.
+  void LookupSyncGroup(SyncGroup &group, FrameSpan frames, uint64_t now,
+                       std::vector<MetricsRegistry::Counter *> &lookups,
+                       std::vector<MetricsRegistry::Counter *> &misses,
+                       std::vector<MetricsRegistry::Histogram *> &lateness) {
+    group.mMembers.clear();
+    for (int i : group.mOrder) {
+      Source *source = mSources[i];
+      source->RequestVideo();
+      if (!source->IsReady() || source->GetSourceFRateDen() == 0 ||
+          source->GetSourceFRateNum() <= 0) {
+        if (mVerbose) {
+          std::cout << "Source not ready" << std::endl;
+        }
+        continue;
+      }
+      group.mMembers.push_back(i);
+    }
+    if (group.mMembers.empty()) {
+      return;
+    }
+
+    TRACE_SPAN("sync lookup", -1, -1);
+    const size_t count = group.mMembers.size();
+    for (size_t k = 0; k < count; k++) {
+      Source *source = mSources[group.mMembers[k]];
+      source->BeginSync();
+      group.mTimecodes[k].clear();
+      source->GetTimecodes(&group.mTimecodes[k]);
+      group.mTolerance[k] = 5000000LL * source->GetSourceFRateDen() /
+                            source->GetSourceFRateNum();
+    }
+
+    // The source whose newest frame is the oldest bounds the instant, its
+    // frames are the candidates, newest first
+    size_t behind = 0;
+    bool empty = false;
+    for (size_t k = 0; k < count; k++) {
+      if (group.mTimecodes[k].empty()) {
+        empty = true;
+        break;
+      }
+      if (group.mTimecodes[k].back() < group.mTimecodes[behind].back()) {
+        behind = k;
+      }
+    }
+    bool found = false;
+    int64_t instant = 0;
+    const std::vector<int64_t> &candidates = group.mTimecodes[behind];
+    for (int c = (int)candidates.size() - 1 - mSyncDelayFrames;
+         !empty && !found && c >= 0; c--) {
+      instant = candidates[c];
+      found = true;
+      for (size_t k = 0; found && k < count; k++) {
+        const std::vector<int64_t> &timecodes = group.mTimecodes[k];
+        found = std::any_of(timecodes.begin(), timecodes.end(),
+                            [&](int64_t timecode) {
+                              return std::abs(timecode - instant) <=
+                                     group.mTolerance[k];
+                            });
+      }
+    }
+    if (found) {
+      for (size_t k = 0; k < count; k++) {
+        RenderFrame &entry = frames[group.mMembers[k]];
+        entry.mFrame = mSources[group.mMembers[k]]->LockFrameAtTimecode(
+            instant, group.mTolerance[k], &entry.mRingIndex,
+            &entry.mWriteIndex);
+        entry.mFound = entry.mFrame.p_data && entry.mRingIndex >= 0;
+      }
+    }
+    for (size_t k = count; k-- > 0;) {
+      mSources[group.mMembers[k]]->EndSync();
+    }
+
+    if (!found) {
+      group.mMisses->Add();
+    }
+    for (int i : group.mMembers) {
+      RenderFrame &entry = frames[i];
+      entry.mLateness = found ? now - entry.mFrame.timestamp : 0;
+      lookups[i]->Add();
+      if (entry.mFound) {
+        lateness[i]->Observe(entry.mLateness);
+      } else {
+        misses[i]->Add();
+      }
+      if (mVerbose) {
+        std::cout << "Now : " << now << " | Sync TC: " << instant
+                  << " | Found: " << entry.mFound
+                  << " | Source TS: " << entry.mFrame.timestamp
+                  << " | Diff:" << entry.mLateness
+                  << " | Index: " << entry.mRingIndex << std::endl;
+      }
+    }
+  }
 
   // Assume only one source for now
   void Run() {
+    TRACE_THREAD_NAME("renderer");
+
     // If there is one source then we can start the rendering loop
     if (mSources.size() == 0) {
       std::cout << "No sources to render" << std::endl;
+      mClock->RemoveParticipant();
       return;
     }
     std::cout << "Sources to render: " << mSources.size() << std::endl;
 
+    // Metrics of the loop, in 100ns intervals
+    MetricsRegistry &metrics = MetricsRegistry::Get();
+    MetricsRegistry::Counter *ticks =
+        metrics.AddCounter("ve_render_ticks_total", "Render ticks");
+    MetricsRegistry::Histogram *tickDuration = metrics.AddHistogram(
+        "ve_render_tick_seconds",
+        "Time from the start of a tick to the end of Process", "",
+        {10000, 20000, 50000, 100000, 200000, 330000, 500000, 660000,
+         1000000, 2000000},
+        1e-7);
+    std::vector<MetricsRegistry::Counter *> lookups, misses;
+    std::vector<MetricsRegistry::Histogram *> lateness;
+    for (Source *source : mSources) {
+      const std::string label =
+          MetricsRegistry::Label("source", source->GetSourceName());
+      lookups.push_back(metrics.AddCounter(
+          "ve_render_lookups_total", "Frame lookups in the source ring",
+          label));
+      misses.push_back(metrics.AddCounter(
+          "ve_render_lookup_misses_total",
+          "Frame lookups that found no frame close enough to the target",
+          label));
+      lateness.push_back(metrics.AddHistogram(
+          "ve_render_lateness_seconds",
+          "Lookup target time minus the timestamp of the frame found", label,
+          {-100000, 0, 50000, 100000, 200000, 330000, 500000, 660000,
+           1000000, 2000000},
+          1e-7));
+    }
+
     // Simulate a renderering loop
     // Frame per second
     const double fpsOut = mRendererFRateNum / mRendererFRateDen;
     const double frameDurationOut = 1.0 * 1000 / fpsOut;   // in milliseconds
     const int frameDurationOutInt = (int)frameDurationOut; // in milliseconds
 
+    // Allocated once, a tick does not allocate
+    std::vector<RenderFrame> batch(mSources.size());
+    const FrameSpan frames{batch.data(), batch.size()};
+
+    // Sources of the sync group, looked up together after the others
+    SyncGroup syncGroup;
+    std::vector<bool> inSyncGroup(mSources.size(), false);
+    for (int i : mSyncGroup) {
+      if (i < 0 || i >= (int)mSources.size() || inSyncGroup[i]) {
+        continue;
+      }
+      if (!mSources[i]->CanSync()) {
+        std::cout << "Source " << mSources[i]->GetSourceName()
+                  << " cannot be synchronised, looked up on its own"
+                  << std::endl;
+        continue;
+      }
+      inSyncGroup[i] = true;
+      syncGroup.mOrder.push_back(i);
+    }
+    std::sort(syncGroup.mOrder.begin(), syncGroup.mOrder.end(),
+              [this](int a, int b) {
+                return mSources[a]->GetSourceId() < mSources[b]->GetSourceId();
+              });
+    syncGroup.mMembers.reserve(syncGroup.mOrder.size());
+    syncGroup.mTimecodes.resize(syncGroup.mOrder.size());
+    for (auto &timecodes : syncGroup.mTimecodes) {
+      timecodes.reserve(64);
+    }
+    syncGroup.mTolerance.resize(syncGroup.mOrder.size());
+    syncGroup.mMisses = metrics.AddCounter(
+        "ve_render_sync_misses_total",
+        "Ticks with no timecode held by every source of the sync group");
+    int64_t tick = 0;
+
     while (mIsRunning) {
+      tick++;
+      TRACE_SPAN("tick", -1, tick);
+
       // Output current system timestamp (now)
-      uint64_t nowBeforeProcessing =
-          std::chrono::system_clock::now().time_since_epoch().count();
+      uint64_t nowBeforeProcessing = mClock->Now() * 100;
       // The NDI timestamp is in 100ns intervals
       // The now timestamp is in ns intervals
-      std::cout << "Current system timestamp: " << nowBeforeProcessing / 100
-                << std::endl;
+      if (mVerbose) {
+        std::cout << "Current system timestamp: " << nowBeforeProcessing / 100
+                  << std::endl;
+      }
 
       // For all the sources
-      int index[mSources.size()];
-      std::vector<NDIlib_video_frame_v2_t> frames(mSources.size());
-
       for (int i = 0; i < mSources.size(); i++) {
+        // Nothing is locked for a skipped source
+        RenderFrame &entry = frames[i];
+        entry.mSourceId = mSources[i]->GetSourceId();
+        entry.mFound = false;
+        entry.mLateness = 0;
+        entry.mRingIndex = -1;
+        entry.mWriteIndex = -1;
+        if (inSyncGroup[i]) {
+          continue;
+        }
+
+        // Lets an idle source reconnect before we need its frames
+        mSources[i]->RequestVideo();
+        if (!mSources[i]->IsReady()) {
+          if (mVerbose) {
+            std::cout << "Source not ready" << std::endl;
+          }
+          continue;
+        }
+
         if (mSources[i]->GetSourceFRateDen() == 0) {
-          std::cout << "Source frame rate not set" << std::endl;
+          if (mVerbose) {
+            std::cout << "Source frame rate not set" << std::endl;
+          }
           continue;
         }
         // Get the input frame rate from the source
@@ -83,25 +386,46 @@ private:
         // The 2 parameters are
         // 1. The timestamp in 100ns intervals
         // 2. The threshold in 100ns intervals
-        index[i] = 0;
-        int writeIndex = 0;
-        auto frame = mSources[i]->GetVideoFrameAtTime(
-            targetTime / 100, frameDurationInInt * 10000, &(index[i]),
-            &writeIndex);
-        frames[i] = frame;
-        std::cout << "Now : " << nowBeforeProcessing / 100
-                  << " | Target: " << targetTime / 100
-                  << " | Source TS: " << frame.timestamp
-                  << " | Diff:" << (targetTime / 100 - frame.timestamp)
-                  << " | Index: " << index[i]
-                  << " | Write Index: " << writeIndex << std::endl;
+        entry.mFrame = mSources[i]->GetVideoFrameAtTime(
+            targetTime / 100, frameDurationInInt * 10000, &entry.mRingIndex,
+            &entry.mWriteIndex);
+        // A ring lookup that found nothing returns the write index
+        entry.mFound = entry.mFrame.p_data && entry.mRingIndex >= 0 &&
+                       entry.mRingIndex < entry.mWriteIndex;
+        entry.mLateness = targetTime / 100 - entry.mFrame.timestamp;
+        lookups[i]->Add();
+        if (entry.mFound) {
+          lateness[i]->Observe(entry.mLateness);
+        } else {
+          misses[i]->Add();
+        }
+        if (mVerbose) {
+          std::cout << "Now : " << nowBeforeProcessing / 100
+                    << " | Target: " << targetTime / 100
+                    << " | Source TS: " << entry.mFrame.timestamp
+                    << " | Diff:" << entry.mLateness
+                    << " | Index: " << entry.mRingIndex
+                    << " | Write Index: " << entry.mWriteIndex << std::endl;
+          if (!entry.mFound) {
+            std::cout << "Frame not found" << std::endl;
+          }
+        }
+      }
+
+      if (!syncGroup.mOrder.empty()) {
+        LookupSyncGroup(syncGroup, frames, nowBeforeProcessing / 100, lookups,
+                        misses, lateness);
       }
 
       // Process the frame
-      Process(frames);
+      {
+        TRACE_SPAN("process", -1, tick);
+        Process(frames);
+      }
 
-      uint64_t nowAfterProcessing =
-          std::chrono::system_clock::now().time_since_epoch().count();
+      uint64_t nowAfterProcessing = mClock->Now() * 100;
+      ticks->Add();
+      tickDuration->Observe((nowAfterProcessing - nowBeforeProcessing) / 100);
 
       // nowAfterProcessing minus nowBeforeProcessing in milliseconds
       double processingTime =
@@ -112,16 +436,26 @@ private:
       // std::cout << "Processing time: " << processingTime << std::endl;
 
       // Wait for the remaining time (frameDurationOut - processingTime)
-      std::this_thread::sleep_for(
-          std::chrono::milliseconds(frameDurationOutInt - processingTimeInt));
+      {
+        TRACE_SPAN("sleep", -1, tick);
+        mClock->SleepFor((frameDurationOutInt - processingTimeInt) * 10000LL);
+      }
 
-      // Unlock both the sources
+      // Unlock the frames that were found, nothing is locked otherwise
       for (int i = 0; i < mSources.size(); i++) {
-        mSources[i]->ReleaseVideoFrame(index[i]);
+        if (frames[i].mFound) {
+          mSources[i]->ReleaseVideoFrame(frames[i].mRingIndex);
+        }
+        frames[i].mRingIndex = -1;
       }
     }
 
-    // We need to stop all the sources only one for now
+    // All the sources are told first, then waited for
+    for (int i = 0; i < mSources.size(); i++) {
+      mSources[i]->RequestStop();
+    }
+    // The sources may sleep on the clock until they see the stop
+    mClock->RemoveParticipant();
     for (int i = 0; i < mSources.size(); i++) {
       mSources[i]->Stop();
     }
@@ -0,0 +1,392 @@
+#ifndef RENDERER_COMPOSITOR_HPP___
+#define RENDERER_COMPOSITOR_HPP___
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "Processing.NDI.Lib.h"
+#include "format-convert.h"
+#include "keyer.h"
+#include "parallel-for.h"
+#include "renderer-base.h"
+
+// Layered compositor: picture-in-picture and keyed overlays
+//
+// Every tick the layers are drawn in order over a black canvas, the first
+// layer being the bottom one. A layer takes a crop of its source frame as a
+// view (an offset into p_data with the line stride of the frame, nothing is
+// copied), draws it into a destination rectangle of the canvas, scaled with
+// the nearest pixel when the sizes differ, and keys it with the alpha of the
+// frame, a luma key or a chroma key. The rows of a layer are split over the
+// shared ParallelFor pool.
+//
+// The canvas is UYVY or BGRA and takes layers of every packed format. The
+// format pair of a layer is resolved once per frame into a draw loop
+// specialised on it (see pixel-format.h); a layer of another format than
+// the canvas is converted row by row after scaling. Keys work on the row in
+// the canvas format. Sources deliver UYVY or UYVA with
+// NDIlib_recv_color_format_fastest, which a UYVY canvas draws as is.
+class RendererCompositor : public RendererBase {
+public:
+  enum class AlphaMode { Opaque, Straight, LumaKey, ChromaKey };
+
+  struct Rect {
+    int mX;
+    int mY;
+    int mWidth;
+    int mHeight;
+  };
+
+  struct Layer {
+    // Index of the source, in the order of AddSource
+    int mSource;
+    // Part of the source frame, an empty rectangle takes the whole frame
+    Rect mCrop;
+    Rect mDest;
+    AlphaMode mAlpha;
+    // Luma key: transparent at mLow and below, opaque from mHigh up, in
+    // 8-bit luma of the layer format
+    int mLow = 16;
+    int mHigh = 48;
+    // Chroma key: the key colour, 8-bit RGB, and the distance from it at
+    // which the layer starts to show (mInner) and is opaque (mOuter)
+    uint8_t mKeyColour[3] = {0, 177, 64};
+    int mInner = 40;
+    int mOuter = 90;
+  };
+
+  RendererCompositor(int rendererFRateNum, int rendererFRateDen,
+                     std::string ndiSourceName, int xres = 1920,
+                     int yres = 1080,
+                     NDIlib_FourCC_video_type_e FourCC =
+                         NDIlib_FourCC_video_type_UYVY)
+      : RendererBase(rendererFRateNum, rendererFRateDen),
+        mNDISourceName(ndiSourceName), mXres(xres), mYres(yres),
+        mFourCC(FourCC == NDIlib_FourCC_video_type_UYVY
+                    ? NDIlib_FourCC_video_type_UYVY
+                    : NDIlib_FourCC_video_type_BGRA),
+        mBytesPerPixel(mFourCC == NDIlib_FourCC_video_type_UYVY ? 2 : 4) {
+    ResizeBuffer(mCanvas, (size_t)xres * yres * mBytesPerPixel);
+    NDIlib_send_create_t NDI_send_create_desc;
+    NDI_send_create_desc.p_ndi_name = mNDISourceName.c_str();
+    NDI_send_create_desc.p_groups = nullptr;
+    mNDISender = NDIlib_send_create(&NDI_send_create_desc);
+  }
+  virtual ~RendererCompositor() {
+    if (mNDISender) {
+      NDIlib_send_destroy(mNDISender);
+    }
+  }
+
+  // Layers are added before Start, bottom first
+  void AddLayer(const Layer &layer) {
+    mLayers.push_back(layer);
+    mStats.push_back(LayerStats());
+  }
+
+  void Process(FrameSpan frames) override {
+    const auto start = std::chrono::steady_clock::now();
+    ClearCanvas();
+    for (size_t i = 0; i < mLayers.size(); i++) {
+      const Layer &layer = mLayers[i];
+      if (layer.mSource < 0 || layer.mSource >= (int)frames.size() ||
+          !frames[layer.mSource].mFound) {
+        mStats[i].mMissing++;
+        continue;
+      }
+      TRACE_SPAN("layer", frames[layer.mSource].mSourceId,
+                 frames[layer.mSource].mRingIndex);
+      if (DrawLayer(layer, frames[layer.mSource].mFrame)) {
+        mStats[i].mDrawn++;
+      } else {
+        mStats[i].mUnsupported++;
+      }
+    }
+    const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+    mTicks++;
+    mComposeNs += ns;
+    if (ns > mMaxComposeNs) {
+      mMaxComposeNs = ns;
+    }
+
+    NDIlib_video_frame_v2_t output;
+    output.xres = mXres;
+    output.yres = mYres;
+    output.FourCC = mFourCC;
+    output.frame_rate_N = mRendererFRateNum;
+    output.frame_rate_D = mRendererFRateDen;
+    output.frame_format_type = NDIlib_frame_format_type_progressive;
+    output.p_data = mCanvas.data();
+    output.line_stride_in_bytes = mXres * mBytesPerPixel;
+    TRACE_SPAN("send", -1, -1);
+    NDIlib_send_send_video_v2(mNDISender, &output);
+    Record(output);
+  }
+
+  void OutputStats() override {
+    std::cout << "Compositor | " << mXres << "x" << mYres << " | layers "
+              << mLayers.size() << " | compose avg "
+              << (mTicks ? mComposeNs / mTicks / 1000000.0 : 0)
+              << " ms | max " << mMaxComposeNs / 1000000.0 << " ms"
+              << std::endl;
+    for (size_t i = 0; i < mLayers.size(); i++) {
+      std::cout << "Compositor layer " << i << " | drawn " << mStats[i].mDrawn
+                << " | no frame " << mStats[i].mMissing
+                << " | unsupported " << mStats[i].mUnsupported << std::endl;
+    }
+  }
+
+private:
+  struct LayerStats {
+    uint64_t mDrawn = 0;
+    uint64_t mMissing = 0;
+    uint64_t mUnsupported = 0;
+  };
+
+  NDIlib_send_instance_t mNDISender;
+  std::string mNDISourceName;
+  int mXres;
+  int mYres;
+  NDIlib_FourCC_video_type_e mFourCC;
+  int mBytesPerPixel;
+  std::vector<uint8_t> mCanvas;
+  std::vector<Layer> mLayers;
+  std::vector<LayerStats> mStats;
+
+  uint64_t mTicks = 0;
+  uint64_t mComposeNs = 0;
+  uint64_t mMaxComposeNs = 0;
+
+  void ClearCanvas() {
+    if (mBytesPerPixel == 4) {
+      // Opaque black
+      ParallelFor::Shared().Run(mYres, 128, [&](int begin, int end) {
+        uint32_t *p = (uint32_t *)(mCanvas.data() + (size_t)begin * mXres * 4);
+        std::fill(p, p + (size_t)(end - begin) * mXres, 0xff000000u);
+      });
+      return;
+    }
+    // Video range black, neutral chroma
+    ParallelFor::Shared().Run(mYres, 128, [&](int begin, int end) {
+      uint32_t *p = (uint32_t *)(mCanvas.data() + (size_t)begin * mXres * 2);
+      std::fill(p, p + (size_t)(end - begin) * mXres / 2, 0x10801080u);
+    });
+  }
+
+  // Key colour as U and V, or as the three colour bytes of the format
+  static void KeyColour(const Layer &layer,
+                        NDIlib_FourCC_video_type_e FourCC, uint8_t key[3]) {
+    const int r = layer.mKeyColour[0];
+    const int g = layer.mKeyColour[1];
+    const int b = layer.mKeyColour[2];
+    if (FourCC == NDIlib_FourCC_video_type_UYVY ||
+        FourCC == NDIlib_FourCC_video_type_UYVA) {
+      // BT.709, video range
+      const double y = 0.2126 * r + 0.7152 * g + 0.0722 * b;
+      key[0] = (uint8_t)(128 + (b - y) / 1.8556 * 224 / 255 + 0.5);
+      key[1] = (uint8_t)(128 + (r - y) / 1.5748 * 224 / 255 + 0.5);
+      key[2] = 0;
+    } else if (FourCC == NDIlib_FourCC_video_type_RGBA ||
+               FourCC == NDIlib_FourCC_video_type_RGBX) {
+      key[0] = (uint8_t)r;
+      key[1] = (uint8_t)g;
+      key[2] = (uint8_t)b;
+    } else {
+      key[0] = (uint8_t)b;
+      key[1] = (uint8_t)g;
+      key[2] = (uint8_t)r;
+    }
+  }
+
+  using CanvasFormats = FormatList<PixelFormat<NDIlib_FourCC_video_type_UYVY>,
+                                   PixelFormat<NDIlib_FourCC_video_type_BGRA>>;
+
+  // Returns false if the frame format is not supported
+  bool DrawLayer(const Layer &layer, const NDIlib_video_frame_v2_t &frame) {
+    if (!frame.p_data) {
+      return false;
+    }
+    return DispatchFormatPair(frame.FourCC, mFourCC, PackedFormats(),
+                              CanvasFormats(), [&](auto in, auto canvas) {
+                                DrawLayerAs<decltype(in), decltype(canvas)>(
+                                    layer, frame);
+                              });
+  }
+
+  // Rows reused by a thread across layers and ticks
+  struct Scratch {
+    // Scaled row, in the layer format
+    std::vector<uint8_t> mRow;
+    // Scaled alpha plane of UYVA
+    std::vector<uint8_t> mPlane;
+    // Row converted to the canvas format, and its alpha
+    std::vector<uint8_t> mConverted;
+    std::vector<uint8_t> mConvertedAlpha;
+    // Key or alpha the row is blended with
+    std::vector<uint8_t> mAlpha;
+  };
+  static Scratch &ThreadScratch() {
+    thread_local Scratch scratch;
+    return scratch;
+  }
+
+  template <class In, class Canvas>
+  void DrawLayerAs(const Layer &layer, const NDIlib_video_frame_v2_t &frame) {
+    // Crops and destinations go by whole macropixels if either side is
+    // 4:2:2
+    constexpr int group =
+        std::max(In::kPixelsPerGroup, Canvas::kPixelsPerGroup);
+    constexpr bool convert = !SamePixelLayout<In, Canvas>();
+
+    // The crop, within the frame
+    Rect crop = layer.mCrop;
+    if (crop.mWidth <= 0 || crop.mHeight <= 0) {
+      crop = Rect{0, 0, frame.xres, frame.yres};
+    }
+    crop.mX = std::max(0, std::min(crop.mX, frame.xres));
+    crop.mY = std::max(0, std::min(crop.mY, frame.yres));
+    crop.mWidth = std::min(crop.mWidth, frame.xres - crop.mX);
+    crop.mHeight = std::min(crop.mHeight, frame.yres - crop.mY);
+    crop.mX -= crop.mX % group;
+    crop.mWidth -= crop.mWidth % group;
+    // The destination, clipped to the canvas
+    Rect dest = layer.mDest;
+    dest.mX &= ~(group - 1);
+    dest.mWidth &= ~(group - 1);
+    const int x0 = std::max(0, dest.mX);
+    const int y0 = std::max(0, dest.mY);
+    const int x1 = std::min(mXres & ~(group - 1), dest.mX + dest.mWidth);
+    const int y1 = std::min(mYres, dest.mY + dest.mHeight);
+    if (crop.mWidth <= 0 || crop.mHeight <= 0 || x1 <= x0 || y1 <= y0) {
+      return;
+    }
+
+    // Zero-copy views of the crop. The alpha plane of UYVA follows the
+    // UYVY plane, one byte per pixel.
+    const int stride = frame.line_stride_in_bytes;
+    const uint8_t *view = frame.p_data + (size_t)crop.mY * stride +
+                          (size_t)crop.mX * In::kBytesPerPixel;
+    const uint8_t *alphaView = nullptr;
+    if constexpr (In::kAlphaPlane) {
+      alphaView = frame.p_data + (size_t)stride * frame.yres +
+                  (size_t)crop.mY * frame.xres + crop.mX;
+    }
+    // UYVY, BGRX and RGBX have no alpha to key with
+    AlphaMode mode = layer.mAlpha;
+    if (mode == AlphaMode::Straight && !In::kHasAlpha) {
+      mode = AlphaMode::Opaque;
+    }
+
+    uint8_t key[3];
+    KeyColour(layer, Canvas::kFourCC, key);
+    const bool scaled =
+        crop.mWidth != dest.mWidth || crop.mHeight != dest.mHeight;
+    const int width = x1 - x0;
+    const int canvasStride = mXres * Canvas::kBytesPerPixel;
+
+    ParallelFor::Shared().Run(y1 - y0, 32, [&](int begin, int end) {
+      Scratch &scratch = ThreadScratch();
+      scratch.mRow.resize((size_t)width * In::kBytesPerPixel);
+      scratch.mPlane.resize(width);
+      scratch.mConverted.resize((size_t)width * Canvas::kBytesPerPixel);
+      scratch.mConvertedAlpha.resize(width);
+      scratch.mAlpha.resize(width);
+
+      for (int y = y0 + begin; y < y0 + end; y++) {
+        // Nearest source row and the column of the first drawn pixel
+        const int sy = (int)((int64_t)(y - dest.mY) * crop.mHeight /
+                             dest.mHeight);
+        const uint8_t *row = view + (size_t)sy * stride;
+        const uint8_t *alphaRow =
+            alphaView ? alphaView + (size_t)sy * frame.xres : nullptr;
+        if (scaled) {
+          ScaleRow<In>(row, alphaRow, x0 - dest.mX, width, crop.mWidth,
+                       dest.mWidth, scratch.mRow.data(),
+                       scratch.mPlane.data());
+          row = scratch.mRow.data();
+          alphaRow = alphaRow ? scratch.mPlane.data() : nullptr;
+        } else {
+          row += (size_t)(x0 - dest.mX) * In::kBytesPerPixel;
+          alphaRow = alphaRow ? alphaRow + (x0 - dest.mX) : nullptr;
+        }
+        if constexpr (convert) {
+          // The alpha of the layer comes out as a plane for a UYVY canvas
+          uint8_t *convertedAlpha =
+              In::kHasAlpha && Canvas::kYUV ? scratch.mConvertedAlpha.data()
+                                            : nullptr;
+          ConvertRow<In, Canvas>(row, alphaRow, scratch.mConverted.data(),
+                                 convertedAlpha, width);
+          row = scratch.mConverted.data();
+          alphaRow = convertedAlpha;
+        }
+        uint8_t *out = mCanvas.data() + (size_t)y * canvasStride +
+                       (size_t)x0 * Canvas::kBytesPerPixel;
+
+        const uint8_t *alpha = scratch.mAlpha.data();
+        uint8_t *keyed = scratch.mAlpha.data();
+        switch (mode) {
+          case AlphaMode::Opaque:
+            memcpy(out, row, (size_t)width * Canvas::kBytesPerPixel);
+            continue;
+          case AlphaMode::Straight:
+            if constexpr (Canvas::kYUV) {
+              alpha = alphaRow;
+            } else {
+              KeyerAlphaRGBASSE2(row, keyed, width);
+            }
+            break;
+          case AlphaMode::LumaKey:
+            if constexpr (Canvas::kYUV) {
+              KeyerLumaUYVYSSE2(row, keyed, width, layer.mLow, layer.mHigh);
+            } else {
+              KeyerLumaRGBASSE2(row, keyed, width, layer.mLow, layer.mHigh);
+            }
+            break;
+          case AlphaMode::ChromaKey:
+            if constexpr (Canvas::kYUV) {
+              KeyerChromaUYVYSSE2(row, keyed, width, key[0], key[1],
+                                  layer.mInner, layer.mOuter);
+            } else {
+              KeyerChromaRGBASSE2(row, keyed, width, key, layer.mInner,
+                                  layer.mOuter);
+            }
+            break;
+        }
+        if constexpr (Canvas::kYUV) {
+          KeyerBlendUYVYSSE2(row, alpha, out, width);
+        } else {
+          KeyerBlendRGBASSE2(row, alpha, out, width);
+        }
+      }
+    });
+  }
+
+  // Nearest pixel scaling of the drawn part of a row, from the pixel
+  // offset of the destination on. A group of pixels (a UYVY macropixel, an
+  // RGB pixel) is 32 bits; the alpha plane goes by pixels.
+  template <class In>
+  static void ScaleRow(const uint8_t *row, const uint8_t *alphaRow,
+                       int offset, int width, int cropWidth, int destWidth,
+                       uint8_t *out, uint8_t *alphaOut) {
+    constexpr int group = In::kPixelsPerGroup;
+    static_assert(group * In::kBytesPerPixel == 4, "32-bit pixel groups");
+    const uint32_t *in = (const uint32_t *)row;
+    uint32_t *o = (uint32_t *)out;
+    for (int x = 0; x < width; x += group) {
+      const int sx = (int)((int64_t)(offset + x) * cropWidth / destWidth);
+      o[x / group] = in[sx / group];
+    }
+    if (alphaRow) {
+      for (int x = 0; x < width; x++) {
+        alphaOut[x] = alphaRow[(int64_t)(offset + x) * cropWidth / destWidth];
+      }
+    }
+  }
+};
+
+#endif // RENDERER_COMPOSITOR_HPP___
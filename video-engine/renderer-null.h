@@ -0,0 +1,99 @@
+#ifndef RENDERER_NULL_HPP___
+#define RENDERER_NULL_HPP___
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "renderer-base.h"
+
+// Renders nothing, keeps track of what the ticks got from each source
+//
+// For simulated runs (see SyntheticSource): a frame missing, the same frame
+// twice in a row (repeat) or a frame never seen between two ticks (skip)
+// shows the source and the renderer clocks drifting apart, the lateness
+// shows how close to the target time the lookups land.
+class RendererNull : public RendererBase {
+public:
+  struct SourceStats {
+    uint64_t mFound = 0;
+    uint64_t mMissing = 0;
+    uint64_t mRepeated = 0;
+    uint64_t mSkipped = 0;
+    int64_t mLatenessSum = 0;
+    int64_t mLatenessMin = INT64_MAX;
+    int64_t mLatenessMax = INT64_MIN;
+    int64_t mLastTimestamp = 0;
+  };
+
+  RendererNull(int rendererFRateNum, int rendererFRateDen)
+      : RendererBase(rendererFRateNum, rendererFRateDen), mTicks(0) {}
+
+  void Process(FrameSpan frames) override {
+    mTicks++;
+    if (mStats.size() < frames.size()) {
+      mStats.resize(frames.size());
+    }
+    for (size_t i = 0; i < frames.size(); i++) {
+      SourceStats &stats = mStats[i];
+      if (!frames[i].mFound) {
+        stats.mMissing++;
+        continue;
+      }
+      const NDIlib_video_frame_v2_t &frame = frames[i].mFrame;
+      stats.mFound++;
+      stats.mLatenessSum += frames[i].mLateness;
+      stats.mLatenessMin = std::min(stats.mLatenessMin, frames[i].mLateness);
+      stats.mLatenessMax = std::max(stats.mLatenessMax, frames[i].mLateness);
+
+      // Consecutive ticks are a tick apart, or a source frame apart for a
+      // source slower than the renderer; half a source frame more than that
+      // means a frame was lost
+      const int64_t period = frame.frame_rate_N > 0
+                                 ? 10000000LL * frame.frame_rate_D /
+                                       frame.frame_rate_N
+                                 : 0;
+      const int64_t tick =
+          10000000LL * mRendererFRateDen / mRendererFRateNum;
+      if (stats.mLastTimestamp) {
+        const int64_t gap = frame.timestamp - stats.mLastTimestamp;
+        if (gap == 0) {
+          stats.mRepeated++;
+        } else if (period && gap > std::max(period, tick) + period / 2) {
+          stats.mSkipped++;
+        }
+      }
+      stats.mLastTimestamp = frame.timestamp;
+    }
+  }
+
+  void OutputStats() override {
+    std::cout << "Null renderer | ticks " << mTicks << std::endl;
+    for (size_t i = 0; i < mStats.size(); i++) {
+      const SourceStats &stats = mStats[i];
+      std::cout << "Source " << mSources[i]->GetSourceName() << " | found "
+                << stats.mFound << " | missing " << stats.mMissing
+                << " | repeated " << stats.mRepeated << " | skipped "
+                << stats.mSkipped;
+      if (stats.mFound) {
+        std::cout << " | lateness avg "
+                  << stats.mLatenessSum / (double)stats.mFound / 10000.0
+                  << " ms | min " << stats.mLatenessMin / 10000.0
+                  << " ms | max " << stats.mLatenessMax / 10000.0 << " ms";
+      }
+      std::cout << std::endl;
+    }
+  }
+
+  uint64_t GetTicks() { return mTicks; }
+
+  const std::vector<SourceStats> &GetStats() { return mStats; }
+
+private:
+  std::atomic<uint64_t> mTicks;
+  std::vector<SourceStats> mStats;
+};
+
+#endif // RENDERER_NULL_HPP___
@@ -0,0 +1,239 @@
+#ifndef RENDERER_OPENCV_PIPELINE_HPP___
+#define RENDERER_OPENCV_PIPELINE_HPP___
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Processing.NDI.Lib.h"
+#include "convert.h"
+#include "opencv-filters.h"
+#include "renderer-base.h"
+#include "spsc-queue.h"
+
+// Runs a chain of OpenCV filters on the first source, one thread per filter
+//
+// Process copies the frame out of the source ring into a pooled buffer and
+// returns, the render tick never waits on a filter. Stages hand the buffers
+// to each other through bounded lock-free queues; a stage writes into its own
+// scratch matrix then swaps it with the job matrix, so frames move between
+// stages without copies. A last thread sends the result and returns the
+// buffer to the pool. When the pool is empty the frame is dropped.
+class RendererOpenCVPipeline : public RendererBase {
+public:
+  RendererOpenCVPipeline(int rendererFRateNum, int rendererFRateDen,
+                         std::string ndiSourceName,
+                         std::vector<OpenCVStage> stages, int poolSize = 0)
+      : RendererBase(rendererFRateNum, rendererFRateDen),
+        mNDISourceName(ndiSourceName),
+        mFreeJobs(std::max<size_t>(poolSize, stages.size() + 2)),
+        mPipelineRunning(true), mDrops(0), mRejected(0), mSent(0),
+        mTotalLatencyNs(0) {
+    NDIlib_send_create_t NDI_send_create_desc;
+    NDI_send_create_desc.p_ndi_name = mNDISourceName.c_str();
+    NDI_send_create_desc.p_groups = nullptr;
+    mNDISender = NDIlib_send_create(&NDI_send_create_desc);
+
+    // One job per stage in flight plus one being filled and one being sent
+    for (size_t i = 0; i < mFreeJobs.Capacity(); i++) {
+      mJobs.emplace_back(new Job());
+      mFreeJobs.Push(mJobs.back().get());
+    }
+
+    // Queue i feeds stage i, the last queue feeds the sender
+    for (size_t i = 0; i <= stages.size(); i++) {
+      mQueues.emplace_back(new SPSCQueue<Job *>(mFreeJobs.Capacity()));
+    }
+    for (size_t i = 0; i < stages.size(); i++) {
+      mStages.emplace_back(new Stage());
+      mStages[i]->mStage = stages[i];
+    }
+    for (size_t i = 0; i < stages.size(); i++) {
+      mStages[i]->mThread =
+          std::thread(&RendererOpenCVPipeline::RunStage, this, i);
+    }
+    mSinkThread = std::thread(&RendererOpenCVPipeline::RunSink, this);
+  }
+
+  virtual ~RendererOpenCVPipeline() {
+    mPipelineRunning = false;
+    for (auto &stage : mStages) {
+      stage->mThread.join();
+    }
+    mSinkThread.join();
+    if (mNDISender) {
+      NDIlib_send_destroy(mNDISender);
+    }
+  }
+
+  void Process(FrameSpan frames) override {
+    if (frames.empty() || !frames[0].mFound) {
+      return;
+    }
+    const NDIlib_video_frame_v2_t &frame = frames[0].mFrame;
+
+    cv::Mat view = NDIlib_video_frame_v2_t_to_CVMatView(frame);
+    if (view.empty() || view.type() != CV_8UC4) {
+      // Counted and reported once, the source rarely changes its format
+      if (mRejected++ == 0) {
+        std::cout << "OpenCV pipeline needs BGRA or BGRX frames" << std::endl;
+      }
+      return;
+    }
+
+    Job *job = nullptr;
+    if (!mFreeJobs.Pop(&job)) {
+      mDrops++;
+      return;
+    }
+
+    // The only copy, the ring frame is released at the end of the tick
+    view.copyTo(job->mMat);
+    job->mFrame = frame;
+    job->mFrame.frame_rate_N = mRendererFRateNum;
+    job->mFrame.frame_rate_D = mRendererFRateDen;
+    job->mStartNs = NowNs();
+    job->mEnqueueNs = job->mStartNs;
+    job->mSourceId = frames[0].mSourceId;
+    job->mFrameId = frames[0].mRingIndex;
+    mQueues[0]->Push(job);
+  }
+
+  void OutputStats() override {
+    for (auto &stage : mStages) {
+      const uint64_t frames = stage->mFrames;
+      if (!frames) {
+        continue;
+      }
+      std::cout << "Stage " << stage->mStage.mName << " | frames " << frames
+                << " | busy avg " << stage->mBusyNs / frames / 1000000.0
+                << " ms | busy max " << stage->mMaxBusyNs / 1000000.0
+                << " ms | queue wait avg "
+                << stage->mWaitNs / frames / 1000000.0 << " ms" << std::endl;
+    }
+    const uint64_t sent = mSent;
+    std::cout << "Pipeline | sent " << sent << " | dropped " << mDrops
+              << " | rejected format " << mRejected << " | added latency avg "
+              << (sent ? mTotalLatencyNs / sent / 1000000.0 : 0) << " ms"
+              << std::endl;
+  }
+
+private:
+  struct Job {
+    cv::Mat mMat;
+    NDIlib_video_frame_v2_t mFrame;
+    // Time the job entered the pipeline and its current queue
+    uint64_t mStartNs;
+    uint64_t mEnqueueNs;
+    // Identifies the frame in traces
+    int mSourceId;
+    int64_t mFrameId;
+  };
+
+  struct Stage {
+    OpenCVStage mStage;
+    std::thread mThread;
+    cv::Mat mScratch;
+
+    // Statistics, busy is the filter time, wait the time spent queued
+    std::atomic<uint64_t> mFrames{0};
+    std::atomic<uint64_t> mBusyNs{0};
+    std::atomic<uint64_t> mMaxBusyNs{0};
+    std::atomic<uint64_t> mWaitNs{0};
+  };
+
+  NDIlib_send_instance_t mNDISender;
+  std::string mNDISourceName;
+
+  std::vector<std::unique_ptr<Job>> mJobs;
+  SPSCQueue<Job *> mFreeJobs;
+  std::vector<std::unique_ptr<SPSCQueue<Job *>>> mQueues;
+  std::vector<std::unique_ptr<Stage>> mStages;
+  std::thread mSinkThread;
+  std::atomic<bool> mPipelineRunning;
+
+  std::atomic<uint64_t> mDrops;
+  // Frames of a format the filters do not take
+  std::atomic<uint64_t> mRejected;
+  std::atomic<uint64_t> mSent;
+  std::atomic<uint64_t> mTotalLatencyNs;
+
+  static uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Spins briefly then sleeps, returns false once the pipeline stops
+  bool PopWait(SPSCQueue<Job *> &queue, Job **job) {
+    int spins = 0;
+    while (!queue.Pop(job)) {
+      if (!mPipelineRunning) {
+        return false;
+      }
+      if (++spins < 64) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    }
+    return true;
+  }
+
+  void RunStage(int index) {
+    Stage &stage = *mStages[index];
+    TRACE_THREAD_NAME("stage " + stage.mStage.mName);
+    SPSCQueue<Job *> &input = *mQueues[index];
+    SPSCQueue<Job *> &output = *mQueues[index + 1];
+
+    Job *job = nullptr;
+    while (PopWait(input, &job)) {
+      const uint64_t start = NowNs();
+      stage.mWaitNs += start - job->mEnqueueNs;
+
+      {
+        TRACE_SPAN(stage.mStage.mName.c_str(), job->mSourceId, job->mFrameId);
+        stage.mStage.mFilter(job->mMat, stage.mScratch);
+      }
+      // The job takes the result, the stage reuses the input next time
+      std::swap(job->mMat, stage.mScratch);
+
+      const uint64_t end = NowNs();
+      const uint64_t busy = end - start;
+      stage.mFrames++;
+      stage.mBusyNs += busy;
+      if (busy > stage.mMaxBusyNs) {
+        stage.mMaxBusyNs = busy;
+      }
+
+      job->mEnqueueNs = end;
+      // The queues can hold the whole pool, this never fails
+      output.Push(job);
+    }
+  }
+
+  void RunSink() {
+    TRACE_THREAD_NAME("pipeline sink");
+    SPSCQueue<Job *> &input = *mQueues.back();
+    Job *job = nullptr;
+    while (PopWait(input, &job)) {
+      job->mFrame.p_data = job->mMat.data;
+      job->mFrame.line_stride_in_bytes = (int)job->mMat.step;
+      {
+        TRACE_SPAN("send", job->mSourceId, job->mFrameId);
+        NDIlib_send_send_video_v2(mNDISender, &job->mFrame);
+      }
+      Record(job->mFrame);
+
+      mTotalLatencyNs += NowNs() - job->mStartNs;
+      mSent++;
+      // The sink is the only producer of free jobs
+      mFreeJobs.Push(job);
+    }
+  }
+};
+
+#endif // RENDERER_OPENCV_PIPELINE_HPP___
@@ -1,8 +1,14 @@
 #ifndef RENDERED_PASSTHROUGH_NDI_HPP___
 #define RENDERED_PASSTHROUGH_NDI_HPP___
 
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
 #include "Processing.NDI.Lib.h"
+#include "overlay.h"
 #include "renderer-base.h"
+#include "repeat-frame.h"
 
 class RendererPassthroughNDI : public RendererBase {
 public:
@@ -21,6 +27,23 @@ public:
     //           << std::endl;
 
     mNDISender = NDIlib_send_create(&NDI_send_create_desc);
+
+    mSendDuration = MetricsRegistry::Get().AddHistogram(
+        "ve_render_send_seconds", "Time NDIlib_send_send_video_v2 took", "",
+        {100000, 250000, 500000, 1000000, 2000000, 5000000, 10000000,
+         20000000},
+        1e-9);
+    const std::string output =
+        MetricsRegistry::Label("output", mNDISourceName);
+    MetricsRegistry::Get().AddCallback(
+        "ve_render_repeat_frame_ratio",
+        "Share of the frames identical to the previous one of their source",
+        "gauge", output, [this] { return mRepeatDetector.GetHitRate(); });
+    MetricsRegistry::Get().AddCallback(
+        "ve_render_repeat_cpu_saved_seconds",
+        "Send time saved by skipping repeated frames, less the hashing",
+        "gauge", output,
+        [this] { return mRepeatDetector.GetCpuSavedNs() / 1e9; });
   }
   virtual ~RendererPassthroughNDI() {
     if (mNDISender) {
@@ -28,17 +51,140 @@ public:
     }
   }
 
-  void Process(std::vector<NDIlib_video_frame_v2_t> frames) override {
+  // What to do with frames identical to the previous one of the same source
+  void SetRepeatPolicy(RepeatFrameDetector::Policy policy, int keepaliveTicks,
+                       int hashRowStep = 1) {
+    mRepeatDetector.SetPolicy(policy, keepaliveTicks, hashRowStep);
+  }
+
+  RepeatFrameDetector &GetRepeatDetector() { return mRepeatDetector; }
+
+  // Burns the source name, NDI timecode and latency into the output, for
+  // monitoring. The text is drawn into the ring frame for the send and the
+  // rows under it are restored afterwards, so readers of the same frame
+  // meanwhile can see it. Frames shared with other processes are copied
+  // out of the ring instead, see Source::SharesFrames.
+  void SetBurnIn(bool burnIn) { mBurnIn = burnIn; }
 
-    for (auto frame : frames) {
+  void Process(FrameSpan frames) override {
+
+    for (size_t i = 0; i < frames.size(); i++) {
+      // Skip sources that had no frame this tick
+      if (!frames[i].mFound) {
+        continue;
+      }
+      NDIlib_video_frame_v2_t &frame = frames[i].mFrame;
+      // Nothing new to compress
+      if (!mRepeatDetector.ShouldSend(i, frame)) {
+        RecordRepeat();
+        continue;
+      }
       // Update the frame rate
       frame.frame_rate_N = mRendererFRateNum;
       frame.frame_rate_D = mRendererFRateDen;
-      NDIlib_send_send_video_v2(mNDISender, &frame);
+
+      const bool burnedIn = mBurnIn && BurnIn(i, frame);
+
+      const auto start = std::chrono::steady_clock::now();
+      {
+        TRACE_SPAN("send", frames[i].mSourceId, frames[i].mRingIndex);
+        NDIlib_send_send_video_v2(mNDISender, &frame);
+      }
+      const int64_t sendNs =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start)
+              .count();
+      mRepeatDetector.RecordSendTime(sendNs);
+      mSendDuration->Observe(sendNs);
+      Record(frame);
+      if (burnedIn) {
+        RestoreBurnIn(i, frame);
+      }
     }
   }
 
+  void OutputStats() override { mRepeatDetector.Output(); }
+
 private:
+  RepeatFrameDetector mRepeatDetector;
+  // In nanoseconds
+  MetricsRegistry::Histogram *mSendDuration;
+
+  // Overlay of every source when burning in, with the rows of the ring
+  // frame it covers, or a copy of a shared frame
+  struct BurnInState {
+    std::vector<uint8_t> mBuffer;
+    uint8_t *mRows = nullptr;
+    int mRowBegin = 0;
+    int mRowEnd = 0;
+    TextOverlay mOverlay;
+    int mNameText;
+    int mTimeText;
+  };
+  bool mBurnIn = false;
+  std::vector<std::unique_ptr<BurnInState>> mBurnInStates;
+
+  // Burns the text into the frame, returns true when the ring frame was
+  // written to and has to be restored after the send
+  bool BurnIn(size_t slot, NDIlib_video_frame_v2_t &frame) {
+    while (mBurnInStates.size() <= slot) {
+      std::unique_ptr<BurnInState> state(new BurnInState());
+      state->mNameText = state->mOverlay.AddText(16, 16, 40);
+      state->mTimeText = state->mOverlay.AddText(
+          16, 16 + state->mOverlay.GetCellHeight(), 40);
+      mBurnInStates.push_back(std::move(state));
+    }
+    BurnInState &state = *mBurnInStates[slot];
+    Source *source = mSources[slot];
+
+    const int stride = frame.line_stride_in_bytes;
+    const bool inPlace = !source->SharesFrames();
+    if (inPlace) {
+      // Only the rows under the text are kept aside
+      state.mOverlay.GetRows(frame.yres, &state.mRowBegin, &state.mRowEnd);
+      const size_t size = (size_t)stride * (state.mRowEnd - state.mRowBegin);
+      ResizeBuffer(state.mBuffer, size);
+      state.mRows = frame.p_data + (size_t)stride * state.mRowBegin;
+      memcpy(state.mBuffer.data(), state.mRows, size);
+    } else {
+      // UYVA carries its alpha plane after the UYVY plane
+      const size_t size =
+          (size_t)stride * frame.yres +
+          (frame.FourCC == NDIlib_FourCC_video_type_UYVA
+               ? (size_t)frame.xres * frame.yres
+               : 0);
+      ResizeBuffer(state.mBuffer, size);
+      memcpy(state.mBuffer.data(), frame.p_data, size);
+      frame.p_data = state.mBuffer.data();
+    }
+
+    // The NDI timecode and the timestamp are in 100ns intervals, the
+    // latency is measured on the clock of the source
+    const int64_t ms = frame.timecode / 10000;
+    const int fps = source->GetSourceFRateDen()
+                        ? source->GetSourceFRateNum() /
+                              source->GetSourceFRateDen()
+                        : 0;
+    const int64_t now = source->GetClock()->Now();
+    char text[64];
+    snprintf(text, sizeof(text), "TC %02d:%02d:%02d:%02d  LAT %.1f ms",
+             int(ms / 3600000 % 24), int(ms / 60000 % 60),
+             int(ms / 1000 % 60), int(ms % 1000 * fps / 1000),
+             (now - frame.timestamp) / 10000.0);
+
+    state.mOverlay.SetText(state.mNameText, source->GetSourceName());
+    state.mOverlay.SetText(state.mTimeText, text);
+    state.mOverlay.Apply(frame);
+    return inPlace;
+  }
+
+  // Puts back the rows BurnIn drew over
+  void RestoreBurnIn(size_t slot, const NDIlib_video_frame_v2_t &frame) {
+    BurnInState &state = *mBurnInStates[slot];
+    memcpy(state.mRows, state.mBuffer.data(),
+           (size_t)frame.line_stride_in_bytes *
+               (state.mRowEnd - state.mRowBegin));
+  }
   NDIlib_send_instance_t mNDISender;
   std::string mNDISourceName;
 };
@@ -0,0 +1,285 @@
+#ifndef RENDERER_SWITCHER_HPP___
+#define RENDERER_SWITCHER_HPP___
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "Processing.NDI.Lib.h"
+#include "parallel-for.h"
+#include "renderer-base.h"
+#include "spsc-queue.h"
+#include "transition.h"
+
+// Vision mixer: sends one of the sources, the program, and switches between
+// sources with a cut, a mix, a dip through a colour or a wipe
+//
+// Takes come from one control thread through a lock-free queue and are
+// applied at the start of the next tick, so a transition of N frames takes
+// exactly N ticks: the first shows a step of the new source, the last shows
+// it alone. A take during a transition completes the running one first.
+class RendererSwitcher : public RendererBase {
+public:
+  enum class Transition { Cut, Mix, Dip, Wipe };
+
+  struct Command {
+    Transition mTransition;
+    int mSource;
+    int mFrames;
+  };
+
+  RendererSwitcher(int rendererFRateNum, int rendererFRateDen,
+                   std::string ndiSourceName, int commandCapacity = 64)
+      : RendererBase(rendererFRateNum, rendererFRateDen),
+        mNDISourceName(ndiSourceName), mCommands(commandCapacity),
+        mProgram(0), mNext(-1), mStep(0), mMixRow(SelectMixRowFn()) {
+    NDIlib_send_create_t NDI_send_create_desc;
+    NDI_send_create_desc.p_ndi_name = mNDISourceName.c_str();
+    NDI_send_create_desc.p_groups = nullptr;
+    mNDISender = NDIlib_send_create(&NDI_send_create_desc);
+  }
+  virtual ~RendererSwitcher() {
+    if (mNDISender) {
+      NDIlib_send_destroy(mNDISender);
+    }
+  }
+
+  // Colour of the dip transitions, 8-bit RGB. Call before Start.
+  void SetDipColour(uint8_t r, uint8_t g, uint8_t b) {
+    mDipColour[0] = r;
+    mDipColour[1] = g;
+    mDipColour[2] = b;
+  }
+
+  // Makes the source at index source (in the order of AddSource) the
+  // program. Called from one control thread only; returns false when the
+  // queue is full.
+  bool Take(int source, Transition transition = Transition::Cut,
+            int frames = 0) {
+    if (!mCommands.Push(Command{transition, source, frames})) {
+      mQueueFull++;
+      return false;
+    }
+    return true;
+  }
+
+  int GetProgram() { return mProgram; }
+
+  void Process(FrameSpan frames) override {
+    Command command;
+    while (mCommands.Pop(&command)) {
+      Apply(command, frames.size());
+    }
+
+    if (mNext < 0) {
+      RenderFrame &program = frames[mProgram];
+      if (!program.mFound) {
+        mMissing++;
+        return;
+      }
+      Send(program.mFrame);
+      return;
+    }
+
+    mStep++;
+    mTransitionTicks++;
+    const int weight = mStep * 256 / mFrames;
+    const auto start = std::chrono::steady_clock::now();
+    const NDIlib_video_frame_v2_t *output;
+    {
+      TRACE_SPAN("transition", -1, mStep);
+      output = RenderTransition(frames[mProgram], frames[mNext], weight);
+    }
+    const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+    mRenderNs += ns;
+    if (ns > mMaxRenderNs) {
+      mMaxRenderNs = ns;
+    }
+    if (mStep >= mFrames) {
+      mProgram = mNext;
+      mNext = -1;
+    }
+    if (!output) {
+      mMissing++;
+      return;
+    }
+    Send(*output);
+  }
+
+  void OutputStats() override {
+    std::cout << "Switcher | program " << mProgram << " | cuts " << mCuts
+              << " | transitions " << mTransitions << " | rejected takes "
+              << mRejected << " | queue full " << mQueueFull
+              << " | no frame " << mMissing << std::endl;
+    std::cout << "Switcher | transition ticks " << mTransitionTicks
+              << " | avg "
+              << (mTransitionTicks ? mRenderNs / mTransitionTicks / 1000000.0
+                                   : 0)
+              << " ms | max " << mMaxRenderNs / 1000000.0 << " ms"
+              << std::endl;
+  }
+
+private:
+  NDIlib_send_instance_t mNDISender;
+  std::string mNDISourceName;
+
+  SPSCQueue<Command> mCommands;
+  // Only the render thread writes these
+  std::atomic<int> mProgram;
+  // Source the running transition goes to, -1 when there is none
+  int mNext;
+  Transition mTransition;
+  int mFrames;
+  int mStep;
+
+  const TransitionMixRowFn mMixRow;
+  uint8_t mDipColour[3] = {0, 0, 0};
+  // One row of the dip colour in the format of the last dip
+  std::vector<uint8_t> mColourRow;
+  NDIlib_FourCC_video_type_e mColourFourCC = NDIlib_FourCC_video_type_UYVY;
+  int mColourXres = 0;
+  // Output of the transitions, reused every tick
+  std::vector<uint8_t> mOutput;
+  NDIlib_video_frame_v2_t mOutputFrame;
+
+  uint64_t mCuts = 0;
+  uint64_t mTransitions = 0;
+  uint64_t mRejected = 0;
+  std::atomic<uint64_t> mQueueFull{0};
+  uint64_t mMissing = 0;
+  uint64_t mTransitionTicks = 0;
+  uint64_t mRenderNs = 0;
+  uint64_t mMaxRenderNs = 0;
+
+  void Apply(const Command &command, size_t sourceCount) {
+    if (command.mSource < 0 || command.mSource >= (int)sourceCount) {
+      mRejected++;
+      return;
+    }
+    if (mNext >= 0) {
+      mProgram = mNext;
+      mNext = -1;
+    }
+    if (command.mSource == mProgram) {
+      return;
+    }
+    if (command.mTransition == Transition::Cut || command.mFrames <= 1) {
+      mProgram = command.mSource;
+      mCuts++;
+      return;
+    }
+    mNext = command.mSource;
+    mTransition = command.mTransition;
+    mFrames = command.mFrames;
+    mStep = 0;
+    mTransitions++;
+  }
+
+  void Send(const NDIlib_video_frame_v2_t &frame) {
+    NDIlib_video_frame_v2_t output = frame;
+    output.frame_rate_N = mRendererFRateNum;
+    output.frame_rate_D = mRendererFRateDen;
+    TRACE_SPAN("send", -1, -1);
+    NDIlib_send_send_video_v2(mNDISender, &output);
+    Record(output);
+  }
+
+  // weight goes from 0 (all program) to 256 (all next). Returns the frame to
+  // send, null if there is none.
+  const NDIlib_video_frame_v2_t *RenderTransition(const RenderFrame &from,
+                                                  const RenderFrame &to,
+                                                  int weight) {
+    // A dip only shows one of the sources at a time
+    const bool needsFrom = mTransition != Transition::Dip || weight < 128;
+    const bool needsTo = mTransition != Transition::Dip || weight >= 128;
+    if ((needsFrom && !from.mFound) || (needsTo && !to.mFound)) {
+      // Show what is there rather than nothing
+      if (to.mFound && (weight >= 128 || !from.mFound)) {
+        return &to.mFrame;
+      }
+      return from.mFound ? &from.mFrame : nullptr;
+    }
+    const NDIlib_video_frame_v2_t &a = from.mFrame;
+    const NDIlib_video_frame_v2_t &b = to.mFrame;
+    const NDIlib_video_frame_v2_t &major = weight < 128 ? a : b;
+
+    const int bytesPerPixel = TransitionBytesPerPixel(major.FourCC);
+    // Sources of different formats or sizes cut half way through
+    if (!bytesPerPixel || (mTransition != Transition::Dip &&
+                           (a.FourCC != b.FourCC || a.xres != b.xres ||
+                            a.yres != b.yres))) {
+      return &major;
+    }
+
+    const int xres = major.xres;
+    const int yres = major.yres;
+    const int bytes = xres * bytesPerPixel;
+    ResizeBuffer(mOutput, (size_t)bytes * yres);
+    mOutputFrame = major;
+    mOutputFrame.p_data = mOutput.data();
+    mOutputFrame.line_stride_in_bytes = bytes;
+    uint8_t *out = mOutput.data();
+    const TransitionMixRowFn mixRow = mMixRow;
+
+    switch (mTransition) {
+      case Transition::Dip: {
+        if (mColourFourCC != major.FourCC || mColourXres != xres) {
+          TransitionColourRow(major.FourCC, xres, mDipColour[0],
+                              mDipColour[1], mDipColour[2], mColourRow);
+          mColourFourCC = major.FourCC;
+          mColourXres = xres;
+        }
+        const uint8_t *colour = mColourRow.data();
+        const bool toColour = weight < 128;
+        const int dipWeight = toColour ? weight * 2 : (weight - 128) * 2;
+        ParallelFor::Shared().Run(yres, 64, [&](int begin, int end) {
+          for (int y = begin; y < end; y++) {
+            const uint8_t *row =
+                major.p_data + (size_t)y * major.line_stride_in_bytes;
+            if (toColour) {
+              mixRow(row, colour, out + (size_t)y * bytes, bytes, dipWeight);
+            } else {
+              mixRow(colour, row, out + (size_t)y * bytes, bytes, dipWeight);
+            }
+          }
+        });
+        break;
+      }
+      case Transition::Wipe: {
+        // The next source comes in from the left, UYVY by whole macropixels
+        int edge = xres * weight / 256;
+        if (bytesPerPixel == 2) {
+          edge &= ~1;
+        }
+        const int edgeBytes = edge * bytesPerPixel;
+        ParallelFor::Shared().Run(yres, 64, [&](int begin, int end) {
+          for (int y = begin; y < end; y++) {
+            uint8_t *row = out + (size_t)y * bytes;
+            memcpy(row, b.p_data + (size_t)y * b.line_stride_in_bytes,
+                   edgeBytes);
+            memcpy(row + edgeBytes,
+                   a.p_data + (size_t)y * a.line_stride_in_bytes + edgeBytes,
+                   bytes - edgeBytes);
+          }
+        });
+        break;
+      }
+      default:
+        ParallelFor::Shared().Run(yres, 64, [&](int begin, int end) {
+          for (int y = begin; y < end; y++) {
+            mixRow(a.p_data + (size_t)y * a.line_stride_in_bytes,
+                   b.p_data + (size_t)y * b.line_stride_in_bytes,
+                   out + (size_t)y * bytes, bytes, weight);
+          }
+        });
+        break;
+    }
+    return &mOutputFrame;
+  }
+};
+
+#endif // RENDERER_SWITCHER_HPP___
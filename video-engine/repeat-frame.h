@@ -0,0 +1,143 @@
+#ifndef REPEAT_FRAME_HPP___
+#define REPEAT_FRAME_HPP___
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "Processing.NDI.Lib.h"
+#include "frame-hash.h"
+
+// Counters of a RepeatFrameDetector, readable from any thread
+struct RepeatFrameStats {
+  std::atomic<uint64_t> mFrames{0};
+  // Same ring slot as the previous tick, found without hashing
+  std::atomic<uint64_t> mSlotRepeats{0};
+  // New frame with the same content hash as the previous one
+  std::atomic<uint64_t> mContentRepeats{0};
+  std::atomic<uint64_t> mSkippedSends{0};
+  std::atomic<uint64_t> mHashNs{0};
+  std::atomic<uint64_t> mSendNs{0};
+  std::atomic<uint64_t> mSends{0};
+};
+
+// Detects frames an output already sent, per output slot (one slot per
+// source for a passthrough). A repeat is either the same ring slot handed
+// out again because no newer frame was in the lookup window, or a new frame
+// whose content hash matches the previous one (slides, clocks, graphics).
+//
+// With the Skip policy a repeat is not sent, so the NDI sender does not
+// compress it again. NDI receivers keep showing the last frame; a keepalive
+// still sends every keepaliveTicks-th consecutive repeat.
+class RepeatFrameDetector {
+ public:
+  enum class Policy { Resend, Skip };
+
+  RepeatFrameDetector()
+      : mPolicy(Policy::Resend), mKeepaliveTicks(0), mHashRowStep(1) {}
+
+  // keepaliveTicks of 0 never resends a repeated frame
+  // hashRowStep larger than 1 hashes only every hashRowStep-th row
+  void SetPolicy(Policy policy, int keepaliveTicks, int hashRowStep = 1) {
+    mPolicy = policy;
+    mKeepaliveTicks = keepaliveTicks;
+    mHashRowStep = hashRowStep < 1 ? 1 : hashRowStep;
+  }
+
+  // Returns true if the frame has to be sent
+  bool ShouldSend(size_t slot, const NDIlib_video_frame_v2_t& frame) {
+    if (slot >= mSlots.size()) {
+      mSlots.resize(slot + 1);
+    }
+    SlotState& state = mSlots[slot];
+    mStats.mFrames++;
+
+    bool repeat = false;
+    if (state.mValid && state.mData == frame.p_data &&
+        state.mTimestamp == frame.timestamp) {
+      mStats.mSlotRepeats++;
+      repeat = true;
+    } else {
+      const auto start = std::chrono::steady_clock::now();
+      const uint64_t hash = HashFrame(frame, mHashRowStep);
+      mStats.mHashNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+      if (state.mValid && state.mHash == hash) {
+        mStats.mContentRepeats++;
+        repeat = true;
+      }
+      state.mHash = hash;
+      state.mData = frame.p_data;
+      state.mTimestamp = frame.timestamp;
+      state.mValid = true;
+    }
+
+    if (!repeat) {
+      state.mRepeats = 0;
+      return true;
+    }
+    state.mRepeats++;
+    if (mPolicy == Policy::Resend ||
+        (mKeepaliveTicks > 0 && state.mRepeats % mKeepaliveTicks == 0)) {
+      return true;
+    }
+    mStats.mSkippedSends++;
+    return false;
+  }
+
+  // Time spent sending a frame, used to estimate the CPU saved by skips
+  void RecordSendTime(uint64_t ns) {
+    mStats.mSendNs += ns;
+    mStats.mSends++;
+  }
+
+  RepeatFrameStats& GetStats() { return mStats; }
+
+  double GetHitRate() {
+    const uint64_t frames = mStats.mFrames;
+    if (!frames) {
+      return 0;
+    }
+    return double(mStats.mSlotRepeats + mStats.mContentRepeats) / frames;
+  }
+
+  // Average send time of the skipped frames, minus the time spent hashing
+  int64_t GetCpuSavedNs() {
+    const uint64_t sends = mStats.mSends;
+    if (!sends) {
+      return 0;
+    }
+    return int64_t(mStats.mSkippedSends * (mStats.mSendNs / sends)) -
+           int64_t(mStats.mHashNs);
+  }
+
+  void Output() {
+    std::cout << "Repeat frames | frames " << mStats.mFrames << " | slot "
+              << mStats.mSlotRepeats << " | content "
+              << mStats.mContentRepeats << " | hit rate "
+              << 100.0 * GetHitRate() << " % | skipped sends "
+              << mStats.mSkippedSends << " | hashing "
+              << mStats.mHashNs / 1000000 << " ms | CPU saved "
+              << GetCpuSavedNs() / 1000000 << " ms" << std::endl;
+  }
+
+ private:
+  struct SlotState {
+    const uint8_t* mData = nullptr;
+    int64_t mTimestamp = 0;
+    uint64_t mHash = 0;
+    int mRepeats = 0;
+    bool mValid = false;
+  };
+
+  Policy mPolicy;
+  int mKeepaliveTicks;
+  int mHashRowStep;
+  std::vector<SlotState> mSlots;
+  RepeatFrameStats mStats;
+};
+
+#endif  // REPEAT_FRAME_HPP___
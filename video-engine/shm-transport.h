@@ -0,0 +1,795 @@
+#ifndef SHM_TRANSPORT_HPP___
+#define SHM_TRANSPORT_HPP___
+
+// Shared memory frame transport, so that capture and render can run in
+// separate processes and several renderer processes can share one receive
+//
+// A ShmPublisher copies the frames captured by a Source into a POSIX shared
+// memory ring, a ShmSource maps the ring and hands its frames to a renderer
+// without copying them. Like TimedCircularBuffer, frames are looked up by
+// timestamp and named by their non-modulo ring index.
+//
+// Layout, one header page followed by the slots
+//   ShmRingHeader | ShmSlotHeader + frame data | ShmSlotHeader + ... |
+//
+// Every slot is a seqlock, odd while the publisher writes it. A subscriber
+// takes a lease on a slot before reading it and the publisher never
+// overwrites a leased slot, it skips to the next one instead. Leases expire,
+// so a crashed subscriber cannot pin a slot forever. The lease count of a
+// slot shares one word with a lease generation, bumped whenever the
+// publisher resets the count, so a subscriber whose lease was taken away
+// neither releases a lease of another subscriber nor reads the slot again.
+//
+// The publisher bumps a futex word after every frame. A restarted publisher
+// reuses the ring, it bumps the generation and keeps the frame indices
+// counting. The ring never shrinks, so a subscriber mapping never points past
+// the end of the object; subscribers remap when the generation changes, and
+// forget the leases of the previous generation without touching its slots. A
+// publisher laying the slots out again first lets the old leases expire.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Processing.NDI.Lib.h"
+#include "source.h"
+#include "trace.h"
+
+static constexpr uint32_t kShmMagic = 0x434e5352;  // CNSR
+static constexpr uint32_t kShmVersion = 2;
+static constexpr uint64_t kShmHeaderBytes = 4096;
+// A subscriber holding a frame longer than this is considered gone
+static constexpr int64_t kShmLeaseTimeoutMs = 2000;
+
+struct ShmRingHeader {
+  uint32_t mMagic;
+  uint32_t mVersion;
+  // Odd while a publisher sets the ring up
+  std::atomic<uint32_t> mGeneration;
+  // Futex word, bumped after every frame
+  std::atomic<uint32_t> mFrameSeq;
+  std::atomic<uint32_t> mWaiters;
+  uint32_t mSlots;
+  uint64_t mSlotStride;
+  uint64_t mSlotBytes;
+  // Non-modulo index of the next frame
+  std::atomic<int64_t> mWriteIndex;
+  std::atomic<int32_t> mFrameRateN;
+  std::atomic<int32_t> mFrameRateD;
+  char mSourceName[256];
+};
+
+struct ShmSlotHeader {
+  std::atomic<uint32_t> mSeq;
+  // Lease generation in the high 32 bits, lease count in the low ones
+  std::atomic<uint64_t> mLeases;
+  std::atomic<int64_t> mLeaseExpiresMs;
+  // Non-modulo index of the frame in the slot, -1 when empty
+  std::atomic<int64_t> mIndex;
+  std::atomic<int64_t> mTimestamp;
+  // Stable while the slot is leased
+  int64_t mTimecode;
+  int32_t mXres;
+  int32_t mYres;
+  int32_t mFourCC;
+  int32_t mFrameRateN;
+  int32_t mFrameRateD;
+  int32_t mFormatType;
+  int32_t mLineStride;
+  float mAspectRatio;
+  uint64_t mDataBytes;
+};
+
+static_assert(sizeof(ShmRingHeader) <= kShmHeaderBytes,
+              "ShmRingHeader must fit in the header page");
+static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+                  std::atomic<int64_t>::is_always_lock_free &&
+                  std::atomic<uint64_t>::is_always_lock_free,
+              "Shared memory atomics must be lock free");
+
+// Offset of the frame data in a slot, keeps it 64 byte aligned
+static constexpr uint64_t kShmSlotDataOffset =
+    (sizeof(ShmSlotHeader) + 63) / 64 * 64;
+
+inline uint32_t ShmLeaseCount(uint64_t leases) { return (uint32_t)leases; }
+
+inline uint32_t ShmLeaseGeneration(uint64_t leases) {
+  return (uint32_t)(leases >> 32);
+}
+
+// Drops every lease of the slot, leases taken before are void
+inline void ShmResetLeases(ShmSlotHeader* slot) {
+  uint64_t leases = slot->mLeases.load();
+  while (!slot->mLeases.compare_exchange_weak(
+      leases, (uint64_t)(ShmLeaseGeneration(leases) + 1) << 32)) {
+  }
+}
+
+// Gives back a lease taken under generation, a no-op once it was reset
+inline void ShmReleaseLease(ShmSlotHeader* slot, uint32_t generation) {
+  uint64_t leases = slot->mLeases.load();
+  while (ShmLeaseGeneration(leases) == generation &&
+         ShmLeaseCount(leases) != 0 &&
+         !slot->mLeases.compare_exchange_weak(leases, leases - 1)) {
+  }
+}
+
+inline int64_t ShmNowMs() {
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// The futex words live in memory shared between processes, so the private
+// futex operations cannot be used
+inline void ShmFutexWait(std::atomic<uint32_t>* word, uint32_t expected,
+                         int timeoutMs) {
+  timespec timeout;
+  timeout.tv_sec = timeoutMs / 1000;
+  timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected,
+          &timeout, nullptr, 0);
+}
+
+inline void ShmFutexWake(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX,
+          nullptr, nullptr, 0);
+}
+
+// Bytes of picture data in a frame, including the planes after the first
+inline uint64_t ShmFrameBytes(const NDIlib_video_frame_v2_t& frame) {
+  const uint64_t plane = (uint64_t)frame.line_stride_in_bytes * frame.yres;
+  switch (frame.FourCC) {
+    case NDIlib_FourCC_video_type_UYVA:
+      return plane + (uint64_t)frame.xres * frame.yres;
+    case NDIlib_FourCC_video_type_NV12:
+    case NDIlib_FourCC_video_type_I420:
+    case NDIlib_FourCC_video_type_YV12:
+      return plane * 3 / 2;
+    case NDIlib_FourCC_video_type_P216:
+      return plane * 2;
+    case NDIlib_FourCC_video_type_PA16:
+      return plane * 3;
+    default:
+      return plane;
+  }
+}
+
+// A ring found by ShmListRings
+struct ShmRingInfo {
+  int mIndex;
+  std::string mShmName;
+  std::string mSourceName;
+};
+
+// The rings of a publisher, named prefix + index, with the NDI source each
+// one carries. Rings being set up are listed without their source name.
+inline std::vector<ShmRingInfo> ShmListRings(const std::string& prefix) {
+  std::vector<ShmRingInfo> rings;
+  // POSIX shared memory objects are the files of /dev/shm on Linux
+  const std::string stem = prefix[0] == '/' ? prefix.substr(1) : prefix;
+  DIR* dir = opendir("/dev/shm");
+  if (!dir) {
+    return rings;
+  }
+  while (dirent* entry = readdir(dir)) {
+    const std::string file = entry->d_name;
+    if (file.size() <= stem.size() || file.compare(0, stem.size(), stem) != 0 ||
+        file.find_first_not_of("0123456789", stem.size()) !=
+            std::string::npos) {
+      continue;
+    }
+    ShmRingInfo ring;
+    ring.mIndex = atoi(file.c_str() + stem.size());
+    ring.mShmName = "/" + file;
+
+    const int fd = shm_open(ring.mShmName.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      continue;
+    }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size >= kShmHeaderBytes) {
+      map = mmap(nullptr, kShmHeaderBytes, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+      continue;
+    }
+    const ShmRingHeader* header = (const ShmRingHeader*)map;
+    if (header->mMagic == kShmMagic && header->mVersion == kShmVersion) {
+      const uint32_t generation = header->mGeneration.load();
+      char name[sizeof(header->mSourceName)];
+      memcpy(name, header->mSourceName, sizeof(name));
+      name[sizeof(name) - 1] = 0;
+      if (!(generation & 1) && header->mGeneration.load() == generation) {
+        ring.mSourceName = name;
+      }
+      rings.push_back(ring);
+    }
+    munmap(map, kShmHeaderBytes);
+  }
+  closedir(dir);
+  std::sort(rings.begin(), rings.end(),
+            [](const ShmRingInfo& a, const ShmRingInfo& b) {
+              return a.mIndex < b.mIndex;
+            });
+  return rings;
+}
+
+// Writes the frames of one source into a shared memory ring
+class ShmPublisher {
+ public:
+  ShmPublisher(std::string shmName)
+      : mShmName(shmName),
+        mMap(nullptr),
+        mMapBytes(0),
+        mHeader(nullptr),
+        mPublished(0),
+        mSkipped(0),
+        mDropped(0),
+        mExpiredLeases(0),
+        mCopyNs(0) {}
+  ~ShmPublisher() { Close(); }
+
+  // slotBytes is the largest frame the ring can carry
+  bool Open(int slots, uint64_t slotBytes, std::string sourceName) {
+    Close();
+
+    const int fd = shm_open(mShmName.c_str(), O_CREAT | O_RDWR, 0660);
+    if (fd < 0) {
+      std::cerr << "Cannot open shared memory " << mShmName << std::endl;
+      return false;
+    }
+
+    const uint64_t stride =
+        (kShmSlotDataOffset + slotBytes + 4095) / 4096 * 4096;
+    const uint64_t needed = kShmHeaderBytes + slots * stride;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return false;
+    }
+    // Never shrink, subscribers may map the previous size
+    mMapBytes = std::max<uint64_t>(st.st_size, needed);
+    if ((uint64_t)st.st_size < needed && ftruncate(fd, needed) != 0) {
+      std::cerr << "Cannot size shared memory " << mShmName << std::endl;
+      close(fd);
+      return false;
+    }
+
+    void* map =
+        mmap(nullptr, mMapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      std::cerr << "Cannot map shared memory " << mShmName << std::endl;
+      return false;
+    }
+    mMap = (uint8_t*)map;
+    mHeader = (ShmRingHeader*)mMap;
+
+    const bool fresh =
+        mHeader->mMagic != kShmMagic || mHeader->mVersion != kShmVersion;
+    if (fresh) {
+      mHeader->mMagic = 0;
+      mHeader->mGeneration = 0;
+      mHeader->mFrameSeq = 0;
+      mHeader->mWaiters = 0;
+      mHeader->mWriteIndex = 0;
+    }
+
+    // Subscribers ignore the ring while the generation is odd
+    const uint32_t generation = mHeader->mGeneration.load() | 1;
+    mHeader->mGeneration = generation;
+
+    const bool relayout = fresh || mHeader->mSlots != (uint32_t)slots ||
+                          mHeader->mSlotStride != stride;
+    if (relayout && !fresh) {
+      WaitForLeases();
+    }
+    mHeader->mVersion = kShmVersion;
+    mHeader->mSlots = slots;
+    mHeader->mSlotStride = stride;
+    mHeader->mSlotBytes = slotBytes;
+    mHeader->mFrameRateN = 0;
+    mHeader->mFrameRateD = 0;
+    strncpy(mHeader->mSourceName, sourceName.c_str(),
+            sizeof(mHeader->mSourceName) - 1);
+    mHeader->mSourceName[sizeof(mHeader->mSourceName) - 1] = 0;
+
+    for (int i = 0; i < slots; i++) {
+      ShmSlotHeader* slot = GetSlot(i);
+      if (relayout) {
+        slot->mSeq = 0;
+        // Subscribers of the old layout forget their leases on the new
+        // generation, a count left from them would pin the slot
+        slot->mLeases = 0;
+        slot->mLeaseExpiresMs = 0;
+        slot->mIndex = -1;
+        slot->mTimestamp = 0;
+      } else if (slot->mSeq & 1) {
+        // The previous publisher died writing this slot
+        slot->mIndex = -1;
+        slot->mSeq++;
+      }
+    }
+
+    mHeader->mMagic = kShmMagic;
+    mHeader->mGeneration = generation + 1;
+    ShmFutexWake(&mHeader->mFrameSeq);
+    return true;
+  }
+
+  // Leaves the ring in place, subscribers keep their last frames and a new
+  // publisher can take over
+  void Close() {
+    if (mMap) {
+      munmap(mMap, mMapBytes);
+    }
+    mMap = nullptr;
+    mHeader = nullptr;
+    mMapBytes = 0;
+  }
+
+  // Removes the ring, mappings of subscribers stay valid until they unmap
+  void Unlink() { shm_unlink(mShmName.c_str()); }
+
+  // Called from the capture thread for every captured frame
+  bool Publish(const NDIlib_video_frame_v2_t& frame) {
+    if (!mHeader || !frame.p_data) {
+      return false;
+    }
+    const uint64_t bytes = ShmFrameBytes(frame);
+    if (bytes > mHeader->mSlotBytes) {
+      mDropped++;
+      return false;
+    }
+    TRACE_SPAN("shm publish", -1, mHeader->mWriteIndex.load());
+
+    const int slots = mHeader->mSlots;
+    int64_t index = mHeader->mWriteIndex.load();
+    const int64_t now = ShmNowMs();
+    for (int k = 0; k < slots; k++, index++) {
+      ShmSlotHeader* slot = GetSlot(index % slots);
+
+      // Marking the slot first means a subscriber taking a lease from now on
+      // sees an odd sequence and backs off
+      slot->mSeq.fetch_add(1);
+      if (ShmLeaseCount(slot->mLeases.load()) != 0) {
+        if (now < slot->mLeaseExpiresMs.load()) {
+          slot->mSeq.fetch_add(1);
+          mSkipped++;
+          continue;
+        }
+        ShmResetLeases(slot);
+        mExpiredLeases++;
+      }
+
+      const uint64_t start = NowNs();
+      slot->mTimestamp = frame.timestamp;
+      slot->mTimecode = frame.timecode;
+      slot->mXres = frame.xres;
+      slot->mYres = frame.yres;
+      slot->mFourCC = frame.FourCC;
+      slot->mFrameRateN = frame.frame_rate_N;
+      slot->mFrameRateD = frame.frame_rate_D;
+      slot->mFormatType = frame.frame_format_type;
+      slot->mLineStride = frame.line_stride_in_bytes;
+      slot->mAspectRatio = frame.picture_aspect_ratio;
+      slot->mDataBytes = bytes;
+      memcpy((uint8_t*)slot + kShmSlotDataOffset, frame.p_data, bytes);
+      slot->mIndex = index;
+      slot->mSeq.fetch_add(1, std::memory_order_release);
+      mCopyNs += NowNs() - start;
+
+      mHeader->mFrameRateN = frame.frame_rate_N;
+      mHeader->mFrameRateD = frame.frame_rate_D;
+      mHeader->mWriteIndex.store(index + 1, std::memory_order_release);
+      mHeader->mFrameSeq.fetch_add(1);
+      if (mHeader->mWaiters.load() != 0) {
+        ShmFutexWake(&mHeader->mFrameSeq);
+      }
+      mPublished++;
+      return true;
+    }
+
+    // Every slot is leased
+    mDropped++;
+    return false;
+  }
+
+  void Output() {
+    const uint64_t published = mPublished;
+    std::cout << "Publisher " << mShmName << " | published " << published
+              << " | skipped leased slots " << mSkipped << " | dropped "
+              << mDropped << " | expired leases " << mExpiredLeases
+              << " | copy avg "
+              << (published ? mCopyNs / published / 1000000.0 : 0) << " ms"
+              << std::endl;
+  }
+
+ private:
+  std::string mShmName;
+  uint8_t* mMap;
+  uint64_t mMapBytes;
+  ShmRingHeader* mHeader;
+
+  std::atomic<uint64_t> mPublished;
+  std::atomic<uint64_t> mSkipped;
+  std::atomic<uint64_t> mDropped;
+  std::atomic<uint64_t> mExpiredLeases;
+  std::atomic<uint64_t> mCopyNs;
+
+  ShmSlotHeader* GetSlot(int i) {
+    return (ShmSlotHeader*)(mMap + kShmHeaderBytes + i * mHeader->mSlotStride);
+  }
+
+  // Before the slots are laid out again, waits for the subscribers to give
+  // back the frames of the previous layout or for their leases to expire.
+  // They take no new lease while the generation is odd.
+  void WaitForLeases() {
+    const uint64_t slots = mHeader->mSlots;
+    if (kShmHeaderBytes + slots * mHeader->mSlotStride > mMapBytes) {
+      return;
+    }
+    while (true) {
+      const int64_t now = ShmNowMs();
+      bool leased = false;
+      for (uint64_t i = 0; i < slots; i++) {
+        ShmSlotHeader* slot = GetSlot(i);
+        leased = leased || (ShmLeaseCount(slot->mLeases.load()) != 0 &&
+                            now < slot->mLeaseExpiresMs.load());
+      }
+      if (!leased) {
+        return;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+  static uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+};
+
+// A source reading the ring of a publisher in another process
+// The frames handed to the renderer point into the shared memory, they stay
+// valid until released
+class ShmSource : public Source {
+ public:
+  ShmSource(std::string shmName)
+      : mShmName(shmName),
+        mMap(nullptr),
+        mMapBytes(0),
+        mHeader(nullptr),
+        mGeneration(0),
+        mSlots(0),
+        mSlotStride(0),
+        mReadCursor(0),
+        mLastWriteIndex(-1),
+        mLastFrameMs(0),
+        mPyramidIndex(-1),
+        mLeaseFailures(0),
+        mRemaps(0) {
+    mSourceName = shmName;
+  }
+  virtual ~ShmSource() {
+    Stop();
+    Unmap();
+  }
+
+  void Start(int /*runForIterations*/ = 10) override {
+    mIsRunning = true;
+    mState = State::Warming;
+    mThread = std::thread(&ShmSource::Run, this);
+  }
+
+  NDIlib_video_frame_v2_t GetVideoFrameAtTime(uint64_t timestamp,
+                                              uint64_t threshold, int* index,
+                                              int* writeIndex) override {
+    RequestVideo();
+    TRACE_SPAN_NAMED(span, "shm get");
+
+    NDIlib_video_frame_v2_t frame;
+    frame.p_data = nullptr;
+    int found = -1;
+    int64_t write = 0;
+
+    std::lock_guard<std::mutex> lock(mMapMutex);
+    if (mHeader && mHeader->mGeneration.load() == mGeneration) {
+      write = mHeader->mWriteIndex.load(std::memory_order_acquire);
+      int64_t i = std::max<int64_t>(mReadCursor, write - mSlots);
+      for (; i < write; i++) {
+        ShmSlotHeader* slot = GetSlot(i % mSlots);
+        if (slot->mIndex.load() != i) {
+          continue;
+        }
+        const int64_t diff =
+            std::abs(slot->mTimestamp.load() - (int64_t)timestamp);
+        if (diff > (int64_t)threshold) {
+          continue;
+        }
+        if (!TakeLease(slot, i)) {
+          mLeaseFailures++;
+          continue;
+        }
+        mReadCursor = i;
+        found = (int)i;
+        FillFrame(slot, &frame);
+        break;
+      }
+    }
+    TRACE_SET_FRAME(span, mId, found);
+
+    if (index) {
+      *index = found;
+    }
+    if (writeIndex) {
+      *writeIndex = (int)write;
+    }
+    return frame;
+  }
+
+  // The slots carry the timecode but are leased one at a time, a ring is
+  // looked up on its own
+  bool CanSync() override { return false; }
+
+  // The frames are the slots of the publisher
+  bool SharesFrames() override { return true; }
+
+  void ReleaseVideoFrame(int index) override {
+    if (index < 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mMapMutex);
+    auto it = FindLease(index);
+    if (it == mLeased.end()) {
+      return;
+    }
+    const uint32_t generation = it->mGeneration;
+    mLeased.erase(it);
+    // A restarted publisher may have laid the slots out again
+    if (mHeader->mGeneration.load() == mGeneration) {
+      ShmReleaseLease(GetSlot(index % mSlots), generation);
+    }
+  }
+
+  NDIlib_video_frame_v2_t GetLatestVideoFrame(int* index) override {
+    NDIlib_video_frame_v2_t frame;
+    frame.p_data = nullptr;
+    *index = -1;
+    std::lock_guard<std::mutex> lock(mMapMutex);
+    if (!mHeader || mHeader->mGeneration.load() != mGeneration) {
+      return frame;
+    }
+    const int64_t write = mHeader->mWriteIndex.load(std::memory_order_acquire);
+    for (int64_t i = write - 1; i >= 0 && i >= write - mSlots; i--) {
+      ShmSlotHeader* slot = GetSlot(i % mSlots);
+      if (slot->mIndex.load() == i && TakeLease(slot, i)) {
+        FillFrame(slot, &frame);
+        *index = (int)i;
+        break;
+      }
+    }
+    return frame;
+  }
+
+  // The ring has no room for attachments, the pyramid of the last frame
+  // asked for is kept in this process
+  std::shared_ptr<FramePyramid> GetPyramid(int index) override {
+    std::lock_guard<std::mutex> lock(mMapMutex);
+    if (index < 0) {
+      return nullptr;
+    }
+    auto it = FindLease(index);
+    if (it == mLeased.end()) {
+      return nullptr;
+    }
+    if (index != mPyramidIndex) {
+      // The slot is only read while the lease still holds
+      ShmSlotHeader* slot = GetSlot(index % mSlots);
+      if (mHeader->mGeneration.load() != mGeneration ||
+          ShmLeaseGeneration(slot->mLeases.load()) != it->mGeneration ||
+          slot->mIndex.load() != index) {
+        return nullptr;
+      }
+      NDIlib_video_frame_v2_t frame;
+      FillFrame(slot, &frame);
+      mPyramid = FramePyramid::Build(frame);
+      mPyramidIndex = index;
+    }
+    return mPyramid;
+  }
+
+  void OutputCaptureStats() override {
+    std::cout << "Subscriber " << mShmName << " | frames " << mFramesCaptured
+              << " | lease failures " << mLeaseFailures << " | remaps "
+              << mRemaps << std::endl;
+  }
+
+ private:
+  std::string mShmName;
+  // Guards the mapping, taken by the renderer and the subscriber thread
+  std::mutex mMapMutex;
+  uint8_t* mMap;
+  uint64_t mMapBytes;
+  ShmRingHeader* mHeader;
+  // Layout as mapped, the header may change under a new generation
+  uint32_t mGeneration;
+  int mSlots;
+  uint64_t mSlotStride;
+
+  int64_t mReadCursor;
+  int64_t mLastWriteIndex;
+  int64_t mLastFrameMs;
+  // A lease of the renderer, void once the slot's lease generation moves on
+  struct Lease {
+    int mIndex;
+    uint32_t mGeneration;
+  };
+  std::vector<Lease> mLeased;
+  int mPyramidIndex;
+  std::shared_ptr<FramePyramid> mPyramid;
+
+  std::atomic<uint64_t> mLeaseFailures;
+  std::atomic<uint64_t> mRemaps;
+
+  // Publisher silent for this long, the source is not ready
+  static constexpr int64_t kStaleMs = 1000;
+
+  ShmSlotHeader* GetSlot(int i) {
+    return (ShmSlotHeader*)(mMap + kShmHeaderBytes + i * mSlotStride);
+  }
+
+  std::vector<Lease>::iterator FindLease(int index) {
+    return std::find_if(mLeased.begin(), mLeased.end(),
+                        [index](const Lease& l) { return l.mIndex == index; });
+  }
+
+  bool TakeLease(ShmSlotHeader* slot, int64_t index) {
+    const uint32_t generation =
+        ShmLeaseGeneration(slot->mLeases.fetch_add(1));
+    const uint32_t seq = slot->mSeq.load(std::memory_order_acquire);
+    if ((seq & 1) || slot->mIndex.load() != index) {
+      ShmReleaseLease(slot, generation);
+      return false;
+    }
+    slot->mLeaseExpiresMs = ShmNowMs() + kShmLeaseTimeoutMs;
+    mLeased.push_back(Lease{(int)index, generation});
+    return true;
+  }
+
+  void FillFrame(ShmSlotHeader* slot, NDIlib_video_frame_v2_t* frame) {
+    frame->xres = slot->mXres;
+    frame->yres = slot->mYres;
+    frame->FourCC = (NDIlib_FourCC_video_type_e)slot->mFourCC;
+    frame->frame_rate_N = slot->mFrameRateN;
+    frame->frame_rate_D = slot->mFrameRateD;
+    frame->picture_aspect_ratio = slot->mAspectRatio;
+    frame->frame_format_type = (NDIlib_frame_format_type_e)slot->mFormatType;
+    frame->timecode = slot->mTimecode;
+    frame->p_data = (uint8_t*)slot + kShmSlotDataOffset;
+    frame->line_stride_in_bytes = slot->mLineStride;
+    frame->p_metadata = nullptr;
+    frame->timestamp = slot->mTimestamp;
+  }
+
+  // Maps the ring if the publisher created it, returns false otherwise
+  bool Map() {
+    const int fd = shm_open(mShmName.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < kShmHeaderBytes) {
+      close(fd);
+      return false;
+    }
+    void* map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+    mMap = (uint8_t*)map;
+    mMapBytes = st.st_size;
+    mHeader = (ShmRingHeader*)mMap;
+
+    const uint32_t generation = mHeader->mGeneration.load();
+    mSlots = mHeader->mSlots;
+    mSlotStride = mHeader->mSlotStride;
+    if (mHeader->mMagic != kShmMagic || mHeader->mVersion != kShmVersion ||
+        (generation & 1) || mHeader->mGeneration.load() != generation ||
+        mSlots <= 0 || kShmHeaderBytes + mSlots * mSlotStride > mMapBytes) {
+      Unmap();
+      return false;
+    }
+    mGeneration = generation;
+    mReadCursor = 0;
+    mLastWriteIndex = mHeader->mWriteIndex.load();
+    std::cout << "Subscribed to " << mShmName << " (" << mHeader->mSourceName
+              << ")" << std::endl;
+    return true;
+  }
+
+  void Unmap() {
+    if (mMap) {
+      munmap(mMap, mMapBytes);
+    }
+    mMap = nullptr;
+    mHeader = nullptr;
+    mMapBytes = 0;
+  }
+
+  void Run() {
+    TRACE_THREAD_NAME("subscriber " + mShmName);
+
+    while (isRunning()) {
+      ShmRingHeader* header = nullptr;
+      {
+        std::lock_guard<std::mutex> lock(mMapMutex);
+        // A restarted publisher, remap once the renderer holds no frame
+        if (mHeader && mHeader->mGeneration.load() != mGeneration &&
+            mLeased.empty()) {
+          mPyramidIndex = -1;
+          Unmap();
+          mRemaps++;
+        }
+        if (!mHeader) {
+          Map();
+        }
+        header = mHeader;
+      }
+      if (!header) {
+        mState = State::Warming;
+        WaitForDemand(100);
+        continue;
+      }
+
+      // Sleep until the publisher writes a frame
+      const uint32_t seq = header->mFrameSeq.load();
+      const int64_t write = header->mWriteIndex.load();
+      if (write == mLastWriteIndex) {
+        header->mWaiters.fetch_add(1);
+        ShmFutexWait(&header->mFrameSeq, seq, 100);
+        header->mWaiters.fetch_sub(1);
+      }
+
+      const int64_t now = ShmNowMs();
+      const int64_t latest = header->mWriteIndex.load();
+      if (latest != mLastWriteIndex) {
+        if (latest > mLastWriteIndex && mLastWriteIndex >= 0) {
+          mFramesCaptured += latest - mLastWriteIndex;
+        }
+        mLastWriteIndex = latest;
+        mLastFrameMs = now;
+        mSourceFRateNum = header->mFrameRateN;
+        mSourceFRateDen = header->mFrameRateD;
+        mState = State::Active;
+      } else if (now - mLastFrameMs > kStaleMs) {
+        mState = State::Warming;
+      }
+    }
+  }
+};
+
+#endif  // SHM_TRANSPORT_HPP___
@@ -0,0 +1,446 @@
+#ifndef SIGNAL_MONITOR_HPP___
+#define SIGNAL_MONITOR_HPP___
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Processing.NDI.Lib.h"
+#include "clock.h"
+#include "metrics.h"
+#include "simd.h"
+#include "source.h"
+#include "trace.h"
+
+// Luma of a sampled run of 32 bytes: 16 pixels of UYVY or 8 pixels of the
+// 32-bit RGB formats. RGB luma is approximated as (R + 2G + B) / 4, which is
+// order independent, so BGRA and RGBA take the same kernel.
+inline int SignalLumaUYVYSSE2(const uint8_t* p, uint8_t* out) {
+  const __m128i v0 = _mm_loadu_si128((const __m128i*)p);
+  const __m128i v1 = _mm_loadu_si128((const __m128i*)(p + 16));
+  _mm_storeu_si128((__m128i*)out, _mm_packus_epi16(_mm_srli_epi16(v0, 8),
+                                                   _mm_srli_epi16(v1, 8)));
+  return 16;
+}
+
+inline int SignalLumaRGBASSE2(const uint8_t* p, uint8_t* out) {
+  const __m128i y0 = SimdLumaRGBA(_mm_loadu_si128((const __m128i*)p));
+  const __m128i y1 = SimdLumaRGBA(_mm_loadu_si128((const __m128i*)(p + 16)));
+  _mm_storel_epi64((__m128i*)out,
+                   _mm_packus_epi16(_mm_packs_epi32(y0, y1),
+                                    _mm_setzero_si128()));
+  return 8;
+}
+
+// Sum, sum of squares and sum of absolute differences to prev of count luma
+// samples, prev may be null
+inline void SignalLumaStatsSSE2(const uint8_t* luma, const uint8_t* prev,
+                                size_t count, uint64_t* sum, uint64_t* sumSq,
+                                uint64_t* sad) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sum64 = zero;
+  __m128i sad64 = zero;
+  uint64_t squares = 0;
+  size_t i = 0;
+  while (i + 16 <= count) {
+    // 32-bit lanes of squares hold 4096 iterations of 2 * 2 * 255^2
+    __m128i sq32 = zero;
+    const size_t end = std::min(count - 15, i + 4096 * 16);
+    for (; i < end; i += 16) {
+      const __m128i v = _mm_loadu_si128((const __m128i*)(luma + i));
+      sum64 = _mm_add_epi64(sum64, _mm_sad_epu8(v, zero));
+      const __m128i lo = _mm_unpacklo_epi8(v, zero);
+      const __m128i hi = _mm_unpackhi_epi8(v, zero);
+      sq32 = _mm_add_epi32(sq32, _mm_add_epi32(_mm_madd_epi16(lo, lo),
+                                               _mm_madd_epi16(hi, hi)));
+      if (prev) {
+        sad64 = _mm_add_epi64(
+            sad64,
+            _mm_sad_epu8(v, _mm_loadu_si128((const __m128i*)(prev + i))));
+      }
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, sq32);
+    squares += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+  uint64_t halves[2];
+  _mm_storeu_si128((__m128i*)halves, sum64);
+  *sum = halves[0] + halves[1];
+  _mm_storeu_si128((__m128i*)halves, sad64);
+  *sad = halves[0] + halves[1];
+  for (; i < count; i++) {
+    *sum += luma[i];
+    squares += luma[i] * luma[i];
+    if (prev) {
+      *sad += abs(luma[i] - prev[i]);
+    }
+  }
+  *sumSq = squares;
+}
+
+// Alarms when a source goes black, freezes or goes silent
+//
+// Analysing every frame of every source would cost more than the rest of
+// the engine, so a single low priority thread visits each source a few
+// times per second. It locks the newest frame of the ring, copies the luma
+// of a sparse grid out of it (every rowStep-th row, one run of 32 bytes in
+// every columnStep) and releases the frame; the statistics are computed on
+// the copy. A condition has to hold for its duration to raise an alarm and
+// be gone for clearMs to clear it, both are reported as events.
+//
+// Black    mean luma and its standard deviation below thresholds, so a dark
+//          scene with detail is not black
+// Freeze   mean absolute luma difference to the previous analysis below a
+//          threshold, or no new frame at all
+// Silence  RMS of the audio below a threshold, or audio that stopped. A
+//          source that never had audio is never silent.
+class SignalMonitor {
+ public:
+  enum Kind { Black, Freeze, Silence, kKinds };
+
+  struct Thresholds {
+    // Full range 8-bit luma, video range sources are converted
+    double mBlackMaxMean = 20;
+    double mBlackMaxStdDev = 8;
+    double mFreezeMaxDiff = 0.3;
+    double mSilenceMaxDbfs = -60;
+    int64_t mBlackMs = 2000;
+    int64_t mFreezeMs = 5000;
+    int64_t mSilenceMs = 5000;
+    int64_t mClearMs = 1000;
+  };
+
+  struct Event {
+    Source* mSource;
+    Kind mKind;
+    // True when the alarm is raised, false when it clears
+    bool mActive;
+    // Milliseconds of the monitor clock
+    int64_t mTimeMs;
+  };
+
+  SignalMonitor(double rateFps = 5.0, int rowStep = 8, int columnStep = 2)
+      : mPeriodMs((int64_t)(1000.0 / rateFps)),
+        mRowStep(rowStep < 1 ? 1 : rowStep),
+        mColumnStep(columnStep < 1 ? 1 : columnStep),
+        mClock(SystemClock::Get()),
+        mIsRunning(false),
+        mStartMs(0) {
+    mCallback = [](const Event& event) {
+      std::cout << "Signal " << event.mSource->GetSourceName() << " | "
+                << KindName(event.mKind) << (event.mActive ? " on" : " off")
+                << std::endl;
+    };
+  }
+  ~SignalMonitor() { Stop(); }
+
+  void SetThresholds(const Thresholds& thresholds) {
+    mThresholds = thresholds;
+  }
+
+  // Time source of the alarm durations, set before Start. The thread only
+  // reads it: it does not take part in a VirtualClock run.
+  void SetClock(Clock* clock) { mClock = clock; }
+
+  // Called from the monitor thread, set before Start
+  void SetEventCallback(std::function<void(const Event&)> callback) {
+    mCallback = callback;
+  }
+
+  // Sources are added before Start
+  void AddSource(Source* source) {
+    std::unique_ptr<Entry> entry(new Entry());
+    entry->mSource = source;
+    mEntries.push_back(std::move(entry));
+  }
+
+  void Start() {
+    mIsRunning = true;
+    mStartMs = NowMs();
+    mThread = std::thread(&SignalMonitor::Run, this);
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mIsRunning = false;
+    }
+    mCond.notify_all();
+    if (mThread.joinable()) {
+      mThread.join();
+    }
+  }
+
+  bool IsAlarmed(Source* source, Kind kind) {
+    for (auto& entry : mEntries) {
+      if (entry->mSource == source) {
+        return entry->mAlarms[kind].mActive;
+      }
+    }
+    return false;
+  }
+
+  static const char* KindName(Kind kind) {
+    switch (kind) {
+      case Black:
+        return "black";
+      case Freeze:
+        return "freeze";
+      default:
+        return "silence";
+    }
+  }
+
+  // Alarm states for the scrape. The monitor must outlive the metrics
+  // server.
+  void ExportMetrics(MetricsRegistry& metrics) {
+    for (auto& entry : mEntries) {
+      const std::string source =
+          MetricsRegistry::Label("source", entry->mSource->GetSourceName());
+      for (int kind = 0; kind < kKinds; kind++) {
+        Alarm* alarm = &entry->mAlarms[kind];
+        metrics.AddCallback(
+            "ve_signal_alarm", "1 while a signal alarm is raised", "gauge",
+            source + "," + MetricsRegistry::Label("kind", KindName((Kind)kind)),
+            [alarm] { return alarm->mActive ? 1.0 : 0.0; });
+      }
+      Entry* e = entry.get();
+      metrics.AddCallback("ve_signal_cpu_seconds_total",
+                          "CPU time of the signal analysis", "counter",
+                          source, [e] { return e->mCpuNs / 1e9; });
+    }
+  }
+
+  void Output() {
+    const double wallMs = (double)std::max<int64_t>(1, NowMs() - mStartMs);
+    for (auto& entry : mEntries) {
+      const uint64_t analyses = entry->mAnalyses;
+      std::cout << "Signal " << entry->mSource->GetSourceName()
+                << " | analyses " << analyses << " | no frame "
+                << entry->mNoFrame << " | luma " << entry->mMean << " ("
+                << entry->mStdDev << ") | diff " << entry->mDiff
+                << " | events black " << entry->mAlarms[Black].mEvents
+                << " freeze " << entry->mAlarms[Freeze].mEvents << " silence "
+                << entry->mAlarms[Silence].mEvents << " | cpu avg "
+                << (analyses ? entry->mCpuNs / analyses / 1000.0 : 0)
+                << " us | " << entry->mCpuNs / 1e6 / wallMs * 100
+                << " % of a core" << std::endl;
+    }
+  }
+
+ private:
+  struct Alarm {
+    std::atomic<bool> mActive{false};
+    // Since when the condition holds, or has been gone, -1 if it does not
+    int64_t mSinceMs = -1;
+    uint64_t mEvents = 0;
+  };
+
+  struct Entry {
+    Source* mSource;
+    Alarm mAlarms[kKinds];
+    // Luma grid of this analysis and of the previous one
+    std::vector<uint8_t> mLuma;
+    std::vector<uint8_t> mPrevLuma;
+    int64_t mLastTimestamp = 0;
+    uint64_t mLastAudioFrames = 0;
+    // Last values, for the reports
+    double mMean = 0;
+    double mStdDev = 0;
+    double mDiff = 0;
+    std::atomic<uint64_t> mAnalyses{0};
+    std::atomic<uint64_t> mNoFrame{0};
+    std::atomic<uint64_t> mCpuNs{0};
+  };
+
+  int64_t mPeriodMs;
+  int mRowStep;
+  int mColumnStep;
+  Thresholds mThresholds;
+  std::function<void(const Event&)> mCallback;
+  Clock* mClock;
+
+  std::vector<std::unique_ptr<Entry>> mEntries;
+  std::thread mThread;
+  std::mutex mMutex;
+  std::condition_variable mCond;
+  bool mIsRunning;
+  int64_t mStartMs;
+
+  int64_t NowMs() { return mClock->NowMs(); }
+
+  static uint64_t ThreadCpuNs() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  // Copies the luma grid of the frame into luma, false for the formats
+  // without a kernel
+  bool SampleLuma(const NDIlib_video_frame_v2_t& frame,
+                  std::vector<uint8_t>& luma) {
+    const bool uyvy = frame.FourCC == NDIlib_FourCC_video_type_UYVY ||
+                      frame.FourCC == NDIlib_FourCC_video_type_UYVA;
+    const bool rgba = frame.FourCC == NDIlib_FourCC_video_type_BGRA ||
+                      frame.FourCC == NDIlib_FourCC_video_type_BGRX ||
+                      frame.FourCC == NDIlib_FourCC_video_type_RGBA ||
+                      frame.FourCC == NDIlib_FourCC_video_type_RGBX;
+    if ((!uyvy && !rgba) || !frame.p_data) {
+      return false;
+    }
+    const int rowBytes = frame.xres * (uyvy ? 2 : 4);
+    const int runStep = 32 * mColumnStep;
+    const int runs = rowBytes >= 32 ? (rowBytes - 32) / runStep + 1 : 0;
+    const int rows = (frame.yres + mRowStep - 1) / mRowStep;
+    // Room for the 16 bytes a UYVY run stores
+    luma.resize((size_t)rows * runs * 16);
+    uint8_t* out = luma.data();
+    for (int y = mRowStep / 2; y < frame.yres; y += mRowStep) {
+      const uint8_t* row =
+          frame.p_data + (size_t)y * frame.line_stride_in_bytes;
+      for (int x = 0; x + 32 <= rowBytes; x += runStep) {
+        out += uyvy ? SignalLumaUYVYSSE2(row + x, out)
+                    : SignalLumaRGBASSE2(row + x, out);
+      }
+    }
+    luma.resize(out - luma.data());
+    return true;
+  }
+
+  // Raises or clears an alarm once the condition held or was gone for long
+  // enough
+  void Update(Entry& entry, Kind kind, bool condition, int64_t holdMs,
+              int64_t now) {
+    Alarm& alarm = entry.mAlarms[kind];
+    // While the alarm is off mSinceMs tracks the condition, while it is on
+    // it tracks the absence of the condition
+    const bool changing = alarm.mActive ? !condition : condition;
+    if (!changing) {
+      alarm.mSinceMs = -1;
+      return;
+    }
+    if (alarm.mSinceMs < 0) {
+      alarm.mSinceMs = now;
+    }
+    if (now - alarm.mSinceMs < (alarm.mActive ? mThresholds.mClearMs
+                                              : holdMs)) {
+      return;
+    }
+    alarm.mActive = !alarm.mActive;
+    alarm.mSinceMs = -1;
+    if (alarm.mActive) {
+      alarm.mEvents++;
+    }
+    if (mCallback) {
+      mCallback(Event{entry.mSource, kind, alarm.mActive, now});
+    }
+  }
+
+  void Analyze(Entry& entry) {
+    Source* source = entry.mSource;
+    const int64_t now = NowMs();
+    const uint64_t cpuStart = ThreadCpuNs();
+
+    int index = -1;
+    NDIlib_video_frame_v2_t frame = source->GetLatestVideoFrame(&index);
+    if (index < 0) {
+      entry.mNoFrame++;
+    } else if (frame.timestamp == entry.mLastTimestamp) {
+      // Nothing new since the last analysis, the source stalled
+      source->ReleaseVideoFrame(index);
+      entry.mDiff = 0;
+      Update(entry, Freeze, true, mThresholds.mFreezeMs, now);
+    } else {
+      TRACE_SPAN("signal", source->GetSourceId(), index);
+      entry.mLastTimestamp = frame.timestamp;
+      std::swap(entry.mLuma, entry.mPrevLuma);
+      const bool sampled = SampleLuma(frame, entry.mLuma);
+      source->ReleaseVideoFrame(index);
+
+      if (sampled && !entry.mLuma.empty()) {
+        const size_t count = entry.mLuma.size();
+        const bool comparable = entry.mPrevLuma.size() == count;
+        uint64_t sum = 0, sumSq = 0, sad = 0;
+        SignalLumaStatsSSE2(entry.mLuma.data(),
+                            comparable ? entry.mPrevLuma.data() : nullptr,
+                            count, &sum, &sumSq, &sad);
+        double mean = (double)sum / count;
+        double stdDev =
+            std::sqrt(std::max(0.0, (double)sumSq / count - mean * mean));
+        if (frame.FourCC == NDIlib_FourCC_video_type_UYVY ||
+            frame.FourCC == NDIlib_FourCC_video_type_UYVA) {
+          mean = (mean - 16) * 255 / 219;
+          stdDev = stdDev * 255 / 219;
+        }
+        entry.mMean = mean;
+        entry.mStdDev = stdDev;
+        entry.mDiff = comparable ? (double)sad / count : -1;
+        Update(entry, Black,
+               mean <= mThresholds.mBlackMaxMean &&
+                   stdDev <= mThresholds.mBlackMaxStdDev,
+               mThresholds.mBlackMs, now);
+        Update(entry, Freeze,
+               comparable && entry.mDiff <= mThresholds.mFreezeMaxDiff,
+               mThresholds.mFreezeMs, now);
+      }
+    }
+
+    uint64_t audioFrames = 0;
+    const float rms = source->GetAudioRms(&audioFrames);
+    if (audioFrames) {
+      const bool stopped = audioFrames == entry.mLastAudioFrames;
+      const double dbfs = rms > 0 ? 20 * std::log10(rms) : -200;
+      Update(entry, Silence, stopped || dbfs <= mThresholds.mSilenceMaxDbfs,
+             mThresholds.mSilenceMs, now);
+      entry.mLastAudioFrames = audioFrames;
+    }
+
+    entry.mAnalyses++;
+    entry.mCpuNs += ThreadCpuNs() - cpuStart;
+  }
+
+  void Run() {
+    TRACE_THREAD_NAME("signal monitor");
+    // Lowest priority for this thread only, like the snapshots
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+
+    int64_t due = NowMs();
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCond.wait_for(lock, std::chrono::milliseconds(
+                                 std::max<int64_t>(0, due - NowMs())),
+                       [this] { return !mIsRunning; });
+        if (!mIsRunning) {
+          return;
+        }
+      }
+      for (auto& entry : mEntries) {
+        Analyze(*entry);
+      }
+      due += mPeriodMs;
+      // A late pass does not try to catch up
+      if (due < NowMs()) {
+        due = NowMs() + mPeriodMs;
+      }
+    }
+  }
+};
+
+#endif  // SIGNAL_MONITOR_HPP___
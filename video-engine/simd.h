@@ -0,0 +1,42 @@
+#ifndef SIMD_HPP___
+#define SIMD_HPP___
+
+#include <immintrin.h>
+
+#include <cstdint>
+
+// The engine is built without -march flags, so kernels using more than SSE2
+// are compiled per function and selected at runtime
+#define CNS_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define CNS_TARGET_AVX2 __attribute__((target("avx2")))
+
+inline bool CpuHasSSE42() {
+  static const bool has = __builtin_cpu_supports("sse4.2");
+  return has;
+}
+
+inline bool CpuHasAVX2() {
+  static const bool has = __builtin_cpu_supports("avx2");
+  return has;
+}
+
+// Kernels shared by the video processing headers
+// ------------------------------------------------------------------
+// Rounded average of two bytes, the scalar _mm_avg_epu8
+inline uint8_t SimdAvg(int a, int b) { return (uint8_t)((a + b + 1) >> 1); }
+
+// |a - b| of unsigned bytes
+inline __m128i SimdAbsDiffU8(__m128i a, __m128i b) {
+  return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+
+// Luma of 32-bit RGB approximated as (R + 2G + B) / 4, in the low byte of
+// each 32-bit lane: avg(avg(byte 0, byte 2), byte 1)
+inline __m128i SimdLumaRGBA(__m128i v) {
+  const __m128i rb = _mm_avg_epu8(v, _mm_srli_epi32(v, 16));
+  return _mm_and_si128(_mm_avg_epu8(rb, _mm_srli_epi32(v, 8)),
+                       _mm_set1_epi32(0xff));
+}
+// ------------------------------------------------------------------
+
+#endif  // SIMD_HPP___
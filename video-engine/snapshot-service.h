@@ -0,0 +1,322 @@
+#ifndef SNAPSHOT_SERVICE_HPP___
+#define SNAPSHOT_SERVICE_HPP___
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "Processing.NDI.Lib.h"
+#include "clock.h"
+#include "format-convert.h"
+#include "pyramid.h"
+#include "source.h"
+#include "trace.h"
+
+// JPEG thumbnail of the latest frame of every source, refreshed a few times
+// per second for the operator UI
+//
+// Everything runs on a few low priority worker threads, the renderers never
+// wait on them. A worker takes the source that is due next, locks its newest
+// frame, takes the frame pyramid (shared with any other reader of the frame)
+// and releases the frame before encoding, so a ring slot is only held for
+// the pyramid build. The latest JPEG of a source is published to one of two
+// preallocated slots, each a seqlock: the worker writes the slot readers are
+// not pointed to, and a reader copies the published one and retries if a
+// write overlapped its copy. Neither side takes a lock or allocates in the
+// handoff. With a directory set, each JPEG is also written there, through a
+// rename so that a reader never sees a partial file.
+class SnapshotService {
+ public:
+  struct Snapshot {
+    std::vector<unsigned char> mJpeg;
+    int mWidth;
+    int mHeight;
+    // Sender timestamp of the frame, in 100ns intervals
+    int64_t mTimestamp;
+  };
+
+  // level is the pyramid level thumbnails are taken from, 2 is a quarter of
+  // the source size. A JPEG larger than maxJpegBytes is skipped.
+  SnapshotService(double rateFps = 2.0, int level = 2, int workers = 1,
+                  int jpegQuality = 80, std::string directory = "",
+                  size_t maxJpegBytes = 1 << 20)
+      : mPeriodMs((int64_t)(1000.0 / rateFps)),
+        mLevel(level),
+        mWorkerCount(workers),
+        mJpegQuality(jpegQuality),
+        mDirectory(directory),
+        mMaxJpegBytes(maxJpegBytes),
+        mClock(SystemClock::Get()),
+        mIsRunning(false),
+        mEncoded(0),
+        mSkipped(0),
+        mEncodeNs(0),
+        mBytes(0) {}
+  ~SnapshotService() { Stop(); }
+
+  // Time source of the refresh schedule, set before Start
+  void SetClock(Clock* clock) { mClock = clock; }
+
+  // Sources are added before Start
+  void AddSource(Source* source) {
+    std::unique_ptr<Entry> entry(new Entry());
+    entry->mSource = source;
+    entry->mName = NdiFileName(source->GetSourceName());
+    for (Slot& slot : entry->mSlots) {
+      slot.mJpeg.reset(new unsigned char[mMaxJpegBytes]);
+    }
+    mEntries.push_back(std::move(entry));
+  }
+
+  void Start() {
+    if (!mDirectory.empty()) {
+      mkdir(mDirectory.c_str(), 0755);
+    }
+    mIsRunning = true;
+    const int64_t now = mClock->NowMs();
+    for (size_t i = 0; i < mEntries.size(); i++) {
+      // Spread the sources over the period
+      mEntries[i]->mDueMs = now + mPeriodMs * i / mEntries.size();
+    }
+    for (int i = 0; i < mWorkerCount; i++) {
+      mWorkers.emplace_back(&SnapshotService::Run, this);
+    }
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mIsRunning = false;
+    }
+    mCond.notify_all();
+    for (auto& worker : mWorkers) {
+      worker.join();
+    }
+    mWorkers.clear();
+  }
+
+  // Copies the latest thumbnail of the source, false until the first one is
+  // encoded
+  bool GetSnapshot(Source* source, Snapshot* snapshot) {
+    for (auto& entry : mEntries) {
+      if (entry->mSource == source) {
+        return Read(*entry, snapshot);
+      }
+    }
+    return false;
+  }
+
+  void Output() {
+    const uint64_t encoded = mEncoded;
+    std::cout << "Snapshots | encoded " << encoded << " | skipped "
+              << mSkipped << " | encode avg "
+              << (encoded ? mEncodeNs / encoded / 1000000.0 : 0)
+              << " ms | size avg " << (encoded ? mBytes / encoded : 0)
+              << " bytes" << std::endl;
+  }
+
+ private:
+  // A published JPEG. mSequence is odd while the slot is written, the
+  // fields are atomics so that a torn read is only ever a retry.
+  struct Slot {
+    std::atomic<uint32_t> mSequence{0};
+    std::atomic<int> mWidth{0};
+    std::atomic<int> mHeight{0};
+    std::atomic<int64_t> mTimestamp{0};
+    std::atomic<size_t> mBytes{0};
+    std::unique_ptr<unsigned char[]> mJpeg;
+  };
+
+  struct Entry {
+    Source* mSource;
+    std::string mName;
+    // Guarded by mMutex
+    int64_t mDueMs;
+    bool mBusy = false;
+    // Written by the one worker that has the entry busy
+    Slot mSlots[2];
+    // Slot readers copy, -1 before the first snapshot
+    std::atomic<int> mPublished{-1};
+  };
+
+  int64_t mPeriodMs;
+  int mLevel;
+  int mWorkerCount;
+  int mJpegQuality;
+  std::string mDirectory;
+  size_t mMaxJpegBytes;
+
+  std::vector<std::unique_ptr<Entry>> mEntries;
+  Clock* mClock;
+  std::vector<std::thread> mWorkers;
+  std::mutex mMutex;
+  std::condition_variable mCond;
+  bool mIsRunning;
+
+  std::atomic<uint64_t> mEncoded;
+  std::atomic<uint64_t> mSkipped;
+  std::atomic<uint64_t> mEncodeNs;
+  std::atomic<uint64_t> mBytes;
+
+  // Waits for the entry due next and marks it busy, null once stopped
+  Entry* NextEntry() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mIsRunning) {
+      Entry* next = nullptr;
+      for (auto& entry : mEntries) {
+        if (!entry->mBusy && (!next || entry->mDueMs < next->mDueMs)) {
+          next = entry.get();
+        }
+      }
+      const int64_t now = mClock->NowMs();
+      if (next && next->mDueMs <= now) {
+        next->mBusy = true;
+        next->mDueMs += mPeriodMs;
+        // A late worker does not try to catch up
+        if (next->mDueMs < now) {
+          next->mDueMs = now + mPeriodMs;
+        }
+        return next;
+      }
+      const int64_t waitMs = next ? next->mDueMs - now : mPeriodMs;
+      mCond.wait_for(lock, std::chrono::milliseconds(waitMs));
+    }
+    return nullptr;
+  }
+
+  void Done(Entry* entry) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    entry->mBusy = false;
+  }
+
+  void Publish(Entry& entry, const std::vector<unsigned char>& jpeg, int width,
+               int height, int64_t timestamp) {
+    const int index = entry.mPublished < 0 ? 0 : 1 - entry.mPublished;
+    Slot& slot = entry.mSlots[index];
+    const uint32_t sequence = slot.mSequence.load(std::memory_order_relaxed);
+    slot.mSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.mWidth.store(width, std::memory_order_relaxed);
+    slot.mHeight.store(height, std::memory_order_relaxed);
+    slot.mTimestamp.store(timestamp, std::memory_order_relaxed);
+    slot.mBytes.store(jpeg.size(), std::memory_order_relaxed);
+    memcpy(slot.mJpeg.get(), jpeg.data(), jpeg.size());
+    slot.mSequence.store(sequence + 2, std::memory_order_release);
+    entry.mPublished.store(index, std::memory_order_release);
+  }
+
+  bool Read(Entry& entry, Snapshot* snapshot) {
+    while (true) {
+      const int index = entry.mPublished.load(std::memory_order_acquire);
+      if (index < 0) {
+        return false;
+      }
+      Slot& slot = entry.mSlots[index];
+      const uint32_t sequence = slot.mSequence.load(std::memory_order_acquire);
+      if (sequence & 1) {
+        continue;
+      }
+      const size_t bytes =
+          std::min(slot.mBytes.load(std::memory_order_relaxed), mMaxJpegBytes);
+      snapshot->mWidth = slot.mWidth.load(std::memory_order_relaxed);
+      snapshot->mHeight = slot.mHeight.load(std::memory_order_relaxed);
+      snapshot->mTimestamp = slot.mTimestamp.load(std::memory_order_relaxed);
+      snapshot->mJpeg.assign(slot.mJpeg.get(), slot.mJpeg.get() + bytes);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.mSequence.load(std::memory_order_relaxed) == sequence) {
+        return true;
+      }
+    }
+  }
+
+  // bgr and jpeg are buffers of the worker, reused across snapshots
+  void Snap(Entry* entry, cv::Mat& bgr, std::vector<unsigned char>& jpeg) {
+    Source* source = entry->mSource;
+    int index = -1;
+    NDIlib_video_frame_v2_t frame = source->GetLatestVideoFrame(&index);
+    if (index < 0) {
+      mSkipped++;
+      return;
+    }
+    std::shared_ptr<FramePyramid> pyramid = source->GetPyramid(index);
+    source->ReleaseVideoFrame(index);
+    if (!pyramid) {
+      mSkipped++;
+      return;
+    }
+
+    TRACE_SPAN("snapshot", source->GetSourceId(), index);
+    const auto start = std::chrono::steady_clock::now();
+    const NDIlib_video_frame_v2_t level = pyramid->GetFrame(mLevel);
+    bgr.create(level.yres, level.xres, CV_8UC3);
+    if (!ConvertFrame<PixelFormatBGR24>(level, bgr.data, (int)bgr.step)) {
+      mSkipped++;
+      return;
+    }
+    if (!cv::imencode(".jpg", bgr, jpeg,
+                      {cv::IMWRITE_JPEG_QUALITY, mJpegQuality}) ||
+        jpeg.size() > mMaxJpegBytes) {
+      mSkipped++;
+      return;
+    }
+    mEncodeNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+    mEncoded++;
+    mBytes += jpeg.size();
+    Publish(*entry, jpeg, level.xres, level.yres, frame.timestamp);
+
+    if (!mDirectory.empty()) {
+      Write(entry->mName, jpeg);
+    }
+  }
+
+  void Write(const std::string& name, const std::vector<unsigned char>& jpeg) {
+    const std::string path = mDirectory + "/" + name + ".jpg";
+    const std::string tmp = path + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "wb");
+    if (!file) {
+      return;
+    }
+    const bool written =
+        fwrite(jpeg.data(), 1, jpeg.size(), file) == jpeg.size();
+    fclose(file);
+    if (written) {
+      rename(tmp.c_str(), path.c_str());
+    } else {
+      unlink(tmp.c_str());
+    }
+  }
+
+  void Run() {
+    TRACE_THREAD_NAME("snapshot");
+    // Lowest priority for this thread only, the renderers and the capture
+    // come first
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+
+    cv::Mat bgr;
+    std::vector<unsigned char> jpeg;
+    while (Entry* entry = NextEntry()) {
+      Snap(entry, bgr, jpeg);
+      Done(entry);
+    }
+  }
+};
+
+#endif  // SNAPSHOT_SERVICE_HPP___
@@ -1,52 +1,384 @@
 #ifndef SOURCE_HPP___
 #define SOURCE_HPP___
 
-// #include <condition_variable>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <thread>
 
 #include "Processing.NDI.Lib.h"
+#include "clock.h"
+#include "deinterlace.h"
+#include "memory-budget.h"
+#include "metrics.h"
+#include "pyramid.h"
 #include "tcb.h"
+#include "trace.h"
+
+// NDI names look like "HOST (Stream)", this keeps the letters and digits
+// for the files named after a source or an output
+inline std::string NdiFileName(const std::string& name) {
+  std::string file;
+  for (char c : name) {
+    file += isalnum((unsigned char)c) ? c : '_';
+  }
+  return file;
+}
 
 class Source {
  public:
+  // What to do with the receiver once no renderer has asked for a frame for
+  // longer than the idle timeout
+  enum class IdleMode { None, Proxy, Disconnect };
+
+  // Connection state of the receiver
+  // Warming means connected at full bandwidth but the ring does not hold
+  // enough frames yet for a renderer to look up a delayed frame
+  enum class State { Suspended, Proxy, Warming, Active };
+
   Source()
-      : mSource(nullptr), mBuffer(8), mSourceFRateDen(0), mSourceFRateNum(0) {}
+      : mId(NextId()),
+        mSourceFRateDen(0),
+        mSourceFRateNum(0),
+        mIsRunning(false),
+        mBuffer(8),
+        mSource(nullptr),
+        mNDIRecv(nullptr),
+        mFramesCaptured(0),
+        mLatencySamples(0),
+        mCaptureLatencySum(0),
+        mCaptureLatencyMax(0),
+        mLastTimestamp(0),
+        mPyramidRequests(0),
+        mPyramidBuilds(0),
+        mAudioFrames(0),
+        mAudioRms(0),
+        mMemory(nullptr),
+        mRingDepth(0),
+        mMemoryProxy(false),
+        mClock(SystemClock::Get()),
+        mRunLimitMs(5 * 60 * 1000),
+        mState(State::Suspended),
+        mLastDemandMs(0),
+        mIdleMode(IdleMode::None),
+        mIdleTimeoutMs(0),
+        mLazyConnect(false),
+        mWarmupFrames(3),
+        mWarmupTimeoutMs(500),
+        mWarmupStartMs(0),
+        mWarmupCount(0),
+        mColorFormat(NDIlib_recv_color_format_UYVY_BGRA) {}
   virtual ~Source() {}
-  void Init(NDIlib_source_t* source) { mSource = source; }
+  void Init(NDIlib_source_t* source) {
+    mSource = source;
+    if (mSource && mSource->p_ndi_name) {
+      mSourceName = mSource->p_ndi_name;
+    }
+  }
+
+  // Demand-driven activation
+  // idleTimeoutMs of 0 keeps the receiver connected at full bandwidth for
+  // the lifetime of the source. With lazyConnect the receiver is not
+  // created until a renderer first asks for a frame.
+  void SetIdlePolicy(IdleMode mode, int idleTimeoutMs, bool lazyConnect) {
+    mIdleMode = mode;
+    mIdleTimeoutMs = idleTimeoutMs;
+    mLazyConnect = lazyConnect;
+  }
+
+  // A resumed source is ready once it received warmupFrames frames, or once
+  // warmupTimeoutMs elapsed, whichever comes first
+  void SetWarmup(int warmupFrames, int warmupTimeoutMs) {
+    mWarmupFrames = warmupFrames;
+    mWarmupTimeoutMs = warmupTimeoutMs;
+  }
+
+  // Pixel format the receiver asks the SDK for, applied on the next connect
+  void SetColorFormat(NDIlib_recv_color_format_e colorFormat) {
+    mColorFormat = colorFormat;
+  }
+
+  // What capture does when a renderer still holds the ring slot it is about
+  // to overwrite, see OverflowPolicy. spareFrames is used by Grow only.
+  void SetOverflowPolicy(OverflowPolicy policy, int spareFrames = 0) {
+    mBuffer.SetOverflowPolicy(policy, spareFrames);
+  }
+
+  // Time source of the capture timing and the demand tracking, set before
+  // Start
+  virtual void SetClock(Clock* clock) { mClock = clock; }
+  Clock* GetClock() { return mClock; }
+
+  // The receive thread stops on its own after limitMs, 0 runs until Stop
+  void SetRunLimit(int64_t limitMs) { mRunLimitMs = limitMs; }
+  int64_t GetRunLimit() { return mRunLimitMs; }
+
+  // Interleaved frames are deinterlaced on capture, before anything else
+  // sees them
+  void SetDeinterlaceMode(Deinterlacer::Mode mode) {
+    mDeinterlacer.SetMode(mode);
+  }
+
+  // Called from the capture thread with every video frame, before the frame
+  // is put in the ring, see ShmPublisher
+  void SetFrameCallback(
+      std::function<void(const NDIlib_video_frame_v2_t&)> callback) {
+    mFrameCallback = callback;
+  }
 
   // Control API
   // ------------------------------------------------------------------
   bool isRunning() { return mIsRunning; }
 
-  void Start(int runForIterations = 10) {
-    mIsRunning = true;
+  virtual void Start(int runForIterations = 10) {
+    Attach();
     mThread = std::thread(&Source::Run, this);
   }
-  void Stop() {
-    mIsRunning = false;
-    mThread.join();
+
+  // Marks the source as running without a receive thread of its own
+  // A CaptureExecutor then drives it through Open, Service and Close
+  void Attach() {
+    GetMemoryAccount();
+    mIsRunning = true;
+    // Without lazy connect the source counts as requested from the start
+    if (!mLazyConnect) {
+      mLastDemandMs = NowMs();
+    }
+  }
+  // Tells the receive thread to stop without waiting for it, so that a set
+  // of sources stops together rather than one after the other
+  virtual void RequestStop() {
+    {
+      std::lock_guard<std::mutex> lock(mWakeMutex);
+      mIsRunning = false;
+    }
+    mWakeCond.notify_all();
+  }
+
+  virtual void Stop() {
+    RequestStop();
+    if (mThread.joinable()) {
+      mThread.join();
+    }
   }
 
   void Wait() { mThread.join(); }
+
+  // Called by the renderers every tick for every source they use
+  // Wakes up a suspended or proxy source
+  void RequestVideo() {
+    const State state = mState;
+    if (state != State::Suspended && state != State::Proxy) {
+      mLastDemandMs = NowMs();
+      return;
+    }
+    {
+      // Under the mutex, or the request could land between the check of
+      // WaitForDemand and its wait, and the wake up be lost
+      std::lock_guard<std::mutex> lock(mWakeMutex);
+      mLastDemandMs = NowMs();
+    }
+    mWakeCond.notify_all();
+  }
+
+  // True when the ring holds full bandwidth frames, or the proxy frames the
+  // memory budget asked for
+  bool IsReady() {
+    const State state = mState;
+    return state == State::Active || (state == State::Proxy && mMemoryProxy);
+  }
   // ----------------------------------------------------- Control API
 
+  // Capture steps
+  // ------------------------------------------------------------------
+  // Sources without an NDI receiver override these, see SyntheticSource
+  // Creates the receiver, unless the source starts suspended
+  virtual bool Open() {
+    // Test if initialized
+    if (!mSource) {
+      std::cerr << "Source is not initialized" << std::endl;
+      return false;
+    }
+
+    if (IsIdle()) {
+      mState = State::Suspended;
+      return true;
+    }
+    Resume();
+    return mNDIRecv != nullptr;
+  }
+
+  // Follows the demand from the renderers then captures at most one frame,
+  // waiting up to timeoutMs for it. Returns true if a video frame was put in
+  // the ring.
+  virtual bool Service(int timeoutMs) {
+    DestroyRetired();
+    UpdateDemand();
+    if (!mNDIRecv) {
+      return false;
+    }
+
+    bool captured = false;
+    NDIlib_video_frame_v2_t video_frame;
+    NDIlib_audio_frame_v2_t audio_frame;
+
+    switch (NDIlib_recv_capture_v2(mNDIRecv, &video_frame, &audio_frame,
+                                   nullptr, timeoutMs)) {  // No data
+      case NDIlib_frame_type_none:
+        // printf("No data received.\n");
+        break;
+
+      // Video data
+      case NDIlib_frame_type_video:
+        // OutputVideoFrame(&video_frame);
+        // OuputVideoFrameTimestamp(&video_frame);
+        // Update the source frame rate
+        mSourceFRateDen = video_frame.frame_rate_D;
+        mSourceFRateNum = video_frame.frame_rate_N;
+        // std::cout << "Source frame rate: "
+        //           << (double)mSourceFRateNum / (double)mSourceFRateDen
+        //           << std::endl;
+        UpdateCaptureLatency(video_frame);
+        mDeinterlacer.Apply(video_frame);
+        if (mFrameCallback) {
+          mFrameCallback(video_frame);
+        }
+        // Released by the deleter of the ring
+        mMemory->Charge(MemoryKind::Ring, FrameBytes(video_frame));
+        FollowRingDepth();
+        {
+          TRACE_SPAN_NAMED(span, "ring put");
+          // Put the video frame in the buffer
+          [[maybe_unused]] const int index = mBuffer.Put(
+              video_frame, video_frame.timestamp, video_frame.timecode);
+          TRACE_SET_FRAME(span, mId, index);
+        }
+        mWarmupCount++;
+        captured = true;
+        break;
+
+      // Audio data
+      case NDIlib_frame_type_audio:
+        // OutputAudioFrame(&audio_frame);
+        MeasureAudio(audio_frame);
+        NDIlib_recv_free_audio_v2(mNDIRecv, &audio_frame);
+        break;
+
+      default:
+        break;
+    }
+
+    UpdateWarmup();
+    return captured;
+  }
+
+  // Destroys the receiver, waiting for the readers of its frames
+  virtual void Close() {
+    Disconnect();
+    if (mRetiredRecv) {
+      mBuffer.Clear();
+      DestroyRetired();
+    }
+  }
+
+  // A parked source has no receiver to poll
+  virtual bool IsParked() { return mNDIRecv == nullptr; }
+
+  // Waits until the source is requested again, stopped, or the timeout
+  // elapsed
+  void WaitForDemand(int timeoutMs) {
+    std::unique_lock<std::mutex> lock(mWakeMutex);
+    mWakeCond.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+                       [this] { return !isRunning() || !IsIdle(); });
+  }
+  // ------------------------------------------------------ Capture steps
+
   // Getters and setters
   // ---------------------------------------------------------------
   std::string GetSourceName() { return mSourceName; }
 
+  // Unique in the process, identifies the source in traces
+  int GetSourceId() { return mId; }
+
+  // Frame memory of the source, registered with the budget under the source
+  // name on the first call, once the name is known
+  MemoryAccount* GetMemoryAccount() {
+    if (!mMemory) {
+      mMemory = MemoryBudget::Get().Register(mSourceName, true);
+    }
+    return mMemory;
+  }
+
   int GetSourceFRateDen() { return mSourceFRateDen; }
 
   int GetSourceFRateNum() { return mSourceFRateNum; }
 
-  NDIlib_video_frame_v2_t GetVideoFrameAtTime(uint64_t timestamp,
-                                              uint64_t threshold, int* index,
-                                              int* writeIndex) {
+  State GetState() { return mState; }
+
+  uint64_t GetFramesCaptured() { return mFramesCaptured; }
+
+  // Time between the sender timestamp and the frame reaching the ring, in
+  // 100ns intervals
+  uint64_t GetCaptureLatencyAvg() {
+    const uint64_t samples = mLatencySamples;
+    return samples ? mCaptureLatencySum / samples : 0;
+  }
+  uint64_t GetCaptureLatencyMax() { return mCaptureLatencyMax; }
+
+  // Sender timestamp of the last captured frame, in 100ns intervals
+  int64_t GetLastTimestamp() { return mLastTimestamp; }
+  // Clock time the last frame was captured at, in 100ns intervals
+  int64_t GetLastCaptureTime() { return mLastCaptureTime; }
+
+  // RMS level of the last audio frame over all its channels, 1.0 being full
+  // scale. frames is the number of audio frames received so far, 0 if the
+  // source never had audio.
+  virtual float GetAudioRms(uint64_t* frames) {
+    *frames = mAudioFrames;
+    return mAudioRms;
+  }
+
+  virtual void OutputCaptureStats() {
+    std::cout << "Source " << mSourceName << " | frames " << mFramesCaptured
+              << " | capture latency avg "
+              << GetCaptureLatencyAvg() / 10000.0 << " ms | max "
+              << GetCaptureLatencyMax() / 10000.0 << " ms" << std::endl;
+    if (mAudioFrames) {
+      std::cout << "Source " << mSourceName << " | audio frames "
+                << mAudioFrames << std::endl;
+    }
+    OverflowStats& overflow = mBuffer.GetOverflowStats();
+    std::cout << "Source " << mSourceName << " | ring puts " << overflow.mPuts
+              << " | blocked " << overflow.mBlocked << " ("
+              << overflow.mBlockedNs / 1000000.0 << " ms) | skipped "
+              << overflow.mSkipped << " | dropped " << overflow.mDropped
+              << " | grown " << overflow.mGrown << std::endl;
+    mDeinterlacer.Output(mSourceName);
+    if (mPyramidRequests) {
+      std::cout << "Source " << mSourceName << " | pyramid requests "
+                << mPyramidRequests << " | built " << mPyramidBuilds
+                << std::endl;
+    }
+  }
+
+  virtual NDIlib_video_frame_v2_t GetVideoFrameAtTime(uint64_t timestamp,
+                                                      uint64_t threshold,
+                                                      int* index,
+                                                      int* writeIndex) {
+    RequestVideo();
+
     int index_ = 0;
     int writeIndex_ = 0;
+    TRACE_SPAN_NAMED(span, "ring get");
     auto frame = mBuffer.Get(timestamp, threshold, &index_, &writeIndex_);
+    TRACE_SET_FRAME(span, mId, index_);
 
     if (index) {
       *index = index_;
@@ -58,24 +390,190 @@ class Source {
     return frame;
   }
 
+  // Locks the newest frame of the ring without counting as a request, so
+  // background readers do not keep an idle source connected. index is -1
+  // if there is no frame; release it like a frame from GetVideoFrameAtTime.
+  virtual NDIlib_video_frame_v2_t GetLatestVideoFrame(int* index) {
+    return mBuffer.GetLatest(index);
+  }
+
+  // Reduced copies of the frame at index, which must still be locked (not
+  // released yet). Built on the first request, then shared by every reader
+  // of the frame. Null if the frame format has no pyramid.
+  virtual std::shared_ptr<FramePyramid> GetPyramid(int index) {
+    mPyramidRequests++;
+    return mBuffer.GetAttachment<FramePyramid>(
+        index, [this](const NDIlib_video_frame_v2_t& frame) {
+          mPyramidBuilds++;
+          std::shared_ptr<FramePyramid> pyramid = FramePyramid::Build(frame);
+          if (!pyramid) {
+            return pyramid;
+          }
+          // Charged for as long as a reader or the ring holds the pyramid
+          MemoryAccount* memory = GetMemoryAccount();
+          const int64_t bytes = pyramid->GetBytes();
+          memory->Charge(MemoryKind::Pyramid, bytes);
+          return std::shared_ptr<FramePyramid>(
+              pyramid.get(), [pyramid, memory, bytes](FramePyramid*) {
+                memory->Release(MemoryKind::Pyramid, bytes);
+              });
+        });
+  }
+
+  // Exports the capture and ring statistics, read from their atomics by the
+  // scrape. The source must outlive the metrics server.
+  virtual void ExportMetrics(MetricsRegistry& metrics) {
+    const std::string source = MetricsRegistry::Label("source", mSourceName);
+    OverflowStats* overflow = &mBuffer.GetOverflowStats();
+    metrics.AddCallback("ve_source_frames_received_total",
+                        "Video frames captured from the source", "counter",
+                        source, [this] { return (double)mFramesCaptured; });
+    metrics.AddCallback(
+        "ve_source_capture_latency_seconds_max",
+        "Longest time from the sender timestamp to the ring", "gauge",
+        source, [this] { return mCaptureLatencyMax / 1e7; });
+    metrics.AddCallback("ve_source_ready",
+                        "1 when the ring holds full bandwidth frames",
+                        "gauge", source,
+                        [this] { return IsReady() ? 1.0 : 0.0; });
+    metrics.AddCallback("ve_ring_slots", "Slots of the source ring", "gauge",
+                        source, [this] { return (double)mBuffer.GetSize(); });
+    metrics.AddCallback("ve_ring_occupied_slots",
+                        "Slots of the source ring holding a frame", "gauge",
+                        source,
+                        [this] { return (double)mBuffer.GetOccupied(); });
+    metrics.AddCallback("ve_ring_locked_frames",
+                        "Frames of the source ring held by readers", "gauge",
+                        source, [this] { return (double)mBuffer.GetLocked(); });
+    metrics.AddCallback("ve_ring_skipped_total",
+                        "Slots written around because a reader held them",
+                        "counter", source,
+                        [overflow] { return (double)overflow->mSkipped; });
+    metrics.AddCallback("ve_ring_dropped_total",
+                        "Frames dropped because a reader held the slot",
+                        "counter", source,
+                        [overflow] { return (double)overflow->mDropped; });
+    metrics.AddCallback("ve_ring_blocked_seconds_total",
+                        "Time capture waited for a reader to free a slot",
+                        "counter", source,
+                        [overflow] { return overflow->mBlockedNs / 1e9; });
+  }
+
+  // Timecode locked lookup of a group of sources, see
+  // RendererBase::SetSyncGroup. BeginSync locks the ring until EndSync so
+  // that every source of the group is read at the same instant; the group
+  // takes the sources in id order. In between, GetTimecodes appends the NDI
+  // timecodes of the frames held, oldest first, and LockFrameAtTimecode
+  // locks the frame of one of them, index is -1 if there is none. Frames
+  // are released after EndSync.
+  virtual bool CanSync() { return true; }
+  virtual void BeginSync() { mBuffer.LockRing(); }
+  virtual void EndSync() { mBuffer.UnlockRing(); }
+  virtual void GetTimecodes(std::vector<int64_t>* timecodes) {
+    mBuffer.GetTimecodesLocked(timecodes);
+  }
+  virtual NDIlib_video_frame_v2_t LockFrameAtTimecode(int64_t timecode,
+                                                      int64_t tolerance,
+                                                      int* index,
+                                                      int* writeIndex) {
+    return mBuffer.GetAtTimecodeLocked(timecode, tolerance, index,
+                                       writeIndex);
+  }
+
   // When Releasing we use the non-modulo index
-  void ReleaseVideoFrame(int index) { mBuffer.Unlock(index); }
+  virtual void ReleaseVideoFrame(int index) {
+    if (index < 0) {
+      return;
+    }
+    mBuffer.Unlock(index);
+  }
+
+  // True when other processes read the frames of the ring too, nothing may
+  // write to them then, see ShmSource
+  virtual bool SharesFrames() { return false; }
 
   // --------------------------------------------- Getters and setters
 
- private:
+ protected:
+  int mId;
   std::string mSourceName;
 
   int mSourceFRateDen, mSourceFRateNum;
 
   std::thread mThread;
-  bool mIsRunning;
+  std::atomic<bool> mIsRunning;
 
   TimedCircularBuffer<NDIlib_video_frame_v2_t> mBuffer;
 
   // The source
   NDIlib_source_t* mSource;
 
+  // The receiver, null while suspended
+  NDIlib_recv_instance_t mNDIRecv;
+
+  // Capture statistics
+  std::atomic<uint64_t> mFramesCaptured;
+  std::atomic<uint64_t> mLatencySamples;
+  std::atomic<uint64_t> mCaptureLatencySum;
+  std::atomic<uint64_t> mCaptureLatencyMax;
+  std::atomic<int64_t> mLastTimestamp;
+  std::atomic<int64_t> mLastCaptureTime{0};
+  std::atomic<uint64_t> mPyramidRequests;
+  std::atomic<uint64_t> mPyramidBuilds;
+  std::atomic<uint64_t> mAudioFrames;
+  std::atomic<float> mAudioRms;
+
+  // Frame memory, see GetMemoryAccount
+  MemoryAccount* mMemory;
+  // Ring depth asked by the budget, followed by the capture thread
+  int mRingDepth;
+  // True while the budget keeps the receiver at proxy bandwidth
+  std::atomic<bool> mMemoryProxy;
+
+  Clock* mClock;
+  int64_t mRunLimitMs;
+
+  // Demand tracking, all times are mClock milliseconds
+  std::atomic<State> mState;
+  std::atomic<int64_t> mLastDemandMs;
+  IdleMode mIdleMode;
+  int mIdleTimeoutMs;
+  bool mLazyConnect;
+
+  // Warm-up after a resume
+  int mWarmupFrames;
+  int mWarmupTimeoutMs;
+  int64_t mWarmupStartMs;
+  int mWarmupCount;
+
+  NDIlib_recv_color_format_e mColorFormat;
+
+  std::function<void(const NDIlib_video_frame_v2_t&)> mFrameCallback;
+
+  Deinterlacer mDeinterlacer;
+
+  // Receiver disconnected while readers held some of its frames, destroyed
+  // once they released them, see Disconnect
+  NDIlib_recv_instance_t mRetiredRecv = nullptr;
+
+  // Wakes the receive thread when a suspended source is requested again
+  std::mutex mWakeMutex;
+  std::condition_variable mWakeCond;
+
+  static int NextId() {
+    static std::atomic<int> nextId(0);
+    return nextId++;
+  }
+
+  int64_t NowMs() { return mClock->NowMs(); }
+
+  bool IsIdle() {
+    if (mIdleMode == IdleMode::None || mIdleTimeoutMs <= 0) {
+      return false;
+    }
+    return NowMs() - mLastDemandMs > mIdleTimeoutMs;
+  }
+
   // Write OuputVideoFrame and OutputAudioFrame functions using std::cout
 
   void OutputVideoFrame(NDIlib_video_frame_v2_t* frame) {
@@ -101,70 +599,217 @@ class Source {
               << std::endl;
   }
 
-  void Run() {
-    // Test if initialized
-    if (!mSource) {
-      std::cerr << "Source is not initialized" << std::endl;
+  // Frames in the ring belong to the receiver that captured them, so the ring
+  // is flushed before the receiver is destroyed. The capture thread does not
+  // wait for the readers: the frames they hold are released when they are
+  // done, and the receiver retired until then, see DestroyRetired.
+  void Disconnect() {
+    if (!mNDIRecv) {
+      return;
+    }
+    mRetiredRecv = mNDIRecv;
+    mNDIRecv = nullptr;
+    DestroyRetired();
+  }
+
+  // Destroys the retired receiver once no reader holds one of its frames,
+  // returns false while it is still retired
+  bool DestroyRetired() {
+    if (!mRetiredRecv) {
+      return true;
+    }
+    if (!mBuffer.ClearUnlocked()) {
+      return false;
+    }
+    NDIlib_recv_destroy(mRetiredRecv);
+    mRetiredRecv = nullptr;
+    return true;
+  }
+
+  // The bandwidth of a receiver is fixed at creation, so changing it means
+  // creating a new receiver. The ring takes the frames of one receiver at a
+  // time, so this fails while the previous one is retired; the caller tries
+  // again on a later Service.
+  bool Connect(NDIlib_recv_bandwidth_e bandwidth) {
+    Disconnect();
+    if (!DestroyRetired()) {
+      return false;
+    }
+
+    NDIlib_recv_create_v3_t recvDesc;
+    recvDesc.source_to_connect_to = *mSource;
+    recvDesc.bandwidth = bandwidth;
+    recvDesc.color_format = mColorFormat;
+    // Interlaced sources come as interleaved frames rather than fields
+    recvDesc.allow_video_fields = false;
+    mNDIRecv = NDIlib_recv_create_v3(&recvDesc);
+    if (!mNDIRecv) {
+      std::cerr << "Cannot create receiver for " << mSourceName << std::endl;
+      return false;
+    }
+
+    // Set the deleter
+    NDIlib_recv_instance_t recv = mNDIRecv;
+    MemoryAccount* memory = GetMemoryAccount();
+    mBuffer.SetDeleter([recv, memory](NDIlib_video_frame_v2_t* frame) {
+      memory->Release(MemoryKind::Ring, FrameBytes(*frame));
+      NDIlib_recv_free_video_v2(recv, frame);
+    });
+    return true;
+  }
+
+  void Suspend() {
+    mMemoryProxy = false;
+    if (mIdleMode == IdleMode::Proxy) {
+      std::cout << "Source " << mSourceName << " idle, switching to proxy"
+                << std::endl;
+      mState = State::Proxy;
+      if (!Connect(NDIlib_recv_bandwidth_lowest)) {
+        mState = State::Suspended;
+      }
+    } else {
+      std::cout << "Source " << mSourceName << " idle, disconnecting"
+                << std::endl;
+      mState = State::Suspended;
+      Disconnect();
+    }
+  }
+
+  // Proxy frames stay in use, unlike those of an idle source
+  void SwitchToMemoryProxy() {
+    mMemoryProxy = true;
+    mState = State::Proxy;
+    if (!Connect(NDIlib_recv_bandwidth_lowest)) {
+      mMemoryProxy = false;
+      mState = State::Suspended;
+      return;
+    }
+    std::cout << "Source " << mSourceName
+              << " over the memory budget, switched to proxy" << std::endl;
+  }
+
+  void Resume() {
+    mMemoryProxy = false;
+    mState = State::Warming;
+    mWarmupStartMs = NowMs();
+    mWarmupCount = 0;
+    if (!Connect(NDIlib_recv_bandwidth_highest)) {
+      mState = State::Suspended;
+    }
+  }
+
+  void UpdateDemand() {
+    const bool idle = IsIdle();
+    const bool memoryProxy = mMemory && mMemory->IsProxy();
+    const State state = mState;
+    if (idle && (state == State::Warming || state == State::Active ||
+                 mMemoryProxy)) {
+      Suspend();
+    } else if (!idle && memoryProxy && !mMemoryProxy) {
+      SwitchToMemoryProxy();
+    } else if (!idle && !memoryProxy &&
+               (state == State::Suspended || state == State::Proxy)) {
+      Resume();
+    }
+  }
+
+  // Applies the ring depth of the budget, see TimedCircularBuffer::SetDepth
+  void FollowRingDepth() {
+    const int depth = mMemory->GetRingDepth();
+    if (depth == mRingDepth) {
+      return;
+    }
+    std::cout << "Source " << mSourceName << " ring depth "
+              << (depth ? std::to_string(depth) : "full") << std::endl;
+    mRingDepth = depth;
+    mBuffer.SetDepth(depth);
+  }
+
+  void UpdateWarmup() {
+    if (mState != State::Warming) {
       return;
     }
+    const int64_t elapsed = NowMs() - mWarmupStartMs;
+    if (mWarmupCount >= mWarmupFrames || elapsed >= mWarmupTimeoutMs) {
+      mState = State::Active;
+      std::cout << "Source " << mSourceName << " ready after " << elapsed
+                << " ms (" << mWarmupCount << " frames)" << std::endl;
+    }
+  }
+
+  void UpdateCaptureLatency(const NDIlib_video_frame_v2_t& frame) {
+    mFramesCaptured++;
+    // The NDI timestamp is in 100ns intervals
+    const int64_t now = mClock->Now();
+    mLastCaptureTime = now;
+    if (frame.timestamp == NDIlib_recv_timestamp_undefined) {
+      return;
+    }
+    mLastTimestamp = frame.timestamp;
+    const int64_t latency = now - frame.timestamp;
+    if (latency < 0) {
+      return;
+    }
+    mLatencySamples++;
+    mCaptureLatencySum += latency;
+    uint64_t max = mCaptureLatencyMax;
+    while (uint64_t(latency) > max &&
+           !mCaptureLatencyMax.compare_exchange_weak(max, latency)) {
+    }
+  }
+
+  // NDI audio frames are planar 32-bit float
+  void MeasureAudio(const NDIlib_audio_frame_v2_t& frame) {
+    const int count = frame.no_channels * frame.no_samples;
+    if (!frame.p_data || count <= 0) {
+      return;
+    }
+    double sum = 0;
+    for (int c = 0; c < frame.no_channels; c++) {
+      const float* samples = (const float*)((const uint8_t*)frame.p_data +
+                                            c * frame.channel_stride_in_bytes);
+      for (int i = 0; i < frame.no_samples; i++) {
+        sum += samples[i] * samples[i];
+      }
+    }
+    mAudioRms = (float)std::sqrt(sum / count);
+    mAudioFrames++;
+  }
+
+  void Run() {
+    TRACE_THREAD_NAME("source " + mSourceName);
 
     // We now have at least one source, so we create a receiver to look at
-    // it.
-    NDIlib_recv_instance_t pNDI_recv = NDIlib_recv_create_v3();
-    if (!pNDI_recv) return;
+    // it. With lazy connect this waits for the first request.
+    if (!Open()) return;
 
-    // Connect to our sources
-    NDIlib_recv_connect(pNDI_recv, mSource);
+    // A short capture timeout keeps a proxy source responsive to requests
+    const int captureTimeoutMs =
+        (mIdleMode == IdleMode::None || mIdleTimeoutMs <= 0) ? 5000 : 20;
 
-    // Run for five minutes
-    using namespace std::chrono;
-    for (const auto start = high_resolution_clock::now();
-         high_resolution_clock::now() - start <
-         minutes(5);) {  // The descriptors
+    // Run for five minutes unless told otherwise
+    const int64_t start = NowMs();
+    while (!mRunLimitMs || NowMs() - start < mRunLimitMs) {
 
       // Break if not running
       if (!isRunning()) {
         break;
       }
 
-      NDIlib_video_frame_v2_t video_frame;
-      NDIlib_audio_frame_v2_t audio_frame;
-
-      // Set the deleter
-      mBuffer.SetDeleter([pNDI_recv](NDIlib_video_frame_v2_t* frame) {
-        NDIlib_recv_free_video_v2(pNDI_recv, frame);
-      });
-
-      switch (NDIlib_recv_capture_v2(pNDI_recv, &video_frame, &audio_frame,
-                                     nullptr, 5000)) {  // No data
-        case NDIlib_frame_type_none:
-          // printf("No data received.\n");
-          break;
-
-        // Video data
-        case NDIlib_frame_type_video:
-          // OutputVideoFrame(&video_frame);
-          // OuputVideoFrameTimestamp(&video_frame);
-          // Update the source frame rate
-          mSourceFRateDen = video_frame.frame_rate_D;
-          mSourceFRateNum = video_frame.frame_rate_N;
-          // std::cout << "Source frame rate: "
-          //           << (double)mSourceFRateNum / (double)mSourceFRateDen
-          //           << std::endl;
-          // Put the video frame in the buffer
-          mBuffer.Put(video_frame, video_frame.timestamp);
-          break;
-
-        // Audio data
-        case NDIlib_frame_type_audio:
-          // OutputAudioFrame(&audio_frame);
-          NDIlib_recv_free_audio_v2(pNDI_recv, &audio_frame);
-          break;
+      Service(captureTimeoutMs);
+
+      // Nothing to capture, sleep until a renderer asks for this source, or
+      // for a millisecond while readers still hold frames of a retired
+      // receiver
+      if (mRetiredRecv) {
+        mClock->SleepFor(10000);
+      } else if (IsParked()) {
+        WaitForDemand(100);
       }
     }
 
     // Destroy the receiver
-    NDIlib_recv_destroy(pNDI_recv);
+    Close();
   }
 };
 
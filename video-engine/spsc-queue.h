@@ -0,0 +1,58 @@
+#ifndef SPSC_QUEUE_HPP___
+#define SPSC_QUEUE_HPP___
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Push fails when the queue is full and Pop fails when it is empty,
+// neither ever blocks.
+template <typename T>
+class SPSCQueue {
+ public:
+  SPSCQueue(size_t capacity)
+      : mSize(capacity + 1), mBuffer(capacity + 1), mWrite(0), mRead(0) {}
+
+  // Producer side
+  bool Push(const T& item) {
+    const size_t write = mWrite.load(std::memory_order_relaxed);
+    const size_t next = (write + 1) % mSize;
+    if (next == mRead.load(std::memory_order_acquire)) {
+      return false;
+    }
+    mBuffer[write] = item;
+    mWrite.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side
+  bool Pop(T* item) {
+    const size_t read = mRead.load(std::memory_order_relaxed);
+    if (read == mWrite.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *item = mBuffer[read];
+    mRead.store((read + 1) % mSize, std::memory_order_release);
+    return true;
+  }
+
+  // Approximate when called while the other side is running
+  size_t Size() {
+    const size_t write = mWrite.load(std::memory_order_acquire);
+    const size_t read = mRead.load(std::memory_order_acquire);
+    return (write + mSize - read) % mSize;
+  }
+
+  size_t Capacity() { return mSize - 1; }
+
+ private:
+  const size_t mSize;
+  std::vector<T> mBuffer;
+
+  // Producer and consumer indices on separate cache lines
+  alignas(64) std::atomic<size_t> mWrite;
+  alignas(64) std::atomic<size_t> mRead;
+};
+
+#endif  // SPSC_QUEUE_HPP___
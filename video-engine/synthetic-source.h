@@ -0,0 +1,246 @@
+#ifndef SYNTHETIC_SOURCE_HPP___
+#define SYNTHETIC_SOURCE_HPP___
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Processing.NDI.Lib.h"
+#include "source.h"
+#include "trace.h"
+
+// Source generating UYVY frames on its clock instead of receiving them,
+// for simulated runs on a VirtualClock (see the soak mode in main.cpp)
+//
+// The sender clock can drift from the engine clock, frames can arrive late
+// by up to a jitter and be lost at a given rate, all from a seeded generator
+// so that a run can be repeated. The pictures are rendered once into a pool
+// of buffers, a buffer returns to the pool when the ring drops its frame.
+//
+// Started on its own, the source sends from a thread of its own; driven by
+// a CaptureExecutor, Service sends the frames that are due (see
+// Tests/Capture_Bench.cpp).
+class SyntheticSource : public Source {
+ public:
+  SyntheticSource(std::string name, int xres = 1920, int yres = 1080,
+                  int frameRateN = 30000, int frameRateD = 1001,
+                  int poolFrames = 16)
+      : mXres(xres),
+        mYres(yres),
+        mFrameRateN(frameRateN),
+        mFrameRateD(frameRateD),
+        mDriftPpm(0),
+        mJitter(0),
+        mDropRate(0),
+        mRandom(0),
+        mFramesSent(0),
+        mFramesLost(0),
+        mPoolEmpty(0),
+        mPeriod(0),
+        mMaxJitter(0),
+        mStart(0),
+        mNext(0),
+        mSent(0),
+        mDue(0) {
+    mSourceName = name;
+    const int stride = xres * 2;
+    for (int i = 0; i < poolFrames; i++) {
+      mPool.emplace_back(new uint8_t[(size_t)stride * yres]);
+      Render(mPool.back().get(), i, poolFrames);
+      mFree.push_back(mPool.back().get());
+    }
+    GetMemoryAccount()->Charge(MemoryKind::Pool, PoolBytes());
+    mBuffer.SetDeleter([this](NDIlib_video_frame_v2_t* frame) {
+      std::lock_guard<std::mutex> lock(mPoolMutex);
+      mFree.push_back(frame->p_data);
+    });
+  }
+  virtual ~SyntheticSource() {
+    Stop();
+    // The ring gives its frames back to the pool
+    mBuffer.Clear();
+    mMemory->Release(MemoryKind::Pool, PoolBytes());
+  }
+
+  // driftPpm is how much faster the sender clock runs, jitterUs the most a
+  // frame arrives late, dropRate the fraction of frames lost on the way
+  void SetImpairments(double driftPpm, int jitterUs, double dropRate,
+                      unsigned seed) {
+    mDriftPpm = driftPpm;
+    mJitter = (int64_t)jitterUs * 10;
+    mDropRate = dropRate;
+    mRandom.seed(seed);
+  }
+
+  void Start(int /*runForIterations*/ = 10) override {
+    Attach();
+    mClock->AddParticipant();
+    mThread = std::thread(&SyntheticSource::Run, this);
+  }
+
+  // The first frame is sent at once
+  bool Open() override {
+    mSourceFRateNum = mFrameRateN;
+    mSourceFRateDen = mFrameRateD;
+    mState = State::Active;
+    // One frame of the sender clock, in 100ns intervals of the engine clock
+    mPeriod =
+        10000000.0 * mFrameRateD / mFrameRateN / (1.0 + mDriftPpm / 1e6);
+    // Frames stay in order
+    mMaxJitter = std::min<int64_t>(mJitter, (int64_t)mPeriod - 1);
+    mStart = mClock->Now();
+    mNext = 0;
+    Schedule();
+    return true;
+  }
+
+  // Sends the next frame once it is due, waiting up to timeoutMs for it.
+  // Returns true if a frame was put in the ring.
+  bool Service(int timeoutMs) override {
+    const int64_t now = mClock->Now();
+    if (now < mDue) {
+      if (timeoutMs <= 0) {
+        return false;
+      }
+      mClock->SleepUntil(std::min(mDue, now + (int64_t)timeoutMs * 10000));
+      if (!isRunning() || mClock->Now() < mDue) {
+        return false;
+      }
+    }
+
+    const int64_t sent = mSent;
+    mFramesSent++;
+    const bool lost = mDropRate > 0 && mUniform(mRandom) < mDropRate;
+    Schedule();
+    if (lost) {
+      mFramesLost++;
+      return false;
+    }
+    uint8_t* data = TakeBuffer();
+    if (!data) {
+      mPoolEmpty++;
+      return false;
+    }
+
+    NDIlib_video_frame_v2_t frame;
+    frame.xres = mXres;
+    frame.yres = mYres;
+    frame.FourCC = NDIlib_FourCC_video_type_UYVY;
+    frame.frame_rate_N = mFrameRateN;
+    frame.frame_rate_D = mFrameRateD;
+    frame.picture_aspect_ratio = 0.0f;
+    frame.frame_format_type = NDIlib_frame_format_type_progressive;
+    frame.timecode = sent;
+    frame.p_data = data;
+    frame.line_stride_in_bytes = mXres * 2;
+    frame.p_metadata = nullptr;
+    frame.timestamp = sent;
+
+    UpdateCaptureLatency(frame);
+    if (mFrameCallback) {
+      mFrameCallback(frame);
+    }
+    {
+      TRACE_SPAN_NAMED(span, "ring put");
+      [[maybe_unused]] const int index =
+          mBuffer.Put(frame, frame.timestamp, frame.timecode);
+      TRACE_SET_FRAME(span, mId, index);
+    }
+    return true;
+  }
+
+  // Nothing to disconnect, the frames are always there to send
+  void Close() override {}
+  bool IsParked() override { return false; }
+
+  void OutputCaptureStats() override {
+    Source::OutputCaptureStats();
+    std::cout << "Source " << mSourceName << " | synthetic sent "
+              << mFramesSent << " | lost " << mFramesLost
+              << " | pool empty " << mPoolEmpty << std::endl;
+  }
+
+ private:
+  int mXres;
+  int mYres;
+  int mFrameRateN;
+  int mFrameRateD;
+  double mDriftPpm;
+  // In 100ns intervals
+  int64_t mJitter;
+  double mDropRate;
+  std::mt19937 mRandom;
+
+  std::uniform_real_distribution<double> mUniform{0.0, 1.0};
+
+  uint64_t mFramesSent;
+  uint64_t mFramesLost;
+  uint64_t mPoolEmpty;
+
+  // Sending schedule, see Open. In 100ns intervals of the engine clock.
+  double mPeriod;
+  int64_t mMaxJitter;
+  int64_t mStart;
+  // Number of the next frame, the time it is sent at and the time it
+  // arrives, late by the jitter
+  int64_t mNext;
+  int64_t mSent;
+  int64_t mDue;
+
+  std::vector<std::unique_ptr<uint8_t[]>> mPool;
+  std::vector<uint8_t*> mFree;
+  std::mutex mPoolMutex;
+
+  // Grey picture with a white bar, at a different place for every buffer
+  void Render(uint8_t* data, int buffer, int buffers) {
+    const int stride = mXres * 2;
+    const int barStart = mXres * buffer / buffers / 2 * 2;
+    const int barEnd = barStart + mXres / buffers / 2 * 2;
+    for (int y = 0; y < mYres; y++) {
+      uint8_t* row = data + (size_t)y * stride;
+      for (int x = 0; x < mXres; x += 2) {
+        const uint8_t luma = (x >= barStart && x < barEnd) ? 235 : 126;
+        row[x * 2 + 0] = 128;
+        row[x * 2 + 1] = luma;
+        row[x * 2 + 2] = 128;
+        row[x * 2 + 3] = luma;
+      }
+    }
+  }
+
+  int64_t PoolBytes() { return (int64_t)mPool.size() * mXres * 2 * mYres; }
+
+  uint8_t* TakeBuffer() {
+    std::lock_guard<std::mutex> lock(mPoolMutex);
+    if (mFree.empty()) {
+      return nullptr;
+    }
+    uint8_t* data = mFree.back();
+    mFree.pop_back();
+    return data;
+  }
+
+  void Schedule() {
+    mSent = mStart + (int64_t)(mNext * mPeriod);
+    mDue = mSent + (mMaxJitter > 0
+                        ? (int64_t)(mRandom() % (uint64_t)mMaxJitter)
+                        : 0);
+    mNext++;
+  }
+
+  void Run() {
+    TRACE_THREAD_NAME("synthetic " + mSourceName);
+    Open();
+    while (isRunning()) {
+      Service(1000);
+    }
+    mClock->RemoveParticipant();
+  }
+};
+
+#endif  // SYNTHETIC_SOURCE_HPP___
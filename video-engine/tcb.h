@@ -1,24 +1,45 @@
 #ifndef TIMED_CIRCULAR_BUFFER_HPP___
 #define TIMED_CIRCULAR_BUFFER_HPP___
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <vector>
+
+// Data derived from an item, built once on first request
+struct Attachment {
+  std::once_flag mOnce;
+  std::shared_ptr<void> mValue;
+};
 
 template <typename T>
 class Element {
  public:
-  Element() : mItem(), mTimestamp(-1), mIsSet(false), mIsLockedTimes(0) {}
-  Element(T item, uint64_t timestamp, bool isSet, bool isLockedTimes = 0)
+  Element()
+      : mItem(), mTimestamp(-1), mIsSet(false), mIsLockedTimes(0), mIndex(-1) {}
+  Element(T item, uint64_t timestamp, bool isSet, bool isLockedTimes = 0,
+          int index = -1, int64_t timecode = 0)
       : mItem(item),
         mTimestamp(timestamp),
         mIsSet(isSet),
-        mIsLockedTimes(isLockedTimes) {}
+        mIsLockedTimes(isLockedTimes),
+        mIndex(index),
+        mTimecode(timecode) {}
   T mItem;
   uint64_t mTimestamp;
   bool mIsSet;
   int mIsLockedTimes;
+  // The non-modulo index the item was written at
+  int mIndex;
+  // Capture instant given by the sender, the NDI timecode for frames
+  int64_t mTimecode = 0;
+  // Created on first request, a new item starts without one
+  std::shared_ptr<Attachment> mAttachment;
 };
 
 // Overload the << operator for the Element class
@@ -28,6 +49,23 @@ std::ostream& operator<<(std::ostream& os, const Element<int>& element) {
   return os;
 }
 
+// What Put does when the slot to write is still locked by a reader
+// Block   waits for the reader to unlock it
+// Skip    writes into the next unlocked slot, the locked ones keep their item
+// Drop    drops the incoming item
+// Grow    moves the locked item to a spare pool until it is unlocked, then
+//         blocks once the spare pool is full
+enum class OverflowPolicy { Block, Skip, Drop, Grow };
+
+struct OverflowStats {
+  std::atomic<uint64_t> mPuts{0};
+  std::atomic<uint64_t> mBlocked{0};
+  std::atomic<uint64_t> mBlockedNs{0};
+  std::atomic<uint64_t> mSkipped{0};
+  std::atomic<uint64_t> mDropped{0};
+  std::atomic<uint64_t> mGrown{0};
+};
+
 template <typename T>
 class TimedCircularBuffer {
  public:
@@ -36,13 +74,19 @@ class TimedCircularBuffer {
         mSize(0),
         mCurrentWrite(0),
         mCurrentRead(0),
-        mDeleter(nullptr) {}
+        mDeleter(nullptr),
+        mPolicy(OverflowPolicy::Block),
+        mSpareCapacity(0),
+        mDepth(0) {}
   TimedCircularBuffer<T>(int size)
       : mBuffer(nullptr),
         mSize(0),
         mCurrentWrite(0),
         mCurrentRead(0),
-        mDeleter(nullptr) {
+        mDeleter(nullptr),
+        mPolicy(OverflowPolicy::Block),
+        mSpareCapacity(0),
+        mDepth(0) {
     Init(size);
   }
   virtual ~TimedCircularBuffer<T>() { Deinit(); }
@@ -51,8 +95,11 @@ class TimedCircularBuffer {
     Deinit();
     mBuffer = new Element<T>[size];
     mSize = size;
+    mDepth = size;
     mCurrentWrite = 0;
     mCurrentRead = 0;
+    mOccupied = 0;
+    mLocked = 0;
   }
 
   void Deinit() {
@@ -67,24 +114,112 @@ class TimedCircularBuffer {
     if (mBuffer) {
       delete[] mBuffer;
     }
+    if (mDeleter) {
+      for (auto& element : mSpare) {
+        mDeleter(&element.mItem);
+      }
+    }
+    mSpare.clear();
   }
 
   void SetDeleter(std::function<void(T*)> deleter) { mDeleter = deleter; }
 
-  void Put(T item, uint64_t timestamp) {
+  // spareCapacity is the size of the spare pool of the Grow policy
+  void SetOverflowPolicy(OverflowPolicy policy, int spareCapacity = 0) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPolicy = policy;
+    mSpareCapacity = spareCapacity;
+  }
+
+  OverflowStats& GetOverflowStats() { return mStats; }
+
+  // Keeps at most depth items, 0 for as many as the ring holds. The older
+  // items are released as soon as no reader holds them, which gives their
+  // memory back without reallocating the ring.
+  void SetDepth(int depth) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mDepth = (depth <= 0 || depth > mSize) ? mSize : depth;
+    Trim();
+  }
+
+  // Read without the lock, for monitoring
+  // Slots of the ring holding an item, and locks held by readers
+  int GetOccupied() { return mOccupied; }
+  int GetLocked() { return mLocked; }
+  int GetSize() { return mSize; }
+
+  // Release every item held by the buffer, waiting for readers to unlock
+  // them first. The write and read indices keep counting so that indices
+  // handed out before the clear are never reused.
+  void Clear() {
+    if (!mBuffer) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    mCond.wait(lock, [this] {
+      for (int i = 0; i < mSize; i++) {
+        if (mBuffer[i].mIsLockedTimes != 0) {
+          return false;
+        }
+      }
+      return mSpare.empty();
+    });
+
+    for (int i = 0; i < mSize; i++) {
+      if (mBuffer[i].mIsSet && mDeleter) {
+        mDeleter(&mBuffer[i].mItem);
+      }
+      mBuffer[i] = Element<T>();
+    }
+    mOccupied = 0;
+    mCurrentRead = mCurrentWrite;
+  }
+
+  // Like Clear without waiting: the items no reader holds are released and
+  // the locked ones move to the spare pool, where their last Unlock releases
+  // them. Returns true once the buffer holds no item at all.
+  bool ClearUnlocked() {
+    if (!mBuffer) {
+      return true;
+    }
+    std::unique_lock<std::mutex> lock(mMutex);
+    for (int i = 0; i < mSize; i++) {
+      if (mBuffer[i].mIsSet) {
+        if (mBuffer[i].mIsLockedTimes != 0) {
+          mSpare.push_back(mBuffer[i]);
+        } else if (mDeleter) {
+          mDeleter(&mBuffer[i].mItem);
+        }
+      }
+      mBuffer[i] = Element<T>();
+    }
+    mOccupied = 0;
+    mCurrentRead = mCurrentWrite;
+    return mSpare.empty();
+  }
+
+  // Returns the non-modulo index of the item, -1 if it was not stored
+  int Put(T item, uint64_t timestamp, int64_t timecode = 0) {
     // Check if is init or not
     if (!mBuffer) {
       std::cerr << "CircularBuffer is not initialized" << std::endl;
-      return;
+      return -1;
     }
 
     // Declare a lock
     std::unique_lock<std::mutex> lock(mMutex);
+    mStats.mPuts++;
 
-    // Wait until the element is unlocked
-    mCond.wait(lock, [this] {
-      return (mBuffer[mCurrentWrite % mSize].mIsLockedTimes == 0);
-    });
+    if (mBuffer[mCurrentWrite % mSize].mIsLockedTimes != 0) {
+      if (!MakeRoom(lock)) {
+        mStats.mDropped++;
+        if (mDeleter) {
+          mDeleter(&item);
+        }
+        return -1;
+      }
+    }
 
     // Write index
     const int index = mCurrentWrite % mSize;
@@ -94,12 +229,17 @@ class TimedCircularBuffer {
     if (val.mIsSet && mDeleter) {
       mDeleter(&val.mItem);
     }
+    if (!val.mIsSet) {
+      mOccupied++;
+    }
 
     // Set the item
-    mBuffer[index] = Element<T>{item, timestamp, true};
+    mBuffer[index] =
+        Element<T>{item, timestamp, true, 0, mCurrentWrite, timecode};
     mCurrentWrite++;
+    Trim();
 
-    return;
+    return mCurrentWrite - 1;
   }
 
   T Get(uint64_t timestamp, int threshold, int* id, int* writeIndex) {
@@ -111,14 +251,14 @@ class TimedCircularBuffer {
     std::unique_lock<std::mutex> lock(mMutex);
 
     // If ReadIndex is smaller than WriteIndex - 8, reset the read index
-    if (mCurrentRead < mCurrentWrite - mSize) {
-      mCurrentRead = mCurrentWrite - (mSize / 2);
+    // A shrunk ring is searched from its oldest item
+    if (mCurrentRead < mCurrentWrite - mDepth) {
+      mCurrentRead = mCurrentWrite - (mDepth < mSize ? mDepth : mSize / 2);
     }
 
     // Find the index of the item within the threshold of the timestamp
     // starting from the current read index
     int index = mCurrentRead;
-    int frameFound = 0;
     while (index < mCurrentWrite) {
       // std::cout << "mCurrentWrite: " << mCurrentWrite
       //           << " | mCurrentRead: " << mCurrentRead << " | index: " <<
@@ -127,25 +267,27 @@ class TimedCircularBuffer {
       // std::cout << "Buffer Timestamp: " << mBuffer[index % mSize].mTimestamp
       //           << std::endl;
       // std::cout << "Timestamp       : " << timestamp << std::endl;
-      uint64_t diff = std::abs(int64_t(mBuffer[index % mSize].mTimestamp) -
-                               int64_t(timestamp));
+      Element<T>& element = mBuffer[index % mSize];
+      uint64_t diff =
+          std::abs(int64_t(element.mTimestamp) - int64_t(timestamp));
 
       // std::cout << "Diff: " << diff << " | Threshold: " << threshold
       //           << std::endl;
-      if (diff <= threshold) {
+      // A slot passed over by the Skip policy still holds an older item,
+      // which is not the one written at index
+      if (element.mIsSet && element.mIndex == index && diff <= threshold) {
         mCurrentRead = index;
         // std::cout << "ReadIndex: " << mCurrentRead << std::endl;
         // Increment the lock count
-        mBuffer[index % mSize].mIsLockedTimes++;
-        frameFound = 1;
+        element.mIsLockedTimes++;
+        mLocked++;
         break;
       }
       index++;
     }
 
-    if (!frameFound) {
-      std::cout << "Frame not found" << std::endl;
-    }
+    // A lookup that found nothing returns the write index, the caller
+    // reports it
     // TODO
     // This will be wrong if we don't find any item within the threshold
     *id = index;
@@ -154,14 +296,126 @@ class TimedCircularBuffer {
     return mBuffer[index % mSize].mItem;
   }
 
+  // Locks the newest item, id is -1 if the buffer is empty
+  // Unlike Get, the read index is left alone
+  T GetLatest(int* id) {
+    *id = -1;
+    if (!mBuffer) {
+      return T();
+    }
+    std::unique_lock<std::mutex> lock(mMutex);
+    Element<T>& element = mBuffer[(mCurrentWrite + mSize - 1) % mSize];
+    if (mCurrentWrite == 0 || !element.mIsSet ||
+        element.mIndex != mCurrentWrite - 1) {
+      return T();
+    }
+    element.mIsLockedTimes++;
+    mLocked++;
+    *id = element.mIndex;
+    return element.mItem;
+  }
+
+  // Lookups that must see several rings at the same instant hold the lock
+  // of every ring while they read them, see Source::BeginSync. The Locked
+  // calls below are made between LockRing and UnlockRing; Unlock is not.
+  void LockRing() { mMutex.lock(); }
+  void UnlockRing() { mMutex.unlock(); }
+
+  // Appends the timecodes of the items in the ring, oldest first
+  void GetTimecodesLocked(std::vector<int64_t>* timecodes) {
+    if (!mBuffer) {
+      return;
+    }
+    for (int index = std::max(0, mCurrentWrite - mSize); index < mCurrentWrite;
+         index++) {
+      const Element<T>& element = mBuffer[index % mSize];
+      if (element.mIsSet && element.mIndex == index) {
+        timecodes->push_back(element.mTimecode);
+      }
+    }
+  }
+
+  // Locks the newest item with a timecode within tolerance of timecode, id
+  // is -1 if there is none. The read index is left alone.
+  T GetAtTimecodeLocked(int64_t timecode, int64_t tolerance, int* id,
+                        int* writeIndex) {
+    *id = -1;
+    *writeIndex = mCurrentWrite;
+    if (!mBuffer) {
+      return T();
+    }
+    for (int index = mCurrentWrite - 1;
+         index >= 0 && index >= mCurrentWrite - mSize; index--) {
+      Element<T>& element = mBuffer[index % mSize];
+      if (element.mIsSet && element.mIndex == index &&
+          std::abs(element.mTimecode - timecode) <= tolerance) {
+        element.mIsLockedTimes++;
+        mLocked++;
+        *id = index;
+        return element.mItem;
+      }
+    }
+    return T();
+  }
+
   void Unlock(int index) {
     std::unique_lock<std::mutex> lock(mMutex);
     // Decrement the lock count if it is not zero, protects against calling
     // Unlock multiple times
-    if (mBuffer[index % mSize].mIsLockedTimes != 0) {
-      mBuffer[index % mSize].mIsLockedTimes--;
+    Element<T>& element = mBuffer[index % mSize];
+    if (element.mIndex == index) {
+      if (element.mIsLockedTimes != 0) {
+        element.mIsLockedTimes--;
+        mLocked--;
+        Trim();
+      }
+    } else {
+      // The item may have been moved to the spare pool
+      for (size_t i = 0; i < mSpare.size(); i++) {
+        if (mSpare[i].mIndex != index) {
+          continue;
+        }
+        mLocked--;
+        if (--mSpare[i].mIsLockedTimes <= 0) {
+          if (mDeleter) {
+            mDeleter(&mSpare[i].mItem);
+          }
+          mSpare.erase(mSpare.begin() + i);
+        }
+        break;
+      }
     }
-    mCond.notify_one();
+    mCond.notify_all();
+  }
+
+  // Returns the data attached to the item at index, building it with
+  // build(item) on the first request. Concurrent requests for the same item
+  // build it once and share it. The item must be locked by the caller (see
+  // Get); returns null if index is not held by the buffer anymore.
+  template <typename A>
+  std::shared_ptr<A> GetAttachment(
+      int index, const std::function<std::shared_ptr<A>(const T&)>& build) {
+    if (!mBuffer || index < 0) {
+      return nullptr;
+    }
+    std::shared_ptr<Attachment> attachment;
+    T item;
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      Element<T>* element = Find(index);
+      if (!element || !element->mIsSet) {
+        return nullptr;
+      }
+      if (!element->mAttachment) {
+        element->mAttachment = std::make_shared<Attachment>();
+      }
+      attachment = element->mAttachment;
+      item = element->mItem;
+    }
+    // Built outside of the lock, the item cannot be overwritten while locked
+    std::call_once(attachment->mOnce,
+                   [&] { attachment->mValue = build(item); });
+    return std::static_pointer_cast<A>(attachment->mValue);
   }
 
   void Output() {
@@ -192,6 +446,92 @@ class TimedCircularBuffer {
   std::function<void(T*)> mDeleter;
 
   std::condition_variable mCond;
+
+  OverflowPolicy mPolicy;
+  // Locked items moved out of the ring by the Grow policy
+  std::vector<Element<T>> mSpare;
+  int mSpareCapacity;
+  OverflowStats mStats;
+  std::atomic<int> mOccupied{0};
+  std::atomic<int> mLocked{0};
+  // Items kept, at most mSize, see SetDepth
+  int mDepth;
+
+  // Releases the unlocked items older than the depth, called with the lock
+  void Trim() {
+    if (!mBuffer || mDepth >= mSize) {
+      return;
+    }
+    for (int i = 0; i < mSize; i++) {
+      Element<T>& element = mBuffer[i];
+      if (element.mIsSet && element.mIsLockedTimes == 0 &&
+          element.mIndex < mCurrentWrite - mDepth) {
+        if (mDeleter) {
+          mDeleter(&element.mItem);
+        }
+        element = Element<T>();
+        mOccupied--;
+      }
+    }
+  }
+
+  // The element holding index, in the ring or in the spare pool
+  Element<T>* Find(int index) {
+    Element<T>& element = mBuffer[index % mSize];
+    if (element.mIndex == index) {
+      return &element;
+    }
+    for (auto& spare : mSpare) {
+      if (spare.mIndex == index) {
+        return &spare;
+      }
+    }
+    return nullptr;
+  }
+
+  // Called by Put when the write slot is locked, frees it according to the
+  // policy. Returns false if the incoming item has to be dropped.
+  bool MakeRoom(std::unique_lock<std::mutex>& lock) {
+    switch (mPolicy) {
+      case OverflowPolicy::Drop:
+        return false;
+
+      case OverflowPolicy::Skip:
+        for (int k = 1; k < mSize; k++) {
+          if (mBuffer[(mCurrentWrite + k) % mSize].mIsLockedTimes == 0) {
+            mCurrentWrite += k;
+            mStats.mSkipped += k;
+            return true;
+          }
+        }
+        break;
+
+      case OverflowPolicy::Grow:
+        if ((int)mSpare.size() < mSpareCapacity) {
+          Element<T>& element = mBuffer[mCurrentWrite % mSize];
+          mSpare.push_back(element);
+          element = Element<T>();
+          mOccupied--;
+          mStats.mGrown++;
+          return true;
+        }
+        break;
+
+      case OverflowPolicy::Block:
+        break;
+    }
+
+    // Wait until the element is unlocked
+    mStats.mBlocked++;
+    const auto start = std::chrono::steady_clock::now();
+    mCond.wait(lock, [this] {
+      return (mBuffer[mCurrentWrite % mSize].mIsLockedTimes == 0);
+    });
+    mStats.mBlockedNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+    return true;
+  }
 };
 
 #endif  // TIMED_CIRCULAR_BUFFER_HPP___
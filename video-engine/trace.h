@@ -0,0 +1,233 @@
+#ifndef TRACE_HPP___
+#define TRACE_HPP___
+
+// Per frame pipeline tracing, dumped in the Chrome trace event format
+// (chrome://tracing or https://ui.perfetto.dev)
+//
+// Built only with CNS_TRACE defined (make TRACE=1), otherwise every macro
+// below expands to nothing. When built in, recording can still be switched
+// off at runtime, a span then costs one relaxed atomic load.
+//
+// Every thread records into its own fixed size ring of events, so recording
+// never takes a lock. A frame is identified by its source id and its ring
+// index (the non-modulo write index given by TimedCircularBuffer::Put), from
+// capture to the renderer send.
+
+#ifdef CNS_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class Trace {
+ public:
+  struct Event {
+    const char* mName;
+    uint64_t mStartNs;
+    uint64_t mDurationNs;
+    int mSourceId;
+    int64_t mFrameId;
+  };
+
+  // Events kept per thread, older events are overwritten
+  static constexpr size_t kEventsPerThread = 1 << 16;
+
+  struct ThreadBuffer {
+    std::vector<Event> mEvents;
+    std::atomic<uint64_t> mCount{0};
+    // Guarded by the registry mutex
+    std::string mName;
+    int mTid;
+    // The thread exited, the next new thread takes the buffer over
+    bool mFree = false;
+  };
+
+  static uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  static bool IsEnabled() {
+    return Enabled().load(std::memory_order_relaxed);
+  }
+  static void SetEnabled(bool enabled) { Enabled() = enabled; }
+
+  static void SetThreadName(const std::string& name) {
+    ThreadBuffer* buffer = GetThreadBuffer();
+    std::lock_guard<std::mutex> lock(Registry().mMutex);
+    buffer->mName = name;
+  }
+
+  static void Record(const char* name, uint64_t startNs, uint64_t endNs,
+                     int sourceId, int64_t frameId) {
+    ThreadBuffer* buffer = GetThreadBuffer();
+    const uint64_t count = buffer->mCount.load(std::memory_order_relaxed);
+    buffer->mEvents[count % kEventsPerThread] =
+        Event{name, startNs, endNs - startNs, sourceId, frameId};
+    buffer->mCount.store(count + 1, std::memory_order_release);
+  }
+
+  // Writes the events of all the threads, returns false if the file cannot
+  // be written. Events recorded while dumping may be missing or torn.
+  static bool Dump(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(Registry().mMutex);
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (auto& buffer : Registry().mBuffers) {
+      fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                    "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+              first ? "" : ",\n", buffer->mTid,
+              Escape(buffer->mName).c_str());
+      first = false;
+
+      const uint64_t count = buffer->mCount.load(std::memory_order_acquire);
+      const uint64_t begin =
+          count > kEventsPerThread ? count - kEventsPerThread : 0;
+      for (uint64_t i = begin; i < count; i++) {
+        const Event& event = buffer->mEvents[i % kEventsPerThread];
+        fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                      "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"source\":%d,"
+                      "\"frame\":%lld}}",
+                Escape(event.mName).c_str(), buffer->mTid,
+                event.mStartNs / 1000.0, event.mDurationNs / 1000.0,
+                event.mSourceId, (long long)event.mFrameId);
+      }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return true;
+  }
+
+ private:
+  // A JSON string body, names may come from the sources
+  static std::string Escape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+      if (c == '"' || c == '\\') {
+        escaped += '\\';
+        escaped += c;
+      } else if ((unsigned char)c < 0x20) {
+        char code[8];
+        snprintf(code, sizeof(code), "\\u%04x", c);
+        escaped += code;
+      } else {
+        escaped += c;
+      }
+    }
+    return escaped;
+  }
+
+  struct BufferRegistry {
+    std::mutex mMutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> mBuffers;
+  };
+
+  static std::atomic<bool>& Enabled() {
+    static std::atomic<bool> enabled(true);
+    return enabled;
+  }
+
+  static BufferRegistry& Registry() {
+    static BufferRegistry registry;
+    return registry;
+  }
+
+  // Gives the buffer of a thread back when the thread exits
+  struct ThreadBufferOwner {
+    ThreadBuffer* mBuffer = nullptr;
+    ~ThreadBufferOwner() {
+      if (mBuffer) {
+        std::lock_guard<std::mutex> lock(Registry().mMutex);
+        mBuffer->mFree = true;
+      }
+    }
+  };
+
+  // A buffer outlives its thread so that a dump still shows it, until a new
+  // thread takes it over. There are never more buffers than threads alive
+  // at once.
+  static ThreadBuffer* GetThreadBuffer() {
+    thread_local ThreadBufferOwner owner;
+    if (!owner.mBuffer) {
+      std::lock_guard<std::mutex> lock(Registry().mMutex);
+      ThreadBuffer* buffer = nullptr;
+      for (auto& free : Registry().mBuffers) {
+        if (free->mFree) {
+          buffer = free.get();
+          break;
+        }
+      }
+      if (!buffer) {
+        Registry().mBuffers.emplace_back(new ThreadBuffer());
+        buffer = Registry().mBuffers.back().get();
+        buffer->mEvents.resize(kEventsPerThread);
+        buffer->mTid = (int)Registry().mBuffers.size();
+      }
+      buffer->mFree = false;
+      buffer->mCount = 0;
+      buffer->mName = "thread " + std::to_string(buffer->mTid);
+      owner.mBuffer = buffer;
+    }
+    return owner.mBuffer;
+  }
+};
+
+// Records the time between its construction and its destruction
+class TraceSpan {
+ public:
+  TraceSpan(const char* name, int sourceId = -1, int64_t frameId = -1)
+      : mName(name),
+        mSourceId(sourceId),
+        mFrameId(frameId),
+        mStartNs(Trace::IsEnabled() ? Trace::NowNs() : 0) {}
+  ~TraceSpan() {
+    if (mStartNs) {
+      Trace::Record(mName, mStartNs, Trace::NowNs(), mSourceId, mFrameId);
+    }
+  }
+  // For frames whose id is only known at the end of the span
+  void SetFrame(int sourceId, int64_t frameId) {
+    mSourceId = sourceId;
+    mFrameId = frameId;
+  }
+
+ private:
+  const char* mName;
+  int mSourceId;
+  int64_t mFrameId;
+  uint64_t mStartNs;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name, sourceId, frameId) \
+  TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name, sourceId, frameId)
+#define TRACE_SPAN_NAMED(var, name) TraceSpan var(name)
+#define TRACE_SET_FRAME(var, sourceId, frameId) var.SetFrame(sourceId, frameId)
+#define TRACE_THREAD_NAME(name) Trace::SetThreadName(name)
+#define TRACE_ENABLE(enabled) Trace::SetEnabled(enabled)
+#define TRACE_DUMP(path) Trace::Dump(path)
+
+#else  // CNS_TRACE
+
+#define TRACE_SPAN(name, sourceId, frameId)
+#define TRACE_SPAN_NAMED(var, name)
+#define TRACE_SET_FRAME(var, sourceId, frameId)
+#define TRACE_THREAD_NAME(name)
+#define TRACE_ENABLE(enabled)
+#define TRACE_DUMP(path) false
+
+#endif  // CNS_TRACE
+
+#endif  // TRACE_HPP___
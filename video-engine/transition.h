@@ -0,0 +1,151 @@
+#ifndef TRANSITION_HPP___
+#define TRANSITION_HPP___
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "Processing.NDI.Lib.h"
+#include "simd.h"
+
+// Row kernels of the switcher transitions (renderer-switcher.h)
+//
+// A mix is a weighted average of the bytes of two rows. It does not need to
+// know the components, so the same kernels blend UYVY and the 32-bit RGB
+// formats. A dip is a mix with a row of a flat colour, see
+// TransitionColourRow, and a wipe only copies parts of rows.
+
+// weight goes from 0 (all a) to 256 (all b), out may be a or b
+typedef void (*TransitionMixRowFn)(const uint8_t* a, const uint8_t* b,
+                                   uint8_t* out, int bytes, int weight);
+
+inline void MixRowScalar(const uint8_t* a, const uint8_t* b, uint8_t* out,
+                         int bytes, int weight) {
+  const int inverse = 256 - weight;
+  for (int x = 0; x < bytes; x++) {
+    out[x] = (uint8_t)((a[x] * inverse + b[x] * weight + 128) >> 8);
+  }
+}
+
+// 16 bytes at a time in 16-bit lanes. a * (256 - w) + b * w is at most
+// 255 * 256, so the sum fits unsigned 16 bits.
+inline void MixRowSSE2(const uint8_t* a, const uint8_t* b, uint8_t* out,
+                       int bytes, int weight) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i wa = _mm_set1_epi16((short)(256 - weight));
+  const __m128i wb = _mm_set1_epi16((short)weight);
+  const __m128i round = _mm_set1_epi16(128);
+  int x = 0;
+  for (; x + 16 <= bytes; x += 16) {
+    const __m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+    const __m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+    const __m128i lo = _mm_srli_epi16(
+        _mm_add_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+                          _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb)),
+            round),
+        8);
+    const __m128i hi = _mm_srli_epi16(
+        _mm_add_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+                          _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb)),
+            round),
+        8);
+    _mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(lo, hi));
+  }
+  MixRowScalar(a + x, b + x, out + x, bytes - x, weight);
+}
+
+// The unpacks and the pack both work within 128-bit lanes, so the bytes
+// come back in order
+CNS_TARGET_AVX2
+inline void MixRowAVX2(const uint8_t* a, const uint8_t* b, uint8_t* out,
+                       int bytes, int weight) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i wa = _mm256_set1_epi16((short)(256 - weight));
+  const __m256i wb = _mm256_set1_epi16((short)weight);
+  const __m256i round = _mm256_set1_epi16(128);
+  int x = 0;
+  for (; x + 32 <= bytes; x += 32) {
+    const __m256i va = _mm256_loadu_si256((const __m256i*)(a + x));
+    const __m256i vb = _mm256_loadu_si256((const __m256i*)(b + x));
+    const __m256i lo = _mm256_srli_epi16(
+        _mm256_add_epi16(
+            _mm256_add_epi16(
+                _mm256_mullo_epi16(_mm256_unpacklo_epi8(va, zero), wa),
+                _mm256_mullo_epi16(_mm256_unpacklo_epi8(vb, zero), wb)),
+            round),
+        8);
+    const __m256i hi = _mm256_srli_epi16(
+        _mm256_add_epi16(
+            _mm256_add_epi16(
+                _mm256_mullo_epi16(_mm256_unpackhi_epi8(va, zero), wa),
+                _mm256_mullo_epi16(_mm256_unpackhi_epi8(vb, zero), wb)),
+            round),
+        8);
+    _mm256_storeu_si256((__m256i*)(out + x), _mm256_packus_epi16(lo, hi));
+  }
+  MixRowScalar(a + x, b + x, out + x, bytes - x, weight);
+}
+
+inline TransitionMixRowFn SelectMixRowFn() {
+  return CpuHasAVX2() ? MixRowAVX2 : MixRowSSE2;
+}
+
+// Bytes per pixel of the formats the transitions support, 0 for the others.
+// The alpha plane of UYVA would need a kernel of its own.
+inline int TransitionBytesPerPixel(NDIlib_FourCC_video_type_e FourCC) {
+  switch (FourCC) {
+    case NDIlib_FourCC_video_type_UYVY:
+      return 2;
+    case NDIlib_FourCC_video_type_BGRA:
+    case NDIlib_FourCC_video_type_BGRX:
+    case NDIlib_FourCC_video_type_RGBA:
+    case NDIlib_FourCC_video_type_RGBX:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+// Fills row with xres pixels of the colour in the format, the colour being
+// 8-bit full range RGB. UYVY takes the BT.709 video range values.
+inline void TransitionColourRow(NDIlib_FourCC_video_type_e FourCC, int xres,
+                                uint8_t r, uint8_t g, uint8_t b,
+                                std::vector<uint8_t>& row) {
+  uint8_t pattern[4];
+  switch (FourCC) {
+    case NDIlib_FourCC_video_type_UYVY: {
+      const double y = 0.2126 * r + 0.7152 * g + 0.0722 * b;
+      const double u = (b - y) / 1.8556;
+      const double v = (r - y) / 1.5748;
+      const uint8_t luma = (uint8_t)(16 + y * 219 / 255 + 0.5);
+      pattern[0] = (uint8_t)(128 + u * 224 / 255 + 0.5);
+      pattern[1] = luma;
+      pattern[2] = (uint8_t)(128 + v * 224 / 255 + 0.5);
+      pattern[3] = luma;
+      break;
+    }
+    case NDIlib_FourCC_video_type_RGBA:
+    case NDIlib_FourCC_video_type_RGBX:
+      pattern[0] = r;
+      pattern[1] = g;
+      pattern[2] = b;
+      pattern[3] = 255;
+      break;
+    default:
+      pattern[0] = b;
+      pattern[1] = g;
+      pattern[2] = r;
+      pattern[3] = 255;
+      break;
+  }
+  const int bytes = xres * TransitionBytesPerPixel(FourCC);
+  row.resize(bytes);
+  for (int x = 0; x < bytes; x += 4) {
+    memcpy(row.data() + x, pattern, std::min(4, bytes - x));
+  }
+}
+
+#endif  // TRANSITION_HPP___